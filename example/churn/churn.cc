@@ -0,0 +1,129 @@
+#include "../../mnet.h"
+#include <time.h>
+using namespace mnet;
+
+// Connection churn benchmark. A single IOManager runs both an echo server
+// and the clients. Each client connects, sends one byte, waits for the echo
+// and closes, then a new connection takes its place. It reports the number
+// of connections per second and the epoll_ctl calls paid per connection.
+
+class Churn {
+public:
+    Churn( int total , int concurrency , bool register_once ) :
+        total_(total),
+        concurrency_(concurrency),
+        started_(0),
+        finished_(0),
+        server_(),
+        io_manager_()
+    {
+        io_manager_.set_register_once( register_once );
+        if( !server_.Bind( Endpoint("127.0.0.1:12346") ) ) {
+            std::cerr<<"Cannot bind to 127.0.0.1:12346"<<std::endl;
+            std::exit(-1);
+        }
+        server_.SetIOManager( &io_manager_ );
+        server_.AsyncAccept( new Socket(&io_manager_) , this );
+    }
+
+    void Run() {
+        for( int i = 0 ; i < concurrency_ && started_ < total_ ; ++i ) {
+            Connect();
+        }
+        io_manager_.RunMainLoop();
+    }
+
+    // Server side
+    void OnAccept( Socket* socket , const NetState& ok ) {
+        if( ok ) {
+            socket->AsyncRead( &server_handler_ );
+        } else {
+            delete socket;
+        }
+        server_.AsyncAccept( new Socket(&io_manager_) , this );
+    }
+
+    // Client side
+    void OnConnect( Socket* socket , const NetState& ok ) {
+        if( !ok ) {
+            std::cerr<<"Cannot connect:"<<std::strerror(ok.error_code())<<std::endl;
+            io_manager_.Interrupt();
+            return;
+        }
+        char c = 'x';
+        socket->write_buffer().Write( &c , 1 );
+        socket->AsyncWrite( this );
+    }
+
+    void OnWrite( Socket* socket , std::size_t size , const NetState& ok ) {
+        socket->AsyncRead( this );
+    }
+
+    void OnRead( Socket* socket , std::size_t size , const NetState& ok ) {
+        socket->Close();
+        delete socket;
+        if( ++finished_ == total_ ) {
+            io_manager_.Interrupt();
+        } else if( started_ < total_ ) {
+            Connect();
+        }
+    }
+
+    uint64_t epoll_ctl_count() const {
+        return io_manager_.epoll_ctl_count();
+    }
+
+private:
+    // Echo back whatever the client sends and close on EOF
+    struct ServerHandler {
+        void OnRead( Socket* socket , std::size_t size , const NetState& ok ) {
+            if( !ok || size == 0 ) {
+                socket->Close();
+                delete socket;
+                return;
+            }
+            std::size_t sz = socket->read_buffer().readable_size();
+            void* buf = socket->read_buffer().Read(&sz);
+            socket->write_buffer().Write( buf , sz );
+            socket->AsyncWrite( this );
+            socket->AsyncRead( this );
+        }
+        void OnWrite( Socket* socket , std::size_t size , const NetState& ok ) {}
+    };
+
+    void Connect() {
+        ++started_;
+        ClientSocket* s = new ClientSocket( &io_manager_ );
+        s->AsyncConnect( Endpoint("127.0.0.1:12346") , this );
+    }
+
+    int total_;
+    int concurrency_;
+    int started_;
+    int finished_;
+    ServerHandler server_handler_;
+    ServerSocket server_;
+    IOManager io_manager_;
+};
+
+double Seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main( int argc , char* argv[] ) {
+    if( argc != 4 ) {
+        std::cerr<<"Usage: churn total concurrency register_once(0/1)"<<std::endl;
+        return -1;
+    }
+    const int total = atoi(argv[1]);
+    Churn c( total , atoi(argv[2]) , atoi(argv[3]) != 0 );
+    double start = Seconds();
+    c.Run();
+    double elapsed = Seconds() - start;
+    std::cout<<"connections/s: "<<total / elapsed<<std::endl;
+    std::cout<<"epoll_ctl/connection: "
+             <<static_cast<double>(c.epoll_ctl_count()) / total<<std::endl;
+    return 0;
+}
@@ -0,0 +1,284 @@
+#include "../../mnet.h"
+#include <time.h>
+#include <stdio.h>
+using namespace mnet;
+
+// Close churn benchmark. A single IOManager runs both a server and the
+// clients. Each client connects, sends one byte and waits for the reply,
+// then the server closes the connection first, which is what leaves the
+// TIME_WAIT entries on a busy server. The server closes with one of:
+//
+//   0 Close, a plain close(2) which leaves a TIME_WAIT entry per connection
+//   1 Abort, a RST through SO_LINGER 0 which leaves no TIME_WAIT entry
+//   2 AsyncClose, a graceful shutdown waiting for the EOF from the client
+//
+// Every stuck_every-th client never closes its side, so a graceful close only
+// finishes once the AsyncClose deadline expires. It reports the closes per
+// second and the TIME_WAIT entries left on the server port. TIME_WAIT entries
+// last 60 seconds, so a mode should not be run again within that time.
+
+namespace {
+
+// Each mode uses its own port, so the TIME_WAIT entries left by a previous run
+// of another mode are not counted
+const uint16_t kBasePort = 12353;
+
+}// namespace
+
+class CloseChurn {
+public:
+    CloseChurn( int total , int concurrency , int mode , int stuck_every ,
+                int close_timeout ) :
+        total_(total),
+        concurrency_(concurrency),
+        mode_(mode),
+        stuck_every_(stuck_every),
+        close_timeout_(close_timeout),
+        started_(0),
+        stuck_count_(0),
+        client_finished_(0),
+        server_closed_(0),
+        timed_out_(0),
+        server_handler_(this),
+        server_(),
+        io_manager_()
+    {
+        if( !server_.Bind( Endpoint("127.0.0.1",port()) ) ) {
+            std::cerr<<"Cannot bind to port "<<port()<<std::endl;
+            std::exit(-1);
+        }
+        server_.SetIOManager( &io_manager_ );
+        server_.AsyncAccept( new Socket(&io_manager_) , this );
+    }
+
+    ~CloseChurn() {
+        for( std::size_t i = 0 ; i < stuck_.size() ; ++i ) {
+            stuck_[i]->Close();
+            delete stuck_[i];
+        }
+    }
+
+    void Run() {
+        for( int i = 0 ; i < concurrency_ && started_ < total_ ; ++i ) {
+            Connect();
+        }
+        io_manager_.RunMainLoop();
+    }
+
+    // Server side
+    void OnAccept( Socket* socket , const NetState& ok ) {
+        if( ok ) {
+            socket->AsyncRead( &server_handler_ );
+        } else {
+            delete socket;
+        }
+        server_.AsyncAccept( new Socket(&io_manager_) , this );
+    }
+
+    // Client side
+    void OnConnect( Socket* socket , const NetState& ok ) {
+        if( !ok ) {
+            std::cerr<<"Cannot connect:"<<std::strerror(ok.error_code())<<std::endl;
+            io_manager_.Interrupt();
+            return;
+        }
+        char c = 'x';
+        socket->write_buffer().Write( &c , 1 );
+        socket->AsyncWrite( this );
+    }
+
+    void OnWrite( Socket* socket , std::size_t size , const NetState& ok ) {
+        socket->AsyncRead( this );
+    }
+
+    // Read the reply and then the EOF or the RST of the server
+    void OnRead( Socket* socket , std::size_t size , const NetState& ok ) {
+        if( ok && size > 0 ) {
+            std::size_t sz = socket->read_buffer().readable_size();
+            socket->read_buffer().Read(&sz);
+            socket->AsyncRead( this );
+            return;
+        }
+        if( stuck_every_ > 0 && ++stuck_count_ % stuck_every_ == 0 ) {
+            // Keep the connection open, the server waits for our EOF
+            stuck_.push_back( socket );
+        } else {
+            socket->Close();
+            delete socket;
+        }
+        ++client_finished_;
+        OnFinished();
+    }
+
+    int timed_out() const {
+        return timed_out_;
+    }
+
+    uint16_t port() const {
+        return static_cast<uint16_t>(kBasePort + mode_);
+    }
+
+private:
+    // The close notifier of a graceful close, one per connection since
+    // OnClose does not tell the socket
+    struct Closer {
+        Closer( CloseChurn* churn , Socket* socket ) : churn(churn) , socket(socket) {}
+
+        void OnData( std::size_t size ) {
+            std::size_t sz = socket->read_buffer().readable_size();
+            socket->read_buffer().Read(&sz);
+        }
+
+        void OnClose( const NetState& ok ) {
+            if( !ok && ok.error_code() == ETIMEDOUT )
+                ++churn->timed_out_;
+            if( socket->Valid() )
+                socket->Close();
+            delete socket;
+            churn->OnServerClosed();
+            delete this;
+        }
+
+        CloseChurn* churn;
+        Socket* socket;
+    };
+
+    struct ServerHandler {
+        explicit ServerHandler( CloseChurn* churn ) : churn(churn) {}
+
+        void OnRead( Socket* socket , std::size_t size , const NetState& ok ) {
+            if( !ok || size == 0 ) {
+                socket->Close();
+                delete socket;
+                churn->OnServerClosed();
+                return;
+            }
+            std::size_t sz = socket->read_buffer().readable_size();
+            void* buf = socket->read_buffer().Read(&sz);
+            socket->write_buffer().Write( buf , sz );
+            socket->AsyncWrite( this );
+        }
+
+        // The reply is in the kernel, the server closes first
+        void OnWrite( Socket* socket , std::size_t size , const NetState& ok ) {
+            switch( churn->mode_ ) {
+            case 0:
+                socket->Close();
+                break;
+            case 1:
+                socket->Abort();
+                break;
+            default:
+                socket->AsyncClose( new Closer(churn,socket) , churn->close_timeout_ );
+                return;
+            }
+            delete socket;
+            churn->OnServerClosed();
+        }
+
+        CloseChurn* churn;
+    };
+
+    void OnServerClosed() {
+        ++server_closed_;
+        OnFinished();
+    }
+
+    void OnFinished() {
+        if( client_finished_ == total_ && server_closed_ == total_ ) {
+            io_manager_.Interrupt();
+        } else if( started_ < total_ && started_ - client_finished_ < concurrency_ ) {
+            Connect();
+        }
+    }
+
+    void Connect() {
+        ++started_;
+        ClientSocket* s = new ClientSocket( &io_manager_ );
+        s->AsyncConnect( Endpoint("127.0.0.1",port()) , this );
+    }
+
+    int total_;
+    int concurrency_;
+    int mode_;
+    int stuck_every_;
+    int close_timeout_;
+    int started_;
+    int stuck_count_;
+    int client_finished_;
+    int server_closed_;
+    int timed_out_;
+    std::vector<Socket*> stuck_;
+    ServerHandler server_handler_;
+    ServerSocket server_;
+    IOManager io_manager_;
+};
+
+double Seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Count the TCP sockets in TIME_WAIT whose local or remote port is port
+void CountTimeWait( uint16_t port , int* local , int* remote ) {
+    *local = *remote = 0;
+    FILE* f = fopen("/proc/net/tcp","r");
+    if( f == NULL )
+        return;
+    char line[512];
+    // Skip the header line
+    if( fgets(line,sizeof(line),f) == NULL ) {
+        fclose(f);
+        return;
+    }
+    while( fgets(line,sizeof(line),f) != NULL ) {
+        unsigned int local_port, remote_port, state;
+        if( sscanf(line,"%*d: %*x:%x %*x:%x %x",&local_port,&remote_port,&state) != 3 )
+            continue;
+        // TCP_TIME_WAIT
+        if( state != 6 )
+            continue;
+        if( local_port == port )
+            ++*local;
+        else if( remote_port == port )
+            ++*remote;
+    }
+    fclose(f);
+}
+
+int main( int argc , char* argv[] ) {
+    if( argc != 6 ) {
+        std::cerr<<"Usage: close_churn total concurrency "
+                   "mode(0 close/1 abort/2 async close) stuck_every close_timeout_ms"<<std::endl;
+        return -1;
+    }
+    const int total = atoi(argv[1]);
+    const int mode = atoi(argv[3]);
+    const int stuck_every = atoi(argv[4]);
+    const int close_timeout = atoi(argv[5]);
+    if( mode == 2 && stuck_every > 0 && close_timeout <= 0 ) {
+        std::cerr<<"A graceful close never finishes for a stuck client without "
+                   "a close timeout"<<std::endl;
+        return -1;
+    }
+    double elapsed;
+    int timed_out;
+    uint16_t port;
+    {
+        CloseChurn c( total , atoi(argv[2]) , mode , stuck_every , close_timeout );
+        double start = Seconds();
+        c.Run();
+        elapsed = Seconds() - start;
+        timed_out = c.timed_out();
+        port = c.port();
+    }
+
+    int local, remote;
+    CountTimeWait( port , &local , &remote );
+    std::cout<<"closes/s: "<<total / elapsed<<std::endl;
+    std::cout<<"close timed out: "<<timed_out<<std::endl;
+    std::cout<<"TIME_WAIT server side: "<<local
+             <<" client side: "<<remote<<std::endl;
+    return 0;
+}
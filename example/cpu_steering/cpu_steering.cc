@@ -0,0 +1,160 @@
+#include "../../mnet.h"
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+using namespace mnet;
+
+// CPU steering benchmark. One IOManager per CPU, each pinned to its CPU and
+// owning a SO_REUSEPORT listener. Client threads pinned to every CPU connect
+// on loopback, so the kernel receives each connection on the client's CPU.
+// For every accepted connection the loop compares SO_INCOMING_CPU with its
+// own CPU; a mismatch means every later packet of the connection is handled
+// on one CPU and wakes up a loop on another one. With the CBPF steering
+// program the mismatch should drop to zero.
+
+namespace {
+
+const uint16_t kPort = 12349;
+
+volatile int g_accepted = 0;
+volatile int g_cross_cpu = 0;
+
+class Loop {
+public:
+    Loop() :
+        cpu_(0)
+        {}
+
+    bool Bind( int cpu ) {
+        cpu_ = cpu;
+        server_.set_reuse_port( true );
+        if( !server_.Bind( Endpoint("127.0.0.1",kPort) ) )
+            return false;
+        server_.SetIOManager( &io_manager_ );
+        server_.AsyncAccept( new Socket(&io_manager_) , this );
+        return true;
+    }
+
+    ServerSocket* server() {
+        return &server_;
+    }
+
+    IOManager* io_manager() {
+        return &io_manager_;
+    }
+
+    void OnAccept( Socket* socket , const NetState& ok ) {
+        if( ok ) {
+            if( socket->GetIncomingCpu() != io_manager_.cpu() )
+                __sync_fetch_and_add( &g_cross_cpu , 1 );
+            socket->Close();
+            __sync_fetch_and_add( &g_accepted , 1 );
+        }
+        delete socket;
+        server_.AsyncAccept( new Socket(&io_manager_) , this );
+    }
+
+    static void* Run( void* arg ) {
+        Loop* loop = static_cast<Loop*>(arg);
+        if( !loop->io_manager_.PinToCpu( loop->cpu_ ) )
+            std::cerr<<"Cannot pin to cpu "<<loop->cpu_<<std::endl;
+        loop->io_manager_.RunMainLoop();
+        return NULL;
+    }
+
+private:
+    int cpu_;
+    ServerSocket server_;
+    IOManager io_manager_;
+};
+
+struct Client {
+    int cpu;
+    int connections;
+};
+
+void* RunClient( void* arg ) {
+    Client* client = static_cast<Client*>(arg);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(client->cpu,&set);
+    pthread_setaffinity_np( pthread_self() , sizeof(set) , &set );
+
+    struct sockaddr_in addr;
+    bzero(&addr,sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(kPort);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    for( int i = 0 ; i < client->connections ; ++i ) {
+        int fd = ::socket(AF_INET,SOCK_STREAM,0);
+        if( ::connect(fd,reinterpret_cast<struct sockaddr*>(&addr),sizeof(addr)) != 0 ) {
+            std::cerr<<"Cannot connect:"<<std::strerror(errno)<<std::endl;
+            std::exit(-1);
+        }
+        ::close(fd);
+    }
+    return NULL;
+}
+
+void SleepUS( long usec ) {
+    struct timespec ts;
+    ts.tv_sec = usec / 1000000;
+    ts.tv_nsec = (usec % 1000000) * 1000;
+    nanosleep(&ts,NULL);
+}
+
+}// namespace
+
+int main( int argc , char* argv[] ) {
+    if( argc != 3 ) {
+        std::cerr<<"Usage: cpu_steering connections_per_cpu steering(0/1)"<<std::endl;
+        return -1;
+    }
+    const int per_cpu = atoi(argv[1]);
+    const bool steering = atoi(argv[2]) != 0;
+    const int cpus = static_cast<int>(sysconf(_SC_NPROCESSORS_ONLN));
+
+    // The listeners join the reuseport group in cpu order
+    std::vector<Loop*> loops;
+    for( int i = 0 ; i < cpus ; ++i ) {
+        loops.push_back( new Loop() );
+        if( !loops.back()->Bind(i) ) {
+            std::cerr<<"Cannot bind to port "<<kPort<<std::endl;
+            return -1;
+        }
+    }
+    if( steering && !loops[0]->server()->SteerByIncomingCpu( cpus ) ) {
+        std::cerr<<"Cannot attach the steering program:"<<std::strerror(errno)<<std::endl;
+        return -1;
+    }
+
+    std::vector<pthread_t> threads(cpus);
+    for( int i = 0 ; i < cpus ; ++i )
+        pthread_create( &threads[i] , NULL , Loop::Run , loops[i] );
+
+    std::vector<Client> clients(cpus);
+    std::vector<pthread_t> client_threads(cpus);
+    for( int i = 0 ; i < cpus ; ++i ) {
+        clients[i].cpu = i;
+        clients[i].connections = per_cpu;
+        pthread_create( &client_threads[i] , NULL , RunClient , &clients[i] );
+    }
+    for( int i = 0 ; i < cpus ; ++i )
+        pthread_join( client_threads[i] , NULL );
+
+    while( g_accepted < per_cpu * cpus )
+        SleepUS(1000);
+
+    for( int i = 0 ; i < cpus ; ++i ) {
+        loops[i]->io_manager()->Interrupt();
+        pthread_join( threads[i] , NULL );
+        delete loops[i];
+    }
+
+    std::cout<<"cpus: "<<cpus<<" steering: "<<steering<<std::endl;
+    std::cout<<"cross cpu connections: "<<g_cross_cpu<<"/"<<g_accepted
+             <<" ("<<100.0 * g_cross_cpu / g_accepted<<"%)"<<std::endl;
+    return 0;
+}
@@ -0,0 +1,192 @@
+#include "../../mnet.h"
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+using namespace mnet;
+
+// Dispatch benchmark. It holds a large number of connections on loopback,
+// makes every one of them readable at the same time by writing one byte from
+// a plain client socket, and measures how long the IOManager takes to drain
+// all the events. The result is reported as cycles (or nanoseconds) per event,
+// so different prefetch distances and batch sizes can be compared.
+
+namespace {
+
+uint64_t Cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+double Seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+const uint16_t kPort = 12347;
+// Spread the clients over several loopback addresses to not run out of
+// ephemeral ports
+const int kLoopbackAddress = 8;
+
+int ConnectRaw( int index ) {
+    int fd = ::socket(AF_INET,SOCK_STREAM,0);
+    if( fd < 0 )
+        return -1;
+    struct sockaddr_in addr;
+    bzero(&addr,sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(kPort);
+    addr.sin_addr.s_addr = htonl( (127u<<24) | (1 + index % kLoopbackAddress) );
+    if( ::connect(fd,reinterpret_cast<struct sockaddr*>(&addr),sizeof(addr)) != 0 ) {
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+}// namespace
+
+class Dispatch {
+public:
+    Dispatch() :
+        accepted_(0),
+        accept_target_(0),
+        received_(0),
+        receive_target_(0)
+    {
+        if( !server_.Bind( Endpoint("0.0.0.0",kPort) ) ) {
+            std::cerr<<"Cannot bind to port "<<kPort<<std::endl;
+            std::exit(-1);
+        }
+        server_.SetIOManager( &io_manager_ );
+        server_.AsyncAccept( new Socket(&io_manager_) , this );
+    }
+
+    IOManager* io_manager() {
+        return &io_manager_;
+    }
+
+    // Run the loop until target connections have been accepted
+    void WaitAccept( int target ) {
+        accept_target_ = target;
+        if( accepted_ < accept_target_ )
+            io_manager_.RunMainLoop();
+    }
+
+    // Run the loop until target bytes have been received
+    void WaitReceive( int target ) {
+        received_ = 0;
+        receive_target_ = target;
+        io_manager_.RunMainLoop();
+    }
+
+    void OnAccept( Socket* socket , const NetState& ok ) {
+        if( ok ) {
+            socket->AsyncRead( this );
+            ++accepted_;
+        } else {
+            delete socket;
+        }
+        server_.AsyncAccept( new Socket(&io_manager_) , this );
+        if( accepted_ == accept_target_ )
+            io_manager_.Interrupt();
+    }
+
+    void OnRead( Socket* socket , std::size_t size , const NetState& ok ) {
+        if( !ok || size == 0 ) {
+            socket->Close();
+            delete socket;
+            return;
+        }
+        socket->read_buffer().Clear();
+        socket->AsyncRead( this );
+        received_ += static_cast<int>(size);
+        if( received_ == receive_target_ )
+            io_manager_.Interrupt();
+    }
+
+private:
+    int accepted_;
+    int accept_target_;
+    int received_;
+    int receive_target_;
+    ServerSocket server_;
+    IOManager io_manager_;
+};
+
+int main( int argc , char* argv[] ) {
+    if( argc < 2 ) {
+        std::cerr<<"Usage: dispatch connections [rounds] [prefetch_distance] [batch_size]"<<std::endl;
+        return -1;
+    }
+    int connections = atoi(argv[1]);
+    const int rounds = argc > 2 ? atoi(argv[2]) : 10;
+
+    // Each connection needs 2 file descriptors in this process
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE,&limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE,&limit);
+    if( static_cast<rlim_t>(connections) * 2 + 64 > limit.rlim_cur ) {
+        connections = static_cast<int>((limit.rlim_cur - 64) / 2);
+        std::cerr<<"File descriptor limit, use "<<connections<<" connections"<<std::endl;
+    }
+
+    Dispatch d;
+    if( argc > 3 )
+        d.io_manager()->set_prefetch_distance( atoi(argv[3]) );
+    if( argc > 4 )
+        d.io_manager()->set_event_batch_size( atoi(argv[4]) );
+
+    // Connect in chunks so the listen backlog never overflows
+    static const int kChunk = 1000;
+    std::vector<int> clients;
+    clients.reserve(connections);
+    while( static_cast<int>(clients.size()) < connections ) {
+        for( int i = 0 ; i < kChunk && static_cast<int>(clients.size()) < connections ; ++i ) {
+            int fd = ConnectRaw( static_cast<int>(clients.size()) );
+            if( fd < 0 ) {
+                std::cerr<<"Cannot connect:"<<std::strerror(errno)<<std::endl;
+                return -1;
+            }
+            clients.push_back(fd);
+        }
+        d.WaitAccept( static_cast<int>(clients.size()) );
+    }
+
+    uint64_t total_cycles = 0;
+    double total_seconds = 0;
+    char c = 'x';
+    for( int r = 0 ; r < rounds ; ++r ) {
+        for( std::size_t i = 0 ; i < clients.size() ; ++i ) {
+            if( ::write(clients[i],&c,1) != 1 ) {
+                std::cerr<<"Cannot write:"<<std::strerror(errno)<<std::endl;
+                return -1;
+            }
+        }
+        double start = Seconds();
+        uint64_t cycles = Cycles();
+        d.WaitReceive( connections );
+        total_cycles += Cycles() - cycles;
+        total_seconds += Seconds() - start;
+    }
+
+    const double events = static_cast<double>(connections) * rounds;
+#if defined(__x86_64__) || defined(__i386__)
+    std::cout<<"cycles/event: "<<total_cycles / events<<std::endl;
+#else
+    std::cout<<"ns/event: "<<total_cycles / events<<std::endl;
+#endif
+    std::cout<<"events/s: "<<events / total_seconds<<std::endl;
+    std::cout<<"final batch size: "<<d.io_manager()->event_batch_size()<<std::endl;
+
+    for( std::size_t i = 0 ; i < clients.size() ; ++i )
+        ::close(clients[i]);
+    return 0;
+}
@@ -0,0 +1,201 @@
+#include "../../mnet.h"
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+using namespace mnet;
+
+// Drain benchmark. Clients send a request and read a large response until
+// EOF. Once the server has received every request, it is shut down while the
+// responses are still in flight. With Interrupt the loop returns at once and
+// the sockets are closed behind it, as exiting the process would do. With
+// Drain the responses are flushed and the connections closed gracefully. A
+// few clients never read their response, so they can only be force closed.
+// The sockets the drain closes are handed back through OnDrainClose, so none
+// is left to the server afterwards.
+
+namespace {
+
+const uint16_t kPort = 12352;
+
+volatile int g_requests = 0;
+volatile int g_complete = 0;
+volatile int g_truncated = 0;
+std::size_t g_response_size = 0;
+
+class Server {
+public:
+    Server() {
+        if( !server_.Bind( Endpoint("127.0.0.1",kPort) ) ) {
+            std::cerr<<"Cannot bind to port "<<kPort<<std::endl;
+            std::exit(-1);
+        }
+        server_.SetIOManager( &io_manager_ );
+        server_.AsyncAccept( new Socket(&io_manager_) , this );
+    }
+
+    IOManager* io_manager() {
+        return &io_manager_;
+    }
+
+    void OnAccept( Socket* socket , const NetState& ok ) {
+        if( ok ) {
+            sockets_.insert( socket );
+            socket->AsyncRead( this );
+        } else {
+            delete socket;
+        }
+        server_.AsyncAccept( new Socket(&io_manager_) , this );
+    }
+
+    void OnRead( Socket* socket , std::size_t size , const NetState& ok ) {
+        if( !ok || size == 0 ) {
+            Release( socket );
+            return;
+        }
+        std::size_t sz = socket->read_buffer().readable_size();
+        socket->read_buffer().Read(&sz);
+        std::vector<char> response( g_response_size , 'x' );
+        socket->write_buffer().Write( &response[0] , response.size() );
+        socket->AsyncWrite( this );
+        socket->AsyncRead( this );
+        __sync_fetch_and_add( &g_requests , 1 );
+    }
+
+    void OnWrite( Socket* socket , std::size_t size , const NetState& ok ) {
+        if( !ok )
+            Release( socket );
+    }
+
+    void OnDrainClose( Socket* socket , const NetState& ok ) {
+        Release( socket );
+    }
+
+    std::size_t socket_size() const {
+        return sockets_.size();
+    }
+
+    // Close what is left after the loop returns
+    void CloseAll() {
+        for( std::set<Socket*>::iterator i = sockets_.begin() ; i != sockets_.end() ; ++i ) {
+            (*i)->Close();
+            delete *i;
+        }
+        sockets_.clear();
+    }
+
+private:
+    void Release( Socket* socket ) {
+        if( sockets_.erase( socket ) == 0 )
+            return;
+        if( socket->Valid() )
+            socket->Close();
+        delete socket;
+    }
+
+    std::set<Socket*> sockets_;
+    ServerSocket server_;
+    IOManager io_manager_;
+};
+
+void* RunLoop( void* arg ) {
+    static_cast<Server*>(arg)->io_manager()->RunMainLoop();
+    return NULL;
+}
+
+int Connect() {
+    struct sockaddr_in addr;
+    bzero(&addr,sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(kPort);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int fd = ::socket(AF_INET,SOCK_STREAM,0);
+    if( ::connect(fd,reinterpret_cast<struct sockaddr*>(&addr),sizeof(addr)) != 0 ) {
+        std::cerr<<"Cannot connect:"<<std::strerror(errno)<<std::endl;
+        std::exit(-1);
+    }
+    return fd;
+}
+
+// Read the response until EOF, slowly enough to keep it in flight for a while
+void* RunClient( void* arg ) {
+    int fd = Connect();
+    char c = 'r';
+    ::write(fd,&c,1);
+    std::size_t total = 0;
+    char buf[16384];
+    while( true ) {
+        ssize_t n = ::read(fd,buf,sizeof(buf));
+        if( n <= 0 )
+            break;
+        total += static_cast<std::size_t>(n);
+        usleep(1000);
+    }
+    if( total == g_response_size )
+        __sync_fetch_and_add( &g_complete , 1 );
+    else
+        __sync_fetch_and_add( &g_truncated , 1 );
+    ::close(fd);
+    return NULL;
+}
+
+// Send the request but never read the response
+void* RunStuckClient( void* arg ) {
+    int fd = Connect();
+    char c = 'r';
+    ::write(fd,&c,1);
+    while( *static_cast<volatile bool*>(arg) == false )
+        usleep(1000);
+    ::close(fd);
+    return NULL;
+}
+
+}// namespace
+
+int main( int argc , char* argv[] ) {
+    if( argc != 6 ) {
+        std::cerr<<"Usage: drain clients stuck_clients response_size timeout_ms drain(0/1)"<<std::endl;
+        return -1;
+    }
+    const int clients = atoi(argv[1]);
+    const int stuck = atoi(argv[2]);
+    g_response_size = static_cast<std::size_t>(atoi(argv[3]));
+    const int timeout = atoi(argv[4]);
+    const bool drain = atoi(argv[5]) != 0;
+
+    Server server;
+    pthread_t loop;
+    pthread_create( &loop , NULL , RunLoop , &server );
+
+    volatile bool stop_stuck = false;
+    std::vector<pthread_t> threads(clients + stuck);
+    for( int i = 0 ; i < clients ; ++i )
+        pthread_create( &threads[i] , NULL , RunClient , NULL );
+    for( int i = 0 ; i < stuck ; ++i )
+        pthread_create( &threads[clients+i] , NULL , RunStuckClient ,
+                        const_cast<bool*>(&stop_stuck) );
+    while( g_requests < clients + stuck )
+        usleep(1000);
+
+    if( drain ) {
+        server.io_manager()->Drain( timeout , &server );
+        pthread_join( loop , NULL );
+    } else {
+        server.io_manager()->Interrupt();
+        pthread_join( loop , NULL );
+    }
+    const std::size_t left = server.socket_size();
+    server.CloseAll();
+    stop_stuck = true;
+    for( std::size_t i = 0 ; i < threads.size() ; ++i )
+        pthread_join( threads[i] , NULL );
+
+    std::cout<<"mode: "<<(drain ? "drain" : "interrupt")<<std::endl;
+    if( drain ) {
+        const IOManager::DrainStats& stats = server.io_manager()->drain_stats();
+        std::cout<<"drained clean: "<<stats.clean<<" force closed: "<<stats.forced<<std::endl;
+    }
+    std::cout<<"sockets left open: "<<left<<std::endl;
+    std::cout<<"complete responses: "<<g_complete<<" truncated: "<<g_truncated<<std::endl;
+    return 0;
+}
@@ -9,18 +9,17 @@ public:
     void OnAccept( Socket* new_socket , const NetState& ok );
     void OnRead( Socket* socket , std::size_t size , const NetState& ok );
     void OnWrite( Socket* socket , std::size_t size , const NetState& ok );
+    void OnSignal( int signo );
     void Run() {
         io_manager_.RunMainLoop();
     }
-    void WakeUp() {
-        io_manager_.Interrupt();
-    }
 
 private:
     int times_; // Times for each echo request
     int fd_fail_; 
     ServerSocket server_; // ServerSocket 
     IOManager io_manager_; // IOManager
+    SignalWatcher signal_watcher_; // Signals to shutdown the server
     Socket* socket_; 
 };
 
@@ -30,8 +29,13 @@ Server::Server():
     fd_fail_(0),
     server_(),
     io_manager_(),
+    signal_watcher_( &io_manager_ ),
     socket_( NULL )
 {
+    signal_watcher_.Add( SIGTERM );
+    signal_watcher_.Add( SIGINT );
+    signal_watcher_.Add( SIGTSTP );
+    signal_watcher_.AsyncWait( this );
     server_.Bind( Endpoint( "127.0.0.1:12345" ) );
     server_.SetIOManager(&io_manager_);
     socket_ = new Socket( &io_manager_ );
@@ -63,10 +67,9 @@ void Server::OnRead( Socket* socket , std::size_t size , const NetState& ok ) {
             socket->Close();
             delete socket;
         } else {
-            // Dump whatever we have here
-            std::size_t read_sz = socket->read_buffer().readable_size();
-            void* buf = socket->read_buffer().Read(&read_sz);
-            socket->write_buffer().Write( buf , read_sz );
+            // Dump whatever we have here, the memory of the read buffer is
+            // handed over to the write buffer without copying
+            socket->read_buffer().TransferTo( &socket->write_buffer() );
             socket->AsyncWrite( this );
             socket->AsyncRead( this );
         }
@@ -79,19 +82,13 @@ void Server::OnRead( Socket* socket , std::size_t size , const NetState& ok ) {
 void Server::OnWrite( Socket* socket , std::size_t size , const NetState& ok ) {
 }
 
-Server* GServer;
-
-void onsignal( int val ) {
-    GServer->WakeUp();
+void Server::OnSignal( int signo ) {
+    io_manager_.Interrupt();
 }
 
 int main() {
-    Server s;
-    signal(SIGTERM,onsignal);
-    signal(SIGINT,onsignal);
-    signal(SIGTSTP,onsignal);
     signal(SIGPIPE,SIG_IGN);
-    GServer = &s;
+    Server s;
     s.Run();
     std::cout<<"Done!"<<std::endl;
     return 0;
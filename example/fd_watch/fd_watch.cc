@@ -0,0 +1,163 @@
+#include "../../mnet.h"
+#include <signal.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+using namespace mnet;
+
+// FdWatcher example. A single IOManager, with no extra thread, reads the output
+// of a child process through a pipe, counts the ticks of a timerfd with level
+// trigger, and collects the events that another thread posts to an eventfd.
+// Once the child exits it raises SIGUSR1, which a SignalWatcher turns into
+// the shutdown of the loop.
+
+namespace {
+
+const int kEventCount = 5;
+
+void* PostEvents( void* arg ) {
+    int fd = *static_cast<int*>(arg);
+    for( int i = 0 ; i < kEventCount ; ++i ) {
+        uint64_t one = 1;
+        if( ::write(fd,&one,sizeof(one)) != sizeof(one) )
+            break;
+        usleep(20000);
+    }
+    return NULL;
+}
+
+}// namespace
+
+class Watch {
+public:
+    Watch() :
+        child_( &io_manager_ ),
+        timer_( &io_manager_ ),
+        event_( &io_manager_ ),
+        signal_( &io_manager_ ),
+        ticks_(0),
+        events_(0),
+        pid_(-1),
+        event_fd_(-1),
+        timer_handler_(this),
+        event_handler_(this)
+    {}
+
+    bool Start() {
+        // Block SIGUSR1 before the thread below is created
+        if( !signal_.Add( SIGUSR1 ) )
+            return false;
+        signal_.AsyncWait( this );
+
+        int pipe_fd[2];
+        if( ::pipe2( pipe_fd , O_NONBLOCK | O_CLOEXEC ) != 0 )
+            return false;
+        pid_ = ::fork();
+        if( pid_ == 0 ) {
+            ::dup2( pipe_fd[1] , STDOUT_FILENO );
+            ::execl( "/bin/sh" , "sh" , "-c" ,
+                     "for i in 1 2 3; do echo line $i; sleep 0.1; done" ,
+                     static_cast<char*>(NULL) );
+            ::_exit(127);
+        }
+        ::close( pipe_fd[1] );
+        child_.Attach( pipe_fd[0] );
+        child_.AsyncWaitReadable( this );
+
+        int timer_fd = ::timerfd_create( CLOCK_MONOTONIC , TFD_NONBLOCK | TFD_CLOEXEC );
+        struct itimerspec spec;
+        spec.it_interval.tv_sec = spec.it_value.tv_sec = 0;
+        spec.it_interval.tv_nsec = spec.it_value.tv_nsec = 50 * 1000 * 1000;
+        ::timerfd_settime( timer_fd , 0 , &spec , NULL );
+        timer_.Attach( timer_fd , FdWatcher::LEVEL_TRIGGER );
+        timer_.AsyncWaitReadable( &timer_handler_ );
+
+        event_fd_ = ::eventfd( 0 , EFD_NONBLOCK | EFD_CLOEXEC );
+        event_.Attach( event_fd_ );
+        event_.AsyncWaitReadable( &event_handler_ );
+        pthread_create( &poster_ , NULL , PostEvents , &event_fd_ );
+        return true;
+    }
+
+    void Run() {
+        io_manager_.RunMainLoop();
+        pthread_join( poster_ , NULL );
+        timer_.Close();
+        event_.Close();
+        std::cout<<"timer ticks: "<<ticks_<<" events: "<<events_<<std::endl;
+    }
+
+    // Output of the child process, read until EAGAIN as required by edge trigger
+    void OnReadable( FdWatcher* watcher , const NetState& ok ) {
+        char buf[256];
+        while( true ) {
+            ssize_t ret = ::read( watcher->fd() , buf , sizeof(buf) );
+            if( ret > 0 ) {
+                std::cout.write( buf , ret );
+                continue;
+            }
+            if( ret < 0 && errno == EAGAIN ) {
+                watcher->AsyncWaitReadable( this );
+                return;
+            }
+            break;
+        }
+        // EOF, the child has exited
+        watcher->Close();
+        ::waitpid( pid_ , NULL , 0 );
+        ::kill( ::getpid() , SIGUSR1 );
+    }
+
+    void OnSignal( int signo ) {
+        std::cout<<"signal: "<<signo<<std::endl;
+        io_manager_.Interrupt();
+    }
+
+private:
+    // Level trigger, one read per notification is enough
+    struct TimerHandler {
+        explicit TimerHandler( Watch* w ) : watch(w) {}
+        void OnReadable( FdWatcher* watcher , const NetState& ok ) {
+            uint64_t expiration;
+            if( ::read( watcher->fd() , &expiration , sizeof(expiration) ) == sizeof(expiration) )
+                watch->ticks_ += expiration;
+            watcher->AsyncWaitReadable( this );
+        }
+        Watch* watch;
+    };
+
+    struct EventHandler {
+        explicit EventHandler( Watch* w ) : watch(w) {}
+        void OnReadable( FdWatcher* watcher , const NetState& ok ) {
+            uint64_t count;
+            // An eventfd is drained by a single read
+            if( ::read( watcher->fd() , &count , sizeof(count) ) == sizeof(count) )
+                watch->events_ += count;
+            watcher->AsyncWaitReadable( this );
+        }
+        Watch* watch;
+    };
+
+    IOManager io_manager_;
+    FdWatcher child_;
+    FdWatcher timer_;
+    FdWatcher event_;
+    SignalWatcher signal_;
+    uint64_t ticks_;
+    uint64_t events_;
+    pid_t pid_;
+    int event_fd_;
+    pthread_t poster_;
+    TimerHandler timer_handler_;
+    EventHandler event_handler_;
+};
+
+int main() {
+    Watch w;
+    if( !w.Start() ) {
+        std::cerr<<"Cannot start:"<<std::strerror(errno)<<std::endl;
+        return -1;
+    }
+    w.Run();
+    return 0;
+}
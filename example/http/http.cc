@@ -0,0 +1,220 @@
+#include "../../mnet.h"
+#include "../../mnet_http.h"
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+using namespace mnet;
+
+// A wrk style benchmark of the HTTP server. A server thread answers GET /hello
+// with a small body, or GET /file with a file sent by sendfile. The clients of
+// the main thread keep a number of requests in flight on each connection, with
+// a depth of 1 every request waits for the previous response and with a larger
+// depth the requests are pipelined. It reports the requests per second.
+
+static const char* kAddress = "127.0.0.1:12366";
+
+double Seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+class Handler {
+public:
+    explicit Handler( const char* file ) :
+        file_(file)
+        {}
+
+    void OnRequest( const http::Request& request , http::Response* response ) {
+        if( request.path() == "/hello" ) {
+            response->AddHeader( "Content-Type" , "text/plain" );
+            response->Write( "Hello, World!" );
+        } else if( request.path() == "/file" && file_ != NULL ) {
+            int fd = ::open( file_ , O_RDONLY );
+            struct stat st;
+            if( fd < 0 || fstat( fd , &st ) != 0 ) {
+                response->set_status(500);
+                if( fd >= 0 )
+                    ::close(fd);
+                return;
+            }
+            response->AddHeader( "Content-Type" , "application/octet-stream" );
+            response->SendFile( fd , 0 , static_cast<std::size_t>(st.st_size) );
+        } else {
+            response->set_status(404);
+        }
+    }
+
+private:
+    const char* file_;
+};
+
+class Server {
+public:
+    explicit Server( const char* file ) :
+        handler_(file),
+        io_manager_(),
+        server_(&io_manager_)
+    {
+        if( !server_.Bind( Endpoint(kAddress) ) ) {
+            std::cerr<<"Cannot bind to "<<kAddress<<std::endl;
+            std::exit(-1);
+        }
+        server_.Start( &handler_ );
+    }
+
+    void Run() {
+        io_manager_.RunMainLoop();
+    }
+
+    IOManager* io_manager() {
+        return &io_manager_;
+    }
+
+private:
+    Handler handler_;
+    IOManager io_manager_;
+    http::Server server_;
+};
+
+class Client {
+public:
+    Client( int connections , int requests , int depth , const std::string& path ) :
+        connections_(connections),
+        requests_(requests),
+        depth_(depth),
+        finished_(0),
+        responses_(0),
+        body_bytes_(0)
+    {
+        request_ = "GET " + path + " HTTP/1.1\r\nHost: 127.0.0.1\r\nUser-Agent: mnet\r\n\r\n";
+        for( int i = 0 ; i < connections ; ++i ) {
+            Conn* c = new Conn( this );
+            c->socket.AsyncConnect( Endpoint(kAddress) , c );
+        }
+    }
+
+    void Run() {
+        io_manager_.RunMainLoop();
+    }
+
+    uint64_t responses() const {
+        return responses_;
+    }
+
+    uint64_t body_bytes() const {
+        return body_bytes_;
+    }
+
+private:
+    struct Conn {
+        explicit Conn( Client* c ) :
+            client(c),
+            left(c->requests_),
+            in_flight(0),
+            socket(&c->io_manager_)
+            {}
+        void OnConnect( Socket* s , const NetState& ok ) {
+            if( !ok ) {
+                std::cerr<<"Cannot connect:"<<std::strerror(ok.error_code())<<std::endl;
+                std::exit(-1);
+            }
+            Send();
+            socket.AsyncRead( this );
+        }
+        void OnWrite( Socket* s , std::size_t size , const NetState& ok ) {}
+        void OnRead( Socket* s , std::size_t size , const NetState& ok ) {
+            if( !ok || size == 0 ) {
+                std::cerr<<"Connection is closed"<<std::endl;
+                std::exit(-1);
+            }
+            // Count the complete responses by their Content-Length
+            while( in_flight != 0 ) {
+                Buffer::Accessor accessor = socket.read_buffer().GetReadAccessor();
+                const char* data = static_cast<const char*>(accessor.address());
+                const char* head_end = static_cast<const char*>(
+                        memmem( data , accessor.size() , "\r\n\r\n" , 4 ) );
+                if( head_end == NULL )
+                    break;
+                const std::size_t head_size = head_end + 4 - data;
+                const char* length = static_cast<const char*>(
+                        memmem( data , head_size , "Content-Length: " , 16 ) );
+                const std::size_t body_size = length == NULL ? 0 : strtoul( length + 16 , NULL , 10 );
+                if( accessor.size() < head_size + body_size )
+                    break;
+                accessor.set_committed_size( head_size + body_size );
+                --in_flight;
+                ++client->responses_;
+                client->body_bytes_ += body_size;
+            }
+            if( in_flight == 0 ) {
+                if( left == 0 ) {
+                    client->OnDone();
+                    return;
+                }
+                Send();
+            }
+            socket.AsyncRead( this );
+        }
+        // Send the next batch of pipelined requests
+        void Send() {
+            while( in_flight < client->depth_ && left != 0 ) {
+                socket.write_buffer().Write( client->request_.data() , client->request_.size() );
+                ++in_flight;
+                --left;
+            }
+            socket.AsyncWrite( this );
+        }
+        Client* client;
+        int left;
+        int in_flight;
+        ClientSocket socket;
+    };
+
+    void OnDone() {
+        if( ++finished_ == connections_ )
+            io_manager_.Interrupt();
+    }
+
+    int connections_;
+    int requests_;
+    int depth_;
+    int finished_;
+    uint64_t responses_;
+    uint64_t body_bytes_;
+    std::string request_;
+    IOManager io_manager_;
+};
+
+void* RunServer( void* arg ) {
+    static_cast<Server*>(arg)->Run();
+    return NULL;
+}
+
+int main( int argc , char* argv[] ) {
+    if( argc != 4 && argc != 5 ) {
+        std::cerr<<"Usage: http connections requests pipeline_depth [file]"<<std::endl;
+        return -1;
+    }
+    const char* file = argc == 5 ? argv[4] : NULL;
+    Server server( file );
+    pthread_t loop;
+    pthread_create( &loop , NULL , RunServer , &server );
+
+    const int depth = atoi(argv[3]);
+    Client client( atoi(argv[1]) , atoi(argv[2]) , depth > 0 ? depth : 1 ,
+                   file != NULL ? "/file" : "/hello" );
+    const double start = Seconds();
+    client.Run();
+    const double elapsed = Seconds() - start;
+
+    server.io_manager()->Interrupt();
+    pthread_join( loop , NULL );
+
+    std::cout<<"path: "<<( file != NULL ? "/file" : "/hello" )
+             <<" pipeline depth: "<<( depth > 0 ? depth : 1 )<<std::endl;
+    std::cout<<"requests/s: "<<client.responses() / elapsed<<std::endl;
+    if( file != NULL )
+        std::cout<<"body MB/s: "<<client.body_bytes() / elapsed / ( 1024 * 1024 )<<std::endl;
+    std::_Exit(0);
+}
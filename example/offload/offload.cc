@@ -0,0 +1,215 @@
+#include "../../mnet.h"
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+using namespace mnet;
+
+// Offload benchmark. A single IOManager serves two kinds of requests. A heavy
+// request burns a few milliseconds of CPU before it is answered, a light one
+// is answered at once. One client thread keeps heavy requests in flight while
+// another one measures the round trip time of light requests. Running the
+// heavy work inline stalls every light request behind it; with an OffloadPool
+// the loop keeps answering them and the p99 should stay flat.
+
+namespace {
+
+const uint16_t kPort = 12351;
+
+volatile bool g_stop = false;
+int g_work_us = 0;
+
+double Seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void Spin( int usec ) {
+    const double end = Seconds() + usec / 1e6;
+    while( Seconds() < end )
+        ;
+}
+
+class Server {
+public:
+    Server( OffloadPool* pool ) :
+        pool_(pool)
+    {
+        if( !server_.Bind( Endpoint("127.0.0.1",kPort) ) ) {
+            std::cerr<<"Cannot bind to port "<<kPort<<std::endl;
+            std::exit(-1);
+        }
+        server_.SetIOManager( &io_manager_ );
+        server_.AsyncAccept( new Socket(&io_manager_) , this );
+    }
+
+    IOManager* io_manager() {
+        return &io_manager_;
+    }
+
+    void OnAccept( Socket* socket , const NetState& ok ) {
+        if( ok ) {
+            socket->AsyncRead( this );
+        } else {
+            delete socket;
+        }
+        server_.AsyncAccept( new Socket(&io_manager_) , this );
+    }
+
+    void OnRead( Socket* socket , std::size_t size , const NetState& ok ) {
+        if( !ok || size == 0 ) {
+            socket->Close();
+            // Otherwise it is deleted by OnComplete
+            if( !socket->has_pending_offload() )
+                delete socket;
+            return;
+        }
+        std::size_t sz = socket->read_buffer().readable_size();
+        const char* buf = static_cast<const char*>(socket->read_buffer().Read(&sz));
+        for( std::size_t i = 0 ; i < sz ; ++i ) {
+            if( buf[i] != 'h' ) {
+                socket->write_buffer().Write( &buf[i] , 1 );
+            } else if( pool_ == NULL ) {
+                Spin( g_work_us );
+                socket->write_buffer().Write( &buf[i] , 1 );
+            } else {
+                // The client keeps one heavy request in flight, so the pool
+                // never saturates here
+                CheckOffload( pool_->Offload( socket , &work_ , this ) );
+            }
+        }
+        if( socket->write_buffer().readable_size() != 0 )
+            socket->AsyncWrite( this );
+        socket->AsyncRead( this );
+    }
+
+    void OnWrite( Socket* socket , std::size_t size , const NetState& ok ) {}
+
+    void OnComplete( Socket* socket , const NetState& ok ) {
+        if( !ok ) {
+            // The socket has been closed meanwhile
+            if( !socket->has_pending_offload() )
+                delete socket;
+            return;
+        }
+        char c = 'h';
+        socket->write_buffer().Write( &c , 1 );
+        socket->AsyncWrite( this );
+    }
+
+private:
+    struct Work {
+        void OnWork() {
+            Spin( g_work_us );
+        }
+    };
+
+    static void CheckOffload( bool ok ) {
+        if( !ok ) {
+            std::cerr<<"The offload pool is saturated"<<std::endl;
+            std::exit(-1);
+        }
+    }
+
+    OffloadPool* pool_;
+    Work work_;
+    ServerSocket server_;
+    IOManager io_manager_;
+};
+
+void* RunLoop( void* arg ) {
+    static_cast<Server*>(arg)->io_manager()->RunMainLoop();
+    return NULL;
+}
+
+int Connect() {
+    struct sockaddr_in addr;
+    bzero(&addr,sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(kPort);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int fd = ::socket(AF_INET,SOCK_STREAM,0);
+    int tag = 1;
+    ::setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&tag,sizeof(tag));
+    if( ::connect(fd,reinterpret_cast<struct sockaddr*>(&addr),sizeof(addr)) != 0 ) {
+        std::cerr<<"Cannot connect:"<<std::strerror(errno)<<std::endl;
+        std::exit(-1);
+    }
+    return fd;
+}
+
+// Keep one heavy request in flight on each connection
+void* RunHeavyClient( void* arg ) {
+    const int connections = *static_cast<int*>(arg);
+    std::vector<int> fds;
+    for( int i = 0 ; i < connections ; ++i )
+        fds.push_back( Connect() );
+    char c = 'h';
+    for( std::size_t i = 0 ; i < fds.size() ; ++i )
+        ::write(fds[i],&c,1);
+    while( !g_stop ) {
+        for( std::size_t i = 0 ; i < fds.size() ; ++i ) {
+            if( ::read(fds[i],&c,1) != 1 )
+                return NULL;
+            ::write(fds[i],&c,1);
+        }
+    }
+    for( std::size_t i = 0 ; i < fds.size() ; ++i )
+        ::close(fds[i]);
+    return NULL;
+}
+
+}// namespace
+
+int main( int argc , char* argv[] ) {
+    if( argc != 5 ) {
+        std::cerr<<"Usage: offload heavy_connections work_us requests pool_threads(0 for inline)"<<std::endl;
+        return -1;
+    }
+    int heavy = atoi(argv[1]);
+    g_work_us = atoi(argv[2]);
+    const int requests = atoi(argv[3]);
+    const int threads = atoi(argv[4]);
+
+    OffloadPool* pool = threads == 0 ? NULL : new OffloadPool( threads , 1024 );
+    Server server( pool );
+    pthread_t loop;
+    pthread_create( &loop , NULL , RunLoop , &server );
+    pthread_t heavy_client;
+    pthread_create( &heavy_client , NULL , RunHeavyClient , &heavy );
+
+    // Measure the light requests, paced at one per millisecond
+    int fd = Connect();
+    std::vector<double> rtt;
+    char c = 'l';
+    for( int i = 0 ; i < requests ; ++i ) {
+        const double start = Seconds();
+        ::write(fd,&c,1);
+        if( ::read(fd,&c,1) != 1 )
+            break;
+        rtt.push_back( (Seconds() - start) * 1e6 );
+        const double next = start + 0.001;
+        while( Seconds() < next )
+            usleep(100);
+    }
+    ::close(fd);
+
+    g_stop = true;
+    pthread_join( heavy_client , NULL );
+    server.io_manager()->Interrupt();
+    pthread_join( loop , NULL );
+
+    std::sort( rtt.begin() , rtt.end() );
+    std::cout<<"mode: "<<(pool == NULL ? "inline" : "offload")<<std::endl;
+    std::cout<<"light rtt us p50: "<<rtt[rtt.size()/2]
+             <<" p99: "<<rtt[rtt.size()*99/100]<<std::endl;
+    if( pool != NULL ) {
+        OffloadPool::Stats stats = pool->stats();
+        std::cout<<"offloaded: "<<stats.completed<<" max queue depth: "<<stats.max_queue_depth
+                 <<" stolen: "<<stats.stolen<<std::endl;
+        delete pool;
+    }
+    return 0;
+}
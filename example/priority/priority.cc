@@ -0,0 +1,238 @@
+#include "../../mnet.h"
+#include <pthread.h>
+#include <time.h>
+#include <algorithm>
+#include <vector>
+using namespace mnet;
+
+// Priority class benchmark. A server thread echoes the requests of many bulk
+// clients, each of them keeps a large request in flight, and of an interactive
+// client that sends a small ping every millisecond. Without priorities the ping
+// waits behind every bulk socket that is ready in the same wakeup. With the ping
+// socket in PRIORITY_HIGH it is dispatched first, and a dispatch budget also
+// bounds the bulk work done before the loop polls again.
+//
+// Modes: 0 same priority, 1 ping in PRIORITY_HIGH, 2 PRIORITY_HIGH and a budget.
+
+static const char* kAddress = "127.0.0.1:12362";
+static const std::size_t kRequestSize = 64 * 1024;
+
+uint64_t Microseconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+// A ping starts with 'p', which moves its connection to PRIORITY_HIGH
+class Server {
+public:
+    Server( int mode , std::size_t budget ) {
+        echo_.use_priority = mode != 0;
+        echo_.checksum = 0;
+        if( mode == 2 )
+            io_manager_.set_dispatch_budget( budget );
+        if( !server_.Bind( Endpoint(kAddress) ) ) {
+            std::cerr<<"Cannot bind to "<<kAddress<<std::endl;
+            std::exit(-1);
+        }
+        server_.SetIOManager( &io_manager_ );
+        server_.AsyncAccept( new Socket(&io_manager_) , this );
+    }
+
+    IOManager* io_manager() {
+        return &io_manager_;
+    }
+
+    void OnAccept( Socket* socket , const NetState& ok ) {
+        if( ok ) {
+            socket->AsyncRead( &echo_ );
+        } else {
+            delete socket;
+        }
+        server_.AsyncAccept( new Socket(&io_manager_) , this );
+    }
+
+private:
+    // Echo back whatever is received. The bulk requests are summed up as well
+    // to account for the work of a real server
+    struct Echo {
+        void OnRead( Socket* socket , std::size_t size , const NetState& ok ) {
+            if( !ok || size == 0 ) {
+                socket->Close();
+                return;
+            }
+            std::size_t sz = socket->read_buffer().readable_size();
+            const unsigned char* buf =
+                static_cast<const unsigned char*>(socket->read_buffer().Read(&sz));
+            if( buf[0] == 'p' && use_priority &&
+                socket->priority() != Socket::PRIORITY_HIGH )
+                socket->set_priority( Socket::PRIORITY_HIGH );
+            for( std::size_t i = 0 ; i < sz ; ++i )
+                checksum += buf[i];
+            socket->write_buffer().Write( buf , sz );
+            socket->AsyncWrite( this );
+            socket->AsyncRead( this );
+        }
+        void OnWrite( Socket* socket , std::size_t size , const NetState& ok ) {}
+        bool use_priority;
+        unsigned int checksum;
+    };
+
+    Echo echo_;
+    ServerSocket server_;
+    IOManager io_manager_;
+};
+
+// Keeps one request in flight and counts the completed ones
+class BulkClient {
+public:
+    BulkClient( IOManager* io_manager , uint64_t* done ) :
+        done_(done),
+        request_( kRequestSize , 'b' ),
+        socket_( io_manager ) {
+        socket_.AsyncConnect( Endpoint(kAddress) , this );
+    }
+
+    void OnConnect( Socket* socket , const NetState& ok ) {
+        if( !ok ) {
+            std::cerr<<"Cannot connect:"<<std::strerror(ok.error_code())<<std::endl;
+            std::exit(-1);
+        }
+        Send();
+    }
+
+    void OnWrite( Socket* socket , std::size_t size , const NetState& ok ) {}
+
+    void OnRead( Socket* socket , std::size_t size , const NetState& ok ) {
+        if( !ok || size == 0 )
+            return;
+        if( socket->read_buffer().readable_size() < kRequestSize ) {
+            socket->AsyncRead( this );
+            return;
+        }
+        socket->read_buffer().Clear();
+        ++*done_;
+        Send();
+    }
+
+private:
+    void Send() {
+        socket_.write_buffer().Write( request_.data() , request_.size() );
+        socket_.AsyncWrite( this );
+        socket_.AsyncRead( this );
+    }
+
+    uint64_t* done_;
+    std::string request_;
+    ClientSocket socket_;
+};
+
+// Sends a ping every millisecond and records the round trips
+class PingClient {
+public:
+    PingClient( IOManager* io_manager , bool use_priority ) :
+        use_priority_(use_priority),
+        sent_(0),
+        socket_( io_manager ) {
+        socket_.AsyncConnect( Endpoint(kAddress) , this );
+    }
+
+    void OnConnect( Socket* socket , const NetState& ok ) {
+        if( !ok ) {
+            std::cerr<<"Cannot connect:"<<std::strerror(ok.error_code())<<std::endl;
+            std::exit(-1);
+        }
+        if( use_priority_ )
+            socket->set_priority( Socket::PRIORITY_HIGH );
+        Ping();
+    }
+
+    void OnWrite( Socket* socket , std::size_t size , const NetState& ok ) {}
+
+    void OnRead( Socket* socket , std::size_t size , const NetState& ok ) {
+        if( !ok || size == 0 )
+            return;
+        if( socket->read_buffer().readable_size() < kPingSize ) {
+            socket->AsyncRead( this );
+            return;
+        }
+        socket->read_buffer().Clear();
+        rtt_.push_back( Microseconds() - sent_ );
+        socket->Schedule( 1 , this );
+    }
+
+    void OnTimeout( int msec ) {
+        Ping();
+    }
+
+    std::vector<uint64_t>* rtt() {
+        return &rtt_;
+    }
+
+private:
+    static const std::size_t kPingSize = 8;
+
+    void Ping() {
+        char ping[kPingSize] = { 'p' };
+        sent_ = Microseconds();
+        socket_.write_buffer().Write( ping , kPingSize );
+        socket_.AsyncWrite( this );
+        socket_.AsyncRead( this );
+    }
+
+    bool use_priority_;
+    uint64_t sent_;
+    std::vector<uint64_t> rtt_;
+    ClientSocket socket_;
+};
+
+void* RunServer( void* arg ) {
+    static_cast<Server*>(arg)->io_manager()->RunMainLoop();
+    return NULL;
+}
+
+uint64_t Percentile( std::vector<uint64_t>* v , double p ) {
+    if( v->empty() )
+        return 0;
+    std::sort( v->begin() , v->end() );
+    return (*v)[ static_cast<std::size_t>( p * (v->size() - 1) ) ];
+}
+
+int main( int argc , char* argv[] ) {
+    if( argc != 5 ) {
+        std::cerr<<"Usage: priority mode(0 none/1 high/2 high and budget) "
+                   "bulk_clients budget seconds"<<std::endl;
+        return -1;
+    }
+    const int mode = atoi(argv[1]);
+    const int bulk_clients = atoi(argv[2]);
+    const int seconds = atoi(argv[4]);
+
+    Server server( mode , static_cast<std::size_t>(atoi(argv[3])) );
+    pthread_t loop;
+    pthread_create( &loop , NULL , RunServer , &server );
+
+    // The client loop orders its sockets in the same way as the server
+    IOManager io_manager;
+    if( mode == 2 )
+        io_manager.set_dispatch_budget( static_cast<std::size_t>(atoi(argv[3])) );
+    uint64_t done = 0;
+    std::vector<BulkClient*> bulk;
+    for( int i = 0 ; i < bulk_clients ; ++i )
+        bulk.push_back( new BulkClient( &io_manager , &done ) );
+    PingClient ping( &io_manager , mode != 0 );
+
+    const uint64_t start = Microseconds();
+    io_manager.RunFor( seconds * 1000 );
+    const double elapsed = ( Microseconds() - start ) / 1e6;
+
+    std::cout<<"bulk requests/s: "<<done / elapsed<<std::endl;
+    std::cout<<"pings: "<<ping.rtt()->size()
+             <<" p50(us): "<<Percentile( ping.rtt() , 0.5 )
+             <<" p99(us): "<<Percentile( ping.rtt() , 0.99 )
+             <<" max(us): "<<Percentile( ping.rtt() , 1.0 )<<std::endl;
+
+    server.io_manager()->Interrupt();
+    pthread_join( loop , NULL );
+    std::_Exit(0);
+}
@@ -0,0 +1,187 @@
+#include "../../mnet.h"
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+using namespace mnet;
+
+// Rebalancing benchmark. Several IOManagers run on their own threads but only
+// the first one accepts connections, so every connection starts on it. The
+// clients keep a request in flight on each connection and every request burns
+// some CPU on the server. Each second it prints the CPU utilization of every
+// loop and the number of requests served, with or without a Rebalancer moving
+// connections from the busy loop to the idle ones.
+
+namespace {
+
+const uint16_t kPort = 12350;
+
+volatile int g_requests = 0;
+volatile bool g_stop = false;
+int g_work_us = 0;
+
+double Seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void Spin( int usec ) {
+    const double end = Seconds() + usec / 1e6;
+    while( Seconds() < end )
+        ;
+}
+
+class Server {
+public:
+    Server( const std::vector<IOManager*>& loops , bool rebalance ) :
+        rebalance_(rebalance)
+    {
+        for( std::size_t i = 0 ; i < loops.size() ; ++i )
+            rebalancer_.AddIOManager( loops[i] );
+        if( !server_.Bind( Endpoint("127.0.0.1",kPort) ) ) {
+            std::cerr<<"Cannot bind to port "<<kPort<<std::endl;
+            std::exit(-1);
+        }
+        io_manager_ = loops[0];
+        server_.SetIOManager( io_manager_ );
+        server_.AsyncAccept( new Socket(io_manager_) , this );
+        if( rebalance_ )
+            rebalancer_.Start( io_manager_ , 200 );
+    }
+
+    void OnAccept( Socket* socket , const NetState& ok ) {
+        if( ok ) {
+            rebalancer_.Track( socket );
+            socket->AsyncRead( this );
+        } else {
+            delete socket;
+        }
+        server_.AsyncAccept( new Socket(io_manager_) , this );
+    }
+
+    void OnRead( Socket* socket , std::size_t size , const NetState& ok ) {
+        if( !ok || size == 0 ) {
+            rebalancer_.Untrack( socket );
+            socket->Close();
+            delete socket;
+            return;
+        }
+        std::size_t sz = socket->read_buffer().readable_size();
+        void* buf = socket->read_buffer().Read(&sz);
+        for( std::size_t i = 0 ; i < sz ; ++i )
+            Spin( g_work_us );
+        __sync_fetch_and_add( &g_requests , static_cast<int>(sz) );
+        socket->write_buffer().Write( buf , sz );
+        socket->AsyncWrite( this );
+        socket->AsyncRead( this );
+    }
+
+    void OnWrite( Socket* socket , std::size_t size , const NetState& ok ) {}
+
+    std::size_t migrate_count() const {
+        return rebalancer_.migrate_count();
+    }
+
+private:
+    bool rebalance_;
+    IOManager* io_manager_;
+    ServerSocket server_;
+    Rebalancer rebalancer_;
+};
+
+void* RunLoop( void* arg ) {
+    static_cast<IOManager*>(arg)->RunMainLoop();
+    return NULL;
+}
+
+// Each client thread keeps one request in flight on each of its connections
+void* RunClient( void* arg ) {
+    const int connections = *static_cast<int*>(arg);
+    struct sockaddr_in addr;
+    bzero(&addr,sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(kPort);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    std::vector<int> fds;
+    for( int i = 0 ; i < connections ; ++i ) {
+        int fd = ::socket(AF_INET,SOCK_STREAM,0);
+        int tag = 1;
+        ::setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&tag,sizeof(tag));
+        if( ::connect(fd,reinterpret_cast<struct sockaddr*>(&addr),sizeof(addr)) != 0 ) {
+            std::cerr<<"Cannot connect:"<<std::strerror(errno)<<std::endl;
+            std::exit(-1);
+        }
+        fds.push_back(fd);
+    }
+    char c = 'x';
+    for( std::size_t i = 0 ; i < fds.size() ; ++i )
+        ::write(fds[i],&c,1);
+    while( !g_stop ) {
+        for( std::size_t i = 0 ; i < fds.size() ; ++i ) {
+            if( ::read(fds[i],&c,1) != 1 )
+                return NULL;
+            ::write(fds[i],&c,1);
+        }
+    }
+    for( std::size_t i = 0 ; i < fds.size() ; ++i )
+        ::close(fds[i]);
+    return NULL;
+}
+
+}// namespace
+
+int main( int argc , char* argv[] ) {
+    if( argc != 6 ) {
+        std::cerr<<"Usage: rebalance loops connections work_us seconds rebalance(0/1)"<<std::endl;
+        return -1;
+    }
+    const int loop_size = atoi(argv[1]);
+    int connections = atoi(argv[2]);
+    g_work_us = atoi(argv[3]);
+    const int seconds = atoi(argv[4]);
+    const bool rebalance = atoi(argv[5]) != 0;
+
+    std::vector<IOManager*> loops;
+    for( int i = 0 ; i < loop_size ; ++i )
+        loops.push_back( new IOManager() );
+    Server server( loops , rebalance );
+
+    std::vector<pthread_t> threads(loop_size);
+    for( int i = 0 ; i < loop_size ; ++i )
+        pthread_create( &threads[i] , NULL , RunLoop , loops[i] );
+    pthread_t client;
+    pthread_create( &client , NULL , RunClient , &connections );
+
+    std::vector<uint64_t> last_cpu(loop_size,0);
+    double last = Seconds();
+    int last_requests = 0;
+    for( int s = 0 ; s < seconds ; ++s ) {
+        sleep(1);
+        const double now = Seconds();
+        const int requests = g_requests;
+        std::cout<<"t="<<s+1<<"s requests/s: "
+                 <<static_cast<int>((requests - last_requests) / (now - last))
+                 <<" cpu%:";
+        for( int i = 0 ; i < loop_size ; ++i ) {
+            uint64_t cpu = 0;
+            loops[i]->GetCpuTime(&cpu);
+            std::cout<<" "<<static_cast<int>((cpu - last_cpu[i]) / ((now - last) * 1e4));
+            last_cpu[i] = cpu;
+        }
+        std::cout<<" migrated: "<<server.migrate_count()<<std::endl;
+        last = now;
+        last_requests = requests;
+    }
+
+    g_stop = true;
+    pthread_join( client , NULL );
+    // The sockets are leaked on purpose, the process is about to exit
+    for( int i = 0 ; i < loop_size ; ++i ) {
+        loops[i]->Interrupt();
+        pthread_join( threads[i] , NULL );
+    }
+    return 0;
+}
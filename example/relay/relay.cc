@@ -0,0 +1,306 @@
+#include "../../mnet.h"
+#include <pthread.h>
+#include <time.h>
+#include <vector>
+using namespace mnet;
+
+// TCP proxy benchmark. A backend thread streams a download to every connection,
+// a proxy thread forwards it to the clients of the main thread. The proxy either
+// copies the bytes through the read and write buffers of its sockets, or splices
+// them with a Relay. It reports the throughput and the CPU time spent by the
+// proxy thread for each GB forwarded.
+
+static const char* kBackendAddress = "127.0.0.1:12363";
+static const char* kProxyAddress = "127.0.0.1:12364";
+static const std::size_t kChunkSize = 1024 * 1024;
+
+double Seconds( clockid_t clock ) {
+    struct timespec ts;
+    clock_gettime(clock,&ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Writes download_size bytes to each connection, then waits for its EOF
+class Backend {
+public:
+    Backend( std::size_t download_size ) :
+        download_size_(download_size),
+        chunk_( kChunkSize , 'x' )
+    {
+        if( !server_.Bind( Endpoint(kBackendAddress) ) ) {
+            std::cerr<<"Cannot bind to "<<kBackendAddress<<std::endl;
+            std::exit(-1);
+        }
+        server_.SetIOManager( &io_manager_ );
+        server_.AsyncAccept( new Socket(&io_manager_) , this );
+    }
+
+    IOManager* io_manager() {
+        return &io_manager_;
+    }
+
+    void OnAccept( Socket* socket , const NetState& ok ) {
+        if( ok ) {
+            Download* d = new Download();
+            d->backend = this;
+            d->left = download_size_;
+            d->OnWrite( socket , 0 , NetState() );
+        } else {
+            delete socket;
+        }
+        server_.AsyncAccept( new Socket(&io_manager_) , this );
+    }
+
+private:
+    struct Download {
+        void OnWrite( Socket* socket , std::size_t size , const NetState& ok ) {
+            if( !ok || left == 0 ) {
+                ::shutdown( socket->fd() , SHUT_WR );
+                socket->AsyncRead( this );
+                return;
+            }
+            std::size_t sz = std::min( left , kChunkSize );
+            left -= sz;
+            socket->write_buffer().Write( backend->chunk_.data() , sz );
+            socket->AsyncWrite( this );
+        }
+        void OnRead( Socket* socket , std::size_t size , const NetState& ok ) {
+            if( ok && size != 0 ) {
+                socket->read_buffer().Clear();
+                socket->AsyncRead( this );
+                return;
+            }
+            socket->Close();
+            delete socket;
+            delete this;
+        }
+        Backend* backend;
+        std::size_t left;
+    };
+
+    std::size_t download_size_;
+    std::string chunk_;
+    ServerSocket server_;
+    IOManager io_manager_;
+};
+
+class Proxy {
+public:
+    Proxy( bool use_splice ) :
+        use_splice_(use_splice),
+        cpu_time_(0)
+    {
+        if( !server_.Bind( Endpoint(kProxyAddress) ) ) {
+            std::cerr<<"Cannot bind to "<<kProxyAddress<<std::endl;
+            std::exit(-1);
+        }
+        server_.SetIOManager( &io_manager_ );
+        server_.AsyncAccept( new Socket(&io_manager_) , this );
+    }
+
+    IOManager* io_manager() {
+        return &io_manager_;
+    }
+
+    void OnAccept( Socket* socket , const NetState& ok ) {
+        if( ok ) {
+            Conn* conn = new Conn( this , socket );
+            conn->backend.AsyncConnect( Endpoint(kBackendAddress) , conn );
+        } else {
+            delete socket;
+        }
+        server_.AsyncAccept( new Socket(&io_manager_) , this );
+    }
+
+    void Run() {
+        io_manager_.RunMainLoop();
+        cpu_time_ = Seconds( CLOCK_THREAD_CPUTIME_ID );
+    }
+
+    double cpu_time() const {
+        return cpu_time_;
+    }
+
+private:
+    struct Conn;
+
+    // One direction of the copying proxy, the next read waits for the write
+    struct Copy {
+        void Start() {
+            from->AsyncRead( this );
+        }
+        void OnRead( Socket* socket , std::size_t size , const NetState& ok ) {
+            if( !ok || size == 0 ) {
+                ::shutdown( to->fd() , SHUT_WR );
+                conn->OnDone();
+                return;
+            }
+            std::size_t sz = from->read_buffer().readable_size();
+            void* buf = from->read_buffer().Read(&sz);
+            to->write_buffer().Write( buf , sz );
+            to->AsyncWrite( this );
+        }
+        void OnWrite( Socket* socket , std::size_t size , const NetState& ok ) {
+            if( !ok ) {
+                conn->OnDone();
+                return;
+            }
+            from->AsyncRead( this );
+        }
+        Socket* from;
+        Socket* to;
+        Conn* conn;
+    };
+
+    struct Conn {
+        Conn( Proxy* p , Socket* s ) :
+            proxy(p),
+            client(s),
+            backend(p->io_manager()),
+            done(0) {
+            copy[0].from = copy[1].to = client;
+            copy[0].to = copy[1].from = &backend;
+            copy[0].conn = copy[1].conn = this;
+        }
+        void OnConnect( Socket* socket , const NetState& ok ) {
+            if( !ok ) {
+                std::cerr<<"Cannot connect:"<<std::strerror(ok.error_code())<<std::endl;
+                std::exit(-1);
+            }
+            if( proxy->use_splice_ ) {
+                if( !relay.Start( client , &backend , this ) ) {
+                    std::cerr<<"Cannot start the relay:"<<std::strerror(errno)<<std::endl;
+                    std::exit(-1);
+                }
+            } else {
+                copy[0].Start();
+                copy[1].Start();
+            }
+        }
+        void OnRelayEnd( Relay* r , const NetState& ok ) {
+            done = 2;
+            OnDone();
+        }
+        void OnDone() {
+            if( ++done < 2 )
+                return;
+            client->Close();
+            backend.Close();
+            delete client;
+            delete this;
+        }
+        Proxy* proxy;
+        Socket* client;
+        ClientSocket backend;
+        Relay relay;
+        Copy copy[2];
+        int done;
+    };
+
+    bool use_splice_;
+    double cpu_time_;
+    ServerSocket server_;
+    IOManager io_manager_;
+};
+
+// Opens total downloads through the proxy, concurrency of them at a time
+class Client {
+public:
+    Client( int total , int concurrency ) :
+        total_(total),
+        concurrency_(concurrency),
+        started_(0),
+        finished_(0),
+        bytes_(0)
+    {}
+
+    void Run() {
+        for( int i = 0 ; i < concurrency_ && started_ < total_ ; ++i )
+            Connect();
+        io_manager_.RunMainLoop();
+    }
+
+    void OnConnect( Socket* socket , const NetState& ok ) {
+        if( !ok ) {
+            std::cerr<<"Cannot connect:"<<std::strerror(ok.error_code())<<std::endl;
+            std::exit(-1);
+        }
+        socket->AsyncRead( this );
+    }
+
+    void OnRead( Socket* socket , std::size_t size , const NetState& ok ) {
+        if( ok && size != 0 ) {
+            bytes_ += socket->read_buffer().readable_size();
+            socket->read_buffer().Clear();
+            socket->AsyncRead( this );
+            return;
+        }
+        socket->Close();
+        delete socket;
+        if( ++finished_ == total_ ) {
+            io_manager_.Interrupt();
+        } else if( started_ < total_ ) {
+            Connect();
+        }
+    }
+
+    uint64_t bytes() const {
+        return bytes_;
+    }
+
+private:
+    void Connect() {
+        ++started_;
+        ClientSocket* s = new ClientSocket( &io_manager_ );
+        s->AsyncConnect( Endpoint(kProxyAddress) , this );
+    }
+
+    int total_;
+    int concurrency_;
+    int started_;
+    int finished_;
+    uint64_t bytes_;
+    IOManager io_manager_;
+};
+
+void* RunBackend( void* arg ) {
+    static_cast<Backend*>(arg)->io_manager()->RunMainLoop();
+    return NULL;
+}
+
+void* RunProxy( void* arg ) {
+    static_cast<Proxy*>(arg)->Run();
+    return NULL;
+}
+
+int main( int argc , char* argv[] ) {
+    if( argc != 5 ) {
+        std::cerr<<"Usage: relay mode(0 copy/1 splice) total concurrency download_mb"<<std::endl;
+        return -1;
+    }
+    const bool use_splice = atoi(argv[1]) != 0;
+    const int total = atoi(argv[2]);
+    const std::size_t download = static_cast<std::size_t>(atoi(argv[4])) * 1024 * 1024;
+
+    Backend backend( download );
+    Proxy proxy( use_splice );
+    pthread_t backend_thread , proxy_thread;
+    pthread_create( &backend_thread , NULL , RunBackend , &backend );
+    pthread_create( &proxy_thread , NULL , RunProxy , &proxy );
+
+    Client client( total , atoi(argv[3]) );
+    const double start = Seconds( CLOCK_MONOTONIC );
+    client.Run();
+    const double elapsed = Seconds( CLOCK_MONOTONIC ) - start;
+
+    proxy.io_manager()->Interrupt();
+    pthread_join( proxy_thread , NULL );
+    backend.io_manager()->Interrupt();
+    pthread_join( backend_thread , NULL );
+
+    const double gb = client.bytes() / ( 1024.0 * 1024 * 1024 );
+    std::cout<<"mode: "<<( use_splice ? "splice" : "copy" )<<std::endl;
+    std::cout<<"forwarded GB: "<<gb<<" MB/s: "<<gb * 1024 / elapsed<<std::endl;
+    std::cout<<"proxy cpu ms per GB: "<<proxy.cpu_time() * 1000 / gb<<std::endl;
+    std::_Exit(0);
+}
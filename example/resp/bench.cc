@@ -0,0 +1,222 @@
+#include "../../mnet.h"
+#include "../../mnet_resp.h"
+#include <pthread.h>
+#include <time.h>
+#include <stdio.h>
+using namespace mnet;
+
+// A pipelining load client against the RESP server. A server thread runs a
+// small GET/SET cache, the clients of the main thread keep a number of commands
+// in flight on each connection, half SET and half GET over a fixed key space.
+// The commands are built with resp::Writer and the replies are counted with
+// resp::Parser. It reports the commands per second.
+
+static const char* kAddress = "127.0.0.1:12367";
+static const int kKeys = 10000;
+
+double Seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+class Cache {
+public:
+    void OnCommand( const resp::Command& command , resp::Writer* writer ) {
+        if( command.Is("GET") && command.size() == 2 ) {
+            std::map<std::string,std::string>::iterator i = store_.find( command[1].ToString() );
+            if( i == store_.end() )
+                writer->WriteNull();
+            else
+                writer->WriteBulkString( i->second );
+        } else if( command.Is("SET") && command.size() == 3 ) {
+            store_[command[1].ToString()].assign( command[2].data() , command[2].size() );
+            writer->WriteSimpleString("OK");
+        } else {
+            writer->WriteError("ERR unknown command");
+        }
+    }
+
+private:
+    std::map<std::string,std::string> store_;
+};
+
+class Server {
+public:
+    Server() :
+        io_manager_(),
+        server_(&io_manager_)
+    {
+        if( !server_.Bind( Endpoint(kAddress) ) ) {
+            std::cerr<<"Cannot bind to "<<kAddress<<std::endl;
+            std::exit(-1);
+        }
+        server_.Start( &cache_ );
+    }
+
+    void Run() {
+        io_manager_.RunMainLoop();
+    }
+
+    IOManager* io_manager() {
+        return &io_manager_;
+    }
+
+private:
+    Cache cache_;
+    IOManager io_manager_;
+    resp::Server server_;
+};
+
+class Client {
+public:
+    Client( int connections , int commands , int depth , std::size_t value_size ) :
+        connections_(connections),
+        commands_(commands),
+        depth_(depth),
+        finished_(0),
+        replies_(0),
+        errors_(0),
+        value_( value_size , 'v' )
+    {
+        for( int i = 0 ; i < connections ; ++i ) {
+            Conn* c = new Conn( this , i );
+            c->socket.AsyncConnect( Endpoint(kAddress) , c );
+        }
+    }
+
+    void Run() {
+        io_manager_.RunMainLoop();
+    }
+
+    uint64_t replies() const {
+        return replies_;
+    }
+
+    uint64_t errors() const {
+        return errors_;
+    }
+
+private:
+    struct Conn {
+        Conn( Client* c , int id ) :
+            client(c),
+            left(c->commands_),
+            in_flight(0),
+            next_key(id * 7919),
+            socket(&c->io_manager_)
+            {}
+        void OnConnect( Socket* s , const NetState& ok ) {
+            if( !ok ) {
+                std::cerr<<"Cannot connect:"<<std::strerror(ok.error_code())<<std::endl;
+                std::exit(-1);
+            }
+            Send();
+            socket.AsyncRead( this );
+        }
+        void OnWrite( Socket* s , std::size_t size , const NetState& ok ) {}
+        void OnRead( Socket* s , std::size_t size , const NetState& ok ) {
+            if( !ok || size == 0 ) {
+                std::cerr<<"Connection is closed"<<std::endl;
+                std::exit(-1);
+            }
+            while( in_flight != 0 ) {
+                Buffer::Accessor accessor = socket.read_buffer().GetReadAccessor();
+                std::size_t consumed;
+                const int result = parser.Parse( static_cast<const char*>(accessor.address()) ,
+                                                 accessor.size() , &consumed );
+                if( result == resp::Parser::PARSE_INCOMPLETE )
+                    break;
+                if( result == resp::Parser::PARSE_ERROR ) {
+                    std::cerr<<"Bad reply:"<<parser.error()<<std::endl;
+                    std::exit(-1);
+                }
+                if( parser.values()[0].type == resp::SIMPLE_ERROR )
+                    ++client->errors_;
+                accessor.set_committed_size( consumed );
+                --in_flight;
+                ++client->replies_;
+            }
+            if( in_flight == 0 ) {
+                if( left == 0 ) {
+                    client->OnDone();
+                    return;
+                }
+                Send();
+            }
+            socket.AsyncRead( this );
+        }
+        // Send the next batch of pipelined commands
+        void Send() {
+            resp::Writer writer( &socket.write_buffer() );
+            char key[16];
+            while( in_flight < client->depth_ && left != 0 ) {
+                const int size = snprintf( key , sizeof(key) , "key:%d" , next_key++ % kKeys );
+                if( left % 2 == 0 ) {
+                    writer.WriteArray(3);
+                    writer.WriteBulkString("SET");
+                    writer.WriteBulkString( StringPiece( key , size ) );
+                    writer.WriteBulkString( client->value_ );
+                } else {
+                    writer.WriteArray(2);
+                    writer.WriteBulkString("GET");
+                    writer.WriteBulkString( StringPiece( key , size ) );
+                }
+                ++in_flight;
+                --left;
+            }
+            socket.AsyncWrite( this );
+        }
+        Client* client;
+        int left;
+        int in_flight;
+        int next_key;
+        resp::Parser parser;
+        ClientSocket socket;
+    };
+
+    void OnDone() {
+        if( ++finished_ == connections_ )
+            io_manager_.Interrupt();
+    }
+
+    int connections_;
+    int commands_;
+    int depth_;
+    int finished_;
+    uint64_t replies_;
+    uint64_t errors_;
+    std::string value_;
+    IOManager io_manager_;
+};
+
+void* RunServer( void* arg ) {
+    static_cast<Server*>(arg)->Run();
+    return NULL;
+}
+
+int main( int argc , char* argv[] ) {
+    if( argc != 5 ) {
+        std::cerr<<"Usage: bench connections commands pipeline_depth value_size"<<std::endl;
+        return -1;
+    }
+    Server server;
+    pthread_t loop;
+    pthread_create( &loop , NULL , RunServer , &server );
+
+    const int depth = atoi(argv[3]) > 0 ? atoi(argv[3]) : 1;
+    Client client( atoi(argv[1]) , atoi(argv[2]) , depth ,
+                   static_cast<std::size_t>(atoi(argv[4])) );
+    const double start = Seconds();
+    client.Run();
+    const double elapsed = Seconds() - start;
+
+    server.io_manager()->Interrupt();
+    pthread_join( loop , NULL );
+
+    std::cout<<"pipeline depth: "<<depth<<std::endl;
+    std::cout<<"commands/s: "<<client.replies() / elapsed<<std::endl;
+    if( client.errors() != 0 )
+        std::cout<<"errors: "<<client.errors()<<std::endl;
+    std::_Exit(0);
+}
@@ -0,0 +1,98 @@
+#include "../../mnet.h"
+#include "../../mnet_resp.h"
+#include <signal.h>
+using namespace mnet;
+
+// A minimal Redis compatible cache with GET, SET, DEL, PING, HELLO and QUIT.
+// Try it with redis-cli -p 6380, or with telnet since inline commands work.
+
+class Cache {
+public:
+    void OnCommand( const resp::Command& command , resp::Writer* writer ) {
+        if( command.Is("GET") && command.size() == 2 ) {
+            std::map<std::string,std::string>::iterator i = store_.find( command[1].ToString() );
+            if( i == store_.end() )
+                writer->WriteNull();
+            else
+                writer->WriteBulkString( i->second );
+        } else if( command.Is("SET") && command.size() == 3 ) {
+            store_[command[1].ToString()].assign( command[2].data() , command[2].size() );
+            writer->WriteSimpleString("OK");
+        } else if( command.Is("DEL") && command.size() >= 2 ) {
+            int64_t deleted = 0;
+            for( std::size_t i = 1 ; i < command.size() ; ++i )
+                deleted += store_.erase( command[i].ToString() );
+            writer->WriteInteger( deleted );
+        } else if( command.Is("PING") ) {
+            if( command.size() == 2 )
+                writer->WriteBulkString( command[1] );
+            else
+                writer->WriteSimpleString("PONG");
+        } else if( command.Is("HELLO") ) {
+            if( command.size() >= 2 ) {
+                if( command[1] == "3" ) {
+                    writer->set_protocol(3);
+                } else if( command[1] == "2" ) {
+                    writer->set_protocol(2);
+                } else {
+                    writer->WriteError("NOPROTO unsupported protocol version");
+                    return;
+                }
+            }
+            writer->WriteMap(3);
+            writer->WriteBulkString("server");
+            writer->WriteBulkString("mnet");
+            writer->WriteBulkString("proto");
+            writer->WriteInteger( writer->protocol() );
+            writer->WriteBulkString("mode");
+            writer->WriteBulkString("standalone");
+        } else if( command.Is("QUIT") ) {
+            writer->WriteSimpleString("OK");
+            writer->Close();
+        } else {
+            writer->WriteError("ERR unknown command or wrong number of arguments");
+        }
+    }
+
+private:
+    std::map<std::string,std::string> store_;
+};
+
+class Main {
+public:
+    Main() :
+        io_manager_(),
+        signal_watcher_( &io_manager_ ),
+        server_( &io_manager_ )
+    {
+        signal_watcher_.Add( SIGTERM );
+        signal_watcher_.Add( SIGINT );
+        signal_watcher_.AsyncWait( this );
+        if( !server_.Bind( Endpoint("127.0.0.1:6380") ) ) {
+            std::cerr<<"Cannot bind to 127.0.0.1:6380"<<std::endl;
+            std::exit(-1);
+        }
+        server_.Start( &cache_ );
+    }
+
+    void Run() {
+        io_manager_.RunMainLoop();
+    }
+
+    void OnSignal( int signo ) {
+        io_manager_.Interrupt();
+    }
+
+private:
+    Cache cache_;
+    IOManager io_manager_;
+    SignalWatcher signal_watcher_;
+    resp::Server server_;
+};
+
+int main() {
+    signal(SIGPIPE,SIG_IGN);
+    Main m;
+    m.Run();
+    return 0;
+}
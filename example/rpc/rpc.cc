@@ -0,0 +1,175 @@
+#include "../../mnet.h"
+#include "../../mnet_rpc.h"
+#include <pthread.h>
+#include <time.h>
+using namespace mnet;
+
+// A benchmark of echo RPCs. A server thread runs the Echo method, which sends
+// the bytes field 1 of the request back, and the clients of the main thread
+// keep a number of calls in flight on each connection. With a depth of 1 every
+// call waits for the previous response, with a larger depth the calls are
+// pipelined. The server runs on one thread, so the calls per second are the
+// calls one core of the server answers.
+
+static const char* kAddress = "127.0.0.1:12368";
+
+enum {
+    METHOD_ECHO = 1
+};
+
+double Seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+class EchoService {
+public:
+    void Echo( rpc::Call* call ) {
+        rpc::Reader request( call->body() );
+        rpc::Writer* response = call->response();
+        while( request.Next() ) {
+            if( request.field() == 1 && request.type() == rpc::WIRE_BYTES )
+                response->WriteBytes( 1 , request.bytes() );
+        }
+        call->Finish( request.error() ? rpc::STATUS_USER : rpc::STATUS_OK );
+    }
+};
+
+typedef rpc::Method< METHOD_ECHO , EchoService , &EchoService::Echo > EchoMethods;
+
+class Server {
+public:
+    Server() :
+        service_(),
+        io_manager_(),
+        server_(&io_manager_)
+    {
+        if( !server_.Bind( Endpoint(kAddress) ) ) {
+            std::cerr<<"Cannot bind to "<<kAddress<<std::endl;
+            std::exit(-1);
+        }
+        server_.Start<EchoMethods>( &service_ );
+    }
+
+    void Run() {
+        io_manager_.RunMainLoop();
+    }
+
+    IOManager* io_manager() {
+        return &io_manager_;
+    }
+
+private:
+    EchoService service_;
+    IOManager io_manager_;
+    rpc::Server server_;
+};
+
+class Client {
+public:
+    Client( int connections , int calls , int depth , std::size_t size ) :
+        connections_(connections),
+        calls_(calls),
+        depth_(depth),
+        finished_(0),
+        responses_(0),
+        payload_( size , 'x' )
+    {
+        for( int i = 0 ; i < connections ; ++i ) {
+            Conn* c = new Conn( this );
+            c->client.Connect( Endpoint(kAddress) , c );
+        }
+    }
+
+    void Run() {
+        io_manager_.RunMainLoop();
+    }
+
+    uint64_t responses() const {
+        return responses_;
+    }
+
+private:
+    struct Conn {
+        explicit Conn( Client* c ) :
+            owner(c),
+            left(c->calls_),
+            client(&c->io_manager_)
+            {}
+        void OnConnect( rpc::Client* c , const NetState& ok ) {
+            if( !ok ) {
+                std::cerr<<"Cannot connect:"<<std::strerror(ok.error_code())<<std::endl;
+                std::exit(-1);
+            }
+            for( int i = 0 ; i < owner->depth_ ; ++i )
+                Call();
+        }
+        void OnResponse( rpc::Client* c , uint64_t request_id , int status ,
+                         void* context , const StringPiece& body ) {
+            rpc::Reader response( body );
+            if( status != rpc::STATUS_OK || !response.Next() ||
+                response.bytes().size() != owner->payload_.size() ) {
+                std::cerr<<"Bad response, status "<<status<<std::endl;
+                std::exit(-1);
+            }
+            ++owner->responses_;
+            if( left != 0 )
+                Call();
+            else if( client.pending_size() == 0 )
+                owner->OnDone();
+        }
+        void Call() {
+            if( left == 0 )
+                return;
+            --left;
+            client.BeginCall( METHOD_ECHO )->WriteBytes( 1 , owner->payload_ );
+            client.EndCall();
+        }
+        Client* owner;
+        int left;
+        rpc::Client client;
+    };
+
+    void OnDone() {
+        if( ++finished_ == connections_ )
+            io_manager_.Interrupt();
+    }
+
+    int connections_;
+    int calls_;
+    int depth_;
+    int finished_;
+    uint64_t responses_;
+    std::string payload_;
+    IOManager io_manager_;
+};
+
+void* RunServer( void* arg ) {
+    static_cast<Server*>(arg)->Run();
+    return NULL;
+}
+
+int main( int argc , char* argv[] ) {
+    if( argc != 5 ) {
+        std::cerr<<"Usage: rpc connections calls pipeline_depth payload_size"<<std::endl;
+        return -1;
+    }
+    Server server;
+    pthread_t loop;
+    pthread_create( &loop , NULL , RunServer , &server );
+
+    const int depth = std::max( atoi(argv[3]) , 1 );
+    Client client( atoi(argv[1]) , atoi(argv[2]) , depth ,
+                   static_cast<std::size_t>(atoi(argv[4])) );
+    const double start = Seconds();
+    client.Run();
+    const double elapsed = Seconds() - start;
+
+    server.io_manager()->Interrupt();
+    pthread_join( loop , NULL );
+
+    std::cout<<"payload: "<<argv[4]<<" bytes pipeline depth: "<<depth<<std::endl;
+    std::cout<<"calls/s: "<<client.responses() / elapsed<<std::endl;
+    std::_Exit(0);
+}
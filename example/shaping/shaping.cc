@@ -0,0 +1,264 @@
+#include "../../mnet.h"
+#include <pthread.h>
+#include <time.h>
+#include <algorithm>
+#include <vector>
+using namespace mnet;
+
+// Traffic shaping benchmark. A server thread streams bulk data to one or two
+// clients and echoes the pings of an interactive client, while the client
+// thread measures the bulk throughput and the round trip of the pings. Without
+// a limit the bulk transfer fills the socket buffers and takes the CPU, so the
+// pings queue behind it; a rate limit keeps the interactive latency low.
+//
+// Modes: 0 unlimited, 1 token bucket per socket (SetRateLimit), 2 kernel pacing
+// (SetPacingRate), 3 token bucket shared by two bulk sockets (SetRateLimitGroup).
+
+static const char* kBulkAddress = "127.0.0.1:12360";
+static const char* kPingAddress = "127.0.0.1:12361";
+static const std::size_t kChunkSize = 256 * 1024;
+
+uint64_t Microseconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+class Server {
+public:
+    Server( int mode , uint64_t rate ) :
+        mode_(mode),
+        rate_(rate),
+        group_( rate , RateLimiter::DefaultBurst(rate) ),
+        chunk_( kChunkSize , 'x' )
+    {
+        bulk_acceptor_.server = this;
+        ping_acceptor_.server = this;
+        if( !bulk_.Bind( Endpoint(kBulkAddress) ) ||
+            !ping_.Bind( Endpoint(kPingAddress) ) ) {
+            std::cerr<<"Cannot bind the server"<<std::endl;
+            std::exit(-1);
+        }
+        bulk_.SetIOManager( &io_manager_ );
+        ping_.SetIOManager( &io_manager_ );
+        bulk_.AsyncAccept( new Socket(&io_manager_) , &bulk_acceptor_ );
+        ping_.AsyncAccept( new Socket(&io_manager_) , &ping_acceptor_ );
+    }
+
+    IOManager* io_manager() {
+        return &io_manager_;
+    }
+
+    // Bulk connections get a new chunk whenever the previous one is written
+    void OnWrite( Socket* socket , std::size_t size , const NetState& ok ) {
+        if( !ok ) {
+            socket->Close();
+            return;
+        }
+        socket->write_buffer().Write( chunk_.data() , chunk_.size() );
+        socket->AsyncWrite( this );
+    }
+
+    // Ping connections echo whatever they receive
+    void OnRead( Socket* socket , std::size_t size , const NetState& ok ) {
+        if( !ok || size == 0 ) {
+            socket->Close();
+            return;
+        }
+        std::size_t sz = socket->read_buffer().readable_size();
+        void* buf = socket->read_buffer().Read(&sz);
+        socket->write_buffer().Write( buf , sz );
+        socket->AsyncWrite( &ignore_write_ );
+        socket->AsyncRead( this );
+    }
+
+private:
+    struct IgnoreWrite {
+        void OnWrite( Socket* socket , std::size_t size , const NetState& ok ) {}
+    };
+
+    struct BulkAcceptor {
+        void OnAccept( Socket* socket , const NetState& ok ) {
+            if( ok ) {
+                server->StartBulk( socket );
+            } else {
+                delete socket;
+            }
+            server->bulk_.AsyncAccept( new Socket(&server->io_manager_) , this );
+        }
+        Server* server;
+    };
+
+    struct PingAcceptor {
+        void OnAccept( Socket* socket , const NetState& ok ) {
+            if( ok ) {
+                socket->AsyncRead( server );
+            } else {
+                delete socket;
+            }
+            server->ping_.AsyncAccept( new Socket(&server->io_manager_) , this );
+        }
+        Server* server;
+    };
+
+    void StartBulk( Socket* socket ) {
+        switch( mode_ ) {
+            case 1: socket->SetRateLimit( rate_ ); break;
+            case 2:
+                if( !socket->SetPacingRate( rate_ ) )
+                    std::cerr<<"SO_MAX_PACING_RATE:"<<std::strerror(errno)<<std::endl;
+                break;
+            case 3: socket->SetRateLimitGroup( &group_ ); break;
+            default: break;
+        }
+        OnWrite( socket , 0 , NetState() );
+    }
+
+    int mode_;
+    uint64_t rate_;
+    RateLimiter group_;
+    std::string chunk_;
+    BulkAcceptor bulk_acceptor_;
+    PingAcceptor ping_acceptor_;
+    IgnoreWrite ignore_write_;
+    ServerSocket bulk_;
+    ServerSocket ping_;
+    IOManager io_manager_;
+};
+
+// Reads the bulk stream and counts the bytes
+class BulkClient {
+public:
+    BulkClient( IOManager* io_manager ) :
+        bytes_(0),
+        socket_( io_manager ) {
+        socket_.AsyncConnect( Endpoint(kBulkAddress) , this );
+    }
+
+    void OnConnect( Socket* socket , const NetState& ok ) {
+        if( !ok ) {
+            std::cerr<<"Cannot connect:"<<std::strerror(ok.error_code())<<std::endl;
+            std::exit(-1);
+        }
+        socket->AsyncRead( this );
+    }
+
+    void OnRead( Socket* socket , std::size_t size , const NetState& ok ) {
+        if( !ok || size == 0 )
+            return;
+        bytes_ += socket->read_buffer().readable_size();
+        socket->read_buffer().Clear();
+        socket->AsyncRead( this );
+    }
+
+    uint64_t bytes() const {
+        return bytes_;
+    }
+
+private:
+    uint64_t bytes_;
+    ClientSocket socket_;
+};
+
+// Sends a small ping every millisecond and records the round trips
+class PingClient {
+public:
+    PingClient( IOManager* io_manager ) :
+        sent_(0),
+        socket_( io_manager ) {
+        socket_.AsyncConnect( Endpoint(kPingAddress) , this );
+    }
+
+    void OnConnect( Socket* socket , const NetState& ok ) {
+        if( !ok ) {
+            std::cerr<<"Cannot connect:"<<std::strerror(ok.error_code())<<std::endl;
+            std::exit(-1);
+        }
+        Ping();
+    }
+
+    void OnWrite( Socket* socket , std::size_t size , const NetState& ok ) {}
+
+    void OnRead( Socket* socket , std::size_t size , const NetState& ok ) {
+        if( !ok || size == 0 )
+            return;
+        if( socket->read_buffer().readable_size() < sizeof(sent_) ) {
+            socket->AsyncRead( this );
+            return;
+        }
+        socket->read_buffer().Clear();
+        rtt_.push_back( Microseconds() - sent_ );
+        socket->Schedule( 1 , this );
+    }
+
+    void OnTimeout( int msec ) {
+        Ping();
+    }
+
+    std::vector<uint64_t>* rtt() {
+        return &rtt_;
+    }
+
+private:
+    void Ping() {
+        sent_ = Microseconds();
+        socket_.write_buffer().Write( &sent_ , sizeof(sent_) );
+        socket_.AsyncWrite( this );
+        socket_.AsyncRead( this );
+    }
+
+    uint64_t sent_;
+    std::vector<uint64_t> rtt_;
+    ClientSocket socket_;
+};
+
+void* RunServer( void* arg ) {
+    static_cast<Server*>(arg)->io_manager()->RunMainLoop();
+    return NULL;
+}
+
+uint64_t Percentile( std::vector<uint64_t>* v , double p ) {
+    if( v->empty() )
+        return 0;
+    std::sort( v->begin() , v->end() );
+    return (*v)[ static_cast<std::size_t>( p * (v->size() - 1) ) ];
+}
+
+int main( int argc , char* argv[] ) {
+    if( argc != 4 ) {
+        std::cerr<<"Usage: shaping mode(0 none/1 bucket/2 pacing/3 group) "
+                   "rate_mb_per_sec seconds"<<std::endl;
+        return -1;
+    }
+    const int mode = atoi(argv[1]);
+    const uint64_t rate = static_cast<uint64_t>(atoi(argv[2])) * 1024 * 1024;
+    const int seconds = atoi(argv[3]);
+
+    Server server( mode , rate );
+    pthread_t loop;
+    pthread_create( &loop , NULL , RunServer , &server );
+
+    IOManager io_manager;
+    BulkClient bulk1( &io_manager );
+    BulkClient* bulk2 = mode == 3 ? new BulkClient( &io_manager ) : NULL;
+    PingClient ping( &io_manager );
+
+    const uint64_t start = Microseconds();
+    io_manager.RunFor( seconds * 1000 );
+    const double elapsed = ( Microseconds() - start ) / 1e6;
+
+    uint64_t bytes = bulk1.bytes() + ( bulk2 != NULL ? bulk2->bytes() : 0 );
+    std::cout<<"bulk MB/s: "<<bytes / elapsed / ( 1024 * 1024 );
+    if( bulk2 != NULL ) {
+        std::cout<<" ("<<bulk1.bytes() / elapsed / ( 1024 * 1024 )<<" + "
+                 <<bulk2->bytes() / elapsed / ( 1024 * 1024 )<<")";
+    }
+    std::cout<<std::endl;
+    std::cout<<"pings: "<<ping.rtt()->size()
+             <<" p50(us): "<<Percentile( ping.rtt() , 0.5 )
+             <<" p99(us): "<<Percentile( ping.rtt() , 0.99 )<<std::endl;
+
+    server.io_manager()->Interrupt();
+    pthread_join( loop , NULL );
+    std::_Exit(0);
+}
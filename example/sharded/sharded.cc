@@ -0,0 +1,130 @@
+#include "../../mnet.h"
+#include <time.h>
+#include <pthread.h>
+using namespace mnet;
+
+// Shard messaging benchmark. Each loop owns a Shard, and a number of tokens
+// keep hopping from one shard to the next through Sharded::InvokeOn. With
+// enough tokens in flight the loops never sleep, so the messages are carried
+// by the rings alone. It reports the message rate and the wake ups through
+// the control fd per message, then sums the per shard counters with MapReduce.
+
+namespace {
+
+struct Shard {
+    Shard() : count(0) {}
+    uint64_t count;
+};
+
+volatile int g_finished_token = 0;
+volatile bool g_done = false;
+uint64_t g_total = 0;
+
+struct Token {
+    Sharded<Shard>* sharded;
+    int hops;
+    void OnShard( Shard* shard ) {
+        ++shard->count;
+        if( --hops > 0 ) {
+            const std::size_t next = (sharded->current_shard() + 1) % sharded->size();
+            sharded->InvokeOn( next , this );
+        } else {
+            __sync_fetch_and_add( &g_finished_token , 1 );
+        }
+    }
+};
+
+struct Sum {
+    typedef uint64_t Result;
+    Sharded<Shard>* sharded;
+    uint64_t total;
+
+    // Invoked on the first shard to start the map reduce from a loop
+    void OnShard( Shard* shard ) {
+        total = 0;
+        sharded->MapReduce( this );
+    }
+    uint64_t OnMap( Shard* shard ) {
+        return shard->count;
+    }
+    void OnReduce( const uint64_t& count ) {
+        total += count;
+    }
+    void OnDone() {
+        g_total = total;
+        __sync_synchronize();
+        g_done = true;
+    }
+};
+
+void* RunLoop( void* arg ) {
+    static_cast<IOManager*>(arg)->RunMainLoop();
+    return NULL;
+}
+
+double Seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void SleepUS( long usec ) {
+    struct timespec ts;
+    ts.tv_sec = usec / 1000000;
+    ts.tv_nsec = (usec % 1000000) * 1000;
+    nanosleep(&ts,NULL);
+}
+
+}// namespace
+
+int main( int argc , char* argv[] ) {
+    if( argc != 4 ) {
+        std::cerr<<"Usage: sharded loops tokens hops"<<std::endl;
+        return -1;
+    }
+    const int loop_size = atoi(argv[1]);
+    const int token_size = atoi(argv[2]);
+    const int hops = atoi(argv[3]);
+
+    std::vector<IOManager*> loops;
+    for( int i = 0 ; i < loop_size ; ++i )
+        loops.push_back( new IOManager() );
+    Sharded<Shard>* sharded = new Sharded<Shard>( loops );
+
+    std::vector<pthread_t> threads(loop_size);
+    for( int i = 0 ; i < loop_size ; ++i )
+        pthread_create( &threads[i] , NULL , RunLoop , loops[i] );
+
+    std::vector<Token> tokens(token_size);
+    const double start = Seconds();
+    for( int i = 0 ; i < token_size ; ++i ) {
+        tokens[i].sharded = sharded;
+        tokens[i].hops = hops;
+        sharded->InvokeOn( i % loop_size , &tokens[i] );
+    }
+    while( g_finished_token < token_size )
+        SleepUS(1000);
+    const double elapsed = Seconds() - start;
+
+    Sum sum;
+    sum.sharded = sharded;
+    sharded->InvokeOn( 0 , &sum );
+    while( !g_done )
+        SleepUS(1000);
+
+    uint64_t wakeups = 0;
+    for( int i = 0 ; i < loop_size ; ++i ) {
+        loops[i]->Interrupt();
+        pthread_join( threads[i] , NULL );
+        wakeups += loops[i]->wakeup_count();
+    }
+    const double messages = static_cast<double>(token_size) * hops;
+    std::cout<<"messages: "<<g_total<<" ("<<messages<<" expected)"<<std::endl;
+    std::cout<<"messages/s: "<<messages / elapsed<<std::endl;
+    std::cout<<"wakeups/message: "<<wakeups / messages<<std::endl;
+
+    delete sharded;
+    for( int i = 0 ; i < loop_size ; ++i )
+        delete loops[i];
+    return 0;
+}
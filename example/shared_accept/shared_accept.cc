@@ -0,0 +1,143 @@
+#include "../../mnet.h"
+#include <time.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+using namespace mnet;
+
+// Shared listener benchmark. Several IOManagers, each running in its own
+// thread, accept connections from one listening socket. A client connects
+// at a steady pace so the loops are idle when a connection arrives. Without
+// EPOLLEXCLUSIVE every loop wakes up for every connection; with it only one
+// loop does. The benchmark reports the wake ups per accepted connection, both
+// as the epoll_wait calls that returned events and as the voluntary context
+// switches of the loop threads, which also counts the wake ups that found the
+// connection already taken by another loop.
+
+namespace {
+
+const uint16_t kPort = 12348;
+const int kLoopSize = 8;
+
+volatile int g_accepted = 0;
+
+class Loop {
+public:
+    Loop() :
+        context_switch_(0)
+        {}
+
+    bool Init( const ServerSocket& listener , bool exclusive ) {
+        if( !server_.ShareFrom( listener ) )
+            return false;
+        server_.set_exclusive( exclusive );
+        server_.SetIOManager( &io_manager_ );
+        server_.AsyncAccept( new Socket(&io_manager_) , this );
+        return true;
+    }
+
+    void OnAccept( Socket* socket , const NetState& ok ) {
+        if( ok ) {
+            socket->Close();
+            __sync_fetch_and_add( &g_accepted , 1 );
+        }
+        delete socket;
+        server_.AsyncAccept( new Socket(&io_manager_) , this );
+    }
+
+    static void* Run( void* arg ) {
+        Loop* loop = static_cast<Loop*>(arg);
+        struct rusage usage;
+        getrusage(RUSAGE_THREAD,&usage);
+        const long start = usage.ru_nvcsw;
+        loop->io_manager_.RunMainLoop();
+        getrusage(RUSAGE_THREAD,&usage);
+        loop->context_switch_ = usage.ru_nvcsw - start;
+        return NULL;
+    }
+
+    IOManager* io_manager() {
+        return &io_manager_;
+    }
+
+    long context_switch() const {
+        return context_switch_;
+    }
+
+private:
+    long context_switch_;
+    ServerSocket server_;
+    IOManager io_manager_;
+};
+
+void SleepUS( long usec ) {
+    struct timespec ts;
+    ts.tv_sec = usec / 1000000;
+    ts.tv_nsec = (usec % 1000000) * 1000;
+    nanosleep(&ts,NULL);
+}
+
+}// namespace
+
+int main( int argc , char* argv[] ) {
+    if( argc != 3 ) {
+        std::cerr<<"Usage: shared_accept connections exclusive(0/1)"<<std::endl;
+        return -1;
+    }
+    const int connections = atoi(argv[1]);
+    const bool exclusive = atoi(argv[2]) != 0;
+
+    ServerSocket listener;
+    if( !listener.Bind( Endpoint("127.0.0.1",kPort) ) ) {
+        std::cerr<<"Cannot bind to port "<<kPort<<std::endl;
+        return -1;
+    }
+
+    Loop loops[kLoopSize];
+    pthread_t threads[kLoopSize];
+    for( int i = 0 ; i < kLoopSize ; ++i ) {
+        if( !loops[i].Init( listener , exclusive ) ) {
+            std::cerr<<"Cannot share the listener"<<std::endl;
+            return -1;
+        }
+        pthread_create( threads+i , NULL , Loop::Run , loops+i );
+    }
+
+    struct sockaddr_in addr;
+    bzero(&addr,sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(kPort);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    for( int i = 0 ; i < connections ; ++i ) {
+        int fd = ::socket(AF_INET,SOCK_STREAM,0);
+        if( ::connect(fd,reinterpret_cast<struct sockaddr*>(&addr),sizeof(addr)) != 0 ) {
+            std::cerr<<"Cannot connect:"<<std::strerror(errno)<<std::endl;
+            return -1;
+        }
+        ::close(fd);
+        // Let the loops go back to sleep before the next connection
+        SleepUS(200);
+    }
+
+    while( g_accepted < connections )
+        SleepUS(1000);
+
+    uint64_t wakeups = 0;
+    long context_switches = 0;
+    for( int i = 0 ; i < kLoopSize ; ++i ) {
+        loops[i].io_manager()->Interrupt();
+        pthread_join( threads[i] , NULL );
+        // Do not count the wake up for the interruption
+        wakeups += loops[i].io_manager()->wakeup_count() - 1;
+        context_switches += loops[i].context_switch() - 1;
+    }
+
+    std::cout<<"loops: "<<kLoopSize<<" exclusive: "<<exclusive<<std::endl;
+    std::cout<<"wakeups/connection: "
+             <<static_cast<double>(wakeups) / connections<<std::endl;
+    std::cout<<"context switches/connection: "
+             <<static_cast<double>(context_switches) / connections<<std::endl;
+    return 0;
+}
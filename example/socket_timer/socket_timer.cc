@@ -0,0 +1,252 @@
+#include "../../mnet.h"
+#include <time.h>
+using namespace mnet;
+
+// Request timeout benchmark. A single IOManager runs both a server and the
+// clients. Each accepted connection arms a request timeout, then the client
+// sends one byte, gets the echo and closes. Every stuck_every-th client never
+// sends anything, so its timeout fires and the server closes it.
+//
+//   0 IOManager::Schedule, with a heap allocated liveness flag shared by the
+//     connection and the timer notifier, since the connection may be deleted
+//     before the timer fires. The timer stays in the heap until it expires.
+//   1 Socket::Schedule, the connection is the notifier and deleting it
+//     cancels the timer.
+//
+// It reports the connections per second, the timeouts fired and the largest
+// size of the timer heap.
+
+namespace {
+
+const char* kAddress = "127.0.0.1:12355";
+
+}// namespace
+
+class TimerChurn;
+
+// Shared by a connection and its timer notifier in mode 0
+struct Liveness {
+    bool alive;
+    int ref;
+};
+
+class Connection : public Socket {
+public:
+    Connection( IOManager* io_manager , TimerChurn* churn ) :
+        Socket( io_manager ),
+        churn_( churn ),
+        liveness_( NULL )
+        {}
+
+    ~Connection() {
+        if( liveness_ != NULL ) {
+            liveness_->alive = false;
+            if( --liveness_->ref == 0 )
+                delete liveness_;
+        }
+    }
+
+    void Start( int mode , int timeout );
+
+    // The request timeout of mode 1
+    void OnTimeout( int msec );
+
+    void OnRead( Socket* socket , std::size_t size , const NetState& ok );
+
+    void OnWrite( Socket* socket , std::size_t size , const NetState& ok );
+
+private:
+    TimerChurn* churn_;
+    Liveness* liveness_;
+};
+
+// The request timeout of mode 0, which has to check whether the connection is
+// still alive before touching it
+struct TimeoutNotifier {
+    TimeoutNotifier( Connection* c , Liveness* l ) : connection(c) , liveness(l) {}
+
+    void OnTimeout( int msec ) {
+        if( liveness->alive )
+            connection->OnTimeout( msec );
+        if( --liveness->ref == 0 )
+            delete liveness;
+        delete this;
+    }
+
+    Connection* connection;
+    Liveness* liveness;
+};
+
+class TimerChurn {
+public:
+    TimerChurn( int total , int concurrency , int mode , int stuck_every , int timeout ) :
+        total_(total),
+        concurrency_(concurrency),
+        mode_(mode),
+        stuck_every_(stuck_every),
+        timeout_(timeout),
+        started_(0),
+        connected_(0),
+        finished_(0),
+        server_closed_(0),
+        timed_out_(0),
+        max_timer_(0),
+        server_(),
+        io_manager_()
+    {
+        if( !server_.Bind( Endpoint(kAddress) ) ) {
+            std::cerr<<"Cannot bind to "<<kAddress<<std::endl;
+            std::exit(-1);
+        }
+        server_.SetIOManager( &io_manager_ );
+        server_.AsyncAccept( new Connection(&io_manager_,this) , this );
+    }
+
+    void Run() {
+        for( int i = 0 ; i < concurrency_ && started_ < total_ ; ++i ) {
+            Connect();
+        }
+        io_manager_.RunMainLoop();
+    }
+
+    // Server side
+    void OnAccept( Socket* socket , const NetState& ok ) {
+        if( ok ) {
+            static_cast<Connection*>(socket)->Start( mode_ , timeout_ );
+            max_timer_ = std::max( max_timer_ , io_manager_.timer_count() );
+        } else {
+            delete socket;
+        }
+        server_.AsyncAccept( new Connection(&io_manager_,this) , this );
+    }
+
+    void OnServerClosed( bool timed_out ) {
+        ++server_closed_;
+        if( timed_out )
+            ++timed_out_;
+        CheckDone();
+    }
+
+    // Client side
+    void OnConnect( Socket* socket , const NetState& ok ) {
+        if( !ok ) {
+            std::cerr<<"Cannot connect:"<<std::strerror(ok.error_code())<<std::endl;
+            io_manager_.Interrupt();
+            return;
+        }
+        if( stuck_every_ > 0 && ++connected_ % stuck_every_ == 0 ) {
+            // Send nothing and wait for the server to give up
+            socket->AsyncRead( this );
+            return;
+        }
+        char c = 'x';
+        socket->write_buffer().Write( &c , 1 );
+        socket->AsyncWrite( this );
+    }
+
+    void OnWrite( Socket* socket , std::size_t size , const NetState& ok ) {
+        socket->AsyncRead( this );
+    }
+
+    void OnRead( Socket* socket , std::size_t size , const NetState& ok ) {
+        socket->Close();
+        delete socket;
+        ++finished_;
+        if( started_ < total_ )
+            Connect();
+        CheckDone();
+    }
+
+    int timed_out() const {
+        return timed_out_;
+    }
+
+    std::size_t max_timer() const {
+        return max_timer_;
+    }
+
+private:
+    void CheckDone() {
+        if( finished_ == total_ && server_closed_ == total_ )
+            io_manager_.Interrupt();
+    }
+
+    void Connect() {
+        ++started_;
+        ClientSocket* s = new ClientSocket( &io_manager_ );
+        s->AsyncConnect( Endpoint(kAddress) , this );
+    }
+
+    int total_;
+    int concurrency_;
+    int mode_;
+    int stuck_every_;
+    int timeout_;
+    int started_;
+    int connected_;
+    int finished_;
+    int server_closed_;
+    int timed_out_;
+    std::size_t max_timer_;
+    ServerSocket server_;
+    IOManager io_manager_;
+};
+
+void Connection::Start( int mode , int timeout ) {
+    if( mode == 0 ) {
+        liveness_ = new Liveness();
+        liveness_->alive = true;
+        liveness_->ref = 2;
+        io_manager()->Schedule( timeout , new TimeoutNotifier(this,liveness_) );
+    } else {
+        Schedule( timeout , this );
+    }
+    AsyncRead( this );
+}
+
+void Connection::OnTimeout( int msec ) {
+    TimerChurn* churn = churn_;
+    Close();
+    delete this;
+    churn->OnServerClosed( true );
+}
+
+void Connection::OnRead( Socket* socket , std::size_t size , const NetState& ok ) {
+    if( !ok || size == 0 ) {
+        TimerChurn* churn = churn_;
+        Close();
+        delete this;
+        churn->OnServerClosed( false );
+        return;
+    }
+    std::size_t sz = read_buffer().readable_size();
+    void* buf = read_buffer().Read(&sz);
+    write_buffer().Write( buf , sz );
+    AsyncWrite( this );
+    AsyncRead( this );
+}
+
+void Connection::OnWrite( Socket* socket , std::size_t size , const NetState& ok ) {}
+
+double Seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main( int argc , char* argv[] ) {
+    if( argc != 6 ) {
+        std::cerr<<"Usage: socket_timer total concurrency timeout_ms stuck_every "
+                   "mode(0 shared flag/1 socket timer)"<<std::endl;
+        return -1;
+    }
+    const int total = atoi(argv[1]);
+    TimerChurn c( total , atoi(argv[2]) , atoi(argv[5]) , atoi(argv[4]) , atoi(argv[3]) );
+    double start = Seconds();
+    c.Run();
+    double elapsed = Seconds() - start;
+    std::cout<<"connections/s: "<<total / elapsed<<std::endl;
+    std::cout<<"timeouts fired: "<<c.timed_out()<<std::endl;
+    std::cout<<"max timer heap size: "<<c.max_timer()<<std::endl;
+    return 0;
+}
@@ -0,0 +1,179 @@
+#include "../../mnet.h"
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+using namespace mnet;
+
+// Embedding benchmark. The main thread runs a 60Hz simulation tick and drives
+// an echo server inline, without a network thread. Client threads measure the
+// echo round trip time.
+//
+//   0 The network is polled with RunOnce(0) once per tick, so a request waits
+//     for the next tick, up to 16.7ms.
+//   1 Between the ticks the host sleeps in poll(2) on the epoll_fd of the
+//     IOManager, with NextTimeout bounding the sleep, and calls RunOnce(0)
+//     whenever it is readable. A request is served as soon as it arrives.
+
+namespace {
+
+const uint16_t kPort = 12354;
+const uint64_t kTickUS = 1000000 / 60;
+
+uint64_t Now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+volatile bool g_stop = false;
+
+class EchoServer {
+public:
+    explicit EchoServer( IOManager* io_manager ) : io_manager_(io_manager) {
+        if( !server_.Bind( Endpoint("127.0.0.1",kPort) ) ) {
+            std::cerr<<"Cannot bind to port "<<kPort<<std::endl;
+            std::exit(-1);
+        }
+        server_.SetIOManager( io_manager_ );
+        server_.AsyncAccept( new Socket(io_manager_) , this );
+    }
+
+    void OnAccept( Socket* socket , const NetState& ok ) {
+        if( ok ) {
+            socket->AsyncRead( this );
+        } else {
+            delete socket;
+        }
+        server_.AsyncAccept( new Socket(io_manager_) , this );
+    }
+
+    void OnRead( Socket* socket , std::size_t size , const NetState& ok ) {
+        if( !ok || size == 0 ) {
+            socket->Close();
+            delete socket;
+            return;
+        }
+        std::size_t sz = socket->read_buffer().readable_size();
+        void* buf = socket->read_buffer().Read(&sz);
+        socket->write_buffer().Write( buf , sz );
+        socket->AsyncWrite( this );
+        socket->AsyncRead( this );
+    }
+
+    void OnWrite( Socket* socket , std::size_t size , const NetState& ok ) {}
+
+private:
+    IOManager* io_manager_;
+    ServerSocket server_;
+};
+
+struct Client {
+    pthread_t thread;
+    std::vector<uint64_t> rtt;
+};
+
+void* RunClient( void* arg ) {
+    Client* client = static_cast<Client*>(arg);
+    struct sockaddr_in addr;
+    bzero(&addr,sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(kPort);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int fd = ::socket(AF_INET,SOCK_STREAM,0);
+    if( ::connect(fd,reinterpret_cast<struct sockaddr*>(&addr),sizeof(addr)) != 0 ) {
+        std::cerr<<"Cannot connect:"<<std::strerror(errno)<<std::endl;
+        std::exit(-1);
+    }
+    while( !g_stop ) {
+        char c = 'x';
+        uint64_t start = Now();
+        if( ::write(fd,&c,1) != 1 || ::read(fd,&c,1) != 1 )
+            break;
+        client->rtt.push_back( Now() - start );
+        usleep(3000);
+    }
+    ::close(fd);
+    return NULL;
+}
+
+// The simulation work of a tick
+void Simulate( int work_us ) {
+    const uint64_t end = Now() + work_us;
+    while( Now() < end )
+        ;
+}
+
+}// namespace
+
+int main( int argc , char* argv[] ) {
+    if( argc != 5 ) {
+        std::cerr<<"Usage: tick clients work_us seconds mode(0 once per tick/1 nested poll)"<<std::endl;
+        return -1;
+    }
+    const int clients = atoi(argv[1]);
+    const int work_us = atoi(argv[2]);
+    const int seconds = atoi(argv[3]);
+    const int mode = atoi(argv[4]);
+
+    IOManager io_manager;
+    EchoServer server( &io_manager );
+    std::vector<Client> client( clients );
+    for( int i = 0 ; i < clients ; ++i )
+        pthread_create( &client[i].thread , NULL , RunClient , &client[i] );
+
+    const uint64_t start = Now();
+    const uint64_t end = start + static_cast<uint64_t>(seconds) * 1000000;
+    uint64_t next_tick = start;
+    uint64_t ticks = 0, late_ticks = 0, polls = 0;
+    while( next_tick < end ) {
+        // Wait for the tick, serving the network meanwhile in the nested mode
+        uint64_t now = Now();
+        while( now < next_tick ) {
+            if( mode == 1 ) {
+                int timeout = static_cast<int>( (next_tick - now + 999) / 1000 );
+                int io_timeout = io_manager.NextTimeout();
+                if( io_timeout >= 0 && io_timeout < timeout )
+                    timeout = io_timeout;
+                struct pollfd pfd;
+                pfd.fd = io_manager.epoll_fd();
+                pfd.events = POLLIN;
+                if( ::poll( &pfd , 1 , timeout ) > 0 || io_manager.NextTimeout() == 0 ) {
+                    io_manager.RunOnce(0);
+                    ++polls;
+                }
+            } else {
+                usleep( static_cast<useconds_t>(next_tick - now) );
+            }
+            now = Now();
+        }
+        if( now > next_tick + kTickUS / 10 )
+            ++late_ticks;
+        Simulate( work_us );
+        if( mode == 0 ) {
+            io_manager.RunOnce(0);
+            ++polls;
+        }
+        ++ticks;
+        next_tick += kTickUS;
+    }
+    g_stop = true;
+    // Serve the last requests so the clients can finish
+    for( int i = 0 ; i < clients ; ++i ) {
+        while( pthread_tryjoin_np( client[i].thread , NULL ) != 0 )
+            io_manager.RunOnce(1);
+    }
+
+    std::vector<uint64_t> rtt;
+    for( int i = 0 ; i < clients ; ++i )
+        rtt.insert( rtt.end() , client[i].rtt.begin() , client[i].rtt.end() );
+    std::sort( rtt.begin() , rtt.end() );
+    std::cout<<"mode: "<<(mode == 1 ? "nested poll" : "once per tick")<<std::endl;
+    std::cout<<"ticks: "<<ticks<<" late ticks: "<<late_ticks<<" RunOnce calls: "<<polls<<std::endl;
+    if( !rtt.empty() ) {
+        std::cout<<"echo rtt us p50: "<<rtt[rtt.size()/2]
+                 <<" p99: "<<rtt[rtt.size()*99/100]
+                 <<" requests: "<<rtt.size()<<std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,189 @@
+#include "../../mnet.h"
+#include <pthread.h>
+#include <time.h>
+using namespace mnet;
+
+// Echo benchmark for Buffer::TransferTo. A server thread echoes every request of
+// the clients of the main thread, either by reading the read buffer and writing
+// it into the write buffer, which copies every byte, or by handing the read
+// buffer over with TransferTo. Each client keeps one request in flight. It reports
+// the throughput and the CPU time the server thread spends for each GB echoed.
+
+static const char* kAddress = "127.0.0.1:12365";
+
+double Seconds( clockid_t clock ) {
+    struct timespec ts;
+    clock_gettime(clock,&ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+class Server {
+public:
+    Server( bool use_transfer ) :
+        use_transfer_(use_transfer),
+        cpu_time_(0)
+    {
+        if( !server_.Bind( Endpoint(kAddress) ) ) {
+            std::cerr<<"Cannot bind to "<<kAddress<<std::endl;
+            std::exit(-1);
+        }
+        server_.SetIOManager( &io_manager_ );
+        server_.AsyncAccept( new Socket(&io_manager_) , this );
+    }
+
+    void Run() {
+        io_manager_.RunMainLoop();
+        cpu_time_ = Seconds( CLOCK_THREAD_CPUTIME_ID );
+    }
+
+    IOManager* io_manager() {
+        return &io_manager_;
+    }
+
+    double cpu_time() const {
+        return cpu_time_;
+    }
+
+    void OnAccept( Socket* socket , const NetState& ok ) {
+        if( ok ) {
+            socket->AsyncRead( this );
+        } else {
+            delete socket;
+        }
+        server_.AsyncAccept( new Socket(&io_manager_) , this );
+    }
+
+    void OnRead( Socket* socket , std::size_t size , const NetState& ok ) {
+        if( !ok || size == 0 ) {
+            socket->Close();
+            delete socket;
+            return;
+        }
+        if( use_transfer_ ) {
+            socket->read_buffer().TransferTo( &socket->write_buffer() );
+        } else {
+            std::size_t sz = socket->read_buffer().readable_size();
+            void* buf = socket->read_buffer().Read(&sz);
+            socket->write_buffer().Write( buf , sz );
+        }
+        socket->AsyncWrite( this );
+        socket->AsyncRead( this );
+    }
+
+    void OnWrite( Socket* socket , std::size_t size , const NetState& ok ) {}
+
+private:
+    bool use_transfer_;
+    double cpu_time_;
+    ServerSocket server_;
+    IOManager io_manager_;
+};
+
+class Client {
+public:
+    Client( int connections , int requests , std::size_t request_size ) :
+        connections_(connections),
+        requests_(requests),
+        finished_(0),
+        bytes_(0),
+        request_( request_size , 'e' )
+    {
+        for( int i = 0 ; i < connections ; ++i ) {
+            Conn* c = new Conn( this );
+            c->socket.AsyncConnect( Endpoint(kAddress) , c );
+        }
+    }
+
+    void Run() {
+        io_manager_.RunMainLoop();
+    }
+
+    uint64_t bytes() const {
+        return bytes_;
+    }
+
+private:
+    struct Conn {
+        explicit Conn( Client* c ) :
+            client(c),
+            left(c->requests_),
+            socket(&c->io_manager_)
+            {}
+        void OnConnect( Socket* s , const NetState& ok ) {
+            if( !ok ) {
+                std::cerr<<"Cannot connect:"<<std::strerror(ok.error_code())<<std::endl;
+                std::exit(-1);
+            }
+            Send();
+        }
+        void OnWrite( Socket* s , std::size_t size , const NetState& ok ) {}
+        void OnRead( Socket* s , std::size_t size , const NetState& ok ) {
+            if( !ok || size == 0 ) {
+                std::cerr<<"Connection is closed"<<std::endl;
+                std::exit(-1);
+            }
+            if( socket.read_buffer().readable_size() < client->request_.size() ) {
+                socket.AsyncRead( this );
+                return;
+            }
+            client->bytes_ += socket.read_buffer().readable_size();
+            socket.read_buffer().Clear();
+            if( --left == 0 ) {
+                client->OnDone();
+                return;
+            }
+            Send();
+        }
+        void Send() {
+            socket.write_buffer().Write( client->request_.data() , client->request_.size() );
+            socket.AsyncWrite( this );
+            socket.AsyncRead( this );
+        }
+        Client* client;
+        int left;
+        ClientSocket socket;
+    };
+
+    void OnDone() {
+        if( ++finished_ == connections_ )
+            io_manager_.Interrupt();
+    }
+
+    int connections_;
+    int requests_;
+    int finished_;
+    uint64_t bytes_;
+    std::string request_;
+    IOManager io_manager_;
+};
+
+void* RunServer( void* arg ) {
+    static_cast<Server*>(arg)->Run();
+    return NULL;
+}
+
+int main( int argc , char* argv[] ) {
+    if( argc != 5 ) {
+        std::cerr<<"Usage: transfer mode(0 copy/1 transfer) connections requests request_kb"<<std::endl;
+        return -1;
+    }
+    const bool use_transfer = atoi(argv[1]) != 0;
+    Server server( use_transfer );
+    pthread_t loop;
+    pthread_create( &loop , NULL , RunServer , &server );
+
+    Client client( atoi(argv[2]) , atoi(argv[3]) ,
+                   static_cast<std::size_t>(atoi(argv[4])) * 1024 );
+    const double start = Seconds( CLOCK_MONOTONIC );
+    client.Run();
+    const double elapsed = Seconds( CLOCK_MONOTONIC ) - start;
+
+    server.io_manager()->Interrupt();
+    pthread_join( loop , NULL );
+
+    const double gb = client.bytes() / ( 1024.0 * 1024 * 1024 );
+    std::cout<<"mode: "<<( use_transfer ? "transfer" : "copy" )<<std::endl;
+    std::cout<<"echoed GB: "<<gb<<" MB/s: "<<gb * 1024 / elapsed<<std::endl;
+    std::cout<<"server cpu ms per GB: "<<server.cpu_time() * 1000 / gb<<std::endl;
+    std::_Exit(0);
+}
@@ -0,0 +1,354 @@
+#include "../../mnet.h"
+#include "../../mnet_http.h"
+#include "../../mnet_ws.h"
+#include <pthread.h>
+#include <time.h>
+#include <set>
+using namespace mnet;
+
+// Benchmarks of the WebSocket layer.
+//   websocket unmask
+// compares the byte by byte unmasking with ws::Unmask over several payload sizes.
+//   websocket echo connections messages size depth
+// runs a server that echoes every message, the clients keep depth masked
+// messages in flight on each connection and it reports the messages per second.
+//   websocket fanout connections messages size
+// runs a server that broadcasts every message it receives to all connections
+// with one shared Frame. The first client sends the messages and it reports the
+// frames delivered per second.
+
+static const char* kAddress = "127.0.0.1:12367";
+
+// The sample key of RFC 6455 and its accept value
+static const char* kKey = "dGhlIHNhbXBsZSBub25jZQ==";
+static const char* kAccept = "s3pPLMBiTxaQ9kYGzzhZRbK+xOo=";
+
+double Seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void UnmaskBytewise( char* data , std::size_t size , const char key[4] ) {
+    for( std::size_t i = 0 ; i < size ; ++i )
+        data[i] ^= key[i%4];
+}
+
+void BenchmarkUnmask() {
+    const std::size_t sizes[] = { 64 , 1024 , 16*1024 , 256*1024 };
+    const char key[4] = { 0x12 , 0x34 , 0x56 , 0x78 };
+    const std::size_t total = 1024*1024*1024;
+    for( std::size_t s = 0 ; s < sizeof(sizes)/sizeof(sizes[0]) ; ++s ) {
+        std::vector<char> payload( sizes[s] , 'a' );
+        const std::size_t rounds = total / sizes[s];
+        double start = Seconds();
+        for( std::size_t i = 0 ; i < rounds ; ++i ) {
+            UnmaskBytewise( &payload[0] , payload.size() , key );
+            __asm__ __volatile__( "" : : "r"(&payload[0]) : "memory" );
+        }
+        const double bytewise = Seconds() - start;
+        start = Seconds();
+        for( std::size_t i = 0 ; i < rounds ; ++i ) {
+            ws::Unmask( &payload[0] , payload.size() , key );
+            __asm__ __volatile__( "" : : "r"(&payload[0]) : "memory" );
+        }
+        const double simd = Seconds() - start;
+        const double gb = static_cast<double>(rounds * sizes[s]) / ( 1024.0 * 1024 * 1024 );
+        std::cout<<"payload "<<sizes[s]<<" bytes: byte by byte "<<gb / bytewise
+                 <<" GB/s, Unmask "<<gb / simd<<" GB/s"<<std::endl;
+    }
+}
+
+class Handler {
+public:
+    explicit Handler( bool fanout ) :
+        fanout_(fanout)
+        {}
+
+    ~Handler() {
+        for( std::set<ws::Connection*>::iterator i = connections_.begin() ;
+             i != connections_.end() ; ++i )
+            delete *i;
+    }
+
+    void OnRequest( const http::Request& request , http::Response* response ) {
+        if( request.path() != "/ws" ) {
+            response->set_status(404);
+            return;
+        }
+        if( ws::Handshake( request , response ) )
+            response->Upgrade( this );
+    }
+
+    void OnUpgrade( Socket* socket ) {
+        ws::Connection* connection = new ws::Connection( socket );
+        connections_.insert( connection );
+        connection->Start( this );
+    }
+
+    void OnMessage( ws::Connection* connection , int opcode , const StringPiece& payload ) {
+        if( !fanout_ ) {
+            connection->Send( opcode , payload );
+            return;
+        }
+        const ws::Frame frame( opcode , payload );
+        for( std::set<ws::Connection*>::iterator i = connections_.begin() ;
+             i != connections_.end() ; ++i )
+            (*i)->Send( frame );
+    }
+
+    void OnClose( ws::Connection* connection , int code ) {
+        connections_.erase( connection );
+        delete connection;
+    }
+
+private:
+    bool fanout_;
+    std::set<ws::Connection*> connections_;
+};
+
+class Server {
+public:
+    explicit Server( bool fanout ) :
+        handler_(fanout),
+        io_manager_(),
+        server_(&io_manager_)
+    {
+        if( !server_.Bind( Endpoint(kAddress) ) ) {
+            std::cerr<<"Cannot bind to "<<kAddress<<std::endl;
+            std::exit(-1);
+        }
+        server_.Start( &handler_ );
+    }
+
+    void Run() {
+        io_manager_.RunMainLoop();
+    }
+
+    IOManager* io_manager() {
+        return &io_manager_;
+    }
+
+private:
+    Handler handler_;
+    IOManager io_manager_;
+    http::Server server_;
+};
+
+class Client {
+public:
+    Client( bool fanout , int connections , int messages , std::size_t size , int depth ) :
+        fanout_(fanout),
+        connections_(connections),
+        messages_(messages),
+        depth_(depth),
+        upgraded_(0),
+        finished_(0),
+        frames_(0),
+        start_(0),
+        conns_()
+    {
+        // A masked binary frame with a zero key, the server unmasks it all the same
+        frame_.push_back( static_cast<char>(0x82) );
+        if( size < 126 ) {
+            frame_.push_back( static_cast<char>( 0x80 | size ) );
+        } else if( size <= 0xFFFF ) {
+            frame_.push_back( static_cast<char>(0xFE) );
+            frame_.push_back( static_cast<char>( size >> 8 ) );
+            frame_.push_back( static_cast<char>( size ) );
+        } else {
+            frame_.push_back( static_cast<char>(0xFF) );
+            for( int i = 7 ; i >= 0 ; --i )
+                frame_.push_back( static_cast<char>( static_cast<uint64_t>(size) >> ( i * 8 ) ) );
+        }
+        frame_.append( 4 , '\0' );
+        frame_.append( size , 'x' );
+        for( int i = 0 ; i < connections ; ++i ) {
+            Conn* c = new Conn( this );
+            conns_.push_back( c );
+            c->socket.AsyncConnect( Endpoint(kAddress) , c );
+        }
+    }
+
+    void Run() {
+        io_manager_.RunMainLoop();
+    }
+
+    uint64_t frames() const {
+        return frames_;
+    }
+
+    // The clock starts once every connection is upgraded
+    double start() const {
+        return start_;
+    }
+
+private:
+    struct Conn {
+        explicit Conn( Client* c ) :
+            client(c),
+            upgraded(false),
+            sent(0),
+            received(0),
+            in_flight(0),
+            socket(&c->io_manager_)
+            {}
+        void OnConnect( Socket* s , const NetState& ok ) {
+            if( !ok ) {
+                std::cerr<<"Cannot connect:"<<std::strerror(ok.error_code())<<std::endl;
+                std::exit(-1);
+            }
+            std::string request = "GET /ws HTTP/1.1\r\nHost: 127.0.0.1\r\n"
+                                  "Upgrade: websocket\r\nConnection: Upgrade\r\n"
+                                  "Sec-WebSocket-Version: 13\r\nSec-WebSocket-Key: ";
+            request += kKey;
+            request += "\r\n\r\n";
+            socket.write_buffer().Write( request.data() , request.size() );
+            socket.AsyncWrite( this );
+            socket.AsyncRead( this );
+        }
+        void OnWrite( Socket* s , std::size_t size , const NetState& ok ) {}
+        void OnRead( Socket* s , std::size_t size , const NetState& ok ) {
+            if( !ok || size == 0 ) {
+                std::cerr<<"Connection is closed"<<std::endl;
+                std::exit(-1);
+            }
+            Buffer::Accessor accessor = socket.read_buffer().GetReadAccessor();
+            const char* data = static_cast<const char*>(accessor.address());
+            std::size_t pos = 0;
+            if( !upgraded ) {
+                const char* end = static_cast<const char*>(
+                        memmem( data , accessor.size() , "\r\n\r\n" , 4 ) );
+                if( end == NULL ) {
+                    socket.AsyncRead( this );
+                    return;
+                }
+                const std::string head( data , end - data );
+                if( head.compare( 0 , 12 , "HTTP/1.1 101" ) != 0 ||
+                    head.find( kAccept ) == std::string::npos ) {
+                    std::cerr<<"Bad handshake response:"<<std::endl<<head<<std::endl;
+                    std::exit(-1);
+                }
+                pos = end + 4 - data;
+                upgraded = true;
+                client->OnUpgraded();
+            }
+            // Count the complete server frames, they are never masked
+            while( accessor.size() - pos >= 2 ) {
+                const unsigned char* p = reinterpret_cast<const unsigned char*>(data + pos);
+                uint64_t length = p[1] & 0x7F;
+                std::size_t header_size = 2;
+                if( length == 126 ) {
+                    header_size = 4;
+                    if( accessor.size() - pos < header_size )
+                        break;
+                    length = static_cast<uint64_t>(p[2]) << 8 | p[3];
+                } else if( length == 127 ) {
+                    header_size = 10;
+                    if( accessor.size() - pos < header_size )
+                        break;
+                    length = 0;
+                    for( int i = 0 ; i < 8 ; ++i )
+                        length = length << 8 | p[2+i];
+                }
+                if( accessor.size() - pos < header_size + length )
+                    break;
+                pos += header_size + static_cast<std::size_t>(length);
+                ++received;
+                ++client->frames_;
+                if( in_flight != 0 )
+                    --in_flight;
+            }
+            accessor.set_committed_size( pos );
+            if( received == client->messages_ ) {
+                client->OnDone();
+                return;
+            }
+            if( client->start_ != 0 )
+                Send();
+            socket.AsyncRead( this );
+        }
+        // Keep the window of messages in flight full
+        void Send() {
+            if( client->fanout_ && this != client->conns_[0] )
+                return;
+            bool sent_any = false;
+            while( in_flight < client->depth_ && sent < client->messages_ ) {
+                socket.write_buffer().Write( client->frame_.data() , client->frame_.size() );
+                ++in_flight;
+                ++sent;
+                sent_any = true;
+            }
+            if( sent_any )
+                socket.AsyncWrite( this );
+        }
+        Client* client;
+        bool upgraded;
+        int sent;
+        int received;
+        int in_flight;
+        ClientSocket socket;
+    };
+
+    void OnUpgraded() {
+        if( ++upgraded_ != connections_ )
+            return;
+        start_ = Seconds();
+        for( std::size_t i = 0 ; i < conns_.size() ; ++i )
+            conns_[i]->Send();
+    }
+
+    void OnDone() {
+        if( ++finished_ == connections_ )
+            io_manager_.Interrupt();
+    }
+
+    bool fanout_;
+    int connections_;
+    int messages_;
+    int depth_;
+    int upgraded_;
+    int finished_;
+    uint64_t frames_;
+    double start_;
+    std::string frame_;
+    std::vector<Conn*> conns_;
+    IOManager io_manager_;
+};
+
+void* RunServer( void* arg ) {
+    static_cast<Server*>(arg)->Run();
+    return NULL;
+}
+
+int main( int argc , char* argv[] ) {
+    if( argc == 2 && strcmp( argv[1] , "unmask" ) == 0 ) {
+        BenchmarkUnmask();
+        return 0;
+    }
+    const bool echo = argc == 6 && strcmp( argv[1] , "echo" ) == 0;
+    const bool fanout = argc == 5 && strcmp( argv[1] , "fanout" ) == 0;
+    if( !echo && !fanout ) {
+        std::cerr<<"Usage: websocket unmask"<<std::endl
+                 <<"       websocket echo connections messages size depth"<<std::endl
+                 <<"       websocket fanout connections messages size"<<std::endl;
+        return -1;
+    }
+    Server server( fanout );
+    pthread_t loop;
+    pthread_create( &loop , NULL , RunServer , &server );
+
+    // The sender of a fanout keeps a window of 16 broadcasts in flight
+    const int depth = fanout ? 16 : std::max( atoi(argv[5]) , 1 );
+    Client client( fanout , atoi(argv[2]) , atoi(argv[3]) ,
+                   static_cast<std::size_t>(atoi(argv[4])) , depth );
+    client.Run();
+    const double elapsed = Seconds() - client.start();
+
+    server.io_manager()->Interrupt();
+    pthread_join( loop , NULL );
+
+    std::cout<<( fanout ? "fanout" : "echo" )<<" payload: "<<argv[4]<<" bytes"<<std::endl;
+    std::cout<<"frames/s: "<<client.frames() / elapsed<<std::endl;
+    std::_Exit(0);
+}
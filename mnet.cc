@@ -5,9 +5,34 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/uio.h>
+#include <sys/sendfile.h>
 #include <sys/epoll.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
 #include <netinet/tcp.h>
+#include <linux/filter.h>
+#include <sched.h>
+#include <pthread.h>
+#include <time.h>
+
+#ifndef SO_INCOMING_CPU
+#define SO_INCOMING_CPU 49
+#endif // SO_INCOMING_CPU
+
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF 51
+#endif // SO_ATTACH_REUSEPORT_CBPF
+
+#ifndef SO_MAX_PACING_RATE
+#define SO_MAX_PACING_RATE 47
+#endif // SO_MAX_PACING_RATE
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif // MPOL_PREFERRED
 
 // The DO_INVOKE macro is a trick to help resolve the problem of that
 // during the user callback it register a new handler. However if we
@@ -32,6 +57,54 @@
 
 
 namespace mnet {
+__thread IOManager* IOManager::current_ = NULL;
+
+namespace detail {
+
+__thread int LivenessGuard::depth_ = 0;
+__thread std::size_t LivenessGuard::log_size_ = 0;
+__thread const Pollable* LivenessGuard::inline_log_[LivenessGuard::kInlineLogSize];
+__thread const Pollable** LivenessGuard::overflow_log_ = NULL;
+__thread std::size_t LivenessGuard::overflow_capacity_ = 0;
+
+bool LivenessGuard::IsLogged( const Pollable* pollable , std::size_t from ) {
+    for( std::size_t i = from ; i < log_size_ ; ++i ) {
+        const Pollable* entry = i < kInlineLogSize ? inline_log_[i] :
+            overflow_log_[i-kInlineLogSize];
+        if( entry == pollable )
+            return true;
+    }
+    return false;
+}
+
+void LivenessGuard::Log( const Pollable* pollable ) {
+    if( log_size_ < kInlineLogSize ) {
+        inline_log_[log_size_++] = pollable;
+        return;
+    }
+    const std::size_t pos = log_size_ - kInlineLogSize;
+    if( pos == overflow_capacity_ ) {
+        const std::size_t capacity = overflow_capacity_ == 0 ?
+            kInlineLogSize : overflow_capacity_ * 2;
+        const Pollable** log = new const Pollable*[capacity];
+        std::copy( overflow_log_ , overflow_log_ + overflow_capacity_ , log );
+        delete [] overflow_log_;
+        overflow_log_ = log;
+        overflow_capacity_ = capacity;
+    }
+    overflow_log_[pos] = pollable;
+    ++log_size_;
+}
+
+void LivenessGuard::ClearLog() {
+    log_size_ = 0;
+    delete [] overflow_log_;
+    overflow_log_ = NULL;
+    overflow_capacity_ = 0;
+}
+
+}// namespace detail
+
 namespace detail {
 namespace {
 
@@ -70,10 +143,13 @@ int NewFileDescriptor() {
     return fd;
 }
 
-uint64_t GetCurrentTimeInMS() {
-    struct timeval tv;
-    VERIFY( ::gettimeofday(&tv,NULL) == 0 );
-    return tv.tv_sec * 1000 + static_cast<uint64_t>(tv.tv_usec/1000);
+// Monotonic time in microseconds. Wall clock time is not used since it
+// jumps whenever NTP adjusts the system time
+uint64_t GetCurrentTimeInUS() {
+    struct timespec ts;
+    VERIFY( ::clock_gettime(CLOCK_MONOTONIC,&ts) == 0 );
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000 +
+           static_cast<uint64_t>(ts.tv_nsec/1000);
 }
 }// namespace
 
@@ -94,6 +170,96 @@ int CreateTcpServerSocketFileDescriptor() {
     return fd;
 }
 
+DeadlineWheel::DeadlineWheel() :
+    current_tick_(0) {
+    for( std::size_t i = 0 ; i < kSlotSize ; ++i ) {
+        InitSentinel( slots_+i );
+    }
+    bzero(bitmap_,sizeof(bitmap_));
+}
+
+void DeadlineWheel::Reset( uint64_t now ) {
+    current_tick_ = now / kGranularity;
+}
+
+void DeadlineWheel::Link( DeadlineNode* node , uint64_t deadline ) {
+    assert( !node->IsLinked() );
+    // Round up so a node never expires before its deadline
+    uint64_t tick = (deadline + kGranularity - 1) / kGranularity;
+    if( tick <= current_tick_ )
+        tick = current_tick_ + 1;
+    const std::size_t slot = static_cast<std::size_t>(tick % kSlotSize);
+
+    // Link to the tail of the slot
+    DeadlineNode* head = slots_ + slot;
+    node->prev = head->prev;
+    node->next = head;
+    head->prev->next = node;
+    head->prev = node;
+    node->deadline = deadline;
+
+    bitmap_[slot/kBitsPerWord] |= static_cast<uint64_t>(1) << (slot%kBitsPerWord);
+}
+
+void DeadlineWheel::AppendList( DeadlineNode* dst , DeadlineNode* src ) {
+    if( src->next == src )
+        return;
+    src->next->prev = dst->prev;
+    src->prev->next = dst;
+    dst->prev->next = src->next;
+    dst->prev = src->prev;
+    InitSentinel(src);
+}
+
+void DeadlineWheel::Expire( uint64_t now , DeadlineNode* expired ) {
+    const uint64_t target = now / kGranularity;
+    if( target <= current_tick_ )
+        return;
+    // When we fall behind more than one round, every slot is expired once
+    uint64_t ticks = target - current_tick_;
+    if( ticks > kSlotSize )
+        ticks = kSlotSize;
+    for( uint64_t i = 1 ; i <= ticks ; ++i ) {
+        const std::size_t slot =
+            static_cast<std::size_t>((current_tick_ + i) % kSlotSize);
+        uint64_t* word = bitmap_ + slot/kBitsPerWord;
+        const uint64_t bit = static_cast<uint64_t>(1) << (slot%kBitsPerWord);
+        if( *word & bit ) {
+            AppendList( expired , slots_+slot );
+            *word &= ~bit;
+        }
+    }
+    current_tick_ = target;
+}
+
+uint64_t DeadlineWheel::NextExpiration() {
+    const uint64_t start = current_tick_ + 1;
+    std::size_t i = 0;
+    while( i < kSlotSize ) {
+        const std::size_t slot = static_cast<std::size_t>((start + i) % kSlotSize);
+        const std::size_t off = slot % kBitsPerWord;
+        const uint64_t word = bitmap_[slot/kBitsPerWord] >> off;
+        if( word == 0 ) {
+            // Skip the rest of this word at once
+            i += kBitsPerWord - off;
+            continue;
+        }
+        const std::size_t skip = static_cast<std::size_t>(__builtin_ctzll(word));
+        i += skip;
+        if( i >= kSlotSize )
+            break;
+        const std::size_t hit = slot + skip;
+        if( slots_[hit].next == slots_+hit ) {
+            // The slot has become empty, clear its bit lazily
+            bitmap_[hit/kBitsPerWord] &= ~(static_cast<uint64_t>(1) << (hit%kBitsPerWord));
+            ++i;
+            continue;
+        }
+        return (start + i) * kGranularity;
+    }
+    return kNoDeadline;
+}
+
 }// namespace detail
 
 
@@ -170,6 +336,42 @@ bool Buffer::Inject( const void* mem , std::size_t length ) {
     return true;
 }
 
+std::size_t Buffer::TransferTo( Buffer* buffer ) {
+    assert( buffer != this );
+    const std::size_t sz = readable_size();
+    if( LIKELY(buffer->readable_size() == 0) ) {
+        // The memory of the empty buffer is reused by this one afterwards
+        Swap( buffer );
+        Clear();
+        return sz;
+    }
+    std::size_t moved;
+    if( buffer->Write( static_cast<char*>(mem_)+read_ptr_ , sz ) ) {
+        moved = sz;
+    } else {
+        moved = buffer->Fill( static_cast<char*>(mem_)+read_ptr_ , sz );
+    }
+    read_ptr_ += moved;
+    RewindBuffer();
+    return moved;
+}
+
+bool StringPiece::EqualsIgnoreCase( const StringPiece& other ) const {
+    if( size_ != other.size_ )
+        return false;
+    for( std::size_t i = 0 ; i < size_ ; ++i ) {
+        char l = data_[i];
+        char r = other.data_[i];
+        if( l >= 'A' && l <= 'Z' )
+            l += 'a' - 'A';
+        if( r >= 'A' && r <= 'Z' )
+            r += 'a' - 'A';
+        if( l != r )
+            return false;
+    }
+    return true;
+}
+
 int Endpoint::Ipv4ToString( char* buf ) const {
     // Parsing the IPV4 into the string. The following code should
     // only work on little endian
@@ -257,18 +459,296 @@ int Endpoint::StringToPort( const char* buf ) {
     return (pend-buf);
 }
 
+void Socket::SetIdleTimeout( int msec ) {
+    if( msec > 0 ) {
+        idle_timeout_ = static_cast<uint64_t>(msec) * 1000;
+        idle_deadline_ = io_manager_->now_ + idle_timeout_;
+        ArmDeadline();
+    } else {
+        // The node will be unlinked lazily when its slot expires
+        idle_timeout_ = idle_deadline_ = 0;
+    }
+}
+
+void Socket::ArmDeadline() {
+    uint64_t deadline = read_deadline_;
+    if( deadline == 0 || (idle_deadline_ != 0 && idle_deadline_ < deadline) )
+        deadline = idle_deadline_;
+    if( deadline == 0 || (close_deadline_ != 0 && close_deadline_ < deadline) )
+        deadline = close_deadline_;
+    if( deadline == 0 ) {
+        deadline_node_.Unlink();
+        return;
+    }
+    // A later deadline is handled lazily when the current slot expires. Only
+    // an earlier deadline requires relinking
+    if( deadline_node_.IsLinked() ) {
+        if( deadline >= deadline_node_.deadline )
+            return;
+        deadline_node_.Unlink();
+    }
+    io_manager_->deadline_wheel_.Link( &deadline_node_ , deadline );
+}
+
+void Socket::OnDeadline() {
+    const uint64_t now = io_manager_->now_;
+    if( close_deadline_ != 0 && close_deadline_ <= now ) {
+        // The peer did not close in time, give up the graceful close
+        assert( state_ == CLOSING );
+        detail::ScopePtr<detail::CloseCallback> cb( user_close_callback_.Release() );
+        Abort();
+        state_ = CLOSED;
+        cb->InvokeClose( NetState(state_category::kSystem,ETIMEDOUT) );
+        return;
+    }
+    const bool read_expired = read_deadline_ != 0 && read_deadline_ <= now;
+    const bool idle_expired = idle_deadline_ != 0 && idle_deadline_ <= now;
+
+    if( read_expired )
+        read_deadline_ = 0;
+    if( idle_expired )
+        idle_deadline_ = now + idle_timeout_;
+    // Link the socket again for its remaining or next deadline
+    ArmDeadline();
+
+    const NetState state(state_category::kSystem,ETIMEDOUT);
+    if( idle_expired ) {
+        if( !user_read_callback_.IsNull() || !user_write_callback_.IsNull() )
+            OnException(state);
+    } else if( read_expired && !user_read_callback_.IsNull() ) {
+        DO_INVOKE(user_read_callback_,
+                  detail::ScopePtr<detail::ReadCallback>,
+                  this,0,state);
+    }
+}
+
+void Socket::AddTimer( uint64_t usec , int msec , detail::TimeoutCallback* cb ) {
+    detail::SocketTimer* timer = new detail::SocketTimer();
+    timer->callback = cb;
+    timer->deadline = io_manager_->now_ + usec;
+    timer->time = msec;
+    timer->Link( &timer_list_ );
+    io_manager_->AddSocketTimer( timer );
+}
+
+void Socket::CancelTimers() {
+    while( timer_list_ != NULL ) {
+        detail::SocketTimer* timer = timer_list_;
+        timer->Unlink();
+        delete timer->callback;
+        timer->callback = NULL;
+        // The heap entry still refers to the timer, it is deleted there
+        io_manager_->OnSocketTimerCancelled();
+    }
+    // The throttle timer is gone as well
+    is_throttled_ = false;
+}
+
+void Socket::set_priority( int priority ) {
+    set_high_priority( priority == PRIORITY_HIGH );
+    if( priority == PRIORITY_HIGH )
+        io_manager_->dispatch_by_priority_ = true;
+}
+
+void Socket::StopRelay() {
+    relay_->Stop();
+}
+
+void Socket::SetRateLimit( uint64_t bytes_per_sec , std::size_t burst ) {
+    if( bytes_per_sec == 0 ) {
+        rate_limit_.Reset( NULL );
+        return;
+    }
+    if( burst == 0 )
+        burst = RateLimiter::DefaultBurst( bytes_per_sec );
+    if( rate_limit_.IsNull() ) {
+        rate_limit_.Reset( new RateLimiter( bytes_per_sec , burst ) );
+    } else {
+        rate_limit_->set_rate( bytes_per_sec , burst );
+    }
+}
+
+bool Socket::SetPacingRate( uint64_t bytes_per_sec ) {
+    // Older kernels only take a 32 bits rate, where ~0U means unlimited
+    if( bytes_per_sec <= 0xffffffffu ) {
+        unsigned int rate = static_cast<unsigned int>(bytes_per_sec);
+        return ::setsockopt( fd() , SOL_SOCKET , SO_MAX_PACING_RATE ,
+                             &rate , sizeof(rate) ) == 0;
+    }
+    return ::setsockopt( fd() , SOL_SOCKET , SO_MAX_PACING_RATE ,
+                         &bytes_per_sec , sizeof(bytes_per_sec) ) == 0;
+}
+
+std::size_t Socket::WriteAllowance() {
+    const uint64_t now = io_manager_->now_;
+    std::size_t allowance = ~static_cast<std::size_t>(0);
+    if( !rate_limit_.IsNull() )
+        allowance = std::min( allowance , rate_limit_->Available(now) );
+    if( rate_limit_group_ != NULL )
+        allowance = std::min( allowance , rate_limit_group_->Available(now) );
+    return allowance;
+}
+
+void Socket::ChargeWrite( std::size_t size ) {
+    if( !rate_limit_.IsNull() )
+        rate_limit_->Consume( size );
+    if( rate_limit_group_ != NULL )
+        rate_limit_group_->Consume( size );
+}
+
+void Socket::ThrottleWrite() {
+    if( is_throttled_ )
+        return;
+    // The file part of an AsyncSendFile waits for the tokens as well
+    const std::size_t size = write_buffer().readable_size() + sendfile_left_;
+    const uint64_t now = io_manager_->now_;
+    uint64_t delay = 0;
+    if( !rate_limit_.IsNull() )
+        delay = std::max( delay , rate_limit_->Reserve(size,now) );
+    if( rate_limit_group_ != NULL )
+        delay = std::max( delay , rate_limit_group_->Reserve(size,now) );
+    is_throttled_ = true;
+    AddTimer( delay , static_cast<int>(delay/1000) ,
+              detail::MakeTimeoutCallback(&throttle_notifier_) );
+}
+
+void Socket::ThrottleNotifier::OnTimeout( int msec ) {
+    socket->is_throttled_ = false;
+    // Without the write readiness the edge of EPOLLOUT resumes the write
+    if( socket->can_write() && !socket->user_write_callback_.IsNull() )
+        socket->FlushWrite();
+}
+
+std::size_t RateLimiter::Available( uint64_t now ) {
+    if( UNLIKELY(last_refill_ == 0) )
+        last_refill_ = now;
+    if( now > last_refill_ ) {
+        tokens_ += static_cast<double>(now - last_refill_) * rate_ / 1000000;
+        if( tokens_ > burst_ )
+            tokens_ = static_cast<double>(burst_);
+        last_refill_ = now;
+    }
+    return tokens_ < 1 ? 0 : static_cast<std::size_t>(tokens_);
+}
+
+uint64_t RateLimiter::Reserve( std::size_t size , uint64_t now ) {
+    const double want = static_cast<double>( std::min( size , burst_ ) );
+    const uint64_t cost = static_cast<uint64_t>( want * 1000000 / rate_ ) + 1;
+    uint64_t slot = now;
+    if( want > tokens_ )
+        slot += static_cast<uint64_t>( (want - tokens_) * 1000000 / rate_ ) + 1;
+    // Queue up behind the sockets already waiting for the tokens
+    if( next_slot_ > now )
+        slot = std::max( slot , next_slot_ + cost );
+    next_slot_ = slot;
+    return slot - now;
+}
+
+void Socket::Abort() {
+    struct linger option;
+    option.l_onoff = 1;
+    option.l_linger = 0;
+    // Ignore the failure, the socket is closed with a FIN then
+    ::setsockopt( fd() , SOL_SOCKET , SO_LINGER , &option , sizeof(option) );
+    Close();
+}
+
+void Socket::DoMigrateTo( IOManager* target , detail::MigrateCallback* callback ) {
+    assert( Valid() );
+    assert( state_ == NORMAL );
+    assert( pending_offload_ == 0 );
+    assert( relay_ == NULL );
+    // The group is shared with the other sockets of this IOManager only, so
+    // the socket leaves it before another thread touches the bucket
+    rate_limit_group_ = NULL;
+    MigrateTask* task = new MigrateTask();
+    task->socket = this;
+    task->target = target;
+    task->callback = callback;
+    task->is_epoll_read = task->is_epoll_write = false;
+    task->detached = false;
+    // The event of this socket may still be pending in the ongoing dispatch
+    // loop, so the source IOManager detaches it after the dispatch loop
+    io_manager_->Post( task );
+}
+
+void Socket::MigrateTask::OnPost() {
+    if( !detached ) {
+        // On the source thread. Remember how the fd was watched, so the
+        // target watches it in the same way
+        is_epoll_read = socket->is_epoll_read();
+        is_epoll_write = socket->is_epoll_write();
+        socket->io_manager_->Unwatch( socket );
+        socket->deadline_node_.Unlink();
+        socket->live_link_.Unlink();
+        // The heap entries of the timers stay on the source, so the timers are
+        // cancelled here and scheduled again on the target with their deadline
+        while( socket->timer_list_ != NULL ) {
+            detail::SocketTimer* old_timer = socket->timer_list_;
+            detail::SocketTimer* new_timer = new detail::SocketTimer();
+            new_timer->callback = old_timer->callback;
+            new_timer->deadline = old_timer->deadline;
+            new_timer->time = old_timer->time;
+            old_timer->Unlink();
+            old_timer->callback = NULL;
+            socket->io_manager_->OnSocketTimerCancelled();
+            timer.push_back( new_timer );
+        }
+        if( socket->listener_ != NULL ) {
+            socket->listener_->OnConnectionClosed();
+            socket->listener_ = NULL;
+        }
+        // From now on the socket belongs to the target thread
+        socket->io_manager_ = target;
+        detached = true;
+        target->Post( this );
+        return;
+    }
+
+    // On the target thread. Adding the fd reports its current readiness as
+    // a new edge, so no data that arrived meanwhile is missed
+    if( target->register_once() ) {
+        target->WatchSocket( socket );
+    } else {
+        if( is_epoll_read )
+            target->WatchRead( socket );
+        if( is_epoll_write )
+            target->WatchWrite( socket );
+    }
+    target->LinkSocket( socket );
+    if( socket->is_high_priority() )
+        target->dispatch_by_priority_ = true;
+    socket->ArmDeadline();
+    for( std::size_t i = 0 ; i < timer.size() ; ++i ) {
+        timer[i]->Link( &socket->timer_list_ );
+        target->AddSocketTimer( timer[i] );
+    }
+    if( callback != NULL ) {
+        detail::ScopePtr<detail::MigrateCallback> cb( callback );
+        cb->Invoke( socket );
+    }
+    delete this;
+}
+
 void Socket::OnReadNotify( ) {
     set_can_read(true);
+    if( UNLIKELY(relay_ != NULL) ) {
+        relay_->OnReadNotify( this );
+        return;
+    }
     // In order to not make the misbehavior program mess up our user space
     // memory. If we detect that the user has not registered any callback
     // function just leave the data inside of the kernel and put the states
-    // of current Pollable to readable
-    if( UNLIKELY(user_read_callback_.IsNull()) ) {
+    // of current Pollable to readable. A pending AsyncClose waits for the
+    // EOF through the close callback instead.
+    if( UNLIKELY(user_read_callback_.IsNull() && user_close_callback_.IsNull()) ) {
         return;
     } else {
         NetState state;
         std::size_t read_sz = DoRead(&state);
         if( LIKELY(state_ != CLOSING) ) {
+            // The read is done, the deadline node is unlinked lazily
+            read_deadline_ = 0;
             // Invoke the callback function
             DO_INVOKE( user_read_callback_ ,
                 detail::ScopePtr<detail::ReadCallback>,
@@ -278,28 +758,29 @@ void Socket::OnReadNotify( ) {
                 // We are in closing state, so it should be an asynchronous close
                 // We may still receive data here, we need to notify the user to
                 // consume the data here
+                detail::LivenessGuard guard(this);
                 if( UNLIKELY(read_sz > 0) ) {
                     user_close_callback_->InvokeData( read_sz );
-                } else {
-                    // Checking whether we hit eof during the last read
-                    if( eof_ ) {
-                        bool deleted = false;
-                        set_notify_flag( &deleted );
-                        detail::ScopePtr<detail::CloseCallback> cb( user_close_callback_.Release() );
-                        cb->InvokeClose(NetState());
-                        if( !deleted ) {
-                            Close();
-                            state_ = CLOSED;
-                        }
+                    if( guard.deleted() )
+                        return;
+                }
+                // Checking whether we hit eof during the last read. The EOF
+                // may come together with the data when the peer close has
+                // been reported by EPOLLRDHUP
+                if( eof_ ) {
+                    detail::ScopePtr<detail::CloseCallback> cb( user_close_callback_.Release() );
+                    cb->InvokeClose(NetState());
+                    if( !guard.deleted() ) {
+                        Close();
+                        state_ = CLOSED;
                     }
                 }
             } else {
-                bool deleted = false;
-                set_notify_flag( &deleted );
+                detail::LivenessGuard guard(this);
                 // We failed here, so we just go straitforward to issue an
                 // Close operation on the notifier and close the underlying socket
                 user_close_callback_->InvokeClose(state);
-                if( !deleted ) {
+                if( !guard.deleted() ) {
                     Close();
                     state_ = CLOSED;
                 }
@@ -311,6 +792,27 @@ void Socket::OnReadNotify( ) {
 void Socket::OnWriteNotify( ) {
     // Set up the can write flag
     set_can_write(true);
+    if( UNLIKELY(relay_ != NULL) ) {
+        relay_->OnWriteNotify( this );
+        return;
+    }
+    FlushWrite();
+}
+
+void Socket::FlushWrite() {
+    if( UNLIKELY(sendfile_left_ != 0) ) {
+        NetState state;
+        std::size_t write_sz = DoSendFile(&state);
+        if( !state || sendfile_left_ == 0 ) {
+            DO_INVOKE(user_write_callback_,
+                      detail::ScopePtr<detail::WriteCallback>,
+                      this,
+                      prev_write_size_ + write_sz , state );
+        } else {
+            prev_write_size_ += write_sz;
+        }
+        return;
+    }
     if( UNLIKELY(write_buffer().readable_size() == 0) ) {
         // We do nothing since we have nothing to write out
         return;
@@ -337,17 +839,28 @@ void Socket::OnWriteNotify( ) {
     }
 }
 
+void Socket::OnPeerCloseNotify( ) {
+    // Just mark the socket, the EOF is replayed by the following read. An
+    // idle socket without read callback is known to be dead at once.
+    peer_closed_ = true;
+}
+
 void Socket::OnException( const NetState& state ) {
     assert( !state );
-    bool deleted = false;
-    set_notify_flag( &deleted );
+    if( UNLIKELY(relay_ != NULL) ) {
+        relay_->OnException( state );
+        return;
+    }
+    read_deadline_ = 0;
+    sendfile_left_ = 0;
+    detail::LivenessGuard guard(this);
 
     if( LIKELY(!user_read_callback_.IsNull()) ) {
         DO_INVOKE(user_read_callback_,
                   detail::ScopePtr<detail::ReadCallback>,
                   this,0,state);
     }
-    if( !deleted ) {
+    if( !guard.deleted() ) {
         if( LIKELY(!user_write_callback_.IsNull()) ) {
             DO_INVOKE(user_write_callback_,
                     detail::ScopePtr<detail::WriteCallback>,
@@ -434,9 +947,17 @@ std::size_t Socket::DoRead( NetState* ok ) {
                     }
                 }
                 read_sz += sz;
+                Touch();
 
                 if( static_cast<std::size_t>(sz) < io_manager_->swap_buffer_size_ + accessor_sz ) {
-                    set_can_read(false);
+                    if( UNLIKELY(peer_closed_) ) {
+                        // The FIN has arrived before this read, so a short read
+                        // means everything before it has been drained. Replay
+                        // the EOF without issuing another readv
+                        eof_ = true;
+                    } else {
+                        set_can_read(false);
+                    }
                     return read_sz;
                 } else {
                     continue;
@@ -449,12 +970,24 @@ std::size_t Socket::DoRead( NetState* ok ) {
 std::size_t Socket::DoWrite( NetState* ok ) {
     assert( write_buffer().readable_size() > 0 );
     ok->Clear();
+    const bool is_limited = !rate_limit_.IsNull() || rate_limit_group_ != NULL;
+    std::size_t allowance = 0;
+    if( UNLIKELY(is_limited) ) {
+        allowance = WriteAllowance();
+        if( allowance == 0 ) {
+            ThrottleWrite();
+            return 0;
+        }
+    }
     do {
         // Start to write the data
         Buffer::Accessor accessor = write_buffer().GetReadAccessor();
+        std::size_t size = accessor.size();
+        if( UNLIKELY(is_limited) && allowance < size )
+            size = allowance;
 
         // Trying to send out the data to underlying TCP socket
-        ssize_t sz = ::write(fd(),accessor.address(),accessor.size());
+        ssize_t sz = ::write(fd(),accessor.address(),size);
 
         // Write can return zero which has same meaning with negative
         // value( I guess this is for historic reason ). What we gonna
@@ -476,15 +1009,67 @@ std::size_t Socket::DoWrite( NetState* ok ) {
             }
         } else {
             // Set up the committed size
-            if( static_cast<std::size_t>(sz) < accessor.size() ) {
+            if( static_cast<std::size_t>(sz) < size ) {
                 set_can_write(false);
             }
             accessor.set_committed_size( static_cast<std::size_t>(sz) );
+            Touch();
+            if( UNLIKELY(is_limited) ) {
+                ChargeWrite( static_cast<std::size_t>(sz) );
+                // The kernel would take more, wait for the tokens
+                if( static_cast<std::size_t>(sz) == size && size < accessor.size() )
+                    ThrottleWrite();
+            }
             return static_cast<std::size_t>(sz);
         }
     } while(true);
 }
 
+std::size_t Socket::DoSendFile( NetState* ok ) {
+    ok->Clear();
+    std::size_t sent = 0;
+    // The bytes in the write buffer go out ahead of the file
+    while( write_buffer().readable_size() != 0 ) {
+        std::size_t sz = DoWrite( ok );
+        if( !*ok )
+            return sent;
+        sent += sz;
+        if( !can_write() || is_throttled_ )
+            return sent;
+    }
+    const bool is_limited = !rate_limit_.IsNull() || rate_limit_group_ != NULL;
+    while( sendfile_left_ != 0 ) {
+        std::size_t count = sendfile_left_;
+        if( UNLIKELY(is_limited) ) {
+            const std::size_t allowance = WriteAllowance();
+            if( allowance == 0 ) {
+                ThrottleWrite();
+                return sent;
+            }
+            count = std::min( count , allowance );
+        }
+        ssize_t sz = ::sendfile( fd() , sendfile_fd_ , &sendfile_offset_ , count );
+        if( LIKELY(sz > 0) ) {
+            sendfile_left_ -= static_cast<std::size_t>(sz);
+            sent += static_cast<std::size_t>(sz);
+            Touch();
+            if( UNLIKELY(is_limited) )
+                ChargeWrite( static_cast<std::size_t>(sz) );
+        } else if( sz == 0 ) {
+            // The file is shorter than the size to send
+            sendfile_left_ = 0;
+            ok->CheckPoint(state_category::kSystem,EIO);
+        } else if( errno == EAGAIN || errno == EWOULDBLOCK ) {
+            set_can_write(false);
+            return sent;
+        } else if( errno != EINTR ) {
+            sendfile_left_ = 0;
+            ok->CheckPoint(state_category::kSystem,errno);
+        }
+    }
+    return sent;
+}
+
 void Socket::GetLocalEndpoint( Endpoint* endpoint ) {
     struct sockaddr_in ipv4;
     bzero(&ipv4,sizeof(ipv4));
@@ -513,6 +1098,183 @@ void Socket::GetPeerEndpoint( Endpoint* endpoint ) {
     endpoint->set_ipv4( ntohl(ipv4.sin_addr.s_addr) );
 }
 
+int Socket::GetIncomingCpu() const {
+    int cpu = -1;
+    socklen_t len = sizeof(cpu);
+    if( ::getsockopt(fd(),SOL_SOCKET,SO_INCOMING_CPU,&cpu,&len) != 0 )
+        return -1;
+    return cpu;
+}
+
+bool Relay::Setup( Socket* a , Socket* b ) {
+    assert( a->io_manager_ == b->io_manager_ );
+    assert( a->relay_ == NULL && b->relay_ == NULL );
+    channel_[0].Clear();
+    channel_[1].Clear();
+    for( int i = 0 ; i < 2 ; ++i ) {
+        Channel* c = &channel_[i];
+        if( UNLIKELY(::pipe2( c->pipe , O_NONBLOCK | O_CLOEXEC ) != 0) ) {
+            if( i == 1 ) {
+                ::close( channel_[0].pipe[0] );
+                ::close( channel_[0].pipe[1] );
+                channel_[0].pipe[0] = channel_[0].pipe[1] = -1;
+            }
+            return false;
+        }
+        // Ignore the failure, the pipe keeps the size of the system then
+        if( pipe_size_ != 0 )
+            ::fcntl( c->pipe[1] , F_SETPIPE_SZ , static_cast<int>(pipe_size_) );
+        c->capacity = static_cast<std::size_t>( ::fcntl( c->pipe[1] , F_GETPIPE_SZ ) );
+    }
+
+    channel_[0].from = channel_[1].to = a;
+    channel_[0].to = channel_[1].from = b;
+    for( int i = 0 ; i < 2 ; ++i ) {
+        Channel* c = &channel_[i];
+        // The bytes read before the relay started are written out before the
+        // spliced ones. It is the only copy the relay makes
+        std::size_t sz = c->from->read_buffer().readable_size();
+        if( sz != 0 )
+            c->to->write_buffer().Write( c->from->read_buffer().Read(&sz) , sz );
+        c->eof = c->from->eof_;
+        c->from->relay_ = this;
+    }
+    IOManager* io_manager = a->io_manager_;
+    io_manager->WatchRead( a );
+    io_manager->WatchWrite( a );
+    io_manager->WatchRead( b );
+    io_manager->WatchWrite( b );
+    is_running_ = true;
+    return true;
+}
+
+void Relay::Stop() {
+    if( !is_running_ )
+        return;
+    for( int i = 0 ; i < 2 ; ++i ) {
+        Channel* c = &channel_[i];
+        c->from->relay_ = NULL;
+        ::close( c->pipe[0] );
+        ::close( c->pipe[1] );
+        c->pipe[0] = c->pipe[1] = -1;
+        c->pending = 0;
+    }
+    is_running_ = false;
+    user_relay_callback_.Reset( NULL );
+}
+
+bool Relay::FlushBuffer( Channel* c , NetState* state ) {
+    Socket* to = c->to;
+    while( to->can_write() && to->write_buffer().readable_size() != 0 ) {
+        Buffer::Accessor accessor = to->write_buffer().GetReadAccessor();
+        ssize_t sz = ::write( to->fd() , accessor.address() , accessor.size() );
+        if( LIKELY(sz > 0) ) {
+            accessor.set_committed_size( static_cast<std::size_t>(sz) );
+            c->bytes += static_cast<uint64_t>(sz);
+            to->Touch();
+        } else if( errno == EAGAIN || errno == EWOULDBLOCK ) {
+            to->set_can_write(false);
+        } else if( errno != EINTR ) {
+            state->CheckPoint(state_category::kSystem,errno);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Relay::Pump( Channel* c , NetState* state ) {
+    Socket* from = c->from;
+    Socket* to = c->to;
+    bool progress;
+    do {
+        progress = false;
+        if( UNLIKELY(to->write_buffer().readable_size() != 0) ) {
+            if( !FlushBuffer( c , state ) )
+                return false;
+            if( to->write_buffer().readable_size() != 0 )
+                return true;
+        }
+
+        // Drain the pipe into the other socket
+        if( c->pending != 0 && to->can_write() ) {
+            ssize_t sz = ::splice( c->pipe[0] , NULL , to->fd() , NULL , c->pending ,
+                                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+            if( LIKELY(sz > 0) ) {
+                c->pending -= static_cast<std::size_t>(sz);
+                c->bytes += static_cast<uint64_t>(sz);
+                to->Touch();
+                progress = true;
+            } else if( sz < 0 ) {
+                if( errno == EAGAIN ) {
+                    to->set_can_write(false);
+                } else if( errno == EINTR ) {
+                    progress = true;
+                } else {
+                    state->CheckPoint(state_category::kSystem,errno);
+                    return false;
+                }
+            }
+        }
+
+        // Fill the pipe from the source socket
+        if( !c->eof && c->pending < c->capacity && from->can_read() ) {
+            ssize_t sz = ::splice( from->fd() , NULL , c->pipe[1] , NULL ,
+                                   c->capacity - c->pending ,
+                                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+            if( LIKELY(sz > 0) ) {
+                c->pending += static_cast<std::size_t>(sz);
+                from->Touch();
+                progress = true;
+            } else if( sz == 0 ) {
+                c->eof = from->eof_ = true;
+                progress = true;
+            } else if( errno == EAGAIN ) {
+                // The pipe takes pages rather than bytes, so with bytes in it the
+                // pipe may be full instead of the socket being empty. The socket
+                // stays readable until it is tried with an empty pipe
+                if( c->pending == 0 )
+                    from->set_can_read(false);
+            } else if( errno == EINTR ) {
+                progress = true;
+            } else {
+                state->CheckPoint(state_category::kSystem,errno);
+                return false;
+            }
+        }
+
+        // Forward the EOF once everything before it has been written
+        if( c->eof && c->pending == 0 && !c->done ) {
+            ::shutdown( to->fd() , SHUT_WR );
+            c->done = true;
+        }
+    } while( progress );
+    return true;
+}
+
+void Relay::Run( Channel* c ) {
+    NetState state;
+    if( UNLIKELY(!Pump( c , &state )) ) {
+        Finish( state );
+    } else if( channel_[0].done && channel_[1].done ) {
+        Finish( NetState() );
+    }
+}
+
+void Relay::RunBoth() {
+    NetState state;
+    if( UNLIKELY(!Pump( &channel_[0] , &state ) || !Pump( &channel_[1] , &state )) ) {
+        Finish( state );
+    } else if( channel_[0].done && channel_[1].done ) {
+        Finish( NetState() );
+    }
+}
+
+void Relay::Finish( const NetState& state ) {
+    detail::ScopePtr<detail::RelayCallback> cb( user_relay_callback_.Release() );
+    Stop();
+    cb->Invoke( this , state );
+}
+
 void ClientSocket::OnReadNotify( ) {
     if( LIKELY(state_ == CONNECTED) ) {
         Socket::OnReadNotify();
@@ -526,7 +1288,11 @@ void ClientSocket::OnReadNotify( ) {
                 return;
             case CONNECTING:
                 // Read, for connecting, the read information is unrelated
-                // even if we receive it( we should not ), we just ignore
+                // even if we receive it( we should not ), we just ignore.
+                // The data may come in the same event with the connection
+                // completion when both directions are watched, so keep the
+                // readable state to not lose the edge
+                set_can_read(true);
                 return;
             default:
                 UNREACHABLE(return);
@@ -542,6 +1308,7 @@ void ClientSocket::OnWriteNotify() {
         if( state_ == CONNECTING ) {
             set_can_write(true);
             state_ = CONNECTED;
+            io_manager()->LinkSocket(this);
             DO_INVOKE(user_conn_callback_,
                       detail::ScopePtr<detail::ConnectCallback>,
                       this,NetState());
@@ -574,6 +1341,15 @@ bool ServerSocket::Bind( const Endpoint& endpoint ) {
     }
     set_fd( sock_fd );
 
+    if( reuse_port_ ) {
+        int tag = 1;
+        if( UNLIKELY(::setsockopt(fd(),SOL_SOCKET,SO_REUSEPORT,&tag,sizeof(tag)) != 0) ) {
+            ::close(fd());
+            set_fd(-1);
+            return false;
+        }
+    }
+
     // Set up the struct sockaddr_in
     struct sockaddr_in ipv4;
     bzero(&ipv4,sizeof(ipv4));
@@ -603,24 +1379,149 @@ bool ServerSocket::Bind( const Endpoint& endpoint ) {
     return true;
 }
 
-void ServerSocket::HandleRunOutOfFD( int err ) {
-    // Handling the run out of file descriptors error here, if we
-    // don't kernel will not free any resource but continue bothering
-    // us for this problem.
-    switch( err ) {
-        case EMFILE:
-        case ENFILE: {
-            int f;
-            // Run out the file descriptors and gracefully shutdown the peer side
-            VERIFY( ::close( dummy_fd_ ) == 0 );
-            f = ::accept(fd(),NULL,NULL);
-            if( f > 0 )
-                VERIFY( ::close( f ) == 0 );
-            VERIFY( (dummy_fd_ = ::open("/dev/null",O_RDONLY)) >= 0 );
-        } 
-        default: return;
+bool ServerSocket::SteerByIncomingCpu( std::size_t group_size ) {
+    assert( is_bind_ && reuse_port_ );
+    assert( group_size > 0 );
+    // A = the cpu that handles the packet ; A = A % group_size ; return A
+    struct sock_filter code[] = {
+        { BPF_LD  | BPF_W | BPF_ABS , 0 , 0 , static_cast<uint32_t>(SKF_AD_OFF + SKF_AD_CPU) },
+        { BPF_ALU | BPF_MOD | BPF_K , 0 , 0 , static_cast<uint32_t>(group_size) },
+        { BPF_RET | BPF_A , 0 , 0 , 0 }
+    };
+    struct sock_fprog prog;
+    prog.len = sizeof(code)/sizeof(code[0]);
+    prog.filter = code;
+    return ::setsockopt( fd() , SOL_SOCKET , SO_ATTACH_REUSEPORT_CBPF ,
+                         &prog , sizeof(prog) ) == 0;
+}
+
+bool ServerSocket::Adopt( int fd ) {
+    assert( is_bind_ == false );
+    if( UNLIKELY(fd < 0) )
+        return false;
+    int flag = ::fcntl(fd,F_GETFL);
+    if( UNLIKELY(flag < 0) )
+        return false;
+    ::fcntl(fd,F_SETFL,flag | O_NONBLOCK);
+    ::fcntl(fd,F_SETFD,FD_CLOEXEC);
+    set_fd( fd );
+    is_bind_ = true;
+    return true;
+}
+
+bool ServerSocket::ShareFrom( const ServerSocket& listener ) {
+    assert( listener.is_bind_ );
+    int fd = ::fcntl( listener.fd() , F_DUPFD_CLOEXEC , 0 );
+    if( UNLIKELY(fd < 0) )
+        return false;
+    if( !Adopt(fd) ) {
+        ::close(fd);
+        return false;
+    }
+    return true;
+}
+
+void ServerSocket::SetAcceptRate( double rate , std::size_t burst ) {
+    accept_rate_ = rate;
+    accept_burst_ = burst == 0 ? 1 : static_cast<double>(burst);
+    tokens_ = accept_burst_;
+    last_refill_ = io_manager_ == NULL ? 0 : io_manager_->Now();
+}
+
+bool ServerSocket::Admit() {
+    if( UNLIKELY(is_paused_) )
+        return false;
+
+    if( max_connection_ != 0 && active_connection_ >= max_connection_ ) {
+        // Resumed when an accepted socket gets closed
+        Pause( SHED_MAX_CONNECTION , 0 );
+        return false;
+    }
+
+    if( max_queue_delay_ != 0 && io_manager_->loop_delay() > max_queue_delay_ ) {
+        // The loop is too busy to serve its existing connections, give it
+        // a break before taking more
+        Pause( SHED_QUEUE_DELAY , max_queue_delay_ );
+        return false;
+    }
+
+    if( accept_rate_ > 0 ) {
+        const uint64_t now = io_manager_->Now();
+        tokens_ += static_cast<double>(now - last_refill_) * accept_rate_ / 1000000;
+        if( tokens_ > accept_burst_ )
+            tokens_ = accept_burst_;
+        last_refill_ = now;
+        if( tokens_ < 1 ) {
+            // Wait until the next token is available
+            Pause( SHED_ACCEPT_RATE ,
+                   static_cast<uint64_t>( (1 - tokens_) * 1000000 / accept_rate_ ) + 1 );
+            return false;
+        }
+    }
+    return true;
+}
+
+void ServerSocket::Pause( int reason , uint64_t backoff ) {
+    assert( !is_paused_ );
+    // Removing the listen fd from epoll keeps the pending connections in
+    // the backlog, and we will not be waken up by them anymore
+    io_manager_->Unwatch( this );
+    is_paused_ = true;
+    ++stats_.shed[reason];
+
+    if( backoff != 0 && resume_notifier_ == NULL ) {
+        resume_notifier_ = new ResumeNotifier();
+        resume_notifier_->server = this;
+        io_manager_->ScheduleInUS( backoff , resume_notifier_ );
+    }
+
+    if( !shed_callback_.IsNull() )
+        shed_callback_->Invoke( this , reason );
+}
+
+void ServerSocket::Resume() {
+    if( !is_paused_ || is_stopped_ )
+        return;
+    is_paused_ = false;
+    // Adding the fd back with edge trigger reports the connections that
+    // are pending in the backlog at once
+    if( !user_accept_callback_.IsNull() )
+        io_manager_->WatchRead( this );
+}
+
+void ServerSocket::StopAccept() {
+    if( !is_paused_ ) {
+        io_manager_->Unwatch( this );
+        is_paused_ = true;
+    }
+    is_stopped_ = true;
+}
+
+void ServerSocket::ResumeNotifier::OnTimeout( int msec ) {
+    if( server != NULL ) {
+        server->resume_notifier_ = NULL;
+        server->Resume();
+    }
+    delete this;
+}
+
+void ServerSocket::SetupConnection( Socket* socket ) {
+    ++stats_.accepted;
+    socket->io_manager_->WatchSocket( socket );
+    socket->io_manager_->LinkSocket( socket );
+    if( max_connection_ != 0 ) {
+        socket->listener_ = this;
+        ++active_connection_;
+    }
+}
+
+void ServerSocket::OnConnectionClosed() {
+    assert( active_connection_ > 0 );
+    --active_connection_;
+    if( is_paused_ && resume_notifier_ == NULL &&
+        active_connection_ < max_connection_ ) {
+        Resume();
     }
-    UNREACHABLE(return);
 }
 
 int ServerSocket::DoAccept( NetState* state ) {
@@ -632,17 +1533,24 @@ int ServerSocket::DoAccept( NetState* state ) {
                 set_can_read(false);
                 return -1;
             } else {
-                if( errno == EINTR ) 
-                    continue;
-                int err = errno;
-                HandleRunOutOfFD( err );
-                state->CheckPoint(state_category::kSystem,err);
-                if( errno == EAGAIN || errno == EWOULDBLOCK ) {
-                    set_can_read(false);
+                switch( errno ) {
+                    case EINTR:
+                        continue;
+                    case EMFILE:
+                    case ENFILE:
+                        // Run out of the file descriptors. Keep the connections
+                        // in the backlog and retry later instead of spinning on
+                        // the listen fd
+                        Pause( SHED_RUN_OUT_OF_FD , kRunOutOfFDBackoff );
+                        return -1;
+                    default:
+                        state->CheckPoint(state_category::kSystem,errno);
+                        return -1;
                 }
-                return -1;
             }
         } else {
+            if( accept_rate_ > 0 )
+                tokens_ -= 1;
             return nfd;
         }
     } while( true );
@@ -654,6 +1562,9 @@ void ServerSocket::OnReadNotify() {
     if( UNLIKELY(user_accept_callback_.IsNull()) )
         return;
     else {
+        if( UNLIKELY(!Admit()) )
+            return;
+
         NetState accept_state;
 
         int nfd = DoAccept(&accept_state);
@@ -667,6 +1578,7 @@ void ServerSocket::OnReadNotify() {
         } else {
             detail::Pollable* p = static_cast<detail::Pollable*>(new_accept_socket_);
             p->set_fd( nfd );
+            SetupConnection( new_accept_socket_ );
 
             // Temporarily store the new_accept_socket_ to enable user seting it during
             // the invocation of the user_accept_callback_ function
@@ -682,7 +1594,6 @@ void ServerSocket::OnReadNotify() {
 }
 
 void ServerSocket::OnException( const NetState& state ) {
-    HandleRunOutOfFD( state.error_code() );
     // We have an exception on the listener socket file descriptor
     if( !user_accept_callback_.IsNull() ) {
         DO_INVOKE( user_accept_callback_ ,
@@ -694,21 +1605,202 @@ void ServerSocket::OnException( const NetState& state ) {
 ServerSocket::ServerSocket() :
     new_accept_socket_(NULL),
     io_manager_(NULL),
-    is_bind_( false )
+    max_connection_(0),
+    accept_rate_(0),
+    accept_burst_(0),
+    max_queue_delay_(0),
+    tokens_(0),
+    last_refill_(0),
+    active_connection_(0),
+    resume_notifier_(NULL),
+    is_bind_( false ),
+    is_paused_( false ),
+    is_stopped_( false ),
+    reuse_port_( false )
 {
-    // Initialize the dummy_fd_ here
-    dummy_fd_ = ::open("/dev/null", O_RDONLY );
-    VERIFY( dummy_fd_ >= 0 );
+    bzero(&stats_,sizeof(stats_));
 }
 
 ServerSocket::~ServerSocket() {
     // Closing the listen fd
-    VERIFY( ::close(fd()) == 0 );
-    set_fd(-1);
-    ::close( dummy_fd_ );
+    if( fd() >= 0 ) {
+        VERIFY( ::close(fd()) == 0 );
+        set_fd(-1);
+    }
+    // The pending resume timer will find out we are gone
+    if( resume_notifier_ != NULL )
+        resume_notifier_->server = NULL;
+    if( io_manager_ != NULL ) {
+        std::vector<ServerSocket*>& listener = io_manager_->listener_;
+        listener.erase( std::remove( listener.begin() , listener.end() , this ) ,
+                        listener.end() );
+    }
 }
 
-IOManager::IOManager( std::size_t cap ) {
+void FdWatcher::Attach( int fd , int trigger ) {
+    assert( !Valid() );
+    set_fd( fd );
+    trigger_ = trigger;
+    set_can_read(false);
+    set_can_write(false);
+    if( trigger_ == EDGE_TRIGGER ) {
+        // Registered once, an edge nobody waits for is remembered instead
+        io_manager_->WatchFd( this , true , true , true );
+    } else {
+        UpdateInterest();
+    }
+}
+
+int FdWatcher::Detach() {
+    io_manager_->Unwatch( this );
+    user_readable_callback_.Reset( NULL );
+    user_writable_callback_.Reset( NULL );
+    int ret = fd();
+    set_fd(-1);
+    return ret;
+}
+
+void FdWatcher::Close() {
+    // Ignore the close return status
+    ::close( Detach() );
+}
+
+void FdWatcher::UpdateInterest() {
+    io_manager_->WatchFd( this ,
+                          !user_readable_callback_.IsNull() ,
+                          !user_writable_callback_.IsNull() ,
+                          false );
+}
+
+void FdWatcher::OnReadNotify() {
+    if( user_readable_callback_.IsNull() ) {
+        if( trigger_ == EDGE_TRIGGER ) {
+            set_can_read(true);
+        } else {
+            // Nobody waits anymore, stop the level trigger from repeating
+            UpdateInterest();
+        }
+        return;
+    }
+    set_can_read(false);
+    DO_INVOKE(user_readable_callback_,
+              detail::ScopePtr<detail::WatchCallback>,
+              this,NetState());
+}
+
+void FdWatcher::OnWriteNotify() {
+    if( user_writable_callback_.IsNull() ) {
+        if( trigger_ == EDGE_TRIGGER ) {
+            set_can_write(true);
+        } else {
+            UpdateInterest();
+        }
+        return;
+    }
+    set_can_write(false);
+    DO_INVOKE(user_writable_callback_,
+              detail::ScopePtr<detail::WatchCallback>,
+              this,NetState());
+}
+
+void FdWatcher::OnException( const NetState& state ) {
+    assert( !state );
+    detail::LivenessGuard guard(this);
+
+    if( !user_readable_callback_.IsNull() ) {
+        DO_INVOKE(user_readable_callback_,
+                  detail::ScopePtr<detail::WatchCallback>,
+                  this,state);
+    }
+    if( !guard.deleted() && !user_writable_callback_.IsNull() ) {
+        DO_INVOKE(user_writable_callback_,
+                  detail::ScopePtr<detail::WatchCallback>,
+                  this,state);
+    }
+}
+
+SignalWatcher::~SignalWatcher() {
+    if( watcher_.Valid() )
+        watcher_.Close();
+}
+
+bool SignalWatcher::Add( int signo ) {
+    sigaddset( &mask_ , signo );
+    if( ::pthread_sigmask( SIG_BLOCK , &mask_ , NULL ) != 0 )
+        return false;
+    // Updating the mask of an existing signalfd keeps it registered
+    const int fd = ::signalfd( watcher_.Valid() ? watcher_.fd() : -1 ,
+                               &mask_ , SFD_NONBLOCK | SFD_CLOEXEC );
+    if( fd < 0 )
+        return false;
+    if( !watcher_.Valid() ) {
+        watcher_.Attach( fd );
+        watcher_.AsyncWaitReadable( &reader_ );
+    }
+    return true;
+}
+
+void SignalWatcher::ReadSignal() {
+    struct signalfd_siginfo info[8];
+    while( true ) {
+        ssize_t ret = ::read( watcher_.fd() , info , sizeof(info) );
+        if( ret <= 0 ) {
+            // EAGAIN, the signalfd is drained and the next edge can arrive
+            assert( ret < 0 );
+            return;
+        }
+        const std::size_t count = static_cast<std::size_t>(ret) / sizeof(info[0]);
+        for( std::size_t i = 0 ; i < count ; ++i ) {
+            pending_signal_.push_back( static_cast<int>(info[i].ssi_signo) );
+        }
+    }
+}
+
+void SignalWatcher::Reader::OnReadable( FdWatcher* fd_watcher , const NetState& ok ) {
+    watcher->ReadSignal();
+    fd_watcher->AsyncWaitReadable( this );
+    if( !watcher->user_signal_callback_.IsNull() && !watcher->pending_signal_.empty() ) {
+        int signo = watcher->pending_signal_.front();
+        watcher->pending_signal_.pop_front();
+        DO_INVOKE(watcher->user_signal_callback_,
+                  detail::ScopePtr<detail::SignalCallback>,
+                  signo);
+    }
+}
+
+IOManager::IOManager( std::size_t cap ) :
+    timer_fd_deadline_(0),
+#ifdef SYS_epoll_pwait2
+    use_epoll_pwait2_(true),
+#else
+    use_epoll_pwait2_(false),
+#endif // SYS_epoll_pwait2
+    now_( detail::GetCurrentTimeInUS() ),
+    timer_slack_( kDefaultTimerSlack ),
+    loop_delay_(0),
+    epoll_ctl_count_(0),
+    wakeup_count_(0),
+    event_queue_( kEpollEventLength ),
+    in_iteration_(false),
+    place_event_queue_(false),
+    fixed_event_batch_(0),
+    shrink_counter_(0),
+    prefetch_distance_( kDefaultPrefetchDistance ),
+    dispatch_budget_(0),
+    dispatch_by_priority_(false),
+    register_once_(false),
+    cpu_(-1),
+    numa_node_(-1),
+    has_loop_thread_(false),
+    has_posted_task_(false),
+    sleeping_(0),
+    is_draining_(false),
+    drain_deadline_(0),
+    cancelled_timer_(0),
+    swap_buffer_mapped_(false)
+{
+    VERIFY( ::pthread_mutex_init( &task_lock_ , NULL ) == 0 );
+
     epoll_fd_ = ::epoll_create1( EPOLL_CLOEXEC );
     VERIFY( epoll_fd_ > 0 );
 
@@ -721,7 +1813,7 @@ IOManager::IOManager( std::size_t cap ) {
     int flag = ::fcntl(fd,F_GETFL);
     flag |= O_CLOEXEC;
     flag |= O_NONBLOCK;
-    ::fcntl(fd,F_SETFL);
+    ::fcntl(fd,F_SETFL,flag);
 
     // Setup the bind for the control file descriptor
     struct sockaddr_in ipv4;
@@ -743,20 +1835,383 @@ IOManager::IOManager( std::size_t cap ) {
     swap_buffer_ = malloc(cap);
     swap_buffer_size_ = cap;
 
+    deadline_wheel_.Reset( now_ );
+    live_socket_.prev = live_socket_.next = &live_socket_;
+
 }
 
 IOManager::~IOManager() {
     if( epoll_fd_ > 0 ) {
         ::close(ctrl_fd_.fd_);
         ctrl_fd_.set_fd(-1);
+        if( timer_fd_.fd_ >= 0 ) {
+            ::close(timer_fd_.fd_);
+            timer_fd_.set_fd(-1);
+        }
         ::close(epoll_fd_);
     }
     // Check if we have timer queue problem
     for( std::size_t i = 0 ; i < timer_queue_.size() ; ++i ) {
-        delete timer_queue_[i].callback;
+        detail::SocketTimer* owner = timer_queue_[i].owner;
+        if( owner != NULL ) {
+            owner->Unlink();
+            delete owner->callback;
+            delete owner;
+        } else {
+            delete timer_queue_[i].callback;
+        }
+    }
+    // The pollables outliving us must not touch the deferred ready list
+    for( std::size_t i = 0 ; i < deferred_event_.size() ; ++i ) {
+        if( deferred_event_[i].data.ptr != NULL )
+            static_cast<detail::Pollable*>(deferred_event_[i].data.ptr)->deferred_event_ = NULL;
+    }
+    // The posted notifiers that never get a chance to run
+    for( std::size_t i = 0 ; i < posted_task_.size() ; ++i ) {
+        delete posted_task_[i];
+    }
+    ::pthread_mutex_destroy( &task_lock_ );
+
+    if( swap_buffer_mapped_ )
+        ::munmap(swap_buffer_,swap_buffer_size_);
+    else
+        free(swap_buffer_);
+}
+
+bool IOManager::PinToCpu( int cpu ) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu,&set);
+    if( ::pthread_setaffinity_np( ::pthread_self() , sizeof(set) , &set ) != 0 )
+        return false;
+    cpu_ = cpu;
+    return true;
+}
+
+bool IOManager::PlaceOnLocalNode() {
+#if defined(SYS_getcpu) && defined(SYS_mbind)
+    unsigned cpu , node;
+    if( ::syscall( SYS_getcpu , &cpu , &node , NULL ) != 0 )
+        return false;
+
+    void* mem = ::mmap( NULL , swap_buffer_size_ , PROT_READ | PROT_WRITE ,
+                        MAP_PRIVATE | MAP_ANONYMOUS , -1 , 0 );
+    if( mem == MAP_FAILED )
+        return false;
+
+    // The mbind may fail without NUMA support in kernel, then the first touch
+    // below still places the pages on the node of this thread
+    static const std::size_t kMaxNode = 1024;
+    static const std::size_t kBitsPerWord = sizeof(unsigned long) * 8;
+    unsigned long mask[kMaxNode / kBitsPerWord];
+    memset(mask,0,sizeof(mask));
+    if( node < kMaxNode ) {
+        mask[node / kBitsPerWord] |= 1UL << (node % kBitsPerWord);
+        ::syscall( SYS_mbind , mem , swap_buffer_size_ , MPOL_PREFERRED ,
+                   mask , kMaxNode , 0 );
     }
+    memset(mem,0,swap_buffer_size_);
+
+    if( swap_buffer_mapped_ )
+        ::munmap(swap_buffer_,swap_buffer_size_);
+    else
+        free(swap_buffer_);
+    swap_buffer_ = mem;
+    swap_buffer_mapped_ = true;
+
+    // Reallocate the event queue from this thread. A notifier is called while
+    // the DispatchLoop still walks the queue, so it is left to the next
+    // iteration then
+    if( in_iteration_ )
+        place_event_queue_ = true;
+    else
+        PlaceEventQueue();
+
+    numa_node_ = static_cast<int>(node);
+    return true;
+#else
+    return false;
+#endif // SYS_getcpu && SYS_mbind
+}
 
-    free(swap_buffer_);
+void IOManager::PlaceEventQueue() {
+    std::vector<struct epoll_event> queue( event_queue_.size() );
+    event_queue_.swap(queue);
+    place_event_queue_ = false;
+}
+
+void IOManager::DoDrain( int timeout_ms , detail::DrainCallback* callback ) {
+    DrainTask* task = new DrainTask();
+    task->io_manager = this;
+    task->timeout = static_cast<uint64_t>(timeout_ms) * 1000;
+    task->callback = callback;
+    Post( task );
+}
+
+void IOManager::DrainTask::OnPost() {
+    io_manager->StartDrain( timeout , callback );
+    delete this;
+}
+
+void IOManager::DrainNotifier::OnTimeout( int msec ) {
+    if( io_manager->CheckDrain() || io_manager->now_ >= io_manager->drain_deadline_ ) {
+        io_manager->FinishDrain();
+        delete this;
+        return;
+    }
+    io_manager->Schedule( kDrainCheckInterval , this );
+}
+
+void IOManager::StartDrain( uint64_t timeout , detail::DrainCallback* callback ) {
+    if( is_draining_ ) {
+        delete callback;
+        return;
+    }
+    is_draining_ = true;
+    drain_callback_.Reset( callback );
+    drain_deadline_ = now_ + timeout;
+    for( std::size_t i = 0 ; i < listener_.size() ; ++i ) {
+        listener_[i]->StopAccept();
+    }
+    if( CheckDrain() ) {
+        FinishDrain();
+        return;
+    }
+    DrainNotifier* notifier = new DrainNotifier();
+    notifier->io_manager = this;
+    Schedule( kDrainCheckInterval , notifier );
+}
+
+bool IOManager::CheckDrain() {
+    bool done = true;
+    for( detail::SocketLink* link = live_socket_.next ; link != &live_socket_ ;
+         link = link->next ) {
+        Socket* socket = link->socket;
+        // A response still computed on the OffloadPool is not written yet,
+        // so the socket is neither shutdown nor drained
+        if( socket->pending_offload_ != 0 ) {
+            done = false;
+            continue;
+        }
+        if( !socket->drain_shutdown_ ) {
+            // A socket closed by AsyncClose has been shutdown already
+            if( socket->state_ == Socket::CLOSING ) {
+                socket->drain_shutdown_ = true;
+            } else if( socket->write_buffer_.readable_size() == 0 &&
+                       socket->user_write_callback_.IsNull() ) {
+                ::shutdown( socket->fd() , SHUT_WR );
+                socket->drain_shutdown_ = true;
+                // Watching read reports the FIN of the peer with EPOLLRDHUP
+                WatchRead( socket );
+            }
+        }
+        if( !socket->drain_shutdown_ || !socket->is_peer_closed() )
+            done = false;
+    }
+    return done;
+}
+
+void IOManager::FinishDrain() {
+    const NetState shutdown(state_category::kSystem,ESHUTDOWN);
+    // User may delete any socket inside of the notification, so always
+    // take the head of the list
+    while( live_socket_.next != &live_socket_ ) {
+        Socket* socket = live_socket_.next->socket;
+        socket->live_link_.Unlink();
+        const bool clean = socket->drain_shutdown_ && socket->is_peer_closed();
+        if( clean )
+            ++drain_stats_.clean;
+        else
+            ++drain_stats_.forced;
+        const NetState state = clean ? NetState() : shutdown;
+        if( socket->state_ == Socket::CLOSING ) {
+            // An AsyncClose is pending, its close callback is the only
+            // notifier the owner waits for
+            detail::ScopePtr<detail::CloseCallback> cb( socket->user_close_callback_.Release() );
+            socket->Close();
+            socket->state_ = Socket::CLOSED;
+            cb->InvokeClose( state );
+            continue;
+        }
+        detail::LivenessGuard guard(socket);
+        if( !clean || socket->relay_ != NULL ) {
+            socket->OnException( shutdown );
+        } else if( !socket->user_read_callback_.IsNull() ) {
+            // The peer closed a flushed socket, the pending read sees the EOF
+            socket->read_deadline_ = 0;
+            DO_INVOKE(socket->user_read_callback_,
+                      detail::ScopePtr<detail::ReadCallback>,
+                      socket,0,state);
+        }
+        if( !guard.deleted() && socket->Valid() && socket->state_ != Socket::CLOSED ) {
+            socket->Close();
+            if( !drain_callback_.IsNull() )
+                drain_callback_->Invoke( socket , state );
+        }
+    }
+    drain_callback_.Reset( NULL );
+    // Make the RunMainLoop return at the end of this iteration
+    ctrl_fd_.set_is_wake_up( true );
+}
+
+bool IOManager::GetCpuTime( uint64_t* usec ) const {
+    if( !has_loop_thread_ )
+        return false;
+    struct timespec ts;
+    if( ::clock_gettime( loop_clock_ , &ts ) != 0 )
+        return false;
+    *usec = static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+    return true;
+}
+
+void IOManager::AddPostedTask( detail::PostCallback* cb ) {
+    VERIFY( ::pthread_mutex_lock( &task_lock_ ) == 0 );
+    const bool was_empty = posted_task_.empty();
+    posted_task_.push_back( cb );
+    has_posted_task_ = true;
+    ::pthread_mutex_unlock( &task_lock_ );
+
+    // The loop checks the queue before it blocks again, so only a post to an
+    // empty queue from another thread needs to wake it up
+    if( was_empty &&
+        !(has_loop_thread_ && ::pthread_equal( loop_thread_ , ::pthread_self() )) )
+        SendCtrlData();
+}
+
+void IOManager::ExecutePostedTasks() {
+    std::vector<detail::PostCallback*> tasks;
+    while( has_posted_task_ ) {
+        VERIFY( ::pthread_mutex_lock( &task_lock_ ) == 0 );
+        tasks.swap( posted_task_ );
+        has_posted_task_ = false;
+        ::pthread_mutex_unlock( &task_lock_ );
+
+        for( std::size_t i = 0 ; i < tasks.size() ; ++i ) {
+            detail::ScopePtr<detail::PostCallback> cb( tasks[i] );
+            cb->Invoke();
+        }
+        tasks.clear();
+    }
+}
+
+void IOManager::AddInboundRing( detail::MessageRing* ring ) {
+    inbound_ring_.push_back( ring );
+}
+
+void IOManager::RemoveMessageRing( detail::MessageRing* ring ) {
+    inbound_ring_.erase( std::remove( inbound_ring_.begin() , inbound_ring_.end() , ring ) ,
+                         inbound_ring_.end() );
+    backlog_ring_.erase( std::remove( backlog_ring_.begin() , backlog_ring_.end() , ring ) ,
+                         backlog_ring_.end() );
+}
+
+void IOManager::AddBacklogRing( detail::MessageRing* ring ) {
+    backlog_ring_.push_back( ring );
+}
+
+bool IOManager::HasPendingMessage() const {
+    // A full ring is retried once its consumer pops and wakes this loop up
+    for( std::size_t i = 0 ; i < backlog_ring_.size() ; ++i ) {
+        if( !backlog_ring_[i]->Full() )
+            return true;
+    }
+    for( std::size_t i = 0 ; i < inbound_ring_.size() ; ++i ) {
+        if( !inbound_ring_[i]->Empty() )
+            return true;
+    }
+    return false;
+}
+
+void IOManager::PollMessageRing() {
+    // Only the messages that are already there are invoked, so a busy
+    // producer cannot starve the IO of this loop
+    for( std::size_t i = 0 ; i < inbound_ring_.size() ; ++i ) {
+        detail::MessageRing* ring = inbound_ring_[i];
+        std::size_t n = ring->capacity();
+        for( ; n != 0 ; --n ) {
+            detail::PostCallback* message = ring->Pop();
+            if( message == NULL )
+                break;
+            detail::ScopePtr<detail::PostCallback> cb( message );
+            cb->Invoke();
+        }
+        if( n != ring->capacity() ) {
+            // A full barrier orders the pops before reading the flags of the
+            // producer, which checks the room after setting its sleeping flag
+            __sync_synchronize();
+            if( UNLIKELY(ring->has_backlog()) )
+                ring->producer()->WakeUpIfSleeping();
+        }
+    }
+    if( UNLIKELY(!backlog_ring_.empty()) )
+        FlushBacklogRing();
+}
+
+void IOManager::FlushBacklogRing() {
+    std::size_t left = 0;
+    for( std::size_t i = 0 ; i < backlog_ring_.size() ; ++i ) {
+        detail::MessageRing* ring = backlog_ring_[i];
+        std::vector<detail::PostCallback*>& backlog = ring->backlog();
+        std::size_t pushed = 0;
+        while( pushed < backlog.size() && ring->Push( backlog[pushed] ) )
+            ++pushed;
+        backlog.erase( backlog.begin() , backlog.begin() + pushed );
+        if( backlog.empty() )
+            ring->set_has_backlog( false );
+        else
+            backlog_ring_[left++] = ring;
+        if( pushed != 0 ) {
+            // A full barrier orders the push before reading the sleeping flag
+            __sync_synchronize();
+            ring->consumer()->WakeUpIfSleeping();
+        }
+    }
+    backlog_ring_.resize( left );
+}
+
+bool IOManager::CheckNumaPlacement( const void* mem , std::size_t len ,
+                                    NumaReport* report ) const {
+#ifdef SYS_move_pages
+    static const std::size_t kBatch = 256;
+    if( numa_node_ < 0 )
+        return false;
+    const std::size_t page = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+    uintptr_t addr = reinterpret_cast<uintptr_t>(mem) & ~(page-1);
+    const uintptr_t end = reinterpret_cast<uintptr_t>(mem) + len;
+
+    void* pages[kBatch];
+    int status[kBatch];
+    while( addr < end ) {
+        std::size_t count = 0;
+        for( ; count < kBatch && addr < end ; ++count , addr += page )
+            pages[count] = reinterpret_cast<void*>(addr);
+        // With a NULL node list move_pages only queries the node of each page
+        if( ::syscall( SYS_move_pages , 0 , count , pages , NULL , status , 0 ) != 0 )
+            return false;
+        for( std::size_t i = 0 ; i < count ; ++i ) {
+            if( status[i] < 0 )
+                ++report->unmapped_pages;
+            else if( status[i] == numa_node_ )
+                ++report->local_pages;
+            else
+                ++report->remote_pages;
+        }
+    }
+    return true;
+#else
+    (void)mem;
+    (void)len;
+    (void)report;
+    return false;
+#endif // SYS_move_pages
+}
+
+IOManager::NumaReport IOManager::GetNumaReport() const {
+    NumaReport report;
+    CheckNumaPlacement( swap_buffer_ , swap_buffer_size_ , &report );
+    CheckNumaPlacement( &event_queue_[0] ,
+                        event_queue_.size() * sizeof(struct epoll_event) , &report );
+    return report;
 }
 
 void IOManager::CtrlFd::OnReadNotify() {
@@ -764,13 +2219,22 @@ void IOManager::CtrlFd::OnReadNotify() {
     // since no matter is correct notification or not (it should in most case do not
     // have an error state), the IOManager needs to be waked up.
     char buf[kDataLen];
-    // If this state is correct we read up the information inside of it and
-    // hit the EAGAIN/EWOULDBLOCK
-    ::recvfrom( fd() , buf , kDataLen , 0 , NULL , NULL );
-    is_wake_up_ = true;
+    // Read up all the notifications inside of it until we hit the EAGAIN/
+    // EWOULDBLOCK, since a wake up may be sent for every cross thread message
+    while( ::recvfrom( fd() , buf , kDataLen , 0 , NULL , NULL ) >= 0 )
+        ;
+    // The interruption is told by the flag rather than the data, since a
+    // notification is dropped when the receive buffer is full
+    if( __sync_lock_test_and_set( &is_interrupted_ , 0 ) )
+        is_wake_up_ = true;
 }
 
 void IOManager::Interrupt() {
+    ctrl_fd_.set_is_interrupted();
+    SendCtrlData();
+}
+
+void IOManager::SendCtrlData() {
     struct sockaddr_in ipv4;
     bzero(&ipv4,sizeof(ipv4));
     ipv4.sin_family = AF_INET;
@@ -784,9 +2248,11 @@ void IOManager::Interrupt() {
     // Random bytes
     char buf[CtrlFd::kDataLen];
 
-    // Send the data to that UDP socket
-    VERIFY( ::sendto(ctrl_fd_.fd(),buf,CtrlFd::kDataLen,0,
-                reinterpret_cast<struct sockaddr*>(&ipv4),sizeof(ipv4)) == CtrlFd::kDataLen );
+    // Send the data to that UDP socket. If the socket buffer is full, there
+    // are notifications pending already
+    ret = ::sendto(ctrl_fd_.fd(),buf,CtrlFd::kDataLen,0,
+                reinterpret_cast<struct sockaddr*>(&ipv4),sizeof(ipv4));
+    VERIFY( ret == CtrlFd::kDataLen || errno == EAGAIN || errno == EWOULDBLOCK );
 }
 
 
@@ -794,6 +2260,31 @@ void IOManager::Interrupt() {
 // there's no extra space usage , the pointer for Pollable are stored
 // inside of the epoll_data structure per registeration
 
+void IOManager::EpollCtl( int op , int fd , struct epoll_event* ev ) {
+    VERIFY( ::epoll_ctl( epoll_fd_ , op , fd , ev ) == 0 );
+    ++epoll_ctl_count_;
+}
+
+void IOManager::WatchSocket( detail::Pollable* pollable ) {
+    assert( pollable->Valid() );
+    if( LIKELY(!register_once_) )
+        return;
+    if( pollable->is_epoll_read_ && pollable->is_epoll_write_ )
+        return;
+
+    // With edge trigger, watching the direction that nobody waits for costs
+    // nothing but an ignored notification which just updates can_read_ or
+    // can_write_ of the pollable
+    struct epoll_event ev;
+    ev.data.ptr = pollable;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+
+    const int op = (pollable->is_epoll_read_ || pollable->is_epoll_write_) ?
+        EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    EpollCtl( op , pollable->fd_ , &ev );
+    pollable->is_epoll_read_ = pollable->is_epoll_write_ = true;
+}
+
 void IOManager::WatchRead( detail::Pollable* pollable ) {
     assert( pollable->Valid() );
     // We don't remove any file descriptors unless user explicitly require so
@@ -805,8 +2296,9 @@ void IOManager::WatchRead( detail::Pollable* pollable ) {
 
     ev.data.ptr = pollable;
 
-    // Edge trigger for read
-    ev.events = EPOLLIN | EPOLLET ;
+    // Edge trigger for read, EPOLLRDHUP reports the peer close without
+    // waiting for a zero length read
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET ;
 
     if( UNLIKELY(pollable->is_epoll_write_) ) {
         op = EPOLL_CTL_MOD;
@@ -815,7 +2307,14 @@ void IOManager::WatchRead( detail::Pollable* pollable ) {
         op = EPOLL_CTL_ADD;
     }
 
-    VERIFY( ::epoll_ctl( epoll_fd_ , op , pollable->fd_ , &ev ) == 0 );
+    if( UNLIKELY(pollable->is_epoll_exclusive_) ) {
+        // EPOLLEXCLUSIVE is only allowed with EPOLL_CTL_ADD and does not
+        // accept EPOLLRDHUP, which is meaningless for a listener anyway
+        assert( op == EPOLL_CTL_ADD );
+        ev.events = EPOLLIN | EPOLLET | EPOLLEXCLUSIVE;
+    }
+
+    EpollCtl( op , pollable->fd_ , &ev );
 
     // Set up we gonna watch it
     pollable->is_epoll_read_ = true;
@@ -835,98 +2334,380 @@ void IOManager::WatchWrite( detail::Pollable* pollable ) {
 
     if( UNLIKELY(pollable->is_epoll_read_) ) {
         op = EPOLL_CTL_MOD;
-        ev.events |= EPOLLIN;
+        ev.events |= EPOLLIN | EPOLLRDHUP;
     } else {
         op = EPOLL_CTL_ADD;
     }
 
-    VERIFY( ::epoll_ctl( epoll_fd_ , op , pollable->fd_ , &ev ) == 0 );
+    EpollCtl( op , pollable->fd_ , &ev );
     pollable->is_epoll_write_ = true;
 }
 
+void IOManager::Unwatch( detail::Pollable* pollable ) {
+    pollable->DropDeferredEvent();
+    if( !pollable->is_epoll_read_ && !pollable->is_epoll_write_ )
+        return;
+    EpollCtl( EPOLL_CTL_DEL , pollable->fd_ , NULL );
+    pollable->is_epoll_read_ = pollable->is_epoll_write_ = false;
+}
+
+void IOManager::WatchFd( detail::Pollable* pollable , bool read , bool write , bool edge ) {
+    assert( pollable->Valid() );
+    if( pollable->is_epoll_read_ == read && pollable->is_epoll_write_ == write )
+        return;
+    if( !read && !write ) {
+        Unwatch( pollable );
+        return;
+    }
+
+    struct epoll_event ev;
+    ev.data.ptr = pollable;
+    ev.events = (read ? static_cast<uint32_t>(EPOLLIN) : 0u) |
+                (write ? static_cast<uint32_t>(EPOLLOUT) : 0u) |
+                (edge ? static_cast<uint32_t>(EPOLLET) : 0u);
+
+    const int op = (pollable->is_epoll_read_ || pollable->is_epoll_write_) ?
+        EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    EpollCtl( op , pollable->fd_ , &ev );
+    pollable->is_epoll_read_ = read;
+    pollable->is_epoll_write_ = write;
+}
+
 void IOManager::WatchControlFd() {
     struct epoll_event ev;
     ev.data.ptr = &ctrl_fd_;
     ev.events = EPOLLIN;
-    VERIFY( ::epoll_ctl( epoll_fd_ , EPOLL_CTL_ADD , ctrl_fd_.fd_ , &ev ) == 0 );
+    EpollCtl( EPOLL_CTL_ADD , ctrl_fd_.fd_ , &ev );
 }
 
-void IOManager::DispatchLoop( const struct epoll_event* event_queue , std::size_t sz ) {
-    for( std::size_t i = 0 ; i < sz ; ++i ) {
-        detail::Pollable* p = static_cast<detail::Pollable*>(event_queue[i].data.ptr);
-        int ev = event_queue[i].events;
-
-        // Handling error
-        if( UNLIKELY(ev & EPOLLERR) ) {
-            // Get the per socket error here
-            socklen_t len = sizeof(int);
-            int err_no;
-            VERIFY( ::getsockopt(p->fd_,SOL_SOCKET,SO_ERROR,&err_no,&len) == 0 );
+namespace {
+
+// Prefetch the whole object of a pollable. Socket is the largest pollable that
+// is dispatched in the hot path, prefetching beyond a smaller object is harmless.
+inline void PrefetchPollable( const void* p ) {
+    static const std::size_t kCacheLineSize = 64;
+    const char* addr = static_cast<const char*>(p);
+    for( std::size_t off = 0 ; off < sizeof(ClientSocket) ; off += kCacheLineSize ) {
+        PREFETCH( addr + off , 1 );
+    }
+}
+
+}// namespace
+
+inline void IOManager::DispatchEvent( const struct epoll_event& event ) {
+    detail::Pollable* p = static_cast<detail::Pollable*>(event.data.ptr);
+    int ready = event.events;
+    int ev = ready;
+
+    // Handling error
+    if( UNLIKELY(ev & EPOLLERR) ) {
+        // Get the per socket error here
+        socklen_t len = sizeof(int);
+        int err_no;
+        if( ::getsockopt(p->fd_,SOL_SOCKET,SO_ERROR,&err_no,&len) == 0 ) {
             if( err_no != 0 ) {
                 p->OnException( NetState(state_category::kSystem,err_no) );
-                continue;
+                return;
             }
-            ev &= ~EPOLLERR;
+        } else {
+            // Not a socket, e.g. the write end of a pipe whose read end is
+            // closed. Report it as ready, the following IO gets the error
+            VERIFY( errno == ENOTSOCK );
+            ready |= EPOLLIN | EPOLLOUT;
         }
+        ev &= ~EPOLLERR;
+    }
 
-        if( UNLIKELY(event_queue[i].events & EPOLLHUP) ) {
-            // Translate it into a read event
-            p->OnReadNotify();
-            continue;
+    if( UNLIKELY(ev & (EPOLLRDHUP | EPOLLHUP)) ) {
+        // The peer has closed, mark the pollable before reading so the
+        // read path can replay the EOF without another system call
+        p->OnPeerCloseNotify();
+        ev &= ~EPOLLRDHUP;
+    }
+
+    if( UNLIKELY(ev & EPOLLHUP) ) {
+        // Translate it into a read event
+        p->OnReadNotify();
+        return;
+    }
+
+    // IN/OUT events
+    detail::LivenessGuard guard(p);
+
+    if( LIKELY(ready & EPOLLIN) ) {
+        p->OnReadNotify();
+        ev &= ~EPOLLIN;
+    }
+
+    if( LIKELY(ready & EPOLLOUT) ) {
+        if( !guard.deleted() )
+            p->OnWriteNotify();
+        ev &= ~EPOLLOUT;
+    }
+    // We may somehow have unwatched event here.
+    // We can log them for debuggin or other stuff
+    VERIFY( ev == 0 );
+}
+
+void IOManager::DispatchLoop( const struct epoll_event* event_queue , std::size_t sz ) {
+    if( UNLIKELY(dispatch_by_priority_) ) {
+        DispatchByPriority( event_queue , sz );
+        return;
+    }
+
+    // The pollables are prefetched in 2 stages. The object itself is prefetched
+    // 2*distance events ahead, then at distance events ahead the object is in
+    // the cache and its Prefetch() can fetch the buffer memory it points to.
+    const std::size_t distance = prefetch_distance_;
+    if( distance != 0 ) {
+        for( std::size_t i = 0 ; i < 2*distance && i < sz ; ++i ) {
+            PrefetchPollable( event_queue[i].data.ptr );
         }
+    }
 
-        // IN/OUT events
-        bool deleted = false;
-        p->set_notify_flag( &deleted );
+    for( std::size_t i = 0 ; i < sz ; ++i ) {
+        if( LIKELY(distance != 0) ) {
+            if( i + 2*distance < sz )
+                PrefetchPollable( event_queue[i+2*distance].data.ptr );
+            if( i + distance < sz )
+                static_cast<detail::Pollable*>(event_queue[i+distance].data.ptr)->Prefetch();
+        }
+        DispatchEvent( event_queue[i] );
+    }
+}
 
-        if( LIKELY(event_queue[i].events & EPOLLIN) ) {
-            p->OnReadNotify();
-            ev &= ~EPOLLIN;
+void IOManager::DispatchByPriority( const struct epoll_event* event_queue , std::size_t sz ) {
+    // Split the batch before invoking anything. The capacity is reserved up front
+    // so the entries that the pollables point to never move
+    high_event_.clear();
+    normal_event_.clear();
+    normal_event_.reserve( sz );
+    for( std::size_t i = 0 ; i < sz ; ++i ) {
+        detail::Pollable* p = static_cast<detail::Pollable*>(event_queue[i].data.ptr);
+        if( p->is_high_priority_ ) {
+            high_event_.push_back( event_queue[i] );
+            if( UNLIKELY(p->deferred_event_ != NULL) ) {
+                // Deferred before it was raised to high priority
+                high_event_.back().events |= p->deferred_event_->events;
+                p->DropDeferredEvent();
+            }
+        } else if( p->deferred_event_ != NULL ) {
+            // A new edge of a deferred pollable keeps its place in the list
+            p->deferred_event_->events |= event_queue[i].events;
+        } else {
+            normal_event_.push_back( event_queue[i] );
+            p->deferred_event_ = &normal_event_.back();
         }
+    }
+
+    for( std::size_t i = 0 ; i < high_event_.size() ; ++i ) {
+        DispatchEvent( high_event_[i] );
+    }
 
-        if( LIKELY(event_queue[i].events & EPOLLOUT) ) {
-            if( !deleted ) 
-                p->OnWriteNotify();
-            ev &= ~EPOLLOUT;
+    // The deferred events are older than the batch, they go first
+    std::size_t budget = dispatch_budget_ != 0 ? dispatch_budget_ :
+                                                 ~static_cast<std::size_t>(0);
+    while( budget != 0 && !deferred_event_.empty() ) {
+        struct epoll_event event = deferred_event_.front();
+        if( event.data.ptr != NULL )
+            static_cast<detail::Pollable*>(event.data.ptr)->deferred_event_ = NULL;
+        deferred_event_.pop_front();
+        if( event.data.ptr != NULL ) {
+            DispatchEvent( event );
+            --budget;
         }
-        // We may somehow have unwatched event here.
-        // We can log them for debuggin or other stuff
-        VERIFY( ev == 0 );
     }
+
+    std::size_t i = 0;
+    for( ; i < normal_event_.size() && budget != 0 ; ++i ) {
+        if( normal_event_[i].data.ptr == NULL )
+            continue;
+        static_cast<detail::Pollable*>(normal_event_[i].data.ptr)->deferred_event_ = NULL;
+        DispatchEvent( normal_event_[i] );
+        --budget;
+    }
+
+    // Out of budget, the rest waits for the next iteration
+    for( ; i < normal_event_.size() ; ++i ) {
+        if( normal_event_[i].data.ptr == NULL )
+            continue;
+        deferred_event_.push_back( normal_event_[i] );
+        static_cast<detail::Pollable*>(normal_event_[i].data.ptr)->deferred_event_ =
+            &deferred_event_.back();
+    }
+    normal_event_.clear();
 }
 
-uint64_t IOManager::UpdateTimer( std::size_t event_sz , uint64_t prev_time ) {
-    static const int kMinDiff = 3;
-#define TIME_TRIGGER(diff,t) (std::abs((t)-diff) < kMinDiff)
+void IOManager::AddTimer( uint64_t usec , int msec , detail::TimeoutCallback* cb ) {
+    timer_queue_.push_back( TimerStruct(now_ + usec, msec, cb) );
+    std::push_heap(timer_queue_.begin(),timer_queue_.end());
+}
 
-    if( !timer_queue_.empty() ) {
-        if( event_sz == 0 ) {
-            uint64_t diff = timer_queue_.front().time;
-            while( !timer_queue_.empty() ) {
-                if( LIKELY(TIME_TRIGGER(diff,timer_queue_.front().time)) ) {
-                    detail::ScopePtr<detail::TimeoutCallback> cb(
-                        timer_queue_.front().callback);
+void IOManager::AddSocketTimer( detail::SocketTimer* timer ) {
+    timer_queue_.push_back( TimerStruct(timer->deadline, timer->time, NULL, timer) );
+    std::push_heap(timer_queue_.begin(),timer_queue_.end());
+}
 
-                    cb->Invoke(timer_queue_.front().time);
-                    // Pop from the top element from the heap
-                    std::pop_heap( timer_queue_.begin() , timer_queue_.end() );
-                    timer_queue_.pop_back();
+void IOManager::OnSocketTimerCancelled() {
+    ++cancelled_timer_;
+    if( cancelled_timer_ >= kMinPurgeTimer && cancelled_timer_ * 2 >= timer_queue_.size() )
+        PurgeCancelledTimer();
+}
 
-                } else {
-                    break;
-                }
-            }
-            return detail::GetCurrentTimeInMS();
+void IOManager::PurgeCancelledTimer() {
+    std::size_t keep = 0;
+    for( std::size_t i = 0 ; i < timer_queue_.size() ; ++i ) {
+        if( timer_queue_[i].IsCancelled() ) {
+            delete timer_queue_[i].owner;
+            --cancelled_timer_;
         } else {
-            int ret = detail::GetCurrentTimeInMS();
-            int diff = static_cast<int>( ret - prev_time );
-            for( std::size_t i = 0 ; i < timer_queue_.size() ; ++i ) {
-                timer_queue_[i].time -= diff;
-            }
+            timer_queue_[keep++] = timer_queue_[i];
+        }
+    }
+    timer_queue_.resize( keep , TimerStruct(0,0,NULL) );
+    std::make_heap(timer_queue_.begin(),timer_queue_.end());
+}
+
+void IOManager::UpdateTimer() {
+    if( timer_queue_.empty() )
+        return;
+
+    // Pop all the expired timers before invoking any of them. A notifier may
+    // schedule a new timer with zero delay, which must wait for the next loop
+    // iteration instead of being fired here over and over again.
+    const uint64_t limit = now_ + timer_slack_;
+    std::vector<TimerStruct> expired;
+    while( !timer_queue_.empty() && timer_queue_.front().deadline <= limit ) {
+        expired.push_back( timer_queue_.front() );
+        std::pop_heap( timer_queue_.begin() , timer_queue_.end() );
+        timer_queue_.pop_back();
+    }
+
+    for( std::size_t i = 0 ; i < expired.size() ; ++i ) {
+        detail::SocketTimer* owner = expired[i].owner;
+        if( owner == NULL ) {
+            detail::ScopePtr<detail::TimeoutCallback> cb( expired[i].callback );
+            cb->Invoke( expired[i].time );
+            continue;
+        }
+        // A notifier invoked before may have cancelled this one by closing
+        // its socket
+        if( owner->IsCancelled() ) {
+            --cancelled_timer_;
+            delete owner;
+            continue;
+        }
+        owner->Unlink();
+        detail::ScopePtr<detail::TimeoutCallback> cb( owner->callback );
+        delete owner;
+        cb->Invoke( expired[i].time );
+    }
+}
+
+uint64_t IOManager::NextWakeUpTime() {
+    // Don't wake up for a cancelled socket timer
+    while( !timer_queue_.empty() && timer_queue_.front().IsCancelled() ) {
+        delete timer_queue_.front().owner;
+        --cancelled_timer_;
+        std::pop_heap( timer_queue_.begin() , timer_queue_.end() );
+        timer_queue_.pop_back();
+    }
+    uint64_t deadline = deadline_wheel_.NextExpiration();
+    if( !timer_queue_.empty() && timer_queue_.front().deadline < deadline )
+        deadline = timer_queue_.front().deadline;
+    return deadline;
+}
+
+void IOManager::ExpireDeadlines() {
+    detail::DeadlineNode expired;
+    expired.prev = expired.next = &expired;
+    deadline_wheel_.Expire( now_ , &expired );
+
+    // Always take the head of the list. A notifier may close other sockets
+    // that are in the expired list, which just unlink themselves from it
+    while( expired.next != &expired ) {
+        detail::DeadlineNode* node = expired.next;
+        node->Unlink();
+        node->socket->OnDeadline();
+    }
+}
+
+int IOManager::WaitEvent( struct epoll_event* event_queue , int length , uint64_t limit ) {
+    // The clock may have moved forward since the last refresh due to the time
+    // spent inside of the user callback, so don't trust the cached value here.
+    const uint64_t now = detail::GetCurrentTimeInUS();
+    loop_delay_ = now - now_;
+
+    // Notifiers posted by the loop itself are not signaled through the
+    // control fd, so don't block if any of them is pending. The sleeping flag
+    // is set before the message rings are checked, so a producer either sees
+    // the flag and wakes us up, or its message is seen here.
+    sleeping_ = 1;
+    __sync_synchronize();
+    if( UNLIKELY(has_posted_task_) || !deferred_event_.empty() || HasPendingMessage() )
+        return ::epoll_wait( epoll_fd_ , event_queue , length , 0 );
+
+    const uint64_t deadline = std::min( NextWakeUpTime() , limit );
+    if( deadline == detail::DeadlineWheel::kNoDeadline )
+        return ::epoll_wait( epoll_fd_ , event_queue , length , -1 );
+
+    if( deadline <= now + timer_slack_ )
+        return ::epoll_wait( epoll_fd_ , event_queue , length , 0 );
+
+#ifdef SYS_epoll_pwait2
+    if( LIKELY(use_epoll_pwait2_) ) {
+        const uint64_t diff = deadline - now;
+        struct timespec ts;
+        ts.tv_sec = static_cast<time_t>(diff / 1000000);
+        ts.tv_nsec= static_cast<long>((diff % 1000000) * 1000);
+        int ret = static_cast<int>( ::syscall( SYS_epoll_pwait2 , epoll_fd_ ,
+                    event_queue , length , &ts , NULL , 0 ) );
+        if( LIKELY(ret >= 0 || errno != ENOSYS) )
             return ret;
+        use_epoll_pwait2_ = false;
+    }
+#endif // SYS_epoll_pwait2
+
+    // Fallback to the timerfd, which only needs to be re-armed when the
+    // earliest deadline changes
+    if( UNLIKELY(timer_fd_.fd_ < 0) ) {
+        int fd = ::timerfd_create( CLOCK_MONOTONIC , TFD_NONBLOCK | TFD_CLOEXEC );
+        VERIFY( fd >= 0 );
+        timer_fd_.fd_ = fd;
+        WatchRead(&timer_fd_);
+    }
+    if( timer_fd_deadline_ != deadline ) {
+        struct itimerspec its;
+        bzero(&its,sizeof(its));
+        its.it_value.tv_sec = static_cast<time_t>(deadline / 1000000);
+        its.it_value.tv_nsec= static_cast<long>((deadline % 1000000) * 1000);
+        VERIFY( ::timerfd_settime( timer_fd_.fd_ , TFD_TIMER_ABSTIME , &its , NULL ) == 0 );
+        timer_fd_deadline_ = deadline;
+    }
+    return ::epoll_wait( epoll_fd_ , event_queue , length , -1 );
+}
+
+void IOManager::AdjustEventBatch( std::size_t ready ) {
+    const std::size_t size = event_queue_.size();
+    if( UNLIKELY(fixed_event_batch_ != 0) ) {
+        if( size != fixed_event_batch_ )
+            event_queue_.resize( fixed_event_batch_ );
+        return;
+    }
+    if( UNLIKELY(ready == size) ) {
+        // More events may be pending inside of the kernel, fetch more of them
+        // with a single epoll_wait next time
+        if( size < kMaxEpollEventLength )
+            event_queue_.resize( size * 2 );
+        shrink_counter_ = 0;
+    } else if( ready < size / 4 && size > kEpollEventLength ) {
+        if( ++shrink_counter_ >= kShrinkEventBatchIteration ) {
+            event_queue_.resize( size / 2 );
+            shrink_counter_ = 0;
         }
+    } else {
+        shrink_counter_ = 0;
     }
-#undef TIME_TRIGGER
 }
 
 void IOManager::ExecutePendingAccept() {
@@ -937,40 +2718,518 @@ void IOManager::ExecutePendingAccept() {
     }
 }
 
+IOManager* IOManager::EnterLoop() {
+    now_ = detail::GetCurrentTimeInUS();
+    if( !has_loop_thread_ || !::pthread_equal( loop_thread_ , ::pthread_self() ) ) {
+        loop_thread_ = ::pthread_self();
+        VERIFY( ::pthread_getcpuclockid( loop_thread_ , &loop_clock_ ) == 0 );
+        __sync_synchronize();
+        has_loop_thread_ = true;
+    }
+    IOManager* previous = current_;
+    current_ = this;
+    return previous;
+}
+
+void IOManager::LeaveLoop( IOManager* previous ) {
+    // The thread may exit and be joined once the loop returns, its CPU clock
+    // must not be read any more
+    has_loop_thread_ = false;
+    current_ = previous;
+}
+
+bool IOManager::RunIteration( uint64_t limit , NetState* state ) {
+    // The loop is not reentrant, a nested iteration would overwrite the
+    // event queue the outer DispatchLoop is still walking
+    assert( !in_iteration_ );
+    in_iteration_ = true;
+    if( UNLIKELY(place_event_queue_) )
+        PlaceEventQueue();
+
+    // 0. Execute pending accept
+    ExecutePendingAccept();
+
+    // 1. Wait for the IO events or the earliest timer
+    int ret = WaitEvent( &event_queue_[0] , static_cast<int>(event_queue_.size()) , limit );
+    sleeping_ = 0;
+
+    if( UNLIKELY(ret < 0) ) {
+        if( LIKELY(errno != EINTR) ) {
+            *state = NetState(state_category::kSystem,errno);
+            in_iteration_ = false;
+            return true;
+        }
+        // Interrupted by a signal, handle the timers as an empty batch
+        ret = 0;
+    }
+
+    // Refresh the loop clock once per iteration
+    now_ = detail::GetCurrentTimeInUS();
+    if( ret > 0 )
+        ++wakeup_count_;
+    // Do dispatch for the event here
+    const std::size_t ready = static_cast<std::size_t>( ret );
+    DispatchLoop( &event_queue_[0] , ready );
+    AdjustEventBatch( ready );
+    // Invoke the expired timers
+    UpdateTimer();
+    // Notify the sockets whose read or idle deadline has passed
+    ExpireDeadlines();
+    // Invoke the notifiers posted by this or other threads
+    ExecutePostedTasks();
+    // Invoke the messages from the other loops of the shard mesh
+    PollMessageRing();
+    in_iteration_ = false;
+    // Checking whether we have been notified by interruption
+    if( UNLIKELY(ctrl_fd_.is_wake_up()) ) {
+        // We have been waken up by the caller, just return empty
+        // NetState here. Reset the flag so the loop can run again
+        ctrl_fd_.set_is_wake_up(false);
+        state->Clear();
+        return true;
+    }
+    return false;
+}
+
 NetState IOManager::RunMainLoop() {
-    struct epoll_event event_queue[ IOManager::kEpollEventLength ];
-    uint64_t prev_time = detail::GetCurrentTimeInMS();
-    do {
-        // 0. Execute pending accept
-        ExecutePendingAccept();
-        // 1. Set up the parameter that we need for the epoll_wait , it is very simple
-        int tm = timer_queue_.empty() ? -1 : timer_queue_.front().time ;
+    IOManager* previous = EnterLoop();
+    NetState state;
+    while( !RunIteration( detail::DeadlineWheel::kNoDeadline , &state ) )
+        ;
+    LeaveLoop( previous );
+    return state;
+}
 
-repoll:
-        int ret = ::epoll_wait( epoll_fd_ , event_queue , kEpollEventLength , tm );
+NetState IOManager::RunOnce( int timeout_ms ) {
+    IOManager* previous = EnterLoop();
+    const uint64_t limit = timeout_ms < 0 ? detail::DeadlineWheel::kNoDeadline :
+        now_ + static_cast<uint64_t>(timeout_ms) * 1000;
+    NetState state;
+    RunIteration( limit , &state );
+    LeaveLoop( previous );
+    return state;
+}
 
-        if( UNLIKELY(ret < 0) ) {
+NetState IOManager::RunFor( int msec ) {
+    IOManager* previous = EnterLoop();
+    const uint64_t limit = now_ + static_cast<uint64_t>(msec) * 1000;
+    NetState state;
+    while( now_ < limit && !RunIteration( limit , &state ) )
+        ;
+    LeaveLoop( previous );
+    return state;
+}
 
-            if( LIKELY(errno != EINTR) )
-                return NetState(state_category::kSystem,errno);
-            else
-                // We don't need to go to the begining of the loop since this will cause us
-                // to reflush the timer there. Goto repoll label to start another epoll_wait
-                // would be easiest way we can do
-                goto repoll;
-        } else {
-            // Do dispatch for the event here
-            DispatchLoop( event_queue , static_cast<std::size_t>( ret ) );
-            // Update or invoke the timer event.
-            prev_time = UpdateTimer( static_cast<std::size_t>(ret) , prev_time );
-            // Checking whether we have been notified by interruption
-            if( UNLIKELY(ctrl_fd_.is_wake_up()) ) {
-                // We have been waken up by the caller, just return empty
-                // NetState here
-                return NetState();
+int IOManager::NextTimeout() {
+    if( has_posted_task_ || !deferred_event_.empty() || HasPendingMessage() )
+        return 0;
+    const uint64_t deadline = NextWakeUpTime();
+    if( deadline == detail::DeadlineWheel::kNoDeadline )
+        return -1;
+    const uint64_t now = detail::GetCurrentTimeInUS();
+    if( deadline <= now )
+        return 0;
+    return static_cast<int>( (deadline - now + 999) / 1000 );
+}
+
+namespace detail {
+
+MessageRing::MessageRing( std::size_t capacity ) :
+    slot_( new PostCallback*[capacity] ),
+    capacity_( capacity ),
+    consumer_( NULL ),
+    producer_( NULL ),
+    head_(0),
+    tail_cache_(0),
+    tail_(0),
+    head_cache_(0),
+    has_backlog_(false)
+{
+    assert( capacity != 0 && (capacity & (capacity-1)) == 0 );
+}
+
+MessageRing::~MessageRing() {
+    // The messages that never get a chance to run
+    for( PostCallback* cb = Pop() ; cb != NULL ; cb = Pop() ) {
+        delete cb;
+    }
+    for( std::size_t i = 0 ; i < backlog_.size() ; ++i ) {
+        delete backlog_[i];
+    }
+    delete [] slot_;
+}
+
+ShardMesh::ShardMesh( const std::vector<IOManager*>& loops , std::size_t ring_size ) :
+    loops_( loops )
+{
+    for( std::size_t from = 0 ; from < loops_.size() ; ++from ) {
+        for( std::size_t to = 0 ; to < loops_.size() ; ++to ) {
+            MessageRing* ring = new MessageRing( ring_size );
+            ring->set_consumer( loops_[to] );
+            ring->set_producer( loops_[from] );
+            rings_.push_back( ring );
+        }
+    }
+}
+
+ShardMesh::~ShardMesh() {
+    for( std::size_t from = 0 ; from < loops_.size() ; ++from ) {
+        for( std::size_t to = 0 ; to < loops_.size() ; ++to ) {
+            MessageRing* r = ring( from , to );
+            loops_[from]->RemoveMessageRing( r );
+            loops_[to]->RemoveMessageRing( r );
+            delete r;
+        }
+    }
+}
+
+int ShardMesh::CurrentShard() const {
+    IOManager* current = IOManager::Current();
+    if( current == NULL )
+        return -1;
+    for( std::size_t i = 0 ; i < loops_.size() ; ++i ) {
+        if( loops_[i] == current )
+            return static_cast<int>(i);
+    }
+    return -1;
+}
+
+void ShardMesh::Attach( std::size_t shard ) {
+    for( std::size_t from = 0 ; from < loops_.size() ; ++from ) {
+        loops_[shard]->AddInboundRing( ring( from , shard ) );
+    }
+}
+
+void ShardMesh::Send( std::size_t shard , PostCallback* cb ) {
+    const int from = CurrentShard();
+    if( UNLIKELY(from < 0) ) {
+        loops_[shard]->AddPostedTask( cb );
+        return;
+    }
+    MessageRing* r = ring( static_cast<std::size_t>(from) , shard );
+    // Keep the order behind the backlog, which is flushed by the sender loop
+    if( UNLIKELY(!r->backlog().empty()) ) {
+        r->backlog().push_back( cb );
+        return;
+    }
+    if( UNLIKELY(!r->Push( cb )) ) {
+        r->backlog().push_back( cb );
+        r->set_has_backlog( true );
+        loops_[from]->AddBacklogRing( r );
+        return;
+    }
+    // A full barrier orders the push before reading the sleeping flag
+    __sync_synchronize();
+    loops_[shard]->WakeUpIfSleeping();
+}
+
+}// namespace detail
+
+Rebalancer::Rebalancer() :
+    home_(NULL),
+    period_ms_(0),
+    threshold_(kDefaultThreshold),
+    last_sample_(0),
+    check_notifier_(NULL),
+    migrate_count_(0)
+{
+    landing_.rebalancer = this;
+}
+
+Rebalancer::~Rebalancer() {
+    if( check_notifier_ != NULL )
+        check_notifier_->rebalancer = NULL;
+    for( std::size_t i = 0 ; i < loops_.size() ; ++i ) {
+        delete loops_[i];
+    }
+}
+
+void Rebalancer::AddIOManager( IOManager* io_manager ) {
+    assert( check_notifier_ == NULL );
+    Loop* loop = new Loop();
+    loop->io_manager = io_manager;
+    loop->cpu_time = 0;
+    loops_.push_back( loop );
+}
+
+Rebalancer::Loop* Rebalancer::FindLoop( IOManager* io_manager ) {
+    for( std::size_t i = 0 ; i < loops_.size() ; ++i ) {
+        if( loops_[i]->io_manager == io_manager )
+            return loops_[i];
+    }
+    return NULL;
+}
+
+void Rebalancer::Track( Socket* socket ) {
+    Loop* loop = FindLoop( socket->io_manager_ );
+    assert( loop != NULL );
+    loop->sockets.insert( socket );
+}
+
+void Rebalancer::Untrack( Socket* socket ) {
+    Loop* loop = FindLoop( socket->io_manager_ );
+    assert( loop != NULL );
+    loop->sockets.erase( socket );
+}
+
+void Rebalancer::Start( IOManager* home , int period_ms , int threshold ) {
+    assert( check_notifier_ == NULL );
+    assert( period_ms > 0 );
+    home_ = home;
+    period_ms_ = period_ms;
+    threshold_ = threshold;
+    last_sample_ = 0;
+    check_notifier_ = new CheckNotifier();
+    check_notifier_->rebalancer = this;
+    home_->Schedule( period_ms_ , check_notifier_ );
+}
+
+void Rebalancer::Stop() {
+    if( check_notifier_ != NULL ) {
+        check_notifier_->rebalancer = NULL;
+        check_notifier_ = NULL;
+    }
+}
+
+void Rebalancer::CheckNotifier::OnTimeout( int msec ) {
+    if( rebalancer == NULL ) {
+        delete this;
+        return;
+    }
+    rebalancer->Check();
+    rebalancer->home_->Schedule( rebalancer->period_ms_ , this );
+}
+
+void Rebalancer::Check() {
+    const uint64_t now = home_->Now();
+    const uint64_t elapsed = now - last_sample_;
+    const bool has_sample = last_sample_ != 0;
+    last_sample_ = now;
+
+    // Utilization of each loop thread in percent since the last sample
+    Loop* busiest = NULL;
+    Loop* idlest = NULL;
+    int busiest_usage = 0;
+    int idlest_usage = 0;
+    for( std::size_t i = 0 ; i < loops_.size() ; ++i ) {
+        Loop* loop = loops_[i];
+        uint64_t cpu_time;
+        if( !loop->io_manager->GetCpuTime( &cpu_time ) )
+            return;
+        const uint64_t used = cpu_time - loop->cpu_time;
+        loop->cpu_time = cpu_time;
+        if( !has_sample || elapsed == 0 )
+            continue;
+        const int usage = static_cast<int>( used * 100 / elapsed );
+        if( busiest == NULL || usage > busiest_usage ) {
+            busiest = loop;
+            busiest_usage = usage;
+        }
+        if( idlest == NULL || usage < idlest_usage ) {
+            idlest = loop;
+            idlest_usage = usage;
+        }
+    }
+    if( busiest == NULL || busiest == idlest ||
+        busiest_usage - idlest_usage <= threshold_ )
+        return;
+
+    // Moving half of the gap makes both loops meet in the middle
+    ShedTask* task = new ShedTask();
+    task->rebalancer = this;
+    task->source = busiest;
+    task->target = idlest;
+    task->percent = (busiest_usage - idlest_usage) * 50 / busiest_usage;
+    busiest->io_manager->Post( task );
+}
+
+void Rebalancer::ShedTask::OnPost() {
+    std::size_t count = source->sockets.size() * percent / 100;
+    std::set<Socket*>::iterator i = source->sockets.begin();
+    while( count != 0 && i != source->sockets.end() ) {
+        Socket* socket = *i;
+        // A closing socket stays where it is, and so does a socket whose
+        // offloaded work still completes on this loop, a socket driven by a
+        // Relay together with its peer or a socket sharing a rate limit group
+        // of this loop. They stay tracked
+        if( socket->state_ != Socket::NORMAL || !socket->Valid() ||
+            socket->pending_offload_ != 0 || socket->relay_ != NULL ||
+            socket->rate_limit_group_ != NULL ) {
+            ++i;
+            continue;
+        }
+        source->sockets.erase( i++ );
+        socket->MigrateTo( target->io_manager , &rebalancer->landing_ );
+        __sync_fetch_and_add( &rebalancer->migrate_count_ , 1 );
+        --count;
+    }
+    delete this;
+}
+
+void Rebalancer::Landing::OnMigrate( Socket* socket ) {
+    Loop* loop = rebalancer->FindLoop( socket->io_manager_ );
+    assert( loop != NULL );
+    loop->sockets.insert( socket );
+    if( !rebalancer->user_migrate_callback_.IsNull() )
+        rebalancer->user_migrate_callback_->Invoke( socket );
+}
+
+OffloadPool::OffloadPool( std::size_t thread_size , std::size_t max_queue_depth ) :
+    max_queue_depth_( max_queue_depth ),
+    idle_size_(0),
+    stop_(false),
+    queue_depth_(0),
+    max_seen_queue_depth_(0),
+    next_worker_(0),
+    submitted_(0),
+    completed_(0),
+    rejected_(0),
+    stolen_(0)
+{
+    assert( thread_size > 0 );
+    VERIFY( ::pthread_mutex_init( &idle_lock_ , NULL ) == 0 );
+    VERIFY( ::pthread_cond_init( &idle_cond_ , NULL ) == 0 );
+    for( std::size_t i = 0 ; i < thread_size ; ++i ) {
+        Worker* worker = new Worker();
+        worker->pool = this;
+        worker->index = i;
+        VERIFY( ::pthread_mutex_init( &worker->lock , NULL ) == 0 );
+        workers_.push_back( worker );
+    }
+    // Start the threads once every queue exists, since they steal from each other
+    for( std::size_t i = 0 ; i < workers_.size() ; ++i ) {
+        VERIFY( ::pthread_create( &workers_[i]->thread , NULL , Run , workers_[i] ) == 0 );
+    }
+}
+
+OffloadPool::~OffloadPool() {
+    ::pthread_mutex_lock( &idle_lock_ );
+    stop_ = true;
+    ::pthread_cond_broadcast( &idle_cond_ );
+    ::pthread_mutex_unlock( &idle_lock_ );
+    for( std::size_t i = 0 ; i < workers_.size() ; ++i ) {
+        ::pthread_join( workers_[i]->thread , NULL );
+    }
+    for( std::size_t i = 0 ; i < workers_.size() ; ++i ) {
+        ::pthread_mutex_destroy( &workers_[i]->lock );
+        delete workers_[i];
+    }
+    ::pthread_cond_destroy( &idle_cond_ );
+    ::pthread_mutex_destroy( &idle_lock_ );
+}
+
+bool OffloadPool::Submit( IOManager* io_manager , Socket* socket ,
+                          detail::OffloadCallback* cb ) {
+    // Reserve a place in the queue first, so concurrent submitters can
+    // never exceed the limit together
+    const std::size_t depth = __sync_add_and_fetch( &queue_depth_ , 1 );
+    if( UNLIKELY(depth > max_queue_depth_) ) {
+        __sync_sub_and_fetch( &queue_depth_ , 1 );
+        __sync_fetch_and_add( &rejected_ , 1 );
+        delete cb;
+        return false;
+    }
+    for( std::size_t seen = max_seen_queue_depth_ ; depth > seen ;
+         seen = max_seen_queue_depth_ ) {
+        if( __sync_bool_compare_and_swap( &max_seen_queue_depth_ , seen , depth ) )
+            break;
+    }
+    __sync_fetch_and_add( &submitted_ , 1 );
+
+    Job* job = new Job();
+    job->callback = cb;
+    job->io_manager = io_manager;
+    job->socket = socket;
+    if( socket != NULL )
+        ++socket->pending_offload_;
+
+    Worker* worker = workers_[ __sync_fetch_and_add( &next_worker_ , 1 ) % workers_.size() ];
+    ::pthread_mutex_lock( &worker->lock );
+    worker->queue.push_back( job );
+    ::pthread_mutex_unlock( &worker->lock );
+
+    // The queue depth is raised before the idle lock is taken, so a worker
+    // either sees the job before it sleeps or gets signaled here
+    ::pthread_mutex_lock( &idle_lock_ );
+    if( idle_size_ != 0 )
+        ::pthread_cond_signal( &idle_cond_ );
+    ::pthread_mutex_unlock( &idle_lock_ );
+    return true;
+}
+
+OffloadPool::Job* OffloadPool::Take( Worker* worker ) {
+    Job* job = NULL;
+    ::pthread_mutex_lock( &worker->lock );
+    if( !worker->queue.empty() ) {
+        job = worker->queue.front();
+        worker->queue.pop_front();
+    }
+    ::pthread_mutex_unlock( &worker->lock );
+    if( job != NULL )
+        return job;
+
+    // Steal the newest job of the other workers, their own oldest jobs are
+    // about to be taken by themselves
+    for( std::size_t i = 1 ; i < workers_.size() && job == NULL ; ++i ) {
+        Worker* victim = workers_[ (worker->index + i) % workers_.size() ];
+        ::pthread_mutex_lock( &victim->lock );
+        if( !victim->queue.empty() ) {
+            job = victim->queue.back();
+            victim->queue.pop_back();
+        }
+        ::pthread_mutex_unlock( &victim->lock );
+    }
+    if( job != NULL )
+        __sync_fetch_and_add( &stolen_ , 1 );
+    return job;
+}
+
+void* OffloadPool::Run( void* arg ) {
+    Worker* worker = static_cast<Worker*>(arg);
+    OffloadPool* pool = worker->pool;
+    while( true ) {
+        Job* job = pool->Take( worker );
+        if( job == NULL ) {
+            ::pthread_mutex_lock( &pool->idle_lock_ );
+            while( pool->queue_depth_ == 0 && !pool->stop_ ) {
+                ++pool->idle_size_;
+                ::pthread_cond_wait( &pool->idle_cond_ , &pool->idle_lock_ );
+                --pool->idle_size_;
             }
+            const bool stop = pool->stop_ && pool->queue_depth_ == 0;
+            ::pthread_mutex_unlock( &pool->idle_lock_ );
+            if( stop )
+                return NULL;
+            continue;
         }
-    } while( true );
+        __sync_sub_and_fetch( &pool->queue_depth_ , 1 );
+        job->callback->InvokeWork();
+        __sync_fetch_and_add( &pool->completed_ , 1 );
+        job->io_manager->Post( job );
+    }
+}
+
+void OffloadPool::Job::OnPost() {
+    NetState state;
+    if( socket != NULL ) {
+        --socket->pending_offload_;
+        if( !socket->Valid() )
+            state = NetState(state_category::kSystem,ECANCELED);
+    }
+    detail::ScopePtr<detail::OffloadCallback> cb( callback );
+    delete this;
+    cb->InvokeComplete( state );
+}
+
+OffloadPool::Stats OffloadPool::stats() const {
+    Stats stats;
+    stats.queue_depth = queue_depth_;
+    stats.max_queue_depth = max_seen_queue_depth_;
+    stats.submitted = submitted_;
+    stats.completed = completed_;
+    stats.rejected = rejected_;
+    stats.stolen = stolen_;
+    return stats;
 }
 
 }// namespace mnet
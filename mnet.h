@@ -16,6 +16,8 @@
 #include <vector>
 #include <list>
 #include <map>
+#include <set>
+#include <deque>
 #include <algorithm>
 
 // System related header
@@ -23,6 +25,12 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/epoll.h>
+#include <pthread.h>
+#include <signal.h>
+
+#ifndef EPOLLEXCLUSIVE
+#define EPOLLEXCLUSIVE (1u << 28)
+#endif // EPOLLEXCLUSIVE
 
 // Macros
 #define DISALLOW_COPY_AND_ASSIGN(x) \
@@ -39,6 +47,9 @@
 #define LIKELY(x)       __builtin_expect((x),1)
 #define UNLIKELY(x)     __builtin_expect((x),0)
 
+// Prefetch the cache line of address, rw is 0 for read and 1 for write
+#define PREFETCH(address,rw) __builtin_prefetch((address),(rw),3)
+
 // This directory is used to make gcc options -Weffc++ and -Wnon-virtual-destructor 
 // happy. Since those option will force every class that has a virtual function needs
 // a non virtual destructor which is not very helpful in our cases. Anyway bearing 
@@ -56,6 +67,7 @@
 
 namespace mnet {
 class Buffer;
+class StringPiece;
 class Endpoint;
 class NetState;
 
@@ -63,6 +75,8 @@ class Socket;
 class ClientSocket;
 class ServerSocket;
 class IOManager;
+class FdWatcher;
+class Relay;
 
 namespace detail {
 class Pollable;
@@ -116,6 +130,89 @@ public:
 
 };
 
+class ShedCallback {
+public:
+    virtual void Invoke( ServerSocket* server , int reason ) = 0;
+
+#ifdef FORCE_VIRTUAL_DESTRUCTOR
+    virtual ~ShedCallback() {}
+#endif // FORCE_VIRTUAL_DESTRUCTOR
+
+};
+
+class PostCallback {
+public:
+    virtual void Invoke() = 0;
+
+#ifdef FORCE_VIRTUAL_DESTRUCTOR
+    virtual ~PostCallback() {}
+#endif // FORCE_VIRTUAL_DESTRUCTOR
+
+};
+
+class MigrateCallback {
+public:
+    virtual void Invoke( Socket* socket ) = 0;
+
+#ifdef FORCE_VIRTUAL_DESTRUCTOR
+    virtual ~MigrateCallback() {}
+#endif // FORCE_VIRTUAL_DESTRUCTOR
+
+};
+
+class WatchCallback {
+public:
+    virtual void Invoke( FdWatcher* watcher , const NetState& ok ) = 0;
+
+#ifdef FORCE_VIRTUAL_DESTRUCTOR
+    virtual ~WatchCallback() {}
+#endif // FORCE_VIRTUAL_DESTRUCTOR
+
+};
+
+class SignalCallback {
+public:
+    virtual void Invoke( int signo ) = 0;
+
+#ifdef FORCE_VIRTUAL_DESTRUCTOR
+    virtual ~SignalCallback() {}
+#endif // FORCE_VIRTUAL_DESTRUCTOR
+
+};
+
+class RelayCallback {
+public:
+    virtual void Invoke( Relay* relay , const NetState& ok ) = 0;
+
+#ifdef FORCE_VIRTUAL_DESTRUCTOR
+    virtual ~RelayCallback() {}
+#endif // FORCE_VIRTUAL_DESTRUCTOR
+
+};
+
+class DrainCallback {
+public:
+    virtual void Invoke( Socket* socket , const NetState& ok ) = 0;
+
+#ifdef FORCE_VIRTUAL_DESTRUCTOR
+    virtual ~DrainCallback() {}
+#endif // FORCE_VIRTUAL_DESTRUCTOR
+
+};
+
+// An offloaded work together with its completion. Work is invoked on a
+// thread of the OffloadPool, and Complete on the thread of the IOManager.
+class OffloadCallback {
+public:
+    virtual void InvokeWork() = 0;
+    virtual void InvokeComplete( const NetState& ok ) = 0;
+
+#ifdef FORCE_VIRTUAL_DESTRUCTOR
+    virtual ~OffloadCallback() {}
+#endif // FORCE_VIRTUAL_DESTRUCTOR
+
+};
+
 class CloseCallback {
 public:
     virtual void InvokeClose( const NetState& ok ) = 0;
@@ -169,6 +266,83 @@ template< typename N > struct TimeoutNotifier : public TimeoutCallback {
     TimeoutNotifier( N* n ) :notifier(n) {}
 };
 
+template< typename N > struct ShedNotifier : public ShedCallback {
+    virtual void Invoke( ServerSocket* server , int reason ) {
+        notifier->OnShed( server , reason );
+    }
+    N* notifier;
+    ShedNotifier( N* n ) : notifier(n) {}
+};
+
+template< typename N > struct PostNotifier : public PostCallback {
+    virtual void Invoke() {
+        notifier->OnPost();
+    }
+    N* notifier;
+    PostNotifier( N* n ) : notifier(n) {}
+};
+
+template< typename N > struct MigrateNotifier : public MigrateCallback {
+    virtual void Invoke( Socket* socket ) {
+        notifier->OnMigrate( socket );
+    }
+    N* notifier;
+    MigrateNotifier( N* n ) : notifier(n) {}
+};
+
+template< typename N > struct ReadableNotifier : public WatchCallback {
+    virtual void Invoke( FdWatcher* watcher , const NetState& ok ) {
+        notifier->OnReadable( watcher , ok );
+    }
+    N* notifier;
+    ReadableNotifier( N* n ) : notifier(n) {}
+};
+
+template< typename N > struct WritableNotifier : public WatchCallback {
+    virtual void Invoke( FdWatcher* watcher , const NetState& ok ) {
+        notifier->OnWritable( watcher , ok );
+    }
+    N* notifier;
+    WritableNotifier( N* n ) : notifier(n) {}
+};
+
+template< typename N > struct SignalNotifier : public SignalCallback {
+    virtual void Invoke( int signo ) {
+        notifier->OnSignal( signo );
+    }
+    N* notifier;
+    SignalNotifier( N* n ) : notifier(n) {}
+};
+
+template< typename N > struct RelayNotifier : public RelayCallback {
+    virtual void Invoke( Relay* relay , const NetState& ok ) {
+        notifier->OnRelayEnd( relay , ok );
+    }
+    N* notifier;
+    RelayNotifier( N* n ) : notifier(n) {}
+};
+
+template< typename N > struct DrainCloseNotifier : public DrainCallback {
+    virtual void Invoke( Socket* socket , const NetState& ok ) {
+        notifier->OnDrainClose( socket , ok );
+    }
+    N* notifier;
+    DrainCloseNotifier( N* n ) : notifier(n) {}
+};
+
+template< typename W , typename C > struct OffloadNotifier : public OffloadCallback {
+    virtual void InvokeWork() {
+        work->OnWork();
+    }
+    virtual void InvokeComplete( const NetState& ok ) {
+        completion->OnComplete( socket , ok );
+    }
+    W* work;
+    C* completion;
+    Socket* socket;
+    OffloadNotifier( W* w , C* c , Socket* s ) : work(w) , completion(c) , socket(s) {}
+};
+
 template< typename N > struct CloseNotifier_WithOnData : public CloseCallback {
     virtual void InvokeClose( const NetState& ok ) {
         notifier->OnClose( ok );
@@ -208,6 +382,16 @@ DECLARE_CONCEPT_CHECK(OnTimeout,OnTimeout,void (T::*)(int));
 DECLARE_CONCEPT_CHECK(OnConnect,OnConnect,void (T::*)(Socket*,const NetState&));
 DECLARE_CONCEPT_CHECK(OnClose_Data,OnData,void (T::*)(std::size_t));
 DECLARE_CONCEPT_CHECK(OnClose_Close,OnClose,void (T::*)( const NetState& ));
+DECLARE_CONCEPT_CHECK(OnShed,OnShed,void (T::*)(ServerSocket*,int));
+DECLARE_CONCEPT_CHECK(OnPost,OnPost,void (T::*)());
+DECLARE_CONCEPT_CHECK(OnMigrate,OnMigrate,void (T::*)(Socket*));
+DECLARE_CONCEPT_CHECK(OnWork,OnWork,void (T::*)());
+DECLARE_CONCEPT_CHECK(OnComplete,OnComplete,void (T::*)(Socket*,const NetState&));
+DECLARE_CONCEPT_CHECK(OnReadable,OnReadable,void (T::*)(FdWatcher*,const NetState&));
+DECLARE_CONCEPT_CHECK(OnWritable,OnWritable,void (T::*)(FdWatcher*,const NetState&));
+DECLARE_CONCEPT_CHECK(OnSignal,OnSignal,void (T::*)(int));
+DECLARE_CONCEPT_CHECK(OnRelayEnd,OnRelayEnd,void (T::*)(Relay*,const NetState&));
+DECLARE_CONCEPT_CHECK(OnDrainClose,OnDrainClose,void (T::*)(Socket*,const NetState&));
 
 // On C++03 we don't have static assert
 template< bool V > struct static_assert_result;
@@ -253,6 +437,61 @@ TimeoutCallback* MakeTimeoutCallback( T* n ) {
     return new TimeoutNotifier<T>(n);
 }
 
+template< typename T >
+ShedCallback* MakeShedCallback( T* n ) {
+    STATIC_ASSERT( HasConcept_OnShed<T>::result , No_On_Shed_Is_Found );
+    return new ShedNotifier<T>(n);
+}
+
+template< typename T >
+PostCallback* MakePostCallback( T* n ) {
+    STATIC_ASSERT( HasConcept_OnPost<T>::result , No_On_Post_Is_Found );
+    return new PostNotifier<T>(n);
+}
+
+template< typename T >
+MigrateCallback* MakeMigrateCallback( T* n ) {
+    STATIC_ASSERT( HasConcept_OnMigrate<T>::result , No_On_Migrate_Is_Found );
+    return new MigrateNotifier<T>(n);
+}
+
+template< typename T >
+WatchCallback* MakeReadableCallback( T* n ) {
+    STATIC_ASSERT( HasConcept_OnReadable<T>::result , No_On_Readable_Is_Found );
+    return new ReadableNotifier<T>(n);
+}
+
+template< typename T >
+WatchCallback* MakeWritableCallback( T* n ) {
+    STATIC_ASSERT( HasConcept_OnWritable<T>::result , No_On_Writable_Is_Found );
+    return new WritableNotifier<T>(n);
+}
+
+template< typename T >
+SignalCallback* MakeSignalCallback( T* n ) {
+    STATIC_ASSERT( HasConcept_OnSignal<T>::result , No_On_Signal_Is_Found );
+    return new SignalNotifier<T>(n);
+}
+
+template< typename T >
+RelayCallback* MakeRelayCallback( T* n ) {
+    STATIC_ASSERT( HasConcept_OnRelayEnd<T>::result , No_On_Relay_End_Is_Found );
+    return new RelayNotifier<T>(n);
+}
+
+template< typename T >
+DrainCallback* MakeDrainCallback( T* n ) {
+    STATIC_ASSERT( HasConcept_OnDrainClose<T>::result , No_On_Drain_Close_Is_Found );
+    return new DrainCloseNotifier<T>(n);
+}
+
+template< typename W , typename C >
+OffloadCallback* MakeOffloadCallback( W* w , C* c , Socket* socket ) {
+    STATIC_ASSERT( HasConcept_OnWork<W>::result , No_On_Work_Is_Found );
+    STATIC_ASSERT( HasConcept_OnComplete<C>::result , No_On_Complete_Is_Found );
+    return new OffloadNotifier<W,C>(w,c,socket);
+}
+
 template< typename T >
 CloseCallback* MakeCloseCallback( T* n ) {
     STATIC_ASSERT( HasConcept_OnClose_Close<T>::result , No_On_Close_Is_Found );
@@ -493,15 +732,47 @@ public:
         return capacity_;
     }
 
+    // Prefetch the memory that the next write into this buffer will touch
+    void PrefetchWrite() const {
+        PREFETCH( static_cast<char*>(mem_)+write_ptr_ , 1 );
+    }
+
     void Clear() {
         write_ptr_ = read_ptr_ = 0;
     }
 
+    // Keep the first size readable bytes and drop the rest, which takes back
+    // the bytes written last
+    void Truncate( std::size_t size ) {
+        assert( size <= readable_size() );
+        write_ptr_ = read_ptr_ + size;
+        RewindBuffer();
+    }
+
+    // Exchange the memory and the content of 2 buffers without copying. A fixed
+    // buffer stays fixed, it just gets the memory of the other one.
+    void Swap( Buffer* other ) {
+        std::swap( read_ptr_ , other->read_ptr_ );
+        std::swap( write_ptr_ , other->write_ptr_ );
+        std::swap( capacity_ , other->capacity_ );
+        std::swap( mem_ , other->mem_ );
+    }
+
+    // Move the readable content of this buffer to the end of buffer and leave
+    // this one empty. When buffer is empty, which is the case of an echo moving the
+    // read buffer to the write buffer, the memory of the 2 buffers is swapped and
+    // nothing is copied. Otherwise the content is appended to buffer. Return the
+    // number of bytes moved, which may be less than readable_size() only if buffer
+    // is fixed and runs out of space.
+    std::size_t TransferTo( Buffer* buffer );
+
+    // Make sure at least capacity bytes can be written without growing, so they
+    // can be filled through GetWriteAccessor. It grows the same way as Write.
     bool Reserve( std::size_t capacity ) {
-        if( is_fixed_ )
-            return false;
         if( writable_size() < capacity ) {
-            Grow( capacity - writable_size() );
+            if( is_fixed_ )
+                return false;
+            Grow( ( capacity > capacity_ ? capacity : capacity_ ) * 2 );
         }
         return true;
     }
@@ -537,6 +808,71 @@ private:
     DISALLOW_COPY_AND_ASSIGN(Buffer);
 };
 
+// A view of a range of bytes that is owned by someone else. C++03 doesn't have
+// a std::string_view, this is the minimum we need.
+class StringPiece {
+public:
+    StringPiece() :
+        data_(NULL),
+        size_(0)
+        {}
+
+    StringPiece( const char* data , std::size_t size ) :
+        data_(data),
+        size_(size)
+        {}
+
+    StringPiece( const char* str ) :
+        data_(str),
+        size_(strlen(str))
+        {}
+
+    StringPiece( const std::string& str ) :
+        data_(str.data()),
+        size_(str.size())
+        {}
+
+    const char* data() const {
+        return data_;
+    }
+
+    std::size_t size() const {
+        return size_;
+    }
+
+    bool empty() const {
+        return size_ == 0;
+    }
+
+    char operator[]( std::size_t index ) const {
+        assert( index < size_ );
+        return data_[index];
+    }
+
+    std::string ToString() const {
+        return std::string(data_,size_);
+    }
+
+    bool Equals( const StringPiece& other ) const {
+        return size_ == other.size_ && memcmp(data_,other.data_,size_) == 0;
+    }
+
+    // ASCII case insensitive comparison, used for header names and tokens
+    bool EqualsIgnoreCase( const StringPiece& other ) const;
+
+private:
+    const char* data_;
+    std::size_t size_;
+};
+
+inline bool operator == ( const StringPiece& l , const StringPiece& r ) {
+    return l.Equals(r);
+}
+
+inline bool operator != ( const StringPiece& l , const StringPiece& r ) {
+    return !l.Equals(r);
+}
+
 // Endpoint is a class that is used to represent a tuple (ipv4,port). It is a convinient
 // class for user to 1) get endpoint from the string 2) convert this text representation
 // to the real struct inetaddr structure.
@@ -713,25 +1049,16 @@ class Pollable {
 public:
     Pollable() :
         fd_(-1),
-        notify_flag_( NULL ) ,
         is_epoll_read_( false ),
         is_epoll_write_( false ),
+        is_epoll_exclusive_( false ),
         can_read_( false ),
-        can_write_( false )
+        can_write_( false ),
+        is_high_priority_( false ),
+        deferred_event_( NULL )
         {}
 
-    virtual ~Pollable() {
-        // When this pollable gets destructed, its internal
-        // fd MUST be recalimed. It means the fd_ must be
-        // already set to invalid socket handler value
-        assert( fd_ < 0 );
-
-        // Using notify flag to tell the watcher that this
-        // object has already gets deleted since its dtor
-        // has been invoked now
-        if( notify_flag_ != NULL ) 
-            *notify_flag_ = true;
-    }
+    inline virtual ~Pollable();
 
     // Accessor(readonly) for internal states of Socket
     bool is_epoll_read() const {
@@ -762,12 +1089,31 @@ public:
     virtual void OnWriteNotify( ) = 0;
     virtual void OnException( const NetState& ) =0;
 
+    // This function gets called when the peer has shutdown its write side
+    // (EPOLLRDHUP). It is invoked before the read notification of the same
+    // event, and the pollable should not perform any IO inside of it.
+    virtual void OnPeerCloseNotify( ) {}
+
+    // This function gets called by IOManager a few events ahead of the event
+    // of this pollable. It prefetches the memory that the following read or
+    // write notification is going to touch.
+    virtual void Prefetch( ) const {}
+
 protected:
 
     void set_fd( int fd ) {
+        DropDeferredEvent();
         fd_ = fd;
     }
 
+    bool is_high_priority() const {
+        return is_high_priority_;
+    }
+
+    void set_high_priority( bool high ) {
+        is_high_priority_ = high;
+    }
+
     bool can_write() const {
         return can_write_;
     }
@@ -784,26 +1130,19 @@ protected:
         can_read_ = c;
     }
 
-    void set_notify_flag( bool* flag ) {
-        notify_flag_ = flag;
-    }
-
 private:
     // File descriptors
     int fd_;
 
-    // A Hack to get notification whether this object
-    // gets deleted or not. This is a must since we
-    // need to get information whether user has deleted
-    // this object during the callback function or not
-    bool* notify_flag_;
-
     // If this fd has been added to epoll as epoll_read
     bool is_epoll_read_ ;
 
     // If this fd has been added to epoll as epoll_write
     bool is_epoll_write_;
 
+    // If this fd should be added to epoll with EPOLLEXCLUSIVE
+    bool is_epoll_exclusive_;
+
     // Can read. This flag is used when there're data in
     // the kernel for edge trigger
     bool can_read_;
@@ -811,117 +1150,829 @@ private:
     // Can write. This flag is must since we will use edge trigger
     bool can_write_;
 
+    // High priority pollables are dispatched ahead of the others of a batch and
+    // are never deferred by the dispatch budget
+    bool is_high_priority_;
+
+    // The entry of this pollable in the deferred ready list of its IOManager, NULL
+    // when it has none. The list is a deque so the entry never moves.
+    struct epoll_event* deferred_event_;
+
+    // Forget the deferred event, the pollable is no longer dispatched by it
+    void DropDeferredEvent() {
+        if( UNLIKELY(deferred_event_ != NULL) ) {
+            deferred_event_->data.ptr = NULL;
+            deferred_event_ = NULL;
+        }
+    }
+
     friend class ::mnet::IOManager;
     friend class ::mnet::ServerSocket;
 };
 
-}// namespace detail
-
-// Socket represents a communication socket. It can be a socket that is accepted
-// or a socket that initialized by connect. However, for listening, the user should
-// use ServerSocket. This socket will be added into the epoll fd using edge trigger.
-
-class Socket : public detail::Pollable {
+// LivenessGuard tells whether a pollable has been deleted inside of the scope of
+// a user callback invocation. Each thread keeps a log of the pollables destroyed
+// while any guard is alive, and the length of the log serves as a generation
+// counter. A guard only remembers the generation when it is created, so the common
+// case where nothing gets deleted costs a single compare, and the pollable itself
+// is never written. Guards may nest, the log is cleared once the outermost guard
+// goes out of scope.
+class LivenessGuard {
 public:
-    explicit Socket( IOManager* io_manager ) :
-        io_manager_(io_manager),
-        state_( NORMAL ) ,
-        eof_(false) {}
-    // This function serves for retrieving the Local address for the underlying
-    // file descriptor.
-    void GetLocalEndpoint( Endpoint* addr );
-    // This function retrieve the peer side end point address for underlying file
-    // descriptor
-    void GetPeerEndpoint( Endpoint* addr );
-
-    // Operation for user level read and write
-    template< typename T >
-    void AsyncRead( T* notifier );
-
-    template< typename T >
-    void AsyncWrite( T* notifier );
-
-    template< typename T >
-    void AsyncClose( T* notifier );
-
-    // Closing this socket at once. This operation is entirely relied on the OS
-    // no graceful shutdown is performed on each socket. This is OK in most cases,
-    // however, AsyncClose can guarantee the socket been shutdown properly ( with
-    // EOF received by local side).
-    void Close() {
-        assert( state_ == NORMAL );
-        // Ignore the close return status
-        ::close(fd());
-        // Setting the fd to invalid value
-        set_fd(-1);
+    explicit LivenessGuard( const Pollable* pollable ) :
+        pollable_(pollable),
+        generation_(log_size_) {
+        ++depth_;
     }
 
-    const Buffer& read_buffer() const {
-        return read_buffer_;
+    ~LivenessGuard() {
+        if( --depth_ == 0 && UNLIKELY(log_size_ != 0) )
+            ClearLog();
     }
 
-    Buffer& read_buffer() {
-        return read_buffer_;
+    bool deleted() const {
+        if( LIKELY(generation_ == log_size_) )
+            return false;
+        return IsLogged( pollable_ , generation_ );
     }
 
-    const Buffer& write_buffer() const {
-        return write_buffer_;
+    // Called by the destructor of every pollable
+    static void OnDestroy( const Pollable* pollable ) {
+        if( UNLIKELY(depth_ != 0) )
+            Log( pollable );
     }
 
-    Buffer& write_buffer() {
-        return write_buffer_;
-    }
+private:
+    // Whether pollable is in the log since the position from
+    static bool IsLogged( const Pollable* pollable , std::size_t from );
 
-protected:
-    // The following OnRead/OnWrite function is for IOManager private usage.
-    // User should not call this function.
+    static void Log( const Pollable* pollable );
 
-    virtual void OnReadNotify();
-    virtual void OnWriteNotify();
-    virtual void OnException( const NetState& state );
+    static void ClearLog();
 
-    IOManager* io_manager() const {
-        return io_manager_;
-    }
+    const Pollable* pollable_;
+    std::size_t generation_;
 
-private:
-    std::size_t DoRead( NetState* state );
-    std::size_t DoWrite( NetState* state );
+    // The first entries of the log are stored inline, a callback rarely deletes
+    // more pollables than that
+    static const std::size_t kInlineLogSize = 16;
 
-private:
-    // Callback function
-    detail::ScopePtr<detail::ReadCallback> user_read_callback_;
-    detail::ScopePtr<detail::WriteCallback> user_write_callback_;
-    detail::ScopePtr<detail::CloseCallback> user_close_callback_;
+    // Number of guards alive on this thread
+    static __thread int depth_;
 
-    std::size_t prev_write_size_;
+    // Length of the log, which is the generation
+    static __thread std::size_t log_size_;
 
-    // User level buffer management , per socket per buffer.
-    Buffer read_buffer_ ;
-    Buffer write_buffer_;
+    static __thread const Pollable* inline_log_[kInlineLogSize];
 
-    // IO Manager for this socket
-    IOManager* io_manager_;
+    // The rest of the log, allocated on demand
+    static __thread const Pollable** overflow_log_;
+    static __thread std::size_t overflow_capacity_;
 
-    enum {
-        CLOSING,
-        CLOSED,
-        NORMAL // Initial state for the socket
-    };
+    DISALLOW_COPY_AND_ASSIGN(LivenessGuard);
+};
 
-    int state_;
+inline Pollable::~Pollable() {
+    // When this pollable gets destructed, its internal
+    // fd MUST be recalimed. It means the fd_ must be
+    // already set to invalid socket handler value
+    assert( fd_ < 0 );
 
-    // Flag to indicate that whether a EOF has been seen
-    bool eof_;
+    // A deferred event must not reach a deleted pollable
+    DropDeferredEvent();
 
-    DISALLOW_COPY_AND_ASSIGN(Socket);
-};
+    // Tell the guards watching this pollable that it has been deleted
+    LivenessGuard::OnDestroy( this );
+}
 
-// ClientSocket, client socket represents a socket that could be initialize with
-// async connection operation.
-class ClientSocket : public Socket {
-public:
-    explicit ClientSocket( IOManager* io_manager ) :
+// A timer owned by a socket, see Socket::Schedule. The timer heap of the IOManager
+// refers to it, and the socket links it into its own list. Cancelling it drops the
+// callback and unlinks it in O(1), while the heap entry is removed lazily once it
+// reaches the top of the heap or expires.
+struct SocketTimer {
+    SocketTimer() :
+        next(NULL),
+        pprev(NULL),
+        callback(NULL),
+        deadline(0),
+        time(0)
+        {}
+
+    bool IsCancelled() const {
+        return callback == NULL;
+    }
+
+    void Link( SocketTimer** head ) {
+        next = *head;
+        if( next != NULL )
+            next->pprev = &next;
+        pprev = head;
+        *head = this;
+    }
+
+    void Unlink() {
+        if( pprev != NULL ) {
+            *pprev = next;
+            if( next != NULL )
+                next->pprev = pprev;
+            next = NULL;
+            pprev = NULL;
+        }
+    }
+
+    SocketTimer* next;
+    SocketTimer** pprev;
+
+    // The user callback, NULL once the timer is cancelled
+    TimeoutCallback* callback;
+
+    // Absolute expiration time in microseconds
+    uint64_t deadline;
+
+    // The delay in milliseconds that user asked for
+    int time;
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(SocketTimer);
+};
+
+// An intrusive list node that links a connected Socket into the list of its
+// IOManager, so the IOManager can drain every connection on shutdown.
+struct SocketLink {
+    SocketLink() :
+        prev(NULL),
+        next(NULL),
+        socket(NULL)
+        {}
+
+    bool IsLinked() const {
+        return next != NULL;
+    }
+
+    void Unlink() {
+        if( next != NULL ) {
+            prev->next = next;
+            next->prev = prev;
+            prev = next = NULL;
+        }
+    }
+
+    // Insert this node before the node pos
+    void InsertBefore( SocketLink* pos ) {
+        assert( !IsLinked() );
+        prev = pos->prev;
+        next = pos;
+        pos->prev->next = this;
+        pos->prev = this;
+    }
+
+    SocketLink* prev;
+    SocketLink* next;
+
+    // The owner of this node
+    Socket* socket;
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(SocketLink);
+};
+
+// An intrusive list node that links a Socket into the DeadlineWheel. The
+// node is unlinked in O(1) without knowing which slot it lives in.
+struct DeadlineNode {
+    DeadlineNode() :
+        prev(NULL),
+        next(NULL),
+        deadline(0),
+        socket(NULL)
+        {}
+
+    bool IsLinked() const {
+        return next != NULL;
+    }
+
+    void Unlink() {
+        if( next != NULL ) {
+            prev->next = next;
+            next->prev = prev;
+            prev = next = NULL;
+        }
+    }
+
+    DeadlineNode* prev;
+    DeadlineNode* next;
+
+    // The deadline that is used to choose the slot of this node
+    uint64_t deadline;
+
+    // The owner of this node
+    Socket* socket;
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(DeadlineNode);
+};
+
+// DeadlineWheel is a hashed timing wheel that tracks the read and idle deadlines
+// of sockets. The wheel is lazy: a socket that extends its deadline just updates
+// its own fields and stays in the old slot. When the slot expires the socket is
+// checked against its real deadline and linked again if it is still alive. So
+// touching a deadline costs O(1) without any list or heap operation, and a busy
+// socket is only relinked once per slot expiration instead of once per packet.
+class DeadlineWheel {
+public:
+    DeadlineWheel();
+
+    // Set the current time of the wheel, must be called before any Link
+    void Reset( uint64_t now );
+
+    // Link the node into the slot that expires right after deadline
+    void Link( DeadlineNode* node , uint64_t deadline );
+
+    // Move all nodes whose slot has expired at time now into the list
+    // headed by the sentinel node expired
+    void Expire( uint64_t now , DeadlineNode* expired );
+
+    // Return the time when the next non empty slot expires. It returns
+    // kNoDeadline when the wheel is empty
+    uint64_t NextExpiration();
+
+    static const uint64_t kNoDeadline = ~static_cast<uint64_t>(0);
+
+private:
+
+    static void InitSentinel( DeadlineNode* node ) {
+        node->prev = node->next = node;
+    }
+
+    static void AppendList( DeadlineNode* dst , DeadlineNode* src );
+
+    // The time span in microseconds of each slot
+    static const uint64_t kGranularity = 10000;
+    // The number of slots, the wheel covers kSlotSize*kGranularity in one round
+    static const std::size_t kSlotSize = 4096;
+    static const std::size_t kBitsPerWord = 64;
+
+    // Sentinels for each slot
+    DeadlineNode slots_[kSlotSize];
+
+    // A bit is set when the corresponding slot may have nodes. Since nodes are
+    // unlinked without knowing their slot, a bit is cleared lazily when its slot
+    // is found to be empty.
+    uint64_t bitmap_[kSlotSize/kBitsPerWord];
+
+    // The last tick that has been expired
+    uint64_t current_tick_;
+
+    DISALLOW_COPY_AND_ASSIGN(DeadlineWheel);
+};
+
+// MessageRing is a bounded lock free ring of posted notifiers between exactly
+// one producer thread and one consumer thread. The producer and the consumer
+// each cache the other side's index, so the shared cache line is only read
+// when the ring looks full or empty. The backlog is owned by the producer,
+// it keeps the messages in order when the ring is full. The consumer wakes
+// up a producer with a backlog once it has made room.
+class MessageRing {
+public:
+    // The capacity must be a power of 2
+    explicit MessageRing( std::size_t capacity );
+
+    ~MessageRing();
+
+    // Called by the producer, return false if the ring is full
+    bool Push( PostCallback* cb ) {
+        const std::size_t tail = tail_;
+        if( UNLIKELY(tail - head_cache_ == capacity_) ) {
+            head_cache_ = head_;
+            if( tail - head_cache_ == capacity_ )
+                return false;
+        }
+        slot_[tail & (capacity_-1)] = cb;
+        // Publish the slot before the index
+        __sync_synchronize();
+        tail_ = tail + 1;
+        return true;
+    }
+
+    // Called by the consumer, return NULL if the ring is empty
+    PostCallback* Pop() {
+        const std::size_t head = head_;
+        if( head == tail_cache_ ) {
+            tail_cache_ = tail_;
+            if( head == tail_cache_ )
+                return NULL;
+        }
+        __sync_synchronize();
+        PostCallback* cb = slot_[head & (capacity_-1)];
+        // Consume the slot before releasing it to the producer
+        __sync_synchronize();
+        head_ = head + 1;
+        return cb;
+    }
+
+    // Called by the consumer
+    bool Empty() const {
+        return head_ == tail_;
+    }
+
+    // Called by the producer
+    bool Full() const {
+        return tail_ - head_ == capacity_;
+    }
+
+    std::size_t capacity() const {
+        return capacity_;
+    }
+
+    // Owned by the producer
+    std::vector<PostCallback*>& backlog() {
+        return backlog_;
+    }
+
+    // The IOManager that consumes this ring
+    IOManager* consumer() const {
+        return consumer_;
+    }
+
+    void set_consumer( IOManager* consumer ) {
+        consumer_ = consumer;
+    }
+
+    // The IOManager that produces into this ring
+    IOManager* producer() const {
+        return producer_;
+    }
+
+    void set_producer( IOManager* producer ) {
+        producer_ = producer;
+    }
+
+    // Set by the producer while its backlog is not empty, so the consumer
+    // knows to wake it up after popping
+    bool has_backlog() const {
+        return has_backlog_;
+    }
+
+    void set_has_backlog( bool has_backlog ) {
+        has_backlog_ = has_backlog;
+    }
+
+private:
+    static const std::size_t kCacheLineSize = 64;
+
+    PostCallback** slot_;
+    std::size_t capacity_;
+    IOManager* consumer_;
+    IOManager* producer_;
+
+    // Consumer side
+    char pad0_[kCacheLineSize];
+    volatile std::size_t head_;
+    std::size_t tail_cache_;
+
+    // Producer side
+    char pad1_[kCacheLineSize];
+    volatile std::size_t tail_;
+    std::size_t head_cache_;
+    std::vector<PostCallback*> backlog_;
+    volatile bool has_backlog_;
+
+    char pad2_[kCacheLineSize];
+
+    DISALLOW_COPY_AND_ASSIGN(MessageRing);
+};
+
+class ShardMesh;
+
+}// namespace detail
+
+// RateLimiter is a token bucket of bytes that caps the egress rate of sockets. The
+// bucket is refilled at rate bytes per second and holds at most burst bytes. A
+// socket consumes tokens for every byte it writes, and once the bucket is empty
+// the rest of its write buffer waits on a timer of the IOManager instead of being
+// written. It is owned by a socket through Socket::SetRateLimit, or shared by a
+// group of sockets through Socket::SetRateLimitGroup to cap their total rate. The
+// sockets sharing it must belong to the same IOManager.
+class RateLimiter {
+public:
+    RateLimiter( uint64_t bytes_per_sec , std::size_t burst ) :
+        tokens_( static_cast<double>(burst) ),
+        last_refill_(0),
+        next_slot_(0),
+        rate_( bytes_per_sec ),
+        burst_( burst )
+    {
+        assert( bytes_per_sec > 0 && burst > 0 );
+    }
+
+    void set_rate( uint64_t bytes_per_sec , std::size_t burst ) {
+        assert( bytes_per_sec > 0 && burst > 0 );
+        rate_ = bytes_per_sec;
+        burst_ = burst;
+        if( tokens_ > burst_ )
+            tokens_ = static_cast<double>(burst_);
+    }
+
+    uint64_t rate() const {
+        return rate_;
+    }
+
+    std::size_t burst() const {
+        return burst_;
+    }
+
+    // The default burst for a rate, 20 milliseconds worth of bytes but no less
+    // than a few segments
+    static std::size_t DefaultBurst( uint64_t bytes_per_sec ) {
+        return std::max( static_cast<std::size_t>(bytes_per_sec / 50) ,
+                         static_cast<std::size_t>(kMinBurst) );
+    }
+
+private:
+    // Number of bytes that can be written at time now, in microseconds
+    std::size_t Available( uint64_t now );
+
+    void Consume( std::size_t size ) {
+        tokens_ -= static_cast<double>(size);
+    }
+
+    // Reserve the next slot to write size bytes, capped by the burst, and return
+    // the microseconds to wait for it. The slots of the waiting sockets follow each
+    // other so that a group serves them in turn instead of the first one woken.
+    uint64_t Reserve( std::size_t size , uint64_t now );
+
+    static const std::size_t kMinBurst = 4096;
+
+    double tokens_;
+    uint64_t last_refill_;
+    uint64_t next_slot_;
+    uint64_t rate_;
+    std::size_t burst_;
+
+    friend class Socket;
+    DISALLOW_COPY_AND_ASSIGN(RateLimiter);
+};
+
+// Socket represents a communication socket. It can be a socket that is accepted
+// or a socket that initialized by connect. However, for listening, the user should
+// use ServerSocket. This socket will be added into the epoll fd using edge trigger.
+
+class Socket : public detail::Pollable {
+public:
+    explicit Socket( IOManager* io_manager ) :
+        read_deadline_(0),
+        idle_deadline_(0),
+        close_deadline_(0),
+        idle_timeout_(0),
+        io_manager_(io_manager),
+        listener_(NULL),
+        state_( NORMAL ) ,
+        eof_(false),
+        peer_closed_(false),
+        pending_offload_(0),
+        drain_shutdown_(false),
+        timer_list_(NULL),
+        rate_limit_group_(NULL),
+        is_throttled_(false),
+        relay_(NULL),
+        sendfile_fd_(-1),
+        sendfile_offset_(0),
+        sendfile_left_(0) {
+        deadline_node_.socket = this;
+        throttle_notifier_.socket = this;
+        live_link_.socket = this;
+    }
+
+    ~Socket() {
+        // The completion of an offloaded work still refers to this socket
+        assert( pending_offload_ == 0 );
+        deadline_node_.Unlink();
+        live_link_.Unlink();
+        if( timer_list_ != NULL )
+            CancelTimers();
+        if( relay_ != NULL )
+            StopRelay();
+    }
+    // This function serves for retrieving the Local address for the underlying
+    // file descriptor.
+    void GetLocalEndpoint( Endpoint* addr );
+    // This function retrieve the peer side end point address for underlying file
+    // descriptor
+    void GetPeerEndpoint( Endpoint* addr );
+
+    // Return the CPU that processed the packets of this connection in the kernel
+    // (SO_INCOMING_CPU), or -1 if it is unknown.
+    int GetIncomingCpu() const;
+
+    // Limit the egress rate of this socket to bytes_per_sec with a token bucket of
+    // burst bytes, zero means RateLimiter::DefaultBurst. The write buffer is only
+    // written as fast as the tokens allow, and AsyncWrite completes once all of it
+    // has been written. A zero bytes_per_sec removes the limit.
+    void SetRateLimit( uint64_t bytes_per_sec , std::size_t burst = 0 );
+
+    // Share the rate limit of group with other sockets on the same IOManager. It
+    // applies together with the limit of SetRateLimit, and NULL leaves the group.
+    // The group must outlive this socket or be left before it is destroyed.
+    // The group stays on its IOManager: MigrateTo makes the socket leave it and
+    // keep only the limit of SetRateLimit, and the Rebalancer never moves it.
+    void SetRateLimitGroup( RateLimiter* group ) {
+        rate_limit_group_ = group;
+    }
+
+    // Ask the kernel to pace this connection at bytes_per_sec (SO_MAX_PACING_RATE).
+    // Unlike SetRateLimit, the write buffer is handed to the kernel at once and the
+    // packets are spread out by TCP or the fq qdisc. ~0U removes the pacing. Return
+    // false with errno set if the option is not supported.
+    bool SetPacingRate( uint64_t bytes_per_sec );
+
+    enum {
+        PRIORITY_NORMAL,
+        PRIORITY_HIGH
+    };
+
+    // Set the priority class used by the IOManager to order the ready sockets of
+    // a wakeup. The events of PRIORITY_HIGH sockets are dispatched before the
+    // others and are never deferred by IOManager::set_dispatch_budget, which suits
+    // control or latency critical connections sharing a loop with bulk traffic.
+    void set_priority( int priority );
+
+    int priority() const {
+        return is_high_priority() ? PRIORITY_HIGH : PRIORITY_NORMAL;
+    }
+
+    // Operation for user level read and write. When timeout_ms is not zero and
+    // no data arrives within timeout_ms milliseconds, the notifier's OnRead is
+    // invoked with an ETIMEDOUT NetState.
+    template< typename T >
+    void AsyncRead( T* notifier , int timeout_ms = 0 );
+
+    template< typename T >
+    void AsyncWrite( T* notifier );
+
+    // Write the write buffer followed by size bytes of the file fd from offset,
+    // the file part is sent by sendfile(2) without passing through the user space.
+    // The notifier's OnWrite is invoked once everything has been written, the fd
+    // must stay open until then. The rate limits apply to the file part as well.
+    template< typename T >
+    void AsyncSendFile( int fd , off_t offset , std::size_t size , T* notifier );
+
+    // Shutdown the write side and wait for the EOF from the peer. When timeout_ms
+    // is not zero and the EOF does not arrive within timeout_ms milliseconds, the
+    // socket is aborted and the notifier's OnClose is invoked with an ETIMEDOUT
+    // NetState, so a peer that never closes cannot hold the socket forever.
+    template< typename T >
+    void AsyncClose( T* notifier , int timeout_ms = 0 );
+
+    // Closing this socket at once. This operation is entirely relied on the OS
+    // no graceful shutdown is performed on each socket. This is OK in most cases,
+    // however, AsyncClose can guarantee the socket been shutdown properly ( with
+    // EOF received by local side).
+    inline void Close();
+
+    // Closing this socket at once with a RST instead of a FIN, by setting
+    // SO_LINGER with a zero timeout. Data not yet sent is discarded and no
+    // TIME_WAIT entry is left behind, which matters for a server that closes
+    // connections first under high connection churn.
+    void Abort();
+
+    // Move this socket to the target IOManager, which is normally running on
+    // another thread. It must be called from the thread running the current
+    // IOManager. The fd is removed from the current epoll fd once the ongoing
+    // loop iteration finishes, then the socket is registered again by the
+    // target thread with its buffers, pending notifiers, readiness and
+    // deadlines unchanged. The pending notifiers are invoked on the target
+    // thread afterwards. The socket must stay open until the migration is done,
+    // and the notifier's OnMigrate( Socket* ) is invoked on the target thread
+    // by then. A migrated socket no longer counts against the connection limit
+    // of the listener that accepted it, and it leaves its rate limit group.
+    void MigrateTo( IOManager* target ) {
+        DoMigrateTo( target , NULL );
+    }
+
+    template< typename T >
+    void MigrateTo( IOManager* target , T* notifier ) {
+        DoMigrateTo( target , detail::MakeMigrateCallback(notifier) );
+    }
+
+    // Invoke the notifier's OnTimeout( int msec ) after msec milliseconds on the
+    // thread of the IOManager, like IOManager::Schedule. The timer is owned by this
+    // socket: it is cancelled in O(1) when the socket is closed or destroyed, so
+    // the notifier may refer to the socket without checking whether it is alive.
+    // The pending timers follow the socket when it migrates.
+    template< typename T >
+    void Schedule( int msec , T* notifier ) {
+        AddTimer( static_cast<uint64_t>(msec) * 1000 , msec ,
+                  detail::MakeTimeoutCallback(notifier) );
+    }
+
+    // Cancel every pending timer of this socket, their notifiers are not invoked
+    void CancelTimers();
+
+    bool has_pending_timer() const {
+        return timer_list_ != NULL;
+    }
+
+    // Set the idle timeout of this socket. If no data is read or written for msec
+    // milliseconds, the pending read and write notifiers are invoked with an
+    // ETIMEDOUT NetState. The timeout is armed again after each expiration. Set
+    // msec to zero to disable it.
+    void SetIdleTimeout( int msec );
+
+    // Whether the peer has closed the connection. This is known as soon as the
+    // FIN arrives, without reading from the socket, so a connection pool can
+    // check it before handing out an idle connection.
+    bool is_peer_closed() const {
+        return peer_closed_ || eof_;
+    }
+
+    // Whether an offloaded work still refers to this socket, see OffloadPool.
+    // Such a socket can be closed, but must be deleted from the completion.
+    bool has_pending_offload() const {
+        return pending_offload_ != 0;
+    }
+
+    const Buffer& read_buffer() const {
+        return read_buffer_;
+    }
+
+    Buffer& read_buffer() {
+        return read_buffer_;
+    }
+
+    const Buffer& write_buffer() const {
+        return write_buffer_;
+    }
+
+    Buffer& write_buffer() {
+        return write_buffer_;
+    }
+
+protected:
+    // The following OnRead/OnWrite function is for IOManager private usage.
+    // User should not call this function.
+
+    virtual void OnReadNotify();
+    virtual void OnWriteNotify();
+    virtual void OnException( const NetState& state );
+    virtual void OnPeerCloseNotify();
+    virtual void Prefetch() const {
+        read_buffer_.PrefetchWrite();
+    }
+
+    IOManager* io_manager() const {
+        return io_manager_;
+    }
+
+private:
+    std::size_t DoRead( NetState* state );
+    std::size_t DoWrite( NetState* state );
+
+    // Reset the idle deadline since there is IO activity on this socket. The
+    // deadline wheel is not touched here, the socket is relinked lazily.
+    inline void Touch();
+
+    // Make sure the socket is linked into the deadline wheel no later than its
+    // earliest deadline
+    void ArmDeadline();
+
+    // Called by IOManager when the slot of this socket has expired
+    void OnDeadline();
+
+    void DoMigrateTo( IOManager* target , detail::MigrateCallback* callback );
+
+    // The migration runs in 2 steps, each as a task posted to the IOManager
+    // that owns the step. The first one detaches the socket from the source
+    // IOManager after its dispatch loop, the second one attaches it to the
+    // target IOManager.
+    struct MigrateTask {
+        Socket* socket;
+        IOManager* target;
+        detail::MigrateCallback* callback;
+        bool is_epoll_read;
+        bool is_epoll_write;
+        bool detached;
+        // The pending timers, scheduled again on the target
+        std::vector<detail::SocketTimer*> timer;
+        void OnPost();
+    };
+
+    void AddTimer( uint64_t usec , int msec , detail::TimeoutCallback* cb );
+
+    // Write as much of the write buffer as the kernel and the rate limits accept,
+    // and invoke the write notifier once it is empty
+    void FlushWrite();
+
+    // Number of bytes the rate limits allow to be written now
+    std::size_t WriteAllowance();
+
+    // Charge the rate limits for size bytes written
+    void ChargeWrite( std::size_t size );
+
+    // Wait on a timer until the rate limits allow the write buffer to be written
+    void ThrottleWrite();
+
+    // Stop the relay when the socket is closed or destroyed while it runs
+    void StopRelay();
+
+    // Write the write buffer and then the file of AsyncSendFile
+    std::size_t DoSendFile( NetState* ok );
+
+    struct ThrottleNotifier {
+        void OnTimeout( int msec );
+        Socket* socket;
+    };
+
+private:
+    // Deadlines in microseconds on the IOManager's clock, zero means no deadline
+    uint64_t read_deadline_;
+    uint64_t idle_deadline_;
+    uint64_t close_deadline_;
+
+    // Idle timeout in microseconds, zero means disabled
+    uint64_t idle_timeout_;
+
+    // Node for linking into the IOManager's deadline wheel
+    detail::DeadlineNode deadline_node_;
+
+    // Callback function
+    detail::ScopePtr<detail::ReadCallback> user_read_callback_;
+    detail::ScopePtr<detail::WriteCallback> user_write_callback_;
+    detail::ScopePtr<detail::CloseCallback> user_close_callback_;
+
+    std::size_t prev_write_size_;
+
+    // User level buffer management , per socket per buffer.
+    Buffer read_buffer_ ;
+    Buffer write_buffer_;
+
+    // IO Manager for this socket
+    IOManager* io_manager_;
+
+    // The listener that accepted this socket. It is only set when the listener
+    // limits the number of concurrent connections, so closing the socket can
+    // release its slot.
+    ServerSocket* listener_;
+
+    enum {
+        CLOSING,
+        CLOSED,
+        NORMAL // Initial state for the socket
+    };
+
+    int state_;
+
+    // Flag to indicate that whether a EOF has been seen
+    bool eof_;
+
+    // Flag to indicate that the peer has shutdown its write side. Once this
+    // is set, a short read means all data has been drained and the EOF can
+    // be replayed without another readv returning zero.
+    bool peer_closed_;
+
+    // Number of offloaded works whose completion is not invoked yet
+    std::size_t pending_offload_;
+
+    // Node for linking into the IOManager's list of connected sockets
+    detail::SocketLink live_link_;
+
+    // Whether the write side has been shutdown by IOManager::Drain
+    bool drain_shutdown_;
+
+    // Timers owned by this socket
+    detail::SocketTimer* timer_list_;
+
+    // The rate limit of this socket and the one shared with a group, NULL
+    // if there is none
+    detail::ScopePtr<RateLimiter> rate_limit_;
+    RateLimiter* rate_limit_group_;
+
+    // Resumes the write once the rate limits allow it
+    ThrottleNotifier throttle_notifier_;
+
+    // Whether the write is waiting on the throttle timer
+    bool is_throttled_;
+
+    // The relay this socket is part of, it takes over the read and write
+    // notifications while it runs
+    Relay* relay_;
+
+    // The file of a pending AsyncSendFile, sendfile_left_ is zero if there is none
+    int sendfile_fd_;
+    off_t sendfile_offset_;
+    std::size_t sendfile_left_;
+
+    friend class IOManager;
+    friend class ServerSocket;
+    friend class Rebalancer;
+    friend class OffloadPool;
+    friend class Relay;
+    DISALLOW_COPY_AND_ASSIGN(Socket);
+};
+
+// ClientSocket, client socket represents a socket that could be initialize with
+// async connection operation.
+class ClientSocket : public Socket {
+public:
+    explicit ClientSocket( IOManager* io_manager ) :
         Socket( io_manager ) ,
         state_( DISCONNECTED )
         {}
@@ -960,12 +2011,34 @@ private:
 // be added into the epoll fd by level trigger. This is specifically needed if we
 // want to loop through different epoll set and allow level trigger just make code
 // simpler
+//
+// ServerSocket also performs admission control. When the listener is overloaded it
+// stops watching the listen fd and leaves the pending connections in the kernel
+// backlog, instead of accepting them and dropping them at once. Accepting resumes
+// automatically once the condition is cleared, and each pause is reported to the
+// shed notifier if there is one.
 class ServerSocket : public detail::Pollable {
 public:
     ServerSocket();
 
     ~ServerSocket();
 
+    // Reasons for pausing the accept operation, passed to OnShed
+    enum {
+        SHED_MAX_CONNECTION, // Too many concurrent connections
+        SHED_ACCEPT_RATE,    // The accept rate limit is exceeded
+        SHED_QUEUE_DELAY,    // The IOManager's loop delay is too large
+        SHED_RUN_OUT_OF_FD   // accept failed with EMFILE/ENFILE
+    };
+
+    // Counters for the admission control
+    struct AdmissionStats {
+        // Number of connections accepted
+        uint64_t accepted;
+        // Number of pauses for each shed reason
+        uint64_t shed[SHED_RUN_OUT_OF_FD+1];
+    };
+
     // Set the underlying IOManager 
     inline void SetIOManager( IOManager* io_manager );
 
@@ -973,6 +2046,36 @@ public:
     // to listen. (This function is equavlent for bind + listen)
     bool Bind( const Endpoint& ep );
 
+    // Set SO_REUSEPORT on the listen fd, so several ServerSockets can bind to the
+    // same endpoint and the kernel distributes connections among them. This must
+    // be set before Bind.
+    void set_reuse_port( bool reuse_port ) {
+        reuse_port_ = reuse_port;
+    }
+
+    // Attach a classic BPF program to the SO_REUSEPORT group of this listener. It
+    // sends every new connection to the listener whose index in the group is the
+    // CPU that received the connection, modulo group_size. A listener's index is
+    // the order in which it was bound, so the listener served by the IOManager
+    // pinned to CPU i should be bound i-th.
+    bool SteerByIncomingCpu( std::size_t group_size );
+
+    // Take the ownership of a file descriptor that is already listening, for
+    // example one inherited from systemd. The fd is set to non blocking.
+    bool Adopt( int fd );
+
+    // Listen on the same socket as listener through a duplicated fd. This allows
+    // several IOManagers, each with its own ServerSocket, to accept connections
+    // from a single listening socket.
+    bool ShareFrom( const ServerSocket& listener );
+
+    // Watch the listen fd with EPOLLEXCLUSIVE. When several IOManagers watch the
+    // same listening socket, a new connection then wakes up only one of them
+    // instead of all of them. This must be set before SetIOManager.
+    void set_exclusive( bool exclusive ) {
+        is_epoll_exclusive_ = exclusive;
+    }
+
     // Accept operations. Indeed this operation will not be held
     // by IOManager since IOManager only notify read/write operations.
     // It is for specific socket that has different states to interpret
@@ -980,6 +2083,44 @@ public:
     template< typename T >
     void AsyncAccept( Socket* socket , T* notifier );
 
+    // Limit the number of concurrent connections accepted by this listener.
+    // A connection is released when its Socket is closed, so the ServerSocket
+    // must outlive the sockets it accepts. Zero means unlimited.
+    void SetMaxConnection( std::size_t max_connection ) {
+        max_connection_ = max_connection;
+    }
+
+    // Limit the accept rate with a token bucket that is refilled with rate
+    // tokens per second and holds at most burst tokens. Zero rate disables it.
+    void SetAcceptRate( double rate , std::size_t burst );
+
+    // Stop accepting for a while when the IOManager's loop delay is more than
+    // msec milliseconds. Zero disables it.
+    void SetMaxQueueDelay( int msec ) {
+        max_queue_delay_ = static_cast<uint64_t>(msec) * 1000;
+    }
+
+    // Register a notifier whose OnShed( ServerSocket* , int reason ) function is
+    // invoked each time the accept operation gets paused.
+    template< typename T >
+    void SetShedNotifier( T* notifier ) {
+        shed_callback_.Reset( detail::MakeShedCallback(notifier) );
+    }
+
+    const AdmissionStats& admission_stats() const {
+        return stats_;
+    }
+
+    // Number of accepted sockets that are not closed yet. It is only tracked
+    // when the connection limit is set.
+    std::size_t active_connection() const {
+        return active_connection_;
+    }
+
+    bool is_paused() const {
+        return is_paused_;
+    }
+
     IOManager* io_manager() const {
         return io_manager_;
     }
@@ -999,28 +2140,330 @@ private:
 
     int DoAccept( NetState* state );
 
-    void HandleRunOutOfFD( int err );
+    // Register a newly accepted socket and count it against the connection limit
+    void SetupConnection( Socket* socket );
+
+    // Check the admission rules before accepting. If any of them is violated
+    // the accept operation is paused and false is returned.
+    bool Admit();
+
+    // Stop watching the listen fd. If backoff is not zero, resume it after
+    // backoff microseconds.
+    void Pause( int reason , uint64_t backoff );
+
+    // Start watching the listen fd again
+    void Resume();
+
+    // Stop accepting for good, called when the IOManager starts draining
+    void StopAccept();
+
+    // Called when an accepted Socket is closed
+    void OnConnectionClosed();
+
+    // The time in microseconds to wait before accepting again after running
+    // out of file descriptors
+    static const uint64_t kRunOutOfFDBackoff = 10000;
+
+    // Helper notifier for resuming after the backoff. It is detached when the
+    // ServerSocket is destroyed before the timer fires.
+    struct ResumeNotifier {
+        void OnTimeout( int msec );
+        ServerSocket* server;
+    };
 
 private:
     // User callback function
     detail::ScopePtr<detail::AcceptCallback> user_accept_callback_;
     Socket* new_accept_socket_;
 
-    // The following fd is used to gracefully shutdown the remote the
-    // remote connection when we are run out the FD (EMFILE/ENFILE).
-    int dummy_fd_;
+    // User shed notifier
+    detail::ScopePtr<detail::ShedCallback> shed_callback_;
 
     // This field represents the manager that this listener has been added
     // If it sets to zero, it means the listener has no attached IOManager
     IOManager* io_manager_;
 
+    // Admission control settings, zero means disabled
+    std::size_t max_connection_;
+    double accept_rate_;
+    double accept_burst_;
+    uint64_t max_queue_delay_;
+
+    // Token bucket state for the accept rate
+    double tokens_;
+    uint64_t last_refill_;
+
+    // Number of accepted sockets that are not closed yet
+    std::size_t active_connection_;
+
+    // Pending resume timer, NULL if there is none
+    ResumeNotifier* resume_notifier_;
+
+    AdmissionStats stats_;
+
     // This flag is used to tell the state of the current listener
     bool is_bind_;
 
+    // Whether the listen fd is removed from the epoll fd
+    bool is_paused_;
+
+    // Whether the accept operation is stopped by IOManager::Drain
+    bool is_stopped_;
+
+    // See set_reuse_port()
+    bool reuse_port_;
+
     friend class IOManager;
+    friend class Socket;
     DISALLOW_COPY_AND_ASSIGN(ServerSocket);
 };
 
+// FdWatcher watches the readiness of any file descriptor that is not a socket
+// managed by this library, e.g. a pipe to a child process, an eventfd, a timerfd,
+// an inotify fd or a fd owned by another library. The readiness is dispatched by
+// the same loop as the sockets, so no extra thread is needed to integrate them.
+// The fd must be non-blocking, and the watcher performs no IO on it.
+//
+// With edge trigger the fd is registered once for both directions, and a notifier
+// is only invoked again after the fd has been read or written until EAGAIN. A
+// readiness that arrives while no notifier waits for it is remembered, so the
+// next wait completes at once. With level trigger the notifier is invoked as long
+// as the fd is ready, and the fd is only watched in the directions that have a
+// waiting notifier.
+class FdWatcher : public detail::Pollable {
+public:
+    enum {
+        EDGE_TRIGGER,
+        LEVEL_TRIGGER
+    };
+
+    explicit FdWatcher( IOManager* io_manager ) :
+        io_manager_( io_manager ),
+        trigger_( EDGE_TRIGGER )
+        {}
+
+    // Start watching fd, the watcher does not take the ownership of fd until Close
+    // is called. It must not be watched already.
+    void Attach( int fd , int trigger = EDGE_TRIGGER );
+
+    // Stop watching and return the fd without closing it. The pending notifiers
+    // are dropped without being invoked.
+    int Detach();
+
+    // Stop watching and close the fd. The pending notifiers are dropped without
+    // being invoked.
+    void Close();
+
+    // Invoke the notifier's OnReadable( FdWatcher* , const NetState& ) once the fd
+    // is readable. An error reported on the fd is passed as the NetState.
+    template< typename T >
+    void AsyncWaitReadable( T* notifier );
+
+    // Invoke the notifier's OnWritable( FdWatcher* , const NetState& ) once the fd
+    // is writable.
+    template< typename T >
+    void AsyncWaitWritable( T* notifier );
+
+    int trigger() const {
+        return trigger_;
+    }
+
+    IOManager* io_manager() const {
+        return io_manager_;
+    }
+
+public:
+    virtual void OnReadNotify();
+    virtual void OnWriteNotify();
+    virtual void OnException( const NetState& state );
+
+private:
+    // Watch the directions that have a waiting notifier, only used by level trigger
+    void UpdateInterest();
+
+    detail::ScopePtr<detail::WatchCallback> user_readable_callback_;
+    detail::ScopePtr<detail::WatchCallback> user_writable_callback_;
+
+    IOManager* io_manager_;
+
+    int trigger_;
+
+    DISALLOW_COPY_AND_ASSIGN(FdWatcher);
+};
+
+// SignalWatcher receives signals through a signalfd watched by the IOManager, so
+// a signal is handled on the loop thread like any other event, instead of inside
+// of an asynchronous signal handler.
+class SignalWatcher {
+public:
+    explicit SignalWatcher( IOManager* io_manager ) :
+        watcher_( io_manager ),
+        reader_( this )
+    {
+        sigemptyset( &mask_ );
+    }
+
+    ~SignalWatcher();
+
+    // Add signo to the watched signals. The signal is blocked on the calling thread,
+    // since otherwise it would still be delivered to a signal handler. Threads created
+    // afterwards inherit the signal mask, so it should be called before any other
+    // thread is created. Return false with errno set on failure.
+    bool Add( int signo );
+
+    // Invoke the notifier's OnSignal( int signo ) once a watched signal arrives. The
+    // signals that arrive while no notifier waits are queued.
+    template< typename T >
+    void AsyncWait( T* notifier );
+
+private:
+    struct Reader {
+        explicit Reader( SignalWatcher* w ) : watcher(w) {}
+        void OnReadable( FdWatcher* fd_watcher , const NetState& ok );
+        SignalWatcher* watcher;
+    };
+
+    // Read every pending signal from the signalfd
+    void ReadSignal();
+
+    sigset_t mask_;
+
+    FdWatcher watcher_;
+
+    Reader reader_;
+
+    // Signals arrived but not notified yet
+    std::deque<int> pending_signal_;
+
+    detail::ScopePtr<detail::SignalCallback> user_signal_callback_;
+
+    DISALLOW_COPY_AND_ASSIGN(SignalWatcher);
+};
+
+// Relay forwards the bytes between two connected sockets inside of the kernel.
+// Each direction owns a pipe, the bytes are spliced from the source socket into
+// the pipe and from the pipe into the other socket, so they are never copied into
+// the user space. It is driven by the edge triggered notifications of the sockets.
+// A direction stops reading once its pipe is full and the other socket cannot take
+// more, so TCP pushes the back pressure to the sender. The EOF of a direction is
+// forwarded as a shutdown of the write side of the other socket.
+class Relay {
+public:
+    Relay() :
+        pipe_size_(0),
+        is_running_(false)
+    {
+        channel_[0].Clear();
+        channel_[1].Clear();
+    }
+
+    ~Relay() {
+        Stop();
+    }
+
+    // Set the capacity of the pipes before Start, zero keeps the default of the
+    // system. A larger pipe moves more bytes per splice when the peer is fast.
+    void set_pipe_size( std::size_t size ) {
+        pipe_size_ = size;
+    }
+
+    // Start relaying between the connected sockets a and b, which must belong to
+    // the same IOManager and have no pending read, write or close. The bytes that
+    // are already in a read buffer are forwarded first. The notifier's
+    // OnRelayEnd( Relay* , const NetState& ) is invoked once both directions have
+    // forwarded their EOF, or at the first error. The sockets are detached from the
+    // relay at that point and can be closed or deleted, and so can the relay. It may
+    // be invoked before Start returns, when the sockets have their EOF or an error
+    // already, so the caller must not use the relay after Start unless is_running()
+    // was checked first. Return false with errno set if the pipes cannot be created.
+    template< typename T >
+    bool Start( Socket* a , Socket* b , T* notifier );
+
+    // Detach the sockets without invoking the notifier. The bytes left in the pipes
+    // are dropped.
+    void Stop();
+
+    bool is_running() const {
+        return is_running_;
+    }
+
+    // Bytes forwarded from a to b and from b to a
+    uint64_t a_to_b_bytes() const {
+        return channel_[0].bytes;
+    }
+
+    uint64_t b_to_a_bytes() const {
+        return channel_[1].bytes;
+    }
+
+private:
+    // One direction of the relay
+    struct Channel {
+        void Clear() {
+            from = to = NULL;
+            pipe[0] = pipe[1] = -1;
+            capacity = 0;
+            pending = 0;
+            bytes = 0;
+            eof = done = false;
+        }
+        Socket* from;
+        Socket* to;
+        int pipe[2];
+        // Size of the pipe and the bytes in it
+        std::size_t capacity;
+        std::size_t pending;
+        // Bytes forwarded to the other socket
+        uint64_t bytes;
+        // The source has reached EOF
+        bool eof;
+        // The EOF has been forwarded
+        bool done;
+    };
+
+    bool Setup( Socket* a , Socket* b );
+
+    // Move the bytes of channel until neither side can make progress
+    bool Pump( Channel* channel , NetState* state );
+
+    // Write the bytes left in the write buffer of the target socket
+    bool FlushBuffer( Channel* channel , NetState* state );
+
+    // Pump channel and finish the relay once it fails or both directions are done
+    void Run( Channel* channel );
+
+    // Pump both directions first, then finish as Run does. The notifier may
+    // delete the relay, so nothing is touched after it.
+    void RunBoth();
+
+    // Called by the sockets instead of their own notifications
+    void OnReadNotify( Socket* socket ) {
+        Run( socket == channel_[0].from ? &channel_[0] : &channel_[1] );
+    }
+
+    void OnWriteNotify( Socket* socket ) {
+        Run( socket == channel_[0].to ? &channel_[0] : &channel_[1] );
+    }
+
+    void OnException( const NetState& state ) {
+        Finish( state );
+    }
+
+    void Finish( const NetState& state );
+
+    Channel channel_[2];
+
+    std::size_t pipe_size_;
+
+    bool is_running_;
+
+    detail::ScopePtr<detail::RelayCallback> user_relay_callback_;
+
+    friend class Socket;
+
+    DISALLOW_COPY_AND_ASSIGN(Relay);
+};
+
 // IOManager class represents the reactor. It performs socket event notification
 // and also timeout notification. This IOManager is a truely reactor, it spawn the
 // notification when the IO event is ready ( performs the IO without blocking ).
@@ -1037,15 +2480,239 @@ class IOManager {
 public:
     IOManager( std::size_t cap=0 );
 
-    ~IOManager();
+    ~IOManager();
+
+    // Schedule a notifier that is to be invoked after msec milliseconds passed
+    template< typename T >
+    void Schedule( int msec , T* notifier );
+
+    // Schedule a notifier that is to be invoked after usec microseconds passed.
+    // The notifier's OnTimeout receives the delay rounded down to milliseconds.
+    template< typename T >
+    void ScheduleInUS( uint64_t usec , T* notifier );
+
+    // Pin the calling thread, which must be the thread running this IOManager,
+    // to the cpu. It returns false if the affinity cannot be set.
+    bool PinToCpu( int cpu );
+
+    // The cpu this IOManager is pinned to, -1 if it is not pinned
+    int cpu() const {
+        return cpu_;
+    }
+
+    // Move the memory owned by this IOManager, the swap buffer and the epoll
+    // event queue, onto the NUMA node of the calling thread. It must be called
+    // from the thread running this IOManager, normally right after PinToCpu.
+    // Called from a notifier, the event queue is moved at the next iteration.
+    // The pages are bound to the node with mbind when the kernel supports it,
+    // otherwise they are placed by first touch from the calling thread. Buffer
+    // memory is allocated lazily by the loop thread and is local already once
+    // the thread is pinned. It returns false if the node cannot be resolved.
+    bool PlaceOnLocalNode();
+
+    // The NUMA node of the memory placed by PlaceOnLocalNode, -1 before it is
+    // called
+    int numa_node() const {
+        return numa_node_;
+    }
+
+    // Page placement of memory relative to numa_node()
+    struct NumaReport {
+        std::size_t local_pages;
+        std::size_t remote_pages;
+        // Pages that are not backed by physical memory yet
+        std::size_t unmapped_pages;
+        NumaReport() :
+            local_pages(0),
+            remote_pages(0),
+            unmapped_pages(0)
+        {}
+    };
+
+    // Report the placement of the memory owned by this IOManager
+    NumaReport GetNumaReport() const;
+
+    // Add the placement of an arbitrary region, for example the memory of a
+    // Buffer, to the report. It returns false if the placement is unknown.
+    bool CheckNumaPlacement( const void* mem , std::size_t len ,
+                             NumaReport* report ) const;
+
+    // Current time in microseconds on CLOCK_MONOTONIC. The value is cached and
+    // refreshed once per loop iteration, so calling it costs no system call.
+    uint64_t Now() const {
+        return now_;
+    }
+
+    // Timers whose deadline falls within slack microseconds of the current
+    // time are fired together in a single wake up. A larger slack means fewer
+    // wake ups when many deadlines are close to each other.
+    void set_timer_slack( uint64_t usec ) {
+        timer_slack_ = usec;
+    }
+
+    uint64_t timer_slack() const {
+        return timer_slack_;
+    }
+
+    // Watch both directions of each socket with a single EPOLL_CTL_ADD when it is
+    // accepted or connected, so no epoll_ctl is issued for the rest of its
+    // lifetime. By default each direction is added lazily on its first use,
+    // which costs an EPOLL_CTL_ADD and an EPOLL_CTL_MOD for a socket that both
+    // reads and writes. This must be set before any socket is attached.
+    void set_register_once( bool register_once ) {
+        register_once_ = register_once;
+    }
+
+    bool register_once() const {
+        return register_once_;
+    }
+
+    // Set the number of events fetched by each epoll_wait. Zero means adaptive
+    // sizing, which is the default: the batch doubles when epoll_wait fills it
+    // and halves after it has been mostly empty for a while. The new size takes
+    // effect after the current loop iteration.
+    void set_event_batch_size( std::size_t size ) {
+        fixed_event_batch_ = size;
+    }
+
+    std::size_t event_batch_size() const {
+        return event_queue_.size();
+    }
+
+    // Set how many events ahead the DispatchLoop prefetches the pollables and
+    // their buffers. Zero disables prefetching, which is the default.
+    void set_prefetch_distance( std::size_t distance ) {
+        prefetch_distance_ = distance;
+    }
+
+    // Set the number of normal priority events dispatched in one loop iteration,
+    // zero means no limit, which is the default. The ready events beyond the budget
+    // are deferred to the following iterations, which then poll without blocking,
+    // so the high priority sockets of the next batch don't wait behind them. See
+    // Socket::set_priority.
+    void set_dispatch_budget( std::size_t budget ) {
+        dispatch_budget_ = budget;
+        if( budget != 0 )
+            dispatch_by_priority_ = true;
+    }
+
+    // Number of ready events waiting in the deferred ready list
+    std::size_t deferred_event_count() const {
+        return deferred_event_.size();
+    }
+
+    // Number of times epoll_wait returned with at least one event
+    uint64_t wakeup_count() const {
+        return wakeup_count_;
+    }
+
+    // Number of epoll_ctl system calls issued by this IOManager
+    uint64_t epoll_ctl_count() const {
+        return epoll_ctl_count_;
+    }
+
+    // Number of entries in the timer heap, including the cancelled socket timers
+    // that are not dropped yet
+    std::size_t timer_count() const {
+        return timer_queue_.size();
+    }
+
+    // The time in microseconds that the last loop iteration spent on running
+    // callbacks, which is how long a newly arrived event has to wait.
+    uint64_t loop_delay() const {
+        return loop_delay_;
+    }
+
+    // CPU time in microseconds consumed by the thread running this IOManager.
+    // It can be called from any thread, and returns false unless the loop is
+    // running or once the loop thread has exited.
+    bool GetCpuTime( uint64_t* usec ) const;
+
+    // Post a notifier whose OnPost() is to be invoked on the thread running
+    // this IOManager. It could be safely called from another thread, and the
+    // notifier is invoked after the dispatch of the current loop iteration.
+    // Only the first post to an idle IOManager pays for a wake up.
+    template< typename T >
+    void Post( T* notifier ) {
+        AddPostedTask( detail::MakePostCallback(notifier) );
+    }
+
+    // The IOManager whose RunMainLoop is running on the calling thread, NULL
+    // if there is none
+    static IOManager* Current() {
+        return current_;
+    }
+
+    // Drain this IOManager and make its RunMainLoop return. It could be safely
+    // called from another thread. The listeners stop accepting, and every
+    // connected socket gets its write side shutdown once its write buffer is
+    // flushed and no offloaded work is pending on it. When all of them have
+    // been closed by the peer, or timeout_ms milliseconds passed, the remaining
+    // sockets are closed and the RunMainLoop returns. A socket closed by the
+    // peer sees the EOF on its pending read, a socket still busy sees ESHUTDOWN
+    // on its pending operations, and a socket with a pending AsyncClose is told
+    // through its close notifier.
+    void Drain( int timeout_ms ) {
+        DoDrain( timeout_ms , NULL );
+    }
+
+    // Drain with a notifier whose OnDrainClose( Socket* , const NetState& ) is
+    // invoked for every socket the drain closes, after its pending operations
+    // are notified, so the owner can delete it. The state is ESHUTDOWN for a
+    // socket that was still busy. A socket with a pending AsyncClose is only
+    // told through its close notifier.
+    template< typename T >
+    void Drain( int timeout_ms , T* notifier ) {
+        DoDrain( timeout_ms , detail::MakeDrainCallback(notifier) );
+    }
+
+    struct DrainStats {
+        // Sockets that were flushed and closed by the peer, or closed by user
+        std::size_t clean;
+        // Sockets that were still busy when the timeout passed
+        std::size_t forced;
+        DrainStats() :
+            clean(0),
+            forced(0)
+        {}
+    };
+
+    // It is valid once the RunMainLoop has returned after Drain
+    const DrainStats& drain_stats() const {
+        return drain_stats_;
+    }
 
-    // Schedule a notifier that is to be invoked after msec milliseconds passed
-    template< typename T >
-    void Schedule( int msec , T* notifier );
+    bool is_draining() const {
+        return is_draining_;
+    }
 
     // Calling this function will BLOCK the IOManager into the main loop
     NetState RunMainLoop();
 
+    // Run a single iteration of the main loop. It waits at most timeout_ms
+    // milliseconds for IO events, -1 means no limit, then dispatches them together
+    // with the due timers, deadlines, posted notifiers and shard messages. It lets
+    // a host event loop drive this IOManager, e.g. RunOnce(0) once per tick of a
+    // simulation. Interrupt makes a blocked RunOnce return at once. None of
+    // RunMainLoop, RunOnce and RunFor can be called from inside of a notifier
+    // of this IOManager, the dispatch of the outer iteration is still ongoing.
+    NetState RunOnce( int timeout_ms = 0 );
+
+    // Run the main loop for msec milliseconds, or until Interrupt is called
+    NetState RunFor( int msec );
+
+    // The epoll fd becomes readable whenever there are IO events to dispatch, so
+    // the whole IOManager can be nested inside of another poller. Watch it for
+    // read and call RunOnce(0) when it is ready or NextTimeout has elapsed.
+    int epoll_fd() const {
+        return epoll_fd_;
+    }
+
+    // Milliseconds until the earliest timer or deadline, rounded up. It is 0 if
+    // posted notifiers or shard messages are pending, and -1 if there is nothing
+    // to wait for except IO events.
+    int NextTimeout();
+
     // This function could be safely called from another thread. It will
     // wake up a blocked IOManager for that thread. Once calling from this
     // one, the RunMainLoop will return with an empty NetState .
@@ -1057,6 +2724,19 @@ private:
     void WatchRead( detail::Pollable* pollable );
     void WatchWrite( detail::Pollable* pollable );
 
+    // Remove the pollable from the epoll fd
+    void Unwatch( detail::Pollable* pollable );
+
+    // Called when a socket is accepted or connected. It watches both directions
+    // in register once mode, otherwise it does nothing
+    void WatchSocket( detail::Pollable* pollable );
+
+    // Watch exactly the given directions of the pollable, with edge or level
+    // trigger. It is used by FdWatcher, whose fd is not a socket.
+    void WatchFd( detail::Pollable* pollable , bool read , bool write , bool edge );
+
+    void EpollCtl( int op , int fd , struct epoll_event* ev );
+
     // This function is used here to avoid potential stack overflow for accepting
     // function
     template< typename T >
@@ -1069,7 +2749,126 @@ private:
 private:
 
     void DispatchLoop( const struct epoll_event* evnt , std::size_t sz );
-    uint64_t UpdateTimer( std::size_t event_sz , uint64_t prev_timer );
+
+    // Dispatch a single event to its pollable
+    inline void DispatchEvent( const struct epoll_event& event );
+
+    // Dispatch the high priority events of the batch first, then the deferred
+    // events and the rest of the batch until the dispatch budget runs out. The
+    // events left over go to the deferred ready list
+    void DispatchByPriority( const struct epoll_event* evnt , std::size_t sz );
+
+    // Grow or shrink the event queue according to the last epoll_wait result
+    void AdjustEventBatch( std::size_t ready );
+
+    // Reallocate the event queue, so it is first touched by the calling thread
+    void PlaceEventQueue();
+
+    // Invoke every timer that is due according to the cached clock
+    void UpdateTimer();
+
+    // Block on the epoll fd until an event arrives, the earliest timer expires or
+    // the absolute time limit is reached. The timeout is passed to epoll_pwait2 in
+    // nanoseconds; on kernels without it the timerfd_ is armed with the absolute
+    // deadline instead.
+    int WaitEvent( struct epoll_event* event_queue , int length , uint64_t limit );
+
+    // Make this IOManager the one running on the calling thread, and return the
+    // previous one to be restored by LeaveLoop
+    IOManager* EnterLoop();
+    void LeaveLoop( IOManager* previous );
+
+    // Run a single iteration of the main loop, blocking no later than limit. It
+    // returns true if the loop has been interrupted or failed, the failure is
+    // stored in state.
+    bool RunIteration( uint64_t limit , NetState* state );
+
+    void AddTimer( uint64_t usec , int msec , detail::TimeoutCallback* cb );
+
+    // Used by Socket. The heap entry of a socket timer refers to the timer, and
+    // is dropped lazily once the timer is cancelled. The heap is rebuilt without
+    // the cancelled entries when they make up half of it.
+    void AddSocketTimer( detail::SocketTimer* timer );
+    void OnSocketTimerCancelled();
+    void PurgeCancelledTimer();
+
+    // The heap is not purged while it has fewer cancelled entries than this
+    static const std::size_t kMinPurgeTimer = 64;
+
+    // Return the absolute time of the next timer or deadline wheel expiration
+    uint64_t NextWakeUpTime();
+
+    void AddPostedTask( detail::PostCallback* cb );
+
+    // Send a notification to the control fd
+    void SendCtrlData();
+
+    // Used by ShardMesh. The inbound rings are polled once per loop iteration,
+    // and the rings with a backlog are flushed until the backlog is drained.
+    // The loop only skips blocking for a backlog ring that has room, otherwise
+    // its consumer wakes it up after popping.
+    void AddInboundRing( detail::MessageRing* ring );
+    void AddBacklogRing( detail::MessageRing* ring );
+    void RemoveMessageRing( detail::MessageRing* ring );
+
+    // Invoke the messages of the inbound rings and flush the backlog rings
+    void PollMessageRing();
+
+    // Move the backlog of the rings into the rings as far as they fit
+    void FlushBacklogRing();
+
+    // Wake up the loop only if it is blocking or about to block in epoll_wait
+    void WakeUpIfSleeping() {
+        if( sleeping_ && __sync_bool_compare_and_swap( &sleeping_ , 1 , 0 ) )
+            SendCtrlData();
+    }
+
+    // Whether epoll_wait must not block due to pending messages
+    bool HasPendingMessage() const;
+
+    // Invoke the posted notifiers until none is left
+    void ExecutePostedTasks();
+
+    // Link a connected socket into the list of live sockets
+    void LinkSocket( Socket* socket ) {
+        socket->live_link_.InsertBefore( &live_socket_ );
+    }
+
+    // Called when a linked socket is closed
+    void OnSocketClosed() {
+        if( UNLIKELY(is_draining_) )
+            ++drain_stats_.clean;
+    }
+
+    // The drain is started on the loop thread by a posted DrainTask, and
+    // checked by a DrainNotifier timer until it finishes
+    struct DrainTask {
+        IOManager* io_manager;
+        uint64_t timeout;
+        detail::DrainCallback* callback;
+        void OnPost();
+    };
+
+    struct DrainNotifier {
+        IOManager* io_manager;
+        void OnTimeout( int msec );
+    };
+
+    void DoDrain( int timeout_ms , detail::DrainCallback* callback );
+
+    void StartDrain( uint64_t timeout , detail::DrainCallback* callback );
+
+    // Shutdown the flushed sockets, return true when nothing is left to wait
+    bool CheckDrain();
+
+    // Notify and close every socket that is still linked
+    void FinishDrain();
+
+    // The interval in milliseconds between checks of a draining IOManager
+    static const int kDrainCheckInterval = 10;
+
+    // Check the sockets in the expired slots of the deadline wheel
+    void ExpireDeadlines();
 
     // This function is actually a hack to avoid potential stack overflow. The situation is
     // as follow, if we invoke user's notifier just when we find that we can get a new fd 
@@ -1083,14 +2882,27 @@ private:
     void ExecutePendingAccept();
 
 private:
-    // The maximum buffer for epoll_events buffer for epoll_wait on the stack
+    // The initial and minimum length of the epoll_events buffer for epoll_wait
     static const std::size_t kEpollEventLength = 1024;
 
+    // The maximum length of the epoll_events buffer in adaptive mode
+    static const std::size_t kMaxEpollEventLength = 65536;
+
+    // The number of consecutive mostly empty epoll_wait before shrinking
+    static const std::size_t kShrinkEventBatchIteration = 64;
+
+    // The prefetching is off by default, it has shown no measured gain yet
+    static const std::size_t kDefaultPrefetchDistance = 0;
+
+    // The default timer coalescing window in microseconds
+    static const uint64_t kDefaultTimerSlack = 50;
+
     // control file descriptor
     class CtrlFd : public detail::Pollable {
     public:
         CtrlFd() :
-            is_wake_up_(false)
+            is_wake_up_(false),
+            is_interrupted_(0)
             {}
 
         virtual void OnReadNotify();
@@ -1102,6 +2914,7 @@ private:
         // Send only 1 bytes data serve as an notification
         static const std::size_t kDataLen = 1;
 
+
         bool is_wake_up() const {
             return is_wake_up_;
         }
@@ -1110,15 +2923,138 @@ private:
             is_wake_up_ = b;
         }
 
+        // Called by Interrupt before the notification is sent. Other wake ups
+        // don't make the RunMainLoop return
+        void set_is_interrupted() {
+            __sync_lock_test_and_set( &is_interrupted_ , 1 );
+        }
+
     private:
         bool is_wake_up_;
+        volatile int is_interrupted_;
     };
 
     CtrlFd ctrl_fd_;
 
+    // Timer file descriptor. Only used when epoll_pwait2 is not supported by the
+    // running kernel. It is watched with edge trigger and re-arming it resets the
+    // expiration count, so it never needs to be read.
+    class TimerFd : public detail::Pollable {
+    public:
+        virtual void OnReadNotify() {}
+        virtual void OnWriteNotify() {}
+        virtual void OnException( const NetState& state ) {}
+    };
+
+    TimerFd timer_fd_;
+
+    // The absolute deadline the timer_fd_ is currently armed with, 0 means disarmed
+    uint64_t timer_fd_deadline_;
+
+    // Whether epoll_pwait2 is available. Cleared on the first ENOSYS
+    bool use_epoll_pwait2_;
+
     // Epoll file descriptors.
     int epoll_fd_;
 
+    // Cached CLOCK_MONOTONIC time in microseconds
+    uint64_t now_;
+
+    // Timer coalescing window in microseconds
+    uint64_t timer_slack_;
+
+    // See loop_delay()
+    uint64_t loop_delay_;
+
+    // See epoll_ctl_count()
+    uint64_t epoll_ctl_count_;
+
+    // See wakeup_count()
+    uint64_t wakeup_count_;
+
+    // Buffer for epoll_wait
+    std::vector<struct epoll_event> event_queue_;
+
+    // Set while RunIteration runs, so a nested RunOnce, RunFor or RunMainLoop
+    // from inside of a notifier is caught before it reuses the event queue
+    bool in_iteration_;
+
+    // Set when PlaceOnLocalNode is called from a notifier, the event queue is
+    // reallocated at the start of the next iteration
+    bool place_event_queue_;
+
+    // The event batch size set by user, zero means adaptive
+    std::size_t fixed_event_batch_;
+
+    // Consecutive mostly empty epoll_wait counter
+    std::size_t shrink_counter_;
+
+    // See set_prefetch_distance()
+    std::size_t prefetch_distance_;
+
+    // See set_dispatch_budget()
+    std::size_t dispatch_budget_;
+
+    // Whether the dispatch loop needs to order the events by priority. It is set
+    // once a budget or a high priority socket shows up and is never cleared
+    bool dispatch_by_priority_;
+
+    // The ready events that the dispatch budget has deferred to a later iteration,
+    // oldest first. An entry whose pollable is gone has a NULL data.ptr
+    std::deque<struct epoll_event> deferred_event_;
+
+    // The events of the batch being dispatched split by priority, kept to save the
+    // allocation. The pollables of normal_event_ point to their entries like the
+    // deferred ones, so an entry is dropped if a callback deletes its pollable
+    std::vector<struct epoll_event> high_event_;
+    std::vector<struct epoll_event> normal_event_;
+
+    // See set_register_once()
+    bool register_once_;
+
+    // See cpu()
+    int cpu_;
+
+    // See numa_node()
+    int numa_node_;
+
+    // The thread running this IOManager, valid while has_loop_thread_ is set
+    pthread_t loop_thread_;
+    // CPU clock of that thread. It is resolved by the loop thread itself, so
+    // GetCpuTime never hands a pthread_t that may have been joined to libc
+    clockid_t loop_clock_;
+    volatile bool has_loop_thread_;
+
+    // Notifiers posted from any thread, protected by task_lock_. The flag is
+    // set while the queue is not empty, so the loop can check it without lock
+    pthread_mutex_t task_lock_;
+    std::vector<detail::PostCallback*> posted_task_;
+    volatile bool has_posted_task_;
+
+    // Rings that this loop consumes, and the rings that this loop produces to
+    // that have a backlog
+    std::vector<detail::MessageRing*> inbound_ring_;
+    std::vector<detail::MessageRing*> backlog_ring_;
+
+    // Set while the loop may block in epoll_wait, a producer that clears it
+    // sends the wake up
+    volatile int sleeping_;
+
+    // See Current()
+    static __thread IOManager* current_;
+
+    // Sentinel of the connected sockets
+    detail::SocketLink live_socket_;
+
+    // Listeners attached by ServerSocket::SetIOManager
+    std::vector<ServerSocket*> listener_;
+
+    // See Drain()
+    bool is_draining_;
+    uint64_t drain_deadline_;
+    DrainStats drain_stats_;
+    detail::ScopePtr<detail::DrainCallback> drain_callback_;
+
     // Safely transfer ownership of a pointer in STL is kind of like nightmare in C++03.
     // STL is designed for value semantic, for pointer semantic it is very hard to make
     // copy constructor and assignment operator happy without using smart pointer. For
@@ -1126,21 +3062,39 @@ private:
     // explicitly once it gets invoked.
 
     struct TimerStruct {
+        // Absolute expiration time in microseconds
+        uint64_t deadline;
+        // The delay in milliseconds that user asked for
         int time;
         detail::TimeoutCallback* callback;
+        // The socket timer of this entry, the callback is NULL then
+        detail::SocketTimer* owner;
         bool operator < ( const TimerStruct& rhs ) const {
-            return time > rhs.time;
+            return deadline > rhs.deadline;
+        }
+
+        bool IsCancelled() const {
+            return owner != NULL && owner->IsCancelled();
         }
 
-        TimerStruct( int tm , detail::TimeoutCallback* cb ) :
+        TimerStruct( uint64_t dl , int tm , detail::TimeoutCallback* cb ,
+                     detail::SocketTimer* ow = NULL ) :
+            deadline(dl),
             time(tm),
-            callback(cb)
+            callback(cb),
+            owner(ow)
         {}
     };
 
     // A timer heap , maintain the heap validation by using std::heap_pop
     std::vector<TimerStruct> timer_queue_;
 
+    // Number of cancelled socket timers whose entry is not dropped yet
+    std::size_t cancelled_timer_;
+
+    // Read and idle deadlines of sockets
+    detail::DeadlineWheel deadline_wheel_;
+
     // The pending accept events are listed here. This allows us to avoid potential
     // stack overflow. This field is checked when we enter the loop every time, if
     // a pending accept/error is there, then we just invoke it; otherwise we head to
@@ -1158,6 +3112,9 @@ private:
     void* swap_buffer_;
     std::size_t swap_buffer_size_;
 
+    // Whether the swap buffer is mapped by PlaceOnLocalNode instead of malloc
+    bool swap_buffer_mapped_;
+
     // Friend class, those classes are classes that is inherited
     // from the detail::Pollable class. This class needs to access the private
     // API to watch the event notification.
@@ -1165,9 +3122,345 @@ private:
     friend class Socket;
     friend class ServerSocket;
     friend class ClientSocket;
+    friend class FdWatcher;
+    friend class Relay;
+    friend class detail::ShardMesh;
 
     DISALLOW_COPY_AND_ASSIGN(IOManager);
 };
+
+// Rebalancer moves connections from the busiest IOManager to the idlest one.
+// Every period it samples the CPU time of each loop thread, and if the busiest
+// loop is ahead of the idlest one by more than the threshold, a share of the
+// tracked sockets of the busiest loop proportional to the gap is migrated.
+// Only the sockets passed to Track are moved, they must be untracked before
+// they are closed. The Rebalancer must outlive the loops it balances.
+class Rebalancer {
+public:
+    Rebalancer();
+
+    ~Rebalancer();
+
+    // Add an IOManager to balance. All of them must be added before Start
+    void AddIOManager( IOManager* io_manager );
+
+    // Track or untrack a socket that is eligible for migration. They must be
+    // called from the thread running the socket's IOManager. A tracked socket
+    // that is closing, has offloaded work pending, is driven by a Relay or is
+    // in a rate limit group is skipped, not moved.
+    void Track( Socket* socket );
+    void Untrack( Socket* socket );
+
+    // Register a notifier whose OnMigrate( Socket* ) is invoked on the target
+    // thread each time a socket is moved by this Rebalancer.
+    template< typename T >
+    void SetMigrateNotifier( T* notifier ) {
+        user_migrate_callback_.Reset( detail::MakeMigrateCallback(notifier) );
+    }
+
+    // Check the loops every period_ms milliseconds on the home IOManager. The
+    // threshold is the CPU utilization gap in percent that triggers migration.
+    void Start( IOManager* home , int period_ms , int threshold = kDefaultThreshold );
+
+    // Stop checking, it must be called from the thread running home
+    void Stop();
+
+    // Number of sockets moved so far
+    std::size_t migrate_count() const {
+        return migrate_count_;
+    }
+
+    // The default utilization gap in percent
+    static const int kDefaultThreshold = 20;
+
+private:
+    struct Loop {
+        IOManager* io_manager;
+        // The tracked sockets, only touched by the thread running io_manager
+        std::set<Socket*> sockets;
+        // The last CPU time sample, only touched by the home thread
+        uint64_t cpu_time;
+    };
+
+    Loop* FindLoop( IOManager* io_manager );
+
+    // Sample the CPU time of every loop and post a ShedTask if needed
+    void Check();
+
+    // Timer notifier on the home IOManager. A timer cannot be canceled, so
+    // Stop detaches it and it deletes itself when it fires
+    struct CheckNotifier {
+        Rebalancer* rebalancer;
+        void OnTimeout( int msec );
+    };
+
+    // Posted to the busiest loop, migrate a share of its sockets to target
+    struct ShedTask {
+        Rebalancer* rebalancer;
+        Loop* source;
+        Loop* target;
+        // The share of sockets to move, in percent
+        int percent;
+        void OnPost();
+    };
+
+    // Invoked on the target thread once a socket has been moved
+    struct Landing {
+        Rebalancer* rebalancer;
+        void OnMigrate( Socket* socket );
+    };
+
+    std::vector<Loop*> loops_;
+    IOManager* home_;
+    int period_ms_;
+    int threshold_;
+    uint64_t last_sample_;
+    CheckNotifier* check_notifier_;
+    volatile std::size_t migrate_count_;
+    Landing landing_;
+    detail::ScopePtr<detail::MigrateCallback> user_migrate_callback_;
+
+    DISALLOW_COPY_AND_ASSIGN(Rebalancer);
+};
+
+namespace detail {
+
+// ShardMesh connects a group of IOManagers with a full mesh of MessageRings,
+// one ring for each ordered pair of loops. A message sent from a loop of the
+// group costs no system call unless the target loop is sleeping.
+class ShardMesh {
+public:
+    ShardMesh( const std::vector<IOManager*>& loops , std::size_t ring_size );
+
+    // The loops must have stopped
+    ~ShardMesh();
+
+    std::size_t size() const {
+        return loops_.size();
+    }
+
+    IOManager* io_manager( std::size_t shard ) const {
+        return loops_[shard];
+    }
+
+    // The shard of the calling thread, -1 if it is not a loop of this mesh
+    int CurrentShard() const;
+
+    // Register the inbound rings of the shard, called on its loop thread
+    void Attach( std::size_t shard );
+
+    // Deliver the message to the shard. From a thread outside of the mesh the
+    // message is posted to the target IOManager instead.
+    void Send( std::size_t shard , PostCallback* cb );
+
+private:
+    MessageRing* ring( std::size_t from , std::size_t to ) const {
+        return rings_[from * loops_.size() + to];
+    }
+
+    std::vector<IOManager*> loops_;
+    std::vector<MessageRing*> rings_;
+
+    DISALLOW_COPY_AND_ASSIGN(ShardMesh);
+};
+
+}// namespace detail
+
+// Sharded constructs one instance of T on each IOManager of a group, on the
+// thread running that IOManager, so a service can be split into shards that
+// share nothing. Shards talk to each other through messages carried by the
+// ShardMesh. T must be default constructible. The Sharded object must be
+// destroyed after the loops have stopped and before the IOManagers.
+template< typename T >
+class Sharded {
+public:
+    static const std::size_t kDefaultRingSize = 1024;
+
+    explicit Sharded( const std::vector<IOManager*>& loops ,
+                      std::size_t ring_size = kDefaultRingSize );
+
+    ~Sharded();
+
+    std::size_t size() const {
+        return mesh_.size();
+    }
+
+    // The shard of the calling thread, -1 if it is not a loop of this group
+    int current_shard() const {
+        return mesh_.CurrentShard();
+    }
+
+    // The instance of the calling thread, NULL if it is not a loop of this group
+    T* local() {
+        const int shard = mesh_.CurrentShard();
+        return shard < 0 ? NULL : instance_[shard];
+    }
+
+    // Invoke notifier->OnShard( T* ) on the thread of the shard. It can be
+    // called from any thread, and messages from the same thread to the same
+    // shard are invoked in order.
+    template< typename N >
+    void InvokeOn( std::size_t shard , N* notifier );
+
+    // Invoke notifier->OnMap( T* ) on every shard and send each result back,
+    // where notifier->OnReduce( const N::Result& ) is invoked on the calling
+    // thread once per shard. Then notifier->OnDone() is invoked. It must be
+    // called from a loop of this group.
+    template< typename N >
+    void MapReduce( N* notifier );
+
+private:
+    struct ConstructTask {
+        Sharded* sharded;
+        std::size_t shard;
+        void OnPost() {
+            sharded->mesh_.Attach( shard );
+            sharded->instance_[shard] = new T();
+            delete this;
+        }
+    };
+
+    template< typename N > struct ShardMessage : public detail::PostCallback {
+        virtual void Invoke() {
+            notifier->OnShard( sharded->instance_[shard] );
+        }
+        Sharded* sharded;
+        std::size_t shard;
+        N* notifier;
+    };
+
+    template< typename N > struct ReduceMessage : public detail::PostCallback {
+        virtual void Invoke() {
+            notifier->OnReduce( *result );
+            delete result;
+            if( --(*pending) == 0 ) {
+                delete pending;
+                notifier->OnDone();
+            }
+        }
+        // The callback has no virtual destructor, so the result is held by
+        // pointer to get it destructed properly
+        typename N::Result* result;
+        std::size_t* pending;
+        N* notifier;
+    };
+
+    template< typename N > struct MapMessage : public detail::PostCallback {
+        virtual void Invoke() {
+            ReduceMessage<N>* reply = new ReduceMessage<N>();
+            reply->result = new typename N::Result( notifier->OnMap( sharded->instance_[shard] ) );
+            reply->pending = pending;
+            reply->notifier = notifier;
+            sharded->mesh_.Send( origin , reply );
+        }
+        Sharded* sharded;
+        std::size_t shard;
+        std::size_t origin;
+        std::size_t* pending;
+        N* notifier;
+    };
+
+    detail::ShardMesh mesh_;
+    std::vector<T*> instance_;
+
+    DISALLOW_COPY_AND_ASSIGN(Sharded);
+};
+
+// OffloadPool runs CPU bound work on its own threads, so the IOManager that
+// submits it keeps serving the other connections. Each worker thread owns a
+// queue, and an idle worker steals from the queues of the others. Once the
+// work is done, the completion is posted back to the submitting IOManager.
+class OffloadPool {
+public:
+    // The pool rejects new work once max_queue_depth works are waiting
+    OffloadPool( std::size_t thread_size , std::size_t max_queue_depth );
+
+    // The queued works are still done before the threads exit
+    ~OffloadPool();
+
+    // Invoke work->OnWork() on a thread of the pool, then invoke completion's
+    // OnComplete( Socket* , const NetState& ) on the thread of io_manager with
+    // a NULL socket. It returns false without doing anything when the pool is
+    // saturated, so the caller can stop reading until the queue drains.
+    template< typename W , typename C >
+    bool Offload( IOManager* io_manager , W* work , C* completion ) {
+        return Submit( io_manager , NULL ,
+                       detail::MakeOffloadCallback( work , completion , NULL ) );
+    }
+
+    // Same as above, but the completion is invoked with the socket on the thread
+    // of its IOManager. The socket must not be deleted or migrated until then.
+    // If it is closed meanwhile, the completion gets an ECANCELED NetState.
+    // It must be called from the thread of the socket's IOManager.
+    template< typename W , typename C >
+    bool Offload( Socket* socket , W* work , C* completion ) {
+        return Submit( socket->io_manager_ , socket ,
+                       detail::MakeOffloadCallback( work , completion , socket ) );
+    }
+
+    struct Stats {
+        // Works waiting in the queues now
+        std::size_t queue_depth;
+        // The highest queue depth ever seen
+        std::size_t max_queue_depth;
+        uint64_t submitted;
+        uint64_t completed;
+        // Works refused due to the max queue depth
+        uint64_t rejected;
+        // Works taken from the queue of another worker
+        uint64_t stolen;
+    };
+
+    // It can be called from any thread, the fields are read separately
+    Stats stats() const;
+
+    std::size_t thread_size() const {
+        return workers_.size();
+    }
+
+private:
+    struct Job {
+        detail::OffloadCallback* callback;
+        IOManager* io_manager;
+        Socket* socket;
+        // Posted to io_manager once the work is done
+        void OnPost();
+    };
+
+    struct Worker {
+        OffloadPool* pool;
+        std::size_t index;
+        pthread_t thread;
+        pthread_mutex_t lock;
+        std::deque<Job*> queue;
+    };
+
+    bool Submit( IOManager* io_manager , Socket* socket , detail::OffloadCallback* cb );
+
+    // Take a job from the worker's own queue, or steal one from the others
+    Job* Take( Worker* worker );
+
+    static void* Run( void* arg );
+
+    std::vector<Worker*> workers_;
+    std::size_t max_queue_depth_;
+
+    // Sleeping workers wait on this condition until there are queued jobs
+    pthread_mutex_t idle_lock_;
+    pthread_cond_t idle_cond_;
+    std::size_t idle_size_;
+    bool stop_;
+
+    volatile std::size_t queue_depth_;
+    volatile std::size_t max_seen_queue_depth_;
+    volatile std::size_t next_worker_;
+    volatile uint64_t submitted_;
+    volatile uint64_t completed_;
+    volatile uint64_t rejected_;
+    volatile uint64_t stolen_;
+
+    DISALLOW_COPY_AND_ASSIGN(OffloadPool);
+};
 } // namespace mnet
 
 // ----------------------------------------------------
@@ -1175,8 +3468,13 @@ private:
 // ----------------------------------------------------
 namespace mnet{
 
+inline void Socket::Touch() {
+    if( UNLIKELY(idle_timeout_ != 0) )
+        idle_deadline_ = io_manager_->now_ + idle_timeout_;
+}
+
 template< typename T >
-void Socket::AsyncRead( T* notifier ) {
+void Socket::AsyncRead( T* notifier , int timeout_ms ) {
     assert( state_ != CLOSED );
     assert( user_read_callback_.IsNull() );
     if( UNLIKELY(can_read()) ) {
@@ -1190,9 +3488,10 @@ void Socket::AsyncRead( T* notifier ) {
             // We can directly read data from the kernel space
             NetState state;
             std::size_t sz = DoRead(&state);
-            // Checking if the read process goes smoothly or not
+            // Checking if the read process goes smoothly or not. The read
+            // may also hit the EOF whose edge has been consumed already
             if( UNLIKELY(state) ) {
-                if( sz > 0 ) {
+                if( sz > 0 || eof_ ) {
                     // Notify user that we have something for you.
                     notifier->OnRead( this , sz , NetState(
                                 state_category::kSystem, 0) );
@@ -1208,6 +3507,13 @@ void Socket::AsyncRead( T* notifier ) {
     io_manager_->WatchRead(this);
     // Set up the read operations
     user_read_callback_.Reset( detail::MakeReadCallback(notifier) );
+    // Set up the read deadline
+    if( timeout_ms > 0 ) {
+        read_deadline_ = io_manager_->now_ + static_cast<uint64_t>(timeout_ms) * 1000;
+        ArmDeadline();
+    } else {
+        read_deadline_ = 0;
+    }
 }
 
 template< typename T >
@@ -1239,7 +3545,32 @@ void Socket::AsyncWrite( T* notifier ) {
 }
 
 template< typename T >
-void Socket::AsyncClose( T* notifier ) {
+void Socket::AsyncSendFile( int fd , off_t offset , std::size_t size , T* notifier ) {
+    assert( state_ != CLOSED );
+    assert( size != 0 && sendfile_left_ == 0 );
+    sendfile_fd_ = fd;
+    sendfile_offset_ = offset;
+    sendfile_left_ = size;
+    prev_write_size_ = 0;
+
+    if( can_write() ) {
+        NetState state;
+        prev_write_size_ = DoSendFile( &state );
+        if( UNLIKELY(!state) ) {
+            notifier->OnWrite( this , prev_write_size_ , state );
+            return;
+        }
+        if( sendfile_left_ == 0 ) {
+            notifier->OnWrite( this , prev_write_size_ , NetState() );
+            return;
+        }
+    }
+    io_manager_->WatchWrite(this);
+    user_write_callback_.Reset( detail::MakeWriteCallback(notifier) );
+}
+
+template< typename T >
+void Socket::AsyncClose( T* notifier , int timeout_ms ) {
     assert( state_ == NORMAL );
     // Issue the shutdown on the write pipe operations
     ::shutdown( fd() , SHUT_WR );
@@ -1251,14 +3582,19 @@ void Socket::AsyncClose( T* notifier ) {
         NetState state;
         // Try to read the data from current fd
         std::size_t sz =  DoRead( &state );
-        if( LIKELY(sz == 0 || !state) ) {
+        if( LIKELY(sz == 0 || !state || eof_) ) {
             Close();
-            notifier->OnClose();
+            state_ = CLOSED;
+            notifier->OnClose( state );
             return;
         }
     }
     // After shuting down, we are expecting for read here
     io_manager_->WatchRead(this);
+    if( timeout_ms > 0 ) {
+        close_deadline_ = io_manager_->now_ + static_cast<uint64_t>(timeout_ms) * 1000;
+        ArmDeadline();
+    }
     // Seting up the user close callback function
     user_close_callback_.Reset(
             detail::MakeCloseCallback(notifier));
@@ -1291,9 +3627,12 @@ void ClientSocket::AsyncConnect( const Endpoint& endpoint , T* notifier ) {
         // connect to a local host then kernel just succeeded at once
         // This typically happenes on FreeBSD.
         // Now just call user's callback function directly
+        state_ = CONNECTED;
+        io_manager()->WatchSocket(this);
+        io_manager()->LinkSocket(this);
         notifier->OnConnect( this , NetState(
                     state_category::kSystem, 0) );
-        state_ = CONNECTED;
+        return;
     } else {
         if ( UNLIKELY(errno != EINPROGRESS) ) {
            // When the errno is not EINPROGRESS, this means that it is
@@ -1305,6 +3644,7 @@ void ClientSocket::AsyncConnect( const Endpoint& endpoint , T* notifier ) {
 
     // Now issue the connection on epoll. Epoll interpret this information
     // as could write ( there're potential problem on *NIX system for this).
+    io_manager()->WatchSocket(this);
     io_manager()->WatchWrite(this);
 
     // Setup the user callback function
@@ -1319,7 +3659,7 @@ void ServerSocket::AsyncAccept( Socket* socket , T* notifier ) {
     assert( user_accept_callback_.IsNull() );
     assert( io_manager_ != NULL );
 
-    if( can_read() ) {
+    if( can_read() && Admit() ) {
         // Try to accept at first since for listen fd we use level trigger
         // This cost you a tiny system call but may help save a epoll_wait
         // wake up which will be much more costy than an accept
@@ -1333,6 +3673,7 @@ void ServerSocket::AsyncAccept( Socket* socket , T* notifier ) {
             }
         } else {
             socket->set_fd( nfd );
+            SetupConnection( socket );
             io_manager_->SetPendingAccept( socket,notifier,state );
             return;
         }
@@ -1340,23 +3681,158 @@ void ServerSocket::AsyncAccept( Socket* socket , T* notifier ) {
 
     // When we reach here, it means that we have no pending accepted fd
     // in the kernel space. Now just issue the WatchRead on the listen
-    // fd until we get hitted.
-    io_manager_->WatchRead(this);
+    // fd until we get hitted. A paused listener is watched again once
+    // it is resumed.
+    if( !is_paused_ )
+        io_manager_->WatchRead(this);
     user_accept_callback_.Reset(detail::MakeAcceptCallback(notifier));
     new_accept_socket_ = socket;
 
     return;
 }
 
+inline void Socket::Close() {
+    assert( state_ != CLOSED );
+    // Ignore the close return status
+    ::close(fd());
+    // Setting the fd to invalid value
+    set_fd(-1);
+    // Stop tracking the deadlines
+    read_deadline_ = idle_deadline_ = close_deadline_ = 0;
+    deadline_node_.Unlink();
+    // Forget the file of a pending AsyncSendFile
+    sendfile_left_ = 0;
+    // Release the connection slot of the listener
+    if( listener_ != NULL ) {
+        listener_->OnConnectionClosed();
+        listener_ = NULL;
+    }
+    if( live_link_.IsLinked() ) {
+        live_link_.Unlink();
+        io_manager_->OnSocketClosed();
+    }
+    if( timer_list_ != NULL )
+        CancelTimers();
+    if( UNLIKELY(relay_ != NULL) )
+        StopRelay();
+}
+
+template< typename T >
+bool Relay::Start( Socket* a , Socket* b , T* notifier ) {
+    assert( !is_running_ );
+    if( UNLIKELY(!Setup( a , b )) )
+        return false;
+    user_relay_callback_.Reset( detail::MakeRelayCallback(notifier) );
+    // The sockets may be readable already, their edges will not come again
+    RunBoth();
+    return true;
+}
+
 inline void ServerSocket::SetIOManager( mnet::IOManager* io_manager ) {
         io_manager_ = io_manager;
         io_manager->WatchRead( this );
+        io_manager->listener_.push_back( this );
+}
+
+template< typename T >
+void FdWatcher::AsyncWaitReadable( T* notifier ) {
+    assert( Valid() );
+    assert( user_readable_callback_.IsNull() );
+    if( trigger_ == EDGE_TRIGGER && can_read() ) {
+        // The edge has arrived already, the notifier takes it over
+        set_can_read(false);
+        notifier->OnReadable( this , NetState() );
+        return;
+    }
+    user_readable_callback_.Reset( detail::MakeReadableCallback(notifier) );
+    if( trigger_ == LEVEL_TRIGGER )
+        UpdateInterest();
+}
+
+template< typename T >
+void FdWatcher::AsyncWaitWritable( T* notifier ) {
+    assert( Valid() );
+    assert( user_writable_callback_.IsNull() );
+    if( trigger_ == EDGE_TRIGGER && can_write() ) {
+        set_can_write(false);
+        notifier->OnWritable( this , NetState() );
+        return;
+    }
+    user_writable_callback_.Reset( detail::MakeWritableCallback(notifier) );
+    if( trigger_ == LEVEL_TRIGGER )
+        UpdateInterest();
+}
+
+template< typename T >
+void SignalWatcher::AsyncWait( T* notifier ) {
+    assert( user_signal_callback_.IsNull() );
+    if( !pending_signal_.empty() ) {
+        int signo = pending_signal_.front();
+        pending_signal_.pop_front();
+        notifier->OnSignal( signo );
+        return;
+    }
+    user_signal_callback_.Reset( detail::MakeSignalCallback(notifier) );
 }
 
 template< typename T >
 void IOManager::Schedule( int msec , T* notifier ) {
-    timer_queue_.push_back( TimerStruct(msec, detail::MakeTimeoutCallback(notifier)) );
-    std::push_heap(timer_queue_.begin(),timer_queue_.end());
+    AddTimer( static_cast<uint64_t>(msec) * 1000 , msec ,
+              detail::MakeTimeoutCallback(notifier) );
+}
+
+template< typename T >
+void IOManager::ScheduleInUS( uint64_t usec , T* notifier ) {
+    AddTimer( usec , static_cast<int>(usec/1000) ,
+              detail::MakeTimeoutCallback(notifier) );
+}
+
+template< typename T >
+Sharded<T>::Sharded( const std::vector<IOManager*>& loops , std::size_t ring_size ) :
+    mesh_( loops , ring_size ),
+    instance_( loops.size() , static_cast<T*>(NULL) )
+{
+    for( std::size_t i = 0 ; i < loops.size() ; ++i ) {
+        ConstructTask* task = new ConstructTask();
+        task->sharded = this;
+        task->shard = i;
+        loops[i]->Post( task );
+    }
+}
+
+template< typename T >
+Sharded<T>::~Sharded() {
+    for( std::size_t i = 0 ; i < instance_.size() ; ++i ) {
+        delete instance_[i];
+    }
+}
+
+template< typename T >
+template< typename N >
+void Sharded<T>::InvokeOn( std::size_t shard , N* notifier ) {
+    assert( shard < size() );
+    ShardMessage<N>* message = new ShardMessage<N>();
+    message->sharded = this;
+    message->shard = shard;
+    message->notifier = notifier;
+    mesh_.Send( shard , message );
+}
+
+template< typename T >
+template< typename N >
+void Sharded<T>::MapReduce( N* notifier ) {
+    const int origin = mesh_.CurrentShard();
+    assert( origin >= 0 );
+    std::size_t* pending = new std::size_t( size() );
+    for( std::size_t i = 0 ; i < size() ; ++i ) {
+        MapMessage<N>* message = new MapMessage<N>();
+        message->sharded = this;
+        message->shard = i;
+        message->origin = static_cast<std::size_t>(origin);
+        message->pending = pending;
+        message->notifier = notifier;
+        mesh_.Send( i , message );
+    }
 }
 
 template< typename T >
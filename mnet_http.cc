@@ -0,0 +1,739 @@
+#include "mnet_http.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif // __SSE2__
+
+namespace mnet {
+namespace http {
+namespace {
+
+// tchar of RFC 7230, the characters of a method and a header name
+const char kTokenTable[256] = {
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    0,1,0,1,1,1,1,1,0,0,1,1,0,1,1,0,
+    1,1,1,1,1,1,1,1,1,1,0,0,0,0,0,0,
+    0,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
+    1,1,1,1,1,1,1,1,1,1,1,0,0,0,1,1,
+    1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
+    1,1,1,1,1,1,1,1,1,1,1,0,1,0,1,0,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+};
+
+inline bool IsToken( char c ) {
+    return kTokenTable[static_cast<unsigned char>(c)] != 0;
+}
+
+inline bool IsSpace( char c ) {
+    return c == ' ' || c == '\t';
+}
+
+inline char ToLower( char c ) {
+    return c >= 'A' && c <= 'Z' ? static_cast<char>(c + ('a' - 'A')) : c;
+}
+
+// The size of the chunk size line we accept, extensions included
+const std::size_t kMaxChunkLine = 1024;
+
+// Return the position of the first byte from pos which ends a line or must not
+// appear in a head at all: the control characters except HT, and DEL. LF, CR
+// and the invalid bytes are found in one pass, the caller tells them apart.
+// Return size if there is none.
+std::size_t ScanLine( const char* data , std::size_t pos , std::size_t size ) {
+#ifdef __SSE2__
+    const __m128i kMaxControl = _mm_set1_epi8(0x1f);
+    const __m128i kTab = _mm_set1_epi8('\t');
+    const __m128i kDel = _mm_set1_epi8(0x7f);
+    while( pos + 16 <= size ) {
+        const __m128i v = _mm_loadu_si128(
+                reinterpret_cast<const __m128i*>(data+pos) );
+        // An unsigned v <= 0x1f is a control character
+        __m128i special = _mm_cmpeq_epi8( _mm_min_epu8( v , kMaxControl ) , v );
+        special = _mm_andnot_si128( _mm_cmpeq_epi8( v , kTab ) , special );
+        special = _mm_or_si128( special , _mm_cmpeq_epi8( v , kDel ) );
+        const int mask = _mm_movemask_epi8(special);
+        if( mask != 0 )
+            return pos + __builtin_ctz(mask);
+        pos += 16;
+    }
+#endif // __SSE2__
+    for( ; pos < size ; ++pos ) {
+        const unsigned char c = static_cast<unsigned char>(data[pos]);
+        if( ( c < 0x20 && c != '\t' ) || c == 0x7f )
+            return pos;
+    }
+    return size;
+}
+
+// Parse a non-empty decimal number, fail on overflow
+bool ParseDecimal( const StringPiece& str , uint64_t* value ) {
+    if( str.empty() || str.size() > 19 )
+        return false;
+    uint64_t v = 0;
+    for( std::size_t i = 0 ; i < str.size() ; ++i ) {
+        if( str[i] < '0' || str[i] > '9' )
+            return false;
+        v = v * 10 + static_cast<uint64_t>(str[i] - '0');
+    }
+    *value = v;
+    return true;
+}
+
+// Whether the comma separated list value has the token
+bool HasToken( const StringPiece& value , const StringPiece& token ) {
+    const char* p = value.data();
+    const char* end = p + value.size();
+    while( p < end ) {
+        const char* comma = static_cast<const char*>( memchr( p , ',' , end - p ) );
+        const char* e = comma == NULL ? end : comma;
+        const char* b = p;
+        while( b < e && IsSpace(*b) )
+            ++b;
+        const char* t = e;
+        while( t > b && IsSpace(t[-1]) )
+            --t;
+        if( StringPiece(b,t-b).EqualsIgnoreCase(token) )
+            return true;
+        p = e + 1;
+    }
+    return false;
+}
+
+// Parse the chunk size line at pos. On success, size is the chunk size and
+// data is the position of the chunk data
+int ParseChunkLine( const char* buf , std::size_t pos , std::size_t end ,
+                    uint64_t* size , std::size_t* data ) {
+    const std::size_t limit = std::min( end , pos + kMaxChunkLine );
+    const char* lf = static_cast<const char*>( memchr( buf + pos , '\n' , limit - pos ) );
+    if( lf == NULL )
+        return limit == end ? detail::Parser::PARSE_INCOMPLETE : 400;
+    uint64_t v = 0;
+    std::size_t i = pos;
+    for( ; i < pos + 16 ; ++i ) {
+        const char c = ToLower(buf[i]);
+        if( c >= '0' && c <= '9' )
+            v = v * 16 + static_cast<uint64_t>(c - '0');
+        else if( c >= 'a' && c <= 'f' )
+            v = v * 16 + static_cast<uint64_t>(c - 'a' + 10);
+        else
+            break;
+    }
+    if( i == pos )
+        return 400;
+    // What follows the size is the extensions which we ignore, or the line end
+    const std::size_t line_end = lf - buf;
+    if( buf[i] != ';' && buf[i] != '\r' && buf[i] != '\n' )
+        return 400;
+    if( buf[i] == '\r' && i + 1 != line_end )
+        return 400;
+    *size = v;
+    *data = line_end + 1;
+    return detail::Parser::PARSE_OK;
+}
+
+// Parse the end of line after a chunk's data at pos
+int ParseLineEnd( const char* buf , std::size_t pos , std::size_t end , std::size_t* next ) {
+    if( pos >= end )
+        return detail::Parser::PARSE_INCOMPLETE;
+    if( buf[pos] == '\n' ) {
+        *next = pos + 1;
+        return detail::Parser::PARSE_OK;
+    }
+    if( buf[pos] != '\r' )
+        return 400;
+    if( pos + 1 >= end )
+        return detail::Parser::PARSE_INCOMPLETE;
+    if( buf[pos+1] != '\n' )
+        return 400;
+    *next = pos + 2;
+    return detail::Parser::PARSE_OK;
+}
+
+const char* ReasonPhrase( int status ) {
+    switch( status ) {
+        case 100: return "Continue";
+        case 101: return "Switching Protocols";
+        case 200: return "OK";
+        case 201: return "Created";
+        case 202: return "Accepted";
+        case 204: return "No Content";
+        case 206: return "Partial Content";
+        case 301: return "Moved Permanently";
+        case 302: return "Found";
+        case 303: return "See Other";
+        case 304: return "Not Modified";
+        case 307: return "Temporary Redirect";
+        case 308: return "Permanent Redirect";
+        case 400: return "Bad Request";
+        case 401: return "Unauthorized";
+        case 403: return "Forbidden";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 408: return "Request Timeout";
+        case 409: return "Conflict";
+        case 411: return "Length Required";
+        case 413: return "Payload Too Large";
+        case 414: return "URI Too Long";
+        case 416: return "Range Not Satisfiable";
+        case 417: return "Expectation Failed";
+        case 426: return "Upgrade Required";
+        case 429: return "Too Many Requests";
+        case 431: return "Request Header Fields Too Large";
+        case 500: return "Internal Server Error";
+        case 501: return "Not Implemented";
+        case 502: return "Bad Gateway";
+        case 503: return "Service Unavailable";
+        case 504: return "Gateway Timeout";
+        case 505: return "HTTP Version Not Supported";
+        default:  return "Unknown";
+    }
+}
+
+// Format value into buf backward from its end, return the first digit
+char* FormatDecimal( uint64_t value , char* end ) {
+    do {
+        *--end = static_cast<char>('0' + value % 10);
+        value /= 10;
+    } while( value != 0 );
+    return end;
+}
+
+// Append "HTTP/1.1 <status> <reason>\r\n" into buffer
+void WriteStatusLine( int status , Buffer* buffer ) {
+    char line[64] = "HTTP/1.1 ";
+    line[9] = static_cast<char>('0' + status / 100);
+    line[10] = static_cast<char>('0' + status / 10 % 10);
+    line[11] = static_cast<char>('0' + status % 10);
+    line[12] = ' ';
+    const char* reason = ReasonPhrase(status);
+    const std::size_t reason_size = strlen(reason);
+    memcpy( line + 13 , reason , reason_size );
+    memcpy( line + 13 + reason_size , "\r\n" , 2 );
+    buffer->Write( line , 15 + reason_size );
+}
+
+}// namespace
+
+StringPiece Request::path() const {
+    const char* q = static_cast<const char*>(
+            memchr( target_.data() , '?' , target_.size() ) );
+    return q == NULL ? target_ : StringPiece( target_.data() , q - target_.data() );
+}
+
+StringPiece Request::query() const {
+    const char* q = static_cast<const char*>(
+            memchr( target_.data() , '?' , target_.size() ) );
+    if( q == NULL )
+        return StringPiece();
+    ++q;
+    return StringPiece( q , target_.data() + target_.size() - q );
+}
+
+const StringPiece* Request::FindHeader( const StringPiece& name ) const {
+    for( std::size_t i = 0 ; i < header_size_ ; ++i ) {
+        if( headers_[i].name.EqualsIgnoreCase(name) )
+            return &headers_[i].value;
+    }
+    return NULL;
+}
+
+void Response::AddHeader( const StringPiece& name , const StringPiece& value ) {
+    headers_.Write( name.data() , name.size() );
+    headers_.Write( ": " , 2 );
+    headers_.Write( value.data() , value.size() );
+    headers_.Write( "\r\n" , 2 );
+}
+
+namespace detail {
+
+int Parser::Parse( char* data , std::size_t size , Request* request , std::size_t* consumed ) {
+    if( head_size_ == 0 ) {
+        const int result = ScanHead( data , size );
+        if( result != PARSE_OK )
+            return result;
+    }
+    // The head is parsed again on each call since the memory may have moved
+    const int result = ParseHead( data , request );
+    if( result != PARSE_OK )
+        return result;
+    // Only matters while the body is incomplete
+    expect_continue_ = request->expect_continue_;
+
+    if( request->is_chunked_ )
+        return ParseChunked( data , size , request , consumed );
+
+    if( size - head_size_ < content_length_ )
+        return PARSE_INCOMPLETE;
+    request->body_ = StringPiece( data + head_size_ , content_length_ );
+    *consumed = head_size_ + content_length_;
+    return PARSE_OK;
+}
+
+int Parser::ScanHead( const char* data , std::size_t size ) {
+    std::size_t pos = scanned_;
+    if( pos == 0 ) {
+        // Empty lines before the request line are ignored
+        while( pos < size && ( data[pos] == '\r' || data[pos] == '\n' ) )
+            ++pos;
+        start_ = pos;
+    }
+    while( true ) {
+        const std::size_t p = ScanLine( data , pos , size );
+        std::size_t next;
+        if( p == size || ( data[p] == '\r' && p + 1 == size ) ) {
+            // The line is incomplete, scan it again with more data
+            scanned_ = pos;
+            return size - start_ > max_header_size_ ? 431 : PARSE_INCOMPLETE;
+        }
+        if( data[p] == '\n' ) {
+            next = p + 1;
+        } else if( data[p] == '\r' && data[p+1] == '\n' ) {
+            next = p + 2;
+        } else {
+            return 400;
+        }
+        if( next - start_ > max_header_size_ )
+            return 431;
+        if( p == pos ) {
+            // The empty line ends the head
+            head_size_ = next;
+            return PARSE_OK;
+        }
+        if( line_size_ == Request::kMaxHeaders + 1 )
+            return 431;
+        line_end_[line_size_++] = next;
+        pos = next;
+    }
+}
+
+int Parser::ParseHead( char* data , Request* request ) {
+    request->Clear();
+    content_length_ = 0;
+
+    // The request line
+    const char* p = data + start_;
+    const char* end = data + line_end_[0] - 1;
+    if( end > p && end[-1] == '\r' )
+        --end;
+    const char* q = p;
+    while( q < end && IsToken(*q) )
+        ++q;
+    if( q == p || q == end || *q != ' ' )
+        return 400;
+    request->method_ = StringPiece( p , q - p );
+    p = q + 1;
+    q = p;
+    while( q < end && static_cast<unsigned char>(*q) > ' ' )
+        ++q;
+    if( q == p || q == end || *q != ' ' )
+        return 400;
+    request->target_ = StringPiece( p , q - p );
+    p = q + 1;
+    if( end - p != 8 || memcmp( p , "HTTP/" , 5 ) != 0 ||
+        p[5] < '0' || p[5] > '9' || p[6] != '.' || p[7] < '0' || p[7] > '9' )
+        return 400;
+    if( p[5] != '1' )
+        return 505;
+    request->minor_version_ = p[7] == '0' ? 0 : 1;
+    request->keep_alive_ = request->minor_version_ != 0;
+
+    // The header fields
+    bool has_host = false;
+    bool has_length = false;
+    bool has_encoding = false;
+    for( std::size_t i = 1 ; i < line_size_ ; ++i ) {
+        p = data + line_end_[i-1];
+        end = data + line_end_[i] - 1;
+        if( end > p && end[-1] == '\r' )
+            --end;
+        // No obsolete line folding, nor whitespace before the colon
+        q = p;
+        while( q < end && IsToken(*q) )
+            ++q;
+        if( q == p || q == end || *q != ':' )
+            return 400;
+        const StringPiece name( p , q - p );
+        ++q;
+        while( q < end && IsSpace(*q) )
+            ++q;
+        while( end > q && IsSpace(end[-1]) )
+            --end;
+        const StringPiece value( q , end - q );
+        Header& header = request->headers_[request->header_size_++];
+        header.name = name;
+        header.value = value;
+
+        // The headers the server itself cares about
+        switch( name.size() ) {
+            case 4:
+                if( name.EqualsIgnoreCase("host") )
+                    has_host = true;
+                break;
+            case 6:
+                if( name.EqualsIgnoreCase("expect") ) {
+                    if( !value.EqualsIgnoreCase("100-continue") )
+                        return 417;
+                    request->expect_continue_ = request->minor_version_ != 0;
+                }
+                break;
+            case 10:
+                if( name.EqualsIgnoreCase("connection") ) {
+                    if( HasToken( value , "close" ) )
+                        request->keep_alive_ = false;
+                    else if( HasToken( value , "keep-alive" ) )
+                        request->keep_alive_ = true;
+                }
+                break;
+            case 14:
+                if( name.EqualsIgnoreCase("content-length") ) {
+                    uint64_t length;
+                    if( !ParseDecimal( value , &length ) )
+                        return 400;
+                    // Several Content-Length headers must agree
+                    if( has_length && length != content_length_ )
+                        return 400;
+                    if( length > max_body_size_ )
+                        return 413;
+                    has_length = true;
+                    content_length_ = static_cast<std::size_t>(length);
+                }
+                break;
+            case 17:
+                if( name.EqualsIgnoreCase("transfer-encoding") ) {
+                    // Chunked is the only coding we know
+                    if( has_encoding || !value.EqualsIgnoreCase("chunked") )
+                        return 501;
+                    has_encoding = true;
+                    request->is_chunked_ = true;
+                }
+                break;
+            default:
+                break;
+        }
+    }
+    if( request->minor_version_ != 0 && !has_host )
+        return 400;
+    // A request with both is a smuggling attempt
+    if( has_length && has_encoding )
+        return 400;
+    return PARSE_OK;
+}
+
+int Parser::ParseChunked( char* data , std::size_t size , Request* request , std::size_t* consumed ) {
+    std::size_t pos = chunk_scanned_ == 0 ? head_size_ : chunk_scanned_;
+    std::size_t body_size = chunk_body_size_;
+    uint64_t chunk_size;
+    std::size_t chunk_data;
+    int result;
+
+    // Check the framing from the first chunk that is not checked yet
+    while( true ) {
+        result = ParseChunkLine( data , pos , size , &chunk_size , &chunk_data );
+        if( result != PARSE_OK )
+            return result;
+        if( chunk_size == 0 )
+            break;
+        if( chunk_size > max_body_size_ - body_size )
+            return 413;
+        if( size - chunk_data <= chunk_size )
+            return PARSE_INCOMPLETE;
+        result = ParseLineEnd( data , chunk_data + chunk_size , size , &pos );
+        if( result != PARSE_OK )
+            return result;
+        body_size += static_cast<std::size_t>(chunk_size);
+        chunk_scanned_ = pos;
+        chunk_body_size_ = body_size;
+    }
+
+    // The last chunk, skip the trailer fields until the empty line
+    std::size_t line = chunk_data;
+    std::size_t end = 0;
+    while( end == 0 ) {
+        const char* lf = static_cast<const char*>(
+                memchr( data + line , '\n' , size - line ) );
+        if( lf == NULL )
+            return size - chunk_data > max_header_size_ ? 431 : PARSE_INCOMPLETE;
+        const std::size_t next = lf - data + 1;
+        if( data[line] == '\n' || ( data[line] == '\r' && next - line == 2 ) )
+            end = next;
+        line = next;
+    }
+
+    // Every chunk is here, move their data together right after the head
+    char* out = data + head_size_;
+    pos = head_size_;
+    while( true ) {
+        ParseChunkLine( data , pos , size , &chunk_size , &chunk_data );
+        if( chunk_size == 0 )
+            break;
+        memmove( out , data + chunk_data , static_cast<std::size_t>(chunk_size) );
+        out += chunk_size;
+        ParseLineEnd( data , chunk_data + chunk_size , size , &pos );
+    }
+    request->body_ = StringPiece( data + head_size_ , body_size );
+    *consumed = end;
+    return PARSE_OK;
+}
+
+Connection::Connection( Server* server , IOManager* io_manager ) :
+    prev(NULL),
+    next(NULL),
+    server_(server),
+    socket_(new Socket(io_manager)),
+    parser_(),
+    request_(),
+    response_(),
+    pending_(false),
+    in_run_(false),
+    dead_(false),
+    closing_(false),
+    peer_eof_(false),
+    continue_sent_(false),
+    file_fd_(-1),
+    file_offset_(0),
+    file_size_(0)
+{
+    parser_.set_max_header_size( server->max_header_size_ );
+    parser_.set_max_body_size( server->max_body_size_ );
+}
+
+Connection::~Connection() {
+    if( file_fd_ >= 0 )
+        ::close(file_fd_);
+    if( socket_ != NULL ) {
+        if( socket_->fd() >= 0 )
+            socket_->Close();
+        delete socket_;
+    }
+}
+
+void Connection::Start() {
+    Run();
+}
+
+void Connection::OnRead( Socket* socket , std::size_t size , const NetState& ok ) {
+    pending_ = false;
+    if( !ok ) {
+        dead_ = true;
+    } else if( size == 0 ) {
+        // Still answer the requests that are already here
+        peer_eof_ = true;
+    }
+    if( !in_run_ )
+        Run();
+}
+
+void Connection::OnWrite( Socket* socket , std::size_t size , const NetState& ok ) {
+    pending_ = false;
+    if( !ok )
+        dead_ = true;
+    if( file_fd_ >= 0 ) {
+        ::close(file_fd_);
+        file_fd_ = -1;
+    }
+    if( !in_run_ )
+        Run();
+}
+
+void Connection::Run() {
+    // The socket operations may complete right away, loop here instead of
+    // recursing from their callbacks
+    in_run_ = true;
+    while( !dead_ ) {
+        Process();
+        pending_ = true;
+        if( file_fd_ >= 0 ) {
+            // The batched responses before the file go out first
+            socket_->AsyncSendFile( file_fd_ , file_offset_ , file_size_ , this );
+        } else if( socket_->write_buffer().readable_size() != 0 ) {
+            socket_->AsyncWrite( this );
+        } else if( !upgrade_.IsNull() || closing_ || peer_eof_ ) {
+            break;
+        } else {
+            socket_->AsyncRead( this , server_->idle_timeout_ );
+        }
+        if( pending_ ) {
+            in_run_ = false;
+            return;
+        }
+    }
+    in_run_ = false;
+    if( !upgrade_.IsNull() && !dead_ ) {
+        // The 101 is sent, hand the socket over to the new protocol
+        UpgradeCallback* callback = upgrade_.Release();
+        Socket* socket = socket_;
+        socket_ = NULL;
+        server_->Destroy( this );
+        callback->Invoke( socket );
+        delete callback;
+        return;
+    }
+    server_->Destroy( this );
+}
+
+void Connection::Process() {
+    Buffer& in = socket_->read_buffer();
+    // Every complete request in the read buffer is answered into the write
+    // buffer, so pipelined requests get their responses in one write. A file
+    // response stops the batch since its body is sent separately, and so does
+    // an upgrade since what follows belongs to the new protocol.
+    while( !closing_ && file_fd_ < 0 && upgrade_.IsNull() ) {
+        Buffer::Accessor accessor = in.GetReadAccessor();
+        if( accessor.size() == 0 )
+            break;
+        std::size_t consumed = 0;
+        const int result = parser_.Parse( static_cast<char*>(accessor.address()) ,
+                                          accessor.size() , &request_ , &consumed );
+        if( result == Parser::PARSE_INCOMPLETE ) {
+            if( peer_eof_ ) {
+                closing_ = true;
+            } else if( parser_.expect_continue() && !continue_sent_ ) {
+                // The client waits for our permission to send the body
+                static const char kContinue[] = "HTTP/1.1 100 Continue\r\n\r\n";
+                socket_->write_buffer().Write( kContinue , sizeof(kContinue) - 1 );
+                continue_sent_ = true;
+            }
+            break;
+        }
+        if( result != Parser::PARSE_OK ) {
+            WriteError( result );
+            break;
+        }
+        response_.Clear();
+        server_->handler_->Invoke( request_ , &response_ );
+        ++server_->request_count_;
+        Serialize();
+        accessor.set_committed_size( consumed );
+        parser_.Reset();
+        continue_sent_ = false;
+    }
+}
+
+void Connection::Serialize() {
+    Buffer& out = socket_->write_buffer();
+    const int status = response_.status_;
+    const bool keep_alive = request_.keep_alive_ && response_.keep_alive_;
+    const bool has_body = status >= 200 && status != 204 && status != 304;
+    const std::size_t body_size = response_.file_fd_ >= 0 ?
+        response_.file_size_ : response_.body_.readable_size();
+
+    WriteStatusLine( status , &out );
+    if( response_.headers_.readable_size() != 0 ) {
+        Buffer::Accessor headers = response_.headers_.GetReadAccessor();
+        out.Write( headers.address() , headers.size() );
+    }
+    // Content-Length, Connection and the empty line
+    char tail[96];
+    std::size_t size = 0;
+    if( has_body ) {
+        static const char kLength[] = "Content-Length: ";
+        memcpy( tail , kLength , sizeof(kLength) - 1 );
+        size = sizeof(kLength) - 1;
+        char digits[24];
+        char* end = digits + sizeof(digits);
+        char* begin = FormatDecimal( body_size , end );
+        memcpy( tail + size , begin , end - begin );
+        size += end - begin;
+        memcpy( tail + size , "\r\n" , 2 );
+        size += 2;
+    }
+    if( !keep_alive ) {
+        static const char kClose[] = "Connection: close\r\n";
+        memcpy( tail + size , kClose , sizeof(kClose) - 1 );
+        size += sizeof(kClose) - 1;
+        closing_ = true;
+    } else if( request_.minor_version_ == 0 ) {
+        static const char kKeepAlive[] = "Connection: keep-alive\r\n";
+        memcpy( tail + size , kKeepAlive , sizeof(kKeepAlive) - 1 );
+        size += sizeof(kKeepAlive) - 1;
+    }
+    memcpy( tail + size , "\r\n" , 2 );
+    size += 2;
+    out.Write( tail , size );
+
+    if( has_body && body_size != 0 && !request_.is_head() ) {
+        if( response_.file_fd_ >= 0 ) {
+            // The file is taken over, it is sent after the write buffer
+            file_fd_ = response_.file_fd_;
+            file_offset_ = response_.file_offset_;
+            file_size_ = response_.file_size_;
+            response_.file_fd_ = -1;
+        } else {
+            Buffer::Accessor body = response_.body_.GetReadAccessor();
+            out.Write( body.address() , body.size() );
+        }
+    }
+    if( status == 101 && !response_.upgrade_.IsNull() )
+        upgrade_.Swap( &response_.upgrade_ );
+    response_.Clear();
+}
+
+void Connection::WriteError( int status ) {
+    WriteStatusLine( status , &socket_->write_buffer() );
+    static const char kTail[] = "Content-Length: 0\r\nConnection: close\r\n\r\n";
+    socket_->write_buffer().Write( kTail , sizeof(kTail) - 1 );
+    closing_ = true;
+}
+
+}// namespace detail
+
+Server::Server( IOManager* io_manager ) :
+    io_manager_(io_manager),
+    server_socket_(),
+    handler_(),
+    accepting_(NULL),
+    connections_(NULL),
+    connection_size_(0),
+    request_count_(0),
+    max_header_size_(8192),
+    max_body_size_(1024*1024),
+    idle_timeout_(0)
+    {}
+
+Server::~Server() {
+    while( connections_ != NULL )
+        Destroy( connections_ );
+    delete accepting_;
+}
+
+bool Server::Bind( const Endpoint& endpoint ) {
+    return server_socket_.Bind( endpoint );
+}
+
+void Server::OnAccept( Socket* socket , const NetState& ok ) {
+    detail::Connection* connection = accepting_;
+    accepting_ = new detail::Connection( this , io_manager_ );
+    server_socket_.AsyncAccept( accepting_->socket() , this );
+    if( !ok ) {
+        delete connection;
+        return;
+    }
+    connection->next = connections_;
+    if( connections_ != NULL )
+        connections_->prev = connection;
+    connections_ = connection;
+    ++connection_size_;
+    connection->Start();
+}
+
+void Server::Destroy( detail::Connection* connection ) {
+    if( connection->prev != NULL )
+        connection->prev->next = connection->next;
+    else
+        connections_ = connection->next;
+    if( connection->next != NULL )
+        connection->next->prev = connection->prev;
+    --connection_size_;
+    delete connection;
+}
+
+}// namespace http
+}// namespace mnet
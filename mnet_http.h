@@ -0,0 +1,512 @@
+#ifndef MNET_HTTP_H_
+#define MNET_HTTP_H_
+#include "mnet.h"
+
+#include <sys/types.h>
+
+// A HTTP/1.1 server on top of ServerSocket and Socket. The request line and the
+// headers are parsed in place inside of the read buffer of the connection, the
+// Request only holds StringPiece views into that memory. Pipelined requests are
+// handled in a batch and all of their responses go out with one write. Request
+// bodies may use Content-Length or the chunked transfer encoding, the chunked
+// body is decoded in place as well. A response body is either a copy of the data
+// written by the handler or a range of a file sent by sendfile(2).
+
+namespace mnet {
+namespace http {
+class Request;
+class Response;
+class Server;
+
+namespace detail {
+class Connection;
+class Parser;
+}// namespace detail
+
+struct Header {
+    StringPiece name;
+    StringPiece value;
+};
+
+// A parsed request. Every StringPiece of it points into the read buffer of the
+// connection, so they are only valid inside of the handler's OnRequest.
+class Request {
+public:
+    // Requests with more headers are rejected with 431
+    static const std::size_t kMaxHeaders = 64;
+
+    Request() :
+        minor_version_(1),
+        header_size_(0),
+        keep_alive_(true),
+        is_chunked_(false),
+        expect_continue_(false)
+        {}
+
+    const StringPiece& method() const {
+        return method_;
+    }
+
+    // The request target as it is sent, including the query
+    const StringPiece& target() const {
+        return target_;
+    }
+
+    // The target without the query
+    StringPiece path() const;
+
+    // The part after '?' of the target, empty if there is none
+    StringPiece query() const;
+
+    // 0 for HTTP/1.0 and 1 for HTTP/1.1
+    int minor_version() const {
+        return minor_version_;
+    }
+
+    std::size_t header_size() const {
+        return header_size_;
+    }
+
+    const Header& header( std::size_t index ) const {
+        assert( index < header_size_ );
+        return headers_[index];
+    }
+
+    // Return the value of the first header named name, the name is compared
+    // without case. Return NULL if there is no such header.
+    const StringPiece* FindHeader( const StringPiece& name ) const;
+
+    // The body, a chunked body is already decoded
+    const StringPiece& body() const {
+        return body_;
+    }
+
+    // Whether the connection stays open after this request, which is decided
+    // by the version and the Connection header
+    bool keep_alive() const {
+        return keep_alive_;
+    }
+
+    bool is_chunked() const {
+        return is_chunked_;
+    }
+
+    bool is_head() const {
+        return method_ == StringPiece("HEAD",4);
+    }
+
+private:
+    void Clear() {
+        header_size_ = 0;
+        body_ = StringPiece();
+        keep_alive_ = true;
+        is_chunked_ = false;
+        expect_continue_ = false;
+    }
+
+    StringPiece method_;
+    StringPiece target_;
+    int minor_version_;
+    Header headers_[kMaxHeaders];
+    std::size_t header_size_;
+    StringPiece body_;
+    bool keep_alive_;
+    bool is_chunked_;
+    // The client waits for a 100 Continue before it sends the body
+    bool expect_continue_;
+
+    friend class detail::Parser;
+    friend class detail::Connection;
+
+    DISALLOW_COPY_AND_ASSIGN(Request);
+};
+
+namespace detail {
+
+// The type erased receiver of an upgraded socket
+class UpgradeCallback {
+public:
+    virtual void Invoke( Socket* socket ) = 0;
+
+#ifdef FORCE_VIRTUAL_DESTRUCTOR
+    virtual ~UpgradeCallback() {}
+#endif // FORCE_VIRTUAL_DESTRUCTOR
+};
+
+template< typename N > struct UpgradeNotifier : public UpgradeCallback {
+    virtual void Invoke( Socket* socket ) {
+        notifier->OnUpgrade( socket );
+    }
+    N* notifier;
+    UpgradeNotifier( N* n ) : notifier(n) {}
+};
+
+using ::mnet::detail::static_assert_result;
+
+DECLARE_CONCEPT_CHECK(OnUpgrade,OnUpgrade,void (T::*)(Socket*));
+
+template< typename T >
+UpgradeCallback* MakeUpgradeCallback( T* n ) {
+    STATIC_ASSERT( HasConcept_OnUpgrade<T>::result , No_On_Upgrade_Is_Found );
+    return new UpgradeNotifier<T>(n);
+}
+
+}// namespace detail
+
+// The response a handler fills. It is serialized into the write buffer of the
+// connection after OnRequest returns, the Content-Length and the Connection
+// headers are added by the server.
+class Response {
+public:
+    Response() :
+        status_(200),
+        keep_alive_(true),
+        file_fd_(-1),
+        file_offset_(0),
+        file_size_(0)
+        {}
+
+    ~Response() {
+        CloseFile();
+    }
+
+    int status() const {
+        return status_;
+    }
+
+    void set_status( int status ) {
+        assert( status >= 100 && status <= 999 );
+        status_ = status;
+    }
+
+    // Add a header, the name and the value are copied
+    void AddHeader( const StringPiece& name , const StringPiece& value );
+
+    // Append data to the body
+    void Write( const void* data , std::size_t size ) {
+        assert( file_fd_ < 0 );
+        body_.Write( data , size );
+    }
+
+    void Write( const StringPiece& data ) {
+        Write( data.data() , data.size() );
+    }
+
+    // The body buffer, the handler can fill it through GetWriteAccessor
+    Buffer& body() {
+        return body_;
+    }
+
+    // Use size bytes of the file fd from offset as the body, they are sent by
+    // sendfile(2) and never copied into the user space. The response owns fd
+    // and closes it once it is sent. It can't be mixed with Write.
+    void SendFile( int fd , off_t offset , std::size_t size ) {
+        assert( body_.readable_size() == 0 );
+        CloseFile();
+        file_fd_ = fd;
+        file_offset_ = offset;
+        file_size_ = size;
+    }
+
+    // Switch the connection to another protocol. Once this response, which
+    // must be a 101, is written, the socket is handed to the notifier's
+    //   void OnUpgrade( Socket* socket );
+    // which owns it from then on. The bytes the client sent behind the request
+    // are left in its read buffer.
+    template< typename T >
+    void Upgrade( T* notifier ) {
+        upgrade_.Reset( detail::MakeUpgradeCallback(notifier) );
+    }
+
+    // Close the connection after this response
+    void set_keep_alive( bool keep_alive ) {
+        keep_alive_ = keep_alive;
+    }
+
+    bool keep_alive() const {
+        return keep_alive_;
+    }
+
+private:
+    void Clear() {
+        status_ = 200;
+        keep_alive_ = true;
+        headers_.Clear();
+        body_.Clear();
+        CloseFile();
+        upgrade_.Reset(NULL);
+    }
+
+    void CloseFile() {
+        if( file_fd_ >= 0 ) {
+            ::close(file_fd_);
+            file_fd_ = -1;
+        }
+    }
+
+    int status_;
+    bool keep_alive_;
+    // The headers of the user in the wire format
+    Buffer headers_;
+    Buffer body_;
+    // The file of SendFile
+    int file_fd_;
+    off_t file_offset_;
+    std::size_t file_size_;
+    ::mnet::detail::ScopePtr<detail::UpgradeCallback> upgrade_;
+
+    friend class detail::Connection;
+
+    DISALLOW_COPY_AND_ASSIGN(Response);
+};
+
+namespace detail {
+
+// The type erased request handler
+class HandlerCallback {
+public:
+    virtual void Invoke( const Request& request , Response* response ) = 0;
+
+#ifdef FORCE_VIRTUAL_DESTRUCTOR
+    virtual ~HandlerCallback() {}
+#endif // FORCE_VIRTUAL_DESTRUCTOR
+};
+
+template< typename N > struct HandlerNotifier : public HandlerCallback {
+    virtual void Invoke( const Request& request , Response* response ) {
+        notifier->OnRequest( request , response );
+    }
+    N* notifier;
+    HandlerNotifier( N* n ) : notifier(n) {}
+};
+
+DECLARE_CONCEPT_CHECK(OnRequest,OnRequest,void (T::*)(const Request&,Response*));
+
+template< typename T >
+HandlerCallback* MakeHandlerCallback( T* n ) {
+    STATIC_ASSERT( HasConcept_OnRequest<T>::result , No_On_Request_Is_Found );
+    return new HandlerNotifier<T>(n);
+}
+
+// Incremental request parser. It never copies, the Request points into the
+// parsed memory. The progress of the current request is kept as offsets, so a
+// request that arrives in several reads is not rescanned from the start even
+// though the read buffer may be moved in between.
+class Parser {
+public:
+    enum {
+        PARSE_OK = 0,
+        PARSE_INCOMPLETE = 1
+        // Otherwise the result is the HTTP status code of the error
+    };
+
+    Parser() :
+        max_header_size_(8192),
+        max_body_size_(1024*1024),
+        content_length_(0) {
+        Reset();
+    }
+
+    void set_max_header_size( std::size_t size ) {
+        max_header_size_ = size;
+    }
+
+    void set_max_body_size( std::size_t size ) {
+        max_body_size_ = size;
+    }
+
+    // Parse the request at the head of data. On PARSE_OK, consumed is the size
+    // of the request including its body. The chunked body is decoded in place,
+    // which modifies data. PARSE_INCOMPLETE means more data is needed and the
+    // same bytes must be passed again together with the new data. Whenever the
+    // request at the head of data is done with, Reset must be called.
+    int Parse( char* data , std::size_t size , Request* request , std::size_t* consumed );
+
+    // Whether the head of the current request is fully received and it waits
+    // for a 100 Continue
+    bool expect_continue() const {
+        return expect_continue_;
+    }
+
+    void Reset() {
+        scanned_ = 0;
+        start_ = 0;
+        line_size_ = 0;
+        head_size_ = 0;
+        chunk_scanned_ = 0;
+        chunk_body_size_ = 0;
+        expect_continue_ = false;
+    }
+
+private:
+    // Find the end of the head, recording the end of each line
+    int ScanHead( const char* data , std::size_t size );
+    // Parse the recorded lines of the head into request
+    int ParseHead( char* data , Request* request );
+    // Check the framing of a chunked body, and decode it in place once it's complete
+    int ParseChunked( char* data , std::size_t size , Request* request , std::size_t* consumed );
+
+    std::size_t max_header_size_;
+    std::size_t max_body_size_;
+
+    // Bytes of the head that are scanned
+    std::size_t scanned_;
+    // Offset of the request line, after the empty lines ignored
+    std::size_t start_;
+    // Offset just past the '\n' of each line of the head
+    std::size_t line_end_[Request::kMaxHeaders+2];
+    std::size_t line_size_;
+    // Size of the head including the empty line, 0 until it is found
+    std::size_t head_size_;
+    std::size_t content_length_;
+    // Offset of the next chunk header to check and the body size before it
+    std::size_t chunk_scanned_;
+    std::size_t chunk_body_size_;
+    bool expect_continue_;
+
+    DISALLOW_COPY_AND_ASSIGN(Parser);
+};
+
+// A client connection. It parses the requests in the read buffer, runs the
+// handler for each and flushes the batched responses before reading again.
+class Connection {
+public:
+    Connection( Server* server , IOManager* io_manager );
+
+    ~Connection();
+
+    Socket* socket() {
+        return socket_;
+    }
+
+    void Start();
+
+    // Socket callbacks
+    void OnRead( Socket* socket , std::size_t size , const NetState& ok );
+    void OnWrite( Socket* socket , std::size_t size , const NetState& ok );
+
+    // The list of connections of the server
+    Connection* prev;
+    Connection* next;
+
+private:
+    // Read, process and write until an operation has to wait
+    void Run();
+    // Handle the complete requests in the read buffer
+    void Process();
+    // Serialize response_ into the write buffer
+    void Serialize();
+    // Reply an error and close
+    void WriteError( int status );
+
+    Server* server_;
+    // NULL once it is handed over by an upgrade
+    Socket* socket_;
+    Parser parser_;
+    Request request_;
+    Response response_;
+    // A Socket operation is in flight
+    bool pending_;
+    // Inside of Run, callbacks which are invoked synchronously only record
+    // their result then
+    bool in_run_;
+    // The connection is broken or timed out
+    bool dead_;
+    // The connection is closed once the write buffer is flushed
+    bool closing_;
+    // The peer has shutdown its side
+    bool peer_eof_;
+    bool continue_sent_;
+    // The file part of the response being written
+    int file_fd_;
+    off_t file_offset_;
+    std::size_t file_size_;
+    // The upgrade of the 101 response being written
+    ::mnet::detail::ScopePtr<UpgradeCallback> upgrade_;
+
+    DISALLOW_COPY_AND_ASSIGN(Connection);
+};
+
+}// namespace detail
+
+// The HTTP server. It runs on the thread of its IOManager, the handler's
+//   void OnRequest( const Request& request , Response* response );
+// is invoked for every request in the order they arrive on a connection.
+class Server {
+public:
+    explicit Server( IOManager* io_manager );
+
+    // Close all connections
+    ~Server();
+
+    bool Bind( const Endpoint& endpoint );
+
+    template< typename T >
+    void Start( T* handler );
+
+    // Requests whose head is larger get a 431
+    void set_max_header_size( std::size_t size ) {
+        max_header_size_ = size;
+    }
+
+    // Requests whose body is larger get a 413
+    void set_max_body_size( std::size_t size ) {
+        max_body_size_ = size;
+    }
+
+    // Close a connection that is idle for so many milliseconds between requests,
+    // 0 means never
+    void set_idle_timeout( int msec ) {
+        idle_timeout_ = msec;
+    }
+
+    // The listener, for the admission control of the ServerSocket
+    ServerSocket* server_socket() {
+        return &server_socket_;
+    }
+
+    std::size_t connection_size() const {
+        return connection_size_;
+    }
+
+    uint64_t request_count() const {
+        return request_count_;
+    }
+
+    // Accept callback, used internally
+    void OnAccept( Socket* socket , const NetState& ok );
+
+private:
+    void Destroy( detail::Connection* connection );
+
+    IOManager* io_manager_;
+    ServerSocket server_socket_;
+    ::mnet::detail::ScopePtr<detail::HandlerCallback> handler_;
+    // The connection accepting
+    detail::Connection* accepting_;
+    // The head of the list of connections
+    detail::Connection* connections_;
+    std::size_t connection_size_;
+    uint64_t request_count_;
+    std::size_t max_header_size_;
+    std::size_t max_body_size_;
+    int idle_timeout_;
+
+    friend class detail::Connection;
+
+    DISALLOW_COPY_AND_ASSIGN(Server);
+};
+
+template< typename T >
+void Server::Start( T* handler ) {
+    assert( handler_.IsNull() );
+    handler_.Reset( detail::MakeHandlerCallback(handler) );
+    server_socket_.SetIOManager( io_manager_ );
+    accepting_ = new detail::Connection( this , io_manager_ );
+    server_socket_.AsyncAccept( accepting_->socket() , this );
+}
+
+}// namespace http
+}// namespace mnet
+
+#endif // MNET_HTTP_H_
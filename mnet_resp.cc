@@ -0,0 +1,511 @@
+#include "mnet_resp.h"
+
+namespace mnet {
+namespace resp {
+namespace {
+
+// The longest line we wait for, a simple string or an inline command
+const std::size_t kMaxLine = 64*1024;
+
+bool IsType( char c ) {
+    switch( c ) {
+        case SIMPLE_STRING: case SIMPLE_ERROR: case INTEGER: case BULK_STRING:
+        case ARRAY: case NIL: case BOOLEAN: case DOUBLE: case BIG_NUMBER:
+        case BULK_ERROR: case VERBATIM_STRING: case MAP: case SET:
+        case ATTRIBUTE: case PUSH:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Parse a signed decimal number, fail on overflow
+bool ParseInteger( const char* p , const char* end , int64_t* value ) {
+    bool negative = false;
+    if( p != end && ( *p == '-' || *p == '+' ) ) {
+        negative = *p == '-';
+        ++p;
+    }
+    if( p == end || end - p > 19 )
+        return false;
+    uint64_t v = 0;
+    for( ; p != end ; ++p ) {
+        if( *p < '0' || *p > '9' )
+            return false;
+        v = v * 10 + static_cast<uint64_t>(*p - '0');
+    }
+    if( v > static_cast<uint64_t>(INT64_MAX) + ( negative ? 1 : 0 ) )
+        return false;
+    *value = negative ? static_cast<int64_t>(0 - v) : static_cast<int64_t>(v);
+    return true;
+}
+
+// Format value backward from end, return the first character
+char* FormatInteger( int64_t value , char* end ) {
+    uint64_t v = value < 0 ? 0 - static_cast<uint64_t>(value) : static_cast<uint64_t>(value);
+    do {
+        *--end = static_cast<char>('0' + v % 10);
+        v /= 10;
+    } while( v != 0 );
+    if( value < 0 )
+        *--end = '-';
+    return end;
+}
+
+}// namespace
+
+int Parser::Parse( const char* data , std::size_t size , std::size_t* consumed ) {
+    if( pending_end_ != 0 ) {
+        // Waiting for the payload of a bulk string, there is nothing to scan
+        // until all of it is here
+        if( size < pending_end_ )
+            return PARSE_INCOMPLETE;
+        if( data[pending_end_-2] != '\r' || data[pending_end_-1] != '\n' )
+            return Fail("bad bulk string end");
+        pos_ = pending_end_;
+        pending_end_ = 0;
+        if( Complete() ) {
+            Finish( data , consumed );
+            return PARSE_OK;
+        }
+    } else if( pos_ == 0 ) {
+        // A new message
+        values_.clear();
+        stack_.clear();
+        if( allow_inline_ && size != 0 && !IsType(data[0]) )
+            return ParseInline( data , size , consumed );
+    }
+    while( pos_ < size ) {
+        bool done;
+        const int result = ParseValue( data , size , &done );
+        if( result != PARSE_OK )
+            return result;
+        if( done ) {
+            Finish( data , consumed );
+            return PARSE_OK;
+        }
+    }
+    return PARSE_INCOMPLETE;
+}
+
+int Parser::ParseValue( const char* data , std::size_t size , bool* done ) {
+    // Find the end of the line, from where the last try stopped
+    const std::size_t from = scan_ > pos_ ? scan_ : pos_ + 1;
+    const char* cr = from >= size ? NULL :
+        static_cast<const char*>( memchr( data + from , '\r' , size - from ) );
+    if( cr == NULL || cr + 1 == data + size ) {
+        scan_ = cr == NULL ? size : static_cast<std::size_t>(cr - data);
+        return size - pos_ > kMaxLine ? Fail("line too long") : PARSE_INCOMPLETE;
+    }
+    if( cr[1] != '\n' )
+        return Fail("expect CRLF");
+    scan_ = 0;
+
+    const char type = data[pos_];
+    const char* line = data + pos_ + 1;
+    std::size_t next = cr - data + 2;
+    Value v;
+    v.type = static_cast<Type>(type);
+    v.str = StringPiece( NULL , cr - line );
+    v.integer = 0;
+    v.is_null = false;
+    v.offset = pos_ + 1;
+    int64_t elements = 0;
+
+    switch( type ) {
+        case SIMPLE_STRING:
+        case SIMPLE_ERROR:
+        case BIG_NUMBER:
+            break;
+        case DOUBLE:
+            if( cr == line )
+                return Fail("bad double");
+            break;
+        case INTEGER:
+            if( !ParseInteger( line , cr , &v.integer ) )
+                return Fail("bad integer");
+            break;
+        case BOOLEAN:
+            if( cr - line != 1 || ( *line != 't' && *line != 'f' ) )
+                return Fail("bad boolean");
+            v.integer = *line == 't';
+            break;
+        case NIL:
+            if( cr != line )
+                return Fail("bad null");
+            v.is_null = true;
+            break;
+        case BULK_STRING:
+        case BULK_ERROR:
+        case VERBATIM_STRING: {
+            int64_t length;
+            if( !ParseInteger( line , cr , &length ) )
+                return Fail("bad bulk length");
+            if( length == -1 && type == BULK_STRING ) {
+                v.is_null = true;
+                v.str = StringPiece();
+                break;
+            }
+            if( length < 0 || static_cast<uint64_t>(length) > max_bulk_size_ )
+                return Fail("invalid bulk length");
+            v.offset = next;
+            v.str = StringPiece( NULL , static_cast<std::size_t>(length) );
+            const std::size_t end = next + static_cast<std::size_t>(length) + 2;
+            if( end > size ) {
+                // Wait for the payload without looking at it
+                values_.push_back(v);
+                pos_ = next;
+                pending_end_ = end;
+                return PARSE_INCOMPLETE;
+            }
+            if( data[end-2] != '\r' || data[end-1] != '\n' )
+                return Fail("bad bulk string end");
+            next = end;
+            break;
+        }
+        case ARRAY:
+        case MAP:
+        case SET:
+        case ATTRIBUTE:
+        case PUSH: {
+            int64_t count;
+            if( !ParseInteger( line , cr , &count ) )
+                return Fail("bad aggregate length");
+            v.str = StringPiece();
+            if( count == -1 && type == ARRAY ) {
+                v.is_null = true;
+                break;
+            }
+            if( count < 0 || static_cast<uint64_t>(count) > max_elements_ )
+                return Fail("invalid aggregate length");
+            elements = count;
+            if( type == MAP || type == ATTRIBUTE )
+                elements *= 2;
+            // An attribute is followed by the value it is attached to
+            if( type == ATTRIBUTE )
+                ++elements;
+            v.integer = elements;
+            if( elements != 0 && stack_.size() >= max_depth_ )
+                return Fail("too deeply nested");
+            break;
+        }
+        default:
+            return Fail("unknown type");
+    }
+
+    values_.push_back(v);
+    pos_ = next;
+    if( elements != 0 ) {
+        stack_.push_back(elements);
+        *done = false;
+    } else {
+        *done = Complete();
+    }
+    return PARSE_OK;
+}
+
+int Parser::ParseInline( const char* data , std::size_t size , std::size_t* consumed ) {
+    const char* lf = static_cast<const char*>(
+            memchr( data + scan_ , '\n' , size - scan_ ) );
+    if( lf == NULL ) {
+        scan_ = size;
+        return size > kMaxLine ? Fail("line too long") : PARSE_INCOMPLETE;
+    }
+    const char* end = lf;
+    if( end != data && end[-1] == '\r' )
+        --end;
+
+    // An array of the words
+    Value v;
+    v.type = ARRAY;
+    v.integer = 0;
+    v.is_null = false;
+    v.offset = 0;
+    values_.push_back(v);
+    v.type = BULK_STRING;
+    const char* p = data;
+    while( true ) {
+        while( p != end && ( *p == ' ' || *p == '\t' ) )
+            ++p;
+        if( p == end )
+            break;
+        const char* word = p;
+        while( p != end && *p != ' ' && *p != '\t' )
+            ++p;
+        v.offset = word - data;
+        v.str = StringPiece( NULL , p - word );
+        values_.push_back(v);
+        ++values_[0].integer;
+    }
+    pos_ = lf - data + 1;
+    Finish( data , consumed );
+    return PARSE_OK;
+}
+
+bool Parser::Complete() {
+    while( !stack_.empty() ) {
+        if( --stack_.back() != 0 )
+            return false;
+        stack_.pop_back();
+    }
+    return true;
+}
+
+void Parser::Finish( const char* data , std::size_t* consumed ) {
+    // The data may have moved since the values were parsed
+    for( std::size_t i = 0 ; i < values_.size() ; ++i ) {
+        Value& v = values_[i];
+        v.str = StringPiece( data + v.offset , v.str.size() );
+    }
+    *consumed = pos_;
+    pos_ = 0;
+    scan_ = 0;
+}
+
+void Writer::WriteLine( Type type , const StringPiece& str ) {
+    char* p = Extend( str.size() + 3 );
+    *p = static_cast<char>(type);
+    memcpy( p + 1 , str.data() , str.size() );
+    p[str.size()+1] = '\r';
+    p[str.size()+2] = '\n';
+}
+
+void Writer::WriteHeader( Type type , int64_t size ) {
+    char buf[24];
+    char* end = buf + sizeof(buf);
+    *--end = '\n';
+    *--end = '\r';
+    char* begin = FormatInteger( size , end );
+    *--begin = static_cast<char>(type);
+    memcpy( Extend( buf + sizeof(buf) - begin ) , begin , buf + sizeof(buf) - begin );
+}
+
+void Writer::WriteInteger( int64_t value ) {
+    WriteHeader( INTEGER , value );
+}
+
+void Writer::WriteBulkString( const StringPiece& str ) {
+    memcpy( ReserveBulkString( str.size() ) , str.data() , str.size() );
+}
+
+char* Writer::ReserveBulkString( std::size_t size ) {
+    char buf[24];
+    char* end = buf + sizeof(buf);
+    *--end = '\n';
+    *--end = '\r';
+    char* begin = FormatInteger( static_cast<int64_t>(size) , end );
+    *--begin = '$';
+    const std::size_t header = buf + sizeof(buf) - begin;
+    // The header, the payload and the CRLF are reserved at once
+    char* p = Extend( header + size + 2 );
+    memcpy( p , begin , header );
+    p[header+size] = '\r';
+    p[header+size+1] = '\n';
+    return p + header;
+}
+
+void Writer::WriteNull() {
+    if( protocol_ == 3 )
+        memcpy( Extend(3) , "_\r\n" , 3 );
+    else
+        memcpy( Extend(5) , "$-1\r\n" , 5 );
+}
+
+void Writer::WriteMap( std::size_t size ) {
+    if( protocol_ == 3 )
+        WriteHeader( MAP , size );
+    else
+        WriteHeader( ARRAY , size * 2 );
+}
+
+void Writer::WriteBoolean( bool value ) {
+    if( protocol_ == 3 )
+        memcpy( Extend(4) , value ? "#t\r\n" : "#f\r\n" , 4 );
+    else
+        memcpy( Extend(4) , value ? ":1\r\n" : ":0\r\n" , 4 );
+}
+
+void Writer::WriteDouble( double value ) {
+    char buf[32];
+    // %g prints inf, -inf and nan the way RESP3 wants them
+    const int size = snprintf( buf , sizeof(buf) , "%.17g" , value );
+    if( protocol_ == 3 )
+        WriteLine( DOUBLE , StringPiece( buf , size ) );
+    else
+        WriteBulkString( StringPiece( buf , size ) );
+}
+
+namespace detail {
+
+Connection::Connection( Server* server , IOManager* io_manager ) :
+    prev(NULL),
+    next(NULL),
+    server_(server),
+    socket_(io_manager),
+    parser_(),
+    protocol_(2),
+    pending_(false),
+    in_run_(false),
+    dead_(false),
+    closing_(false),
+    peer_eof_(false)
+{
+    parser_.set_max_bulk_size( server->max_bulk_size_ );
+    parser_.set_allow_inline( true );
+}
+
+Connection::~Connection() {
+    if( socket_.fd() >= 0 )
+        socket_.Close();
+}
+
+void Connection::Start() {
+    Run();
+}
+
+void Connection::OnRead( Socket* socket , std::size_t size , const NetState& ok ) {
+    pending_ = false;
+    if( !ok ) {
+        dead_ = true;
+    } else if( size == 0 ) {
+        // Still answer the commands that are already here
+        peer_eof_ = true;
+    }
+    if( !in_run_ )
+        Run();
+}
+
+void Connection::OnWrite( Socket* socket , std::size_t size , const NetState& ok ) {
+    pending_ = false;
+    if( !ok )
+        dead_ = true;
+    if( !in_run_ )
+        Run();
+}
+
+void Connection::Run() {
+    // The socket operations may complete right away, loop here instead of
+    // recursing from their callbacks
+    in_run_ = true;
+    while( !dead_ ) {
+        Process();
+        pending_ = true;
+        if( socket_.write_buffer().readable_size() != 0 ) {
+            socket_.AsyncWrite( this );
+        } else if( closing_ || peer_eof_ ) {
+            break;
+        } else {
+            socket_.AsyncRead( this , server_->idle_timeout_ );
+        }
+        if( pending_ ) {
+            in_run_ = false;
+            return;
+        }
+    }
+    in_run_ = false;
+    server_->Destroy( this );
+}
+
+void Connection::Process() {
+    Buffer& in = socket_.read_buffer();
+    Writer writer( &socket_.write_buffer() , protocol_ );
+    // Every complete command in the read buffer is answered into the write
+    // buffer, so pipelined commands get their replies in one write
+    while( !closing_ ) {
+        Buffer::Accessor accessor = in.GetReadAccessor();
+        if( accessor.size() == 0 )
+            break;
+        std::size_t consumed = 0;
+        const int result = parser_.Parse( static_cast<const char*>(accessor.address()) ,
+                                          accessor.size() , &consumed );
+        if( result == Parser::PARSE_INCOMPLETE )
+            break;
+        const char* error = NULL;
+        if( result == Parser::PARSE_ERROR ) {
+            error = parser_.error();
+        } else {
+            accessor.set_committed_size( consumed );
+            const std::vector<Value>& values = parser_.values();
+            const std::size_t argc = static_cast<std::size_t>(values[0].integer);
+            if( values[0].type != ARRAY || values[0].is_null || values.size() != argc + 1 ) {
+                error = "expect an array of bulk strings";
+            } else {
+                for( std::size_t i = 1 ; i <= argc ; ++i ) {
+                    if( values[i].type != BULK_STRING || values[i].is_null ) {
+                        error = "expect an array of bulk strings";
+                        break;
+                    }
+                }
+            }
+            // An empty inline command is ignored
+            if( error == NULL && argc == 0 )
+                continue;
+            if( error == NULL ) {
+                server_->handler_->Invoke( Command( &values[1] , argc ) , &writer );
+                ++server_->command_count_;
+                if( writer.is_closing() )
+                    closing_ = true;
+                continue;
+            }
+        }
+        std::string reply("ERR Protocol error: ");
+        reply.append(error);
+        writer.WriteError( reply );
+        closing_ = true;
+    }
+    protocol_ = writer.protocol();
+}
+
+}// namespace detail
+
+Server::Server( IOManager* io_manager ) :
+    io_manager_(io_manager),
+    server_socket_(),
+    handler_(),
+    accepting_(NULL),
+    connections_(NULL),
+    connection_size_(0),
+    command_count_(0),
+    max_bulk_size_(512*1024*1024),
+    idle_timeout_(0)
+    {}
+
+Server::~Server() {
+    while( connections_ != NULL )
+        Destroy( connections_ );
+    delete accepting_;
+}
+
+bool Server::Bind( const Endpoint& endpoint ) {
+    return server_socket_.Bind( endpoint );
+}
+
+void Server::OnAccept( Socket* socket , const NetState& ok ) {
+    detail::Connection* connection = accepting_;
+    accepting_ = new detail::Connection( this , io_manager_ );
+    server_socket_.AsyncAccept( accepting_->socket() , this );
+    if( !ok ) {
+        delete connection;
+        return;
+    }
+    connection->next = connections_;
+    if( connections_ != NULL )
+        connections_->prev = connection;
+    connections_ = connection;
+    ++connection_size_;
+    connection->Start();
+}
+
+void Server::Destroy( detail::Connection* connection ) {
+    if( connection->prev != NULL )
+        connection->prev->next = connection->next;
+    else
+        connections_ = connection->next;
+    if( connection->next != NULL )
+        connection->next->prev = connection->prev;
+    --connection_size_;
+    delete connection;
+}
+
+}// namespace resp
+}// namespace mnet
@@ -0,0 +1,440 @@
+#ifndef MNET_RESP_H_
+#define MNET_RESP_H_
+#include "mnet.h"
+
+// RESP, the protocol of Redis, in both version 2 and 3. The Parser works on the
+// read buffer of a Socket, it keeps its progress as offsets so a message that
+// arrives in several reads is never scanned twice, and the parsed values point
+// into the buffer. The Writer serializes replies straight into the write buffer.
+// The Server is a skeleton for cache servers, it feeds every pipelined command
+// of a read to the handler and flushes all the replies with one write.
+
+namespace mnet {
+namespace resp {
+class Command;
+class Writer;
+class Server;
+
+namespace detail {
+class Connection;
+}// namespace detail
+
+// The type of a value is its leading byte on the wire
+enum Type {
+    SIMPLE_STRING = '+',
+    SIMPLE_ERROR = '-',
+    INTEGER = ':',
+    BULK_STRING = '$',
+    ARRAY = '*',
+    // RESP3 only
+    NIL = '_',
+    BOOLEAN = '#',
+    DOUBLE = ',',
+    BIG_NUMBER = '(',
+    BULK_ERROR = '!',
+    VERBATIM_STRING = '=',
+    MAP = '%',
+    SET = '~',
+    ATTRIBUTE = '|',
+    PUSH = '>'
+};
+
+struct Value {
+    Type type;
+    // The bytes of a string, an error, a double or a big number. It points into
+    // the parsed memory.
+    StringPiece str;
+    // The value of an integer or a boolean. For an aggregate, the number of
+    // values that make it up, they follow it in the parsed values. A map has 2
+    // of them per entry. An attribute has 2 per entry followed by the value it
+    // is attached to.
+    int64_t integer;
+    // The RESP2 null bulk string and null array, and the RESP3 null
+    bool is_null;
+    // Offset of str in the parsed memory, used until the message is complete
+    std::size_t offset;
+};
+
+// Incremental parser of RESP messages. The values of a message are laid out in
+// pre-order in one array, an aggregate is followed by its elements.
+class Parser {
+public:
+    enum {
+        PARSE_OK,
+        PARSE_INCOMPLETE,
+        PARSE_ERROR
+    };
+
+    Parser() :
+        max_bulk_size_(512*1024*1024),
+        max_elements_(1024*1024),
+        max_depth_(32),
+        allow_inline_(false),
+        values_(),
+        stack_(),
+        pos_(0),
+        scan_(0),
+        pending_end_(0),
+        error_(NULL)
+        {}
+
+    // Bulk strings that are larger are an error
+    void set_max_bulk_size( std::size_t size ) {
+        max_bulk_size_ = size;
+    }
+
+    // Aggregates with more elements are an error
+    void set_max_elements( std::size_t size ) {
+        max_elements_ = size;
+    }
+
+    // Aggregates nested deeper are an error
+    void set_max_depth( std::size_t depth ) {
+        max_depth_ = depth;
+    }
+
+    // Accept the inline commands, a line of words separated by spaces, which
+    // is parsed as an array of bulk strings. It is what a telnet sends.
+    void set_allow_inline( bool allow_inline ) {
+        allow_inline_ = allow_inline;
+    }
+
+    // Parse the message at the head of data. On PARSE_OK, consumed is its size
+    // and values() has its values. PARSE_INCOMPLETE means more data is needed,
+    // the same bytes must be passed again together with the new ones, only the
+    // new bytes are parsed then. After PARSE_ERROR, error() tells why and the
+    // stream can't be parsed any further.
+    int Parse( const char* data , std::size_t size , std::size_t* consumed );
+
+    const std::vector<Value>& values() const {
+        return values_;
+    }
+
+    const char* error() const {
+        return error_;
+    }
+
+    // Drop the progress of the current message
+    void Reset() {
+        values_.clear();
+        stack_.clear();
+        pos_ = 0;
+        scan_ = 0;
+        pending_end_ = 0;
+    }
+
+private:
+    // Parse the value at pos_ and the bulk payload behind it, done tells
+    // whether the message is complete
+    int ParseValue( const char* data , std::size_t size , bool* done );
+    int ParseInline( const char* data , std::size_t size , std::size_t* consumed );
+    // Point the strings into data and start over
+    void Finish( const char* data , std::size_t* consumed );
+    // The current value is complete, return true if the message is complete
+    bool Complete();
+    int Fail( const char* error ) {
+        error_ = error;
+        return PARSE_ERROR;
+    }
+
+    std::size_t max_bulk_size_;
+    std::size_t max_elements_;
+    std::size_t max_depth_;
+    bool allow_inline_;
+
+    std::vector<Value> values_;
+    // The elements left of the aggregates that are being parsed
+    std::vector<int64_t> stack_;
+    // Offset of the next value
+    std::size_t pos_;
+    // Offset up to which the line of the next value is searched for its end
+    std::size_t scan_;
+    // The end of a bulk string whose payload is not all here, 0 if there is none
+    std::size_t pending_end_;
+    const char* error_;
+
+    DISALLOW_COPY_AND_ASSIGN(Parser);
+};
+
+// A command is an array of bulk strings, the first is the command name
+class Command {
+public:
+    Command( const Value* values , std::size_t size ) :
+        values_(values),
+        size_(size)
+        {}
+
+    // The number of arguments including the command name
+    std::size_t size() const {
+        return size_;
+    }
+
+    const StringPiece& operator[]( std::size_t index ) const {
+        assert( index < size_ );
+        return values_[index].str;
+    }
+
+    const StringPiece& name() const {
+        return values_[0].str;
+    }
+
+    // Compare the command name without case
+    bool Is( const StringPiece& name ) const {
+        return values_[0].str.EqualsIgnoreCase(name);
+    }
+
+private:
+    const Value* values_;
+    std::size_t size_;
+};
+
+// Serialize values into a Buffer. Each value is formatted in place in the memory
+// of the buffer, no temporary string is built. Under RESP2, the RESP3 only types
+// are written as their RESP2 counterparts.
+class Writer {
+public:
+    explicit Writer( Buffer* buffer , int protocol = 2 ) :
+        buffer_(buffer),
+        protocol_(protocol),
+        close_(false)
+        {}
+
+    // 2 or 3
+    int protocol() const {
+        return protocol_;
+    }
+
+    void set_protocol( int protocol ) {
+        assert( protocol == 2 || protocol == 3 );
+        protocol_ = protocol;
+    }
+
+    void WriteSimpleString( const StringPiece& str ) {
+        WriteLine( SIMPLE_STRING , str );
+    }
+
+    // The error must not contain CR or LF
+    void WriteError( const StringPiece& error ) {
+        WriteLine( SIMPLE_ERROR , error );
+    }
+
+    void WriteInteger( int64_t value );
+
+    void WriteBulkString( const StringPiece& str );
+
+    // Return the memory of a bulk string of size bytes, to be filled by the
+    // caller before anything else is written
+    char* ReserveBulkString( std::size_t size );
+
+    void WriteNull();
+
+    void WriteArray( std::size_t size ) {
+        WriteHeader( ARRAY , size );
+    }
+
+    // Under RESP2, an array of 2*size elements
+    void WriteMap( std::size_t size );
+
+    // Under RESP2, an array
+    void WriteSet( std::size_t size ) {
+        WriteHeader( protocol_ == 3 ? SET : ARRAY , size );
+    }
+
+    // Under RESP2, an array
+    void WritePush( std::size_t size ) {
+        WriteHeader( protocol_ == 3 ? PUSH : ARRAY , size );
+    }
+
+    // Under RESP2, the integer 1 or 0
+    void WriteBoolean( bool value );
+
+    // Under RESP2, a bulk string
+    void WriteDouble( double value );
+
+    // Close the connection once the replies written so far are sent. Only used
+    // by the Server.
+    void Close() {
+        close_ = true;
+    }
+
+    bool is_closing() const {
+        return close_;
+    }
+
+private:
+    // Return size bytes of writable memory of the buffer
+    char* Extend( std::size_t size ) {
+        buffer_->Reserve( size );
+        Buffer::Accessor accessor = buffer_->GetWriteAccessor();
+        accessor.set_committed_size( size );
+        return static_cast<char*>(accessor.address());
+    }
+
+    // type, str, CRLF
+    void WriteLine( Type type , const StringPiece& str );
+    // type, the decimal size, CRLF
+    void WriteHeader( Type type , int64_t size );
+
+    Buffer* buffer_;
+    int protocol_;
+    bool close_;
+
+    DISALLOW_COPY_AND_ASSIGN(Writer);
+};
+
+namespace detail {
+
+// The type erased command handler
+class CommandCallback {
+public:
+    virtual void Invoke( const Command& command , Writer* writer ) = 0;
+
+#ifdef FORCE_VIRTUAL_DESTRUCTOR
+    virtual ~CommandCallback() {}
+#endif // FORCE_VIRTUAL_DESTRUCTOR
+};
+
+template< typename N > struct CommandNotifier : public CommandCallback {
+    virtual void Invoke( const Command& command , Writer* writer ) {
+        notifier->OnCommand( command , writer );
+    }
+    N* notifier;
+    CommandNotifier( N* n ) : notifier(n) {}
+};
+
+using ::mnet::detail::static_assert_result;
+
+DECLARE_CONCEPT_CHECK(OnCommand,OnCommand,void (T::*)(const Command&,Writer*));
+
+template< typename T >
+CommandCallback* MakeCommandCallback( T* n ) {
+    STATIC_ASSERT( HasConcept_OnCommand<T>::result , No_On_Command_Is_Found );
+    return new CommandNotifier<T>(n);
+}
+
+// A client connection. It runs the handler for every complete command in the
+// read buffer and flushes the replies before reading again.
+class Connection {
+public:
+    Connection( Server* server , IOManager* io_manager );
+
+    ~Connection();
+
+    Socket* socket() {
+        return &socket_;
+    }
+
+    void Start();
+
+    // Socket callbacks
+    void OnRead( Socket* socket , std::size_t size , const NetState& ok );
+    void OnWrite( Socket* socket , std::size_t size , const NetState& ok );
+
+    // The list of connections of the server
+    Connection* prev;
+    Connection* next;
+
+private:
+    // Read, process and write until an operation has to wait
+    void Run();
+    // Handle the complete commands in the read buffer
+    void Process();
+
+    Server* server_;
+    Socket socket_;
+    Parser parser_;
+    // The protocol version chosen by HELLO
+    int protocol_;
+    // A Socket operation is in flight
+    bool pending_;
+    // Inside of Run, callbacks which are invoked synchronously only record
+    // their result then
+    bool in_run_;
+    // The connection is broken or timed out
+    bool dead_;
+    // The connection is closed once the write buffer is flushed
+    bool closing_;
+    // The peer has shutdown its side
+    bool peer_eof_;
+
+    DISALLOW_COPY_AND_ASSIGN(Connection);
+};
+
+}// namespace detail
+
+// The RESP server. It runs on the thread of its IOManager, the handler's
+//   void OnCommand( const Command& command , Writer* writer );
+// is invoked for every command in the order they arrive on a connection and
+// must write exactly one reply. The Command points into the read buffer and is
+// only valid inside of OnCommand.
+class Server {
+public:
+    explicit Server( IOManager* io_manager );
+
+    // Close all connections
+    ~Server();
+
+    bool Bind( const Endpoint& endpoint );
+
+    template< typename T >
+    void Start( T* handler );
+
+    // Bulk strings that are larger are a protocol error
+    void set_max_bulk_size( std::size_t size ) {
+        max_bulk_size_ = size;
+    }
+
+    // Close a connection that is idle for so many milliseconds, 0 means never
+    void set_idle_timeout( int msec ) {
+        idle_timeout_ = msec;
+    }
+
+    // The listener, for the admission control of the ServerSocket
+    ServerSocket* server_socket() {
+        return &server_socket_;
+    }
+
+    std::size_t connection_size() const {
+        return connection_size_;
+    }
+
+    uint64_t command_count() const {
+        return command_count_;
+    }
+
+    // Accept callback, used internally
+    void OnAccept( Socket* socket , const NetState& ok );
+
+private:
+    void Destroy( detail::Connection* connection );
+
+    IOManager* io_manager_;
+    ServerSocket server_socket_;
+    ::mnet::detail::ScopePtr<detail::CommandCallback> handler_;
+    // The connection accepting
+    detail::Connection* accepting_;
+    // The head of the list of connections
+    detail::Connection* connections_;
+    std::size_t connection_size_;
+    uint64_t command_count_;
+    std::size_t max_bulk_size_;
+    int idle_timeout_;
+
+    friend class detail::Connection;
+
+    DISALLOW_COPY_AND_ASSIGN(Server);
+};
+
+template< typename T >
+void Server::Start( T* handler ) {
+    assert( handler_.IsNull() );
+    handler_.Reset( detail::MakeCommandCallback(handler) );
+    server_socket_.SetIOManager( io_manager_ );
+    accepting_ = new detail::Connection( this , io_manager_ );
+    server_socket_.AsyncAccept( accepting_->socket() , this );
+}
+
+}// namespace resp
+}// namespace mnet
+
+#endif // MNET_RESP_H_
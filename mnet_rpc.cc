@@ -0,0 +1,761 @@
+#include "mnet_rpc.h"
+
+namespace mnet {
+namespace rpc {
+namespace {
+
+enum {
+    KIND_REQUEST = 1,
+    KIND_RESPONSE = 2,
+    KIND_CANCEL = 3
+};
+
+// The size in front of every frame
+const std::size_t kFrameHeader = 4;
+
+// The longest varint
+const std::size_t kMaxVarint = 10;
+
+// A nested message has a varint size padded to 5 bytes, so it can be filled in
+// once the message is written
+const std::size_t kNestedSize = 5;
+
+std::size_t EncodeVarint( char* out , uint64_t value ) {
+    std::size_t i = 0;
+    while( value >= 0x80 ) {
+        out[i++] = static_cast<char>( value | 0x80 );
+        value >>= 7;
+    }
+    out[i++] = static_cast<char>(value);
+    return i;
+}
+
+// Return the size of the varint at p, 0 if it is truncated or too long
+std::size_t DecodeVarint( const char* p , const char* end , uint64_t* value ) {
+    if( LIKELY( p < end && static_cast<unsigned char>(*p) < 0x80 ) ) {
+        *value = static_cast<unsigned char>(*p);
+        return 1;
+    }
+    uint64_t v = 0;
+    for( std::size_t i = 0 ; i < kMaxVarint && p + i < end ; ++i ) {
+        const unsigned char c = static_cast<unsigned char>(p[i]);
+        v |= static_cast<uint64_t>( c & 0x7F ) << ( 7 * i );
+        if( c < 0x80 ) {
+            *value = v;
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+void EncodeFixed32( char* out , uint32_t value ) {
+    out[0] = static_cast<char>( value );
+    out[1] = static_cast<char>( value >> 8 );
+    out[2] = static_cast<char>( value >> 16 );
+    out[3] = static_cast<char>( value >> 24 );
+}
+
+uint32_t DecodeFixed32( const char* p ) {
+    const unsigned char* u = reinterpret_cast<const unsigned char*>(p);
+    return static_cast<uint32_t>(u[0]) | static_cast<uint32_t>(u[1]) << 8 |
+           static_cast<uint32_t>(u[2]) << 16 | static_cast<uint32_t>(u[3]) << 24;
+}
+
+// Write the head of a frame, its size is filled in by EndFrame. Return the
+// offset of the frame in the readable part of the buffer.
+std::size_t BeginFrame( Buffer* buffer , const char* head , std::size_t size ) {
+    const std::size_t start = buffer->readable_size();
+    buffer->Reserve( kFrameHeader + size );
+    Buffer::Accessor accessor = buffer->GetWriteAccessor();
+    char* out = static_cast<char*>(accessor.address());
+    memcpy( out + kFrameHeader , head , size );
+    accessor.set_committed_size( kFrameHeader + size );
+    return start;
+}
+
+// Return the memory of the frame that starts at offset start
+char* FrameAt( Buffer* buffer , std::size_t start ) {
+    Buffer::Accessor accessor = buffer->GetReadAccessor();
+    return static_cast<char*>(accessor.address()) + start;
+}
+
+void EndFrame( Buffer* buffer , std::size_t start ) {
+    const std::size_t size = buffer->readable_size() - start - kFrameHeader;
+    assert( size <= 0xFFFFFFFF );
+    EncodeFixed32( FrameAt( buffer , start ) , static_cast<uint32_t>(size) );
+}
+
+uint64_t Key( uint32_t field , int type ) {
+    return static_cast<uint64_t>(field) << 3 | static_cast<uint64_t>(type);
+}
+
+}// namespace
+
+void Writer::WriteVarint( uint32_t field , uint64_t value ) {
+    buffer_->Reserve( 2 * kMaxVarint );
+    Buffer::Accessor accessor = buffer_->GetWriteAccessor();
+    char* out = static_cast<char*>(accessor.address());
+    std::size_t size = EncodeVarint( out , Key( field , WIRE_VARINT ) );
+    size += EncodeVarint( out + size , value );
+    accessor.set_committed_size( size );
+}
+
+void Writer::WriteFixed64( uint32_t field , uint64_t value ) {
+    buffer_->Reserve( kMaxVarint + 8 );
+    Buffer::Accessor accessor = buffer_->GetWriteAccessor();
+    char* out = static_cast<char*>(accessor.address());
+    std::size_t size = EncodeVarint( out , Key( field , WIRE_FIXED64 ) );
+    for( int i = 0 ; i < 8 ; ++i )
+        out[size++] = static_cast<char>( value >> ( i * 8 ) );
+    accessor.set_committed_size( size );
+}
+
+char* Writer::ReserveBytes( uint32_t field , std::size_t size ) {
+    buffer_->Reserve( 2 * kMaxVarint + size );
+    Buffer::Accessor accessor = buffer_->GetWriteAccessor();
+    char* out = static_cast<char*>(accessor.address());
+    std::size_t head = EncodeVarint( out , Key( field , WIRE_BYTES ) );
+    head += EncodeVarint( out + head , size );
+    accessor.set_committed_size( head + size );
+    return out + head;
+}
+
+std::size_t Writer::BeginMessage( uint32_t field ) {
+    buffer_->Reserve( kMaxVarint + kNestedSize );
+    {
+        Buffer::Accessor accessor = buffer_->GetWriteAccessor();
+        char* out = static_cast<char*>(accessor.address());
+        const std::size_t head = EncodeVarint( out , Key( field , WIRE_BYTES ) );
+        accessor.set_committed_size( head + kNestedSize );
+    }
+    return buffer_->readable_size() - origin_;
+}
+
+void Writer::EndMessage( std::size_t token ) {
+    const std::size_t start = origin_ + token;
+    const uint64_t size = buffer_->readable_size() - start;
+    char* out = FrameAt( buffer_ , start - kNestedSize );
+    for( std::size_t i = 0 ; i < kNestedSize - 1 ; ++i )
+        out[i] = static_cast<char>( ( ( size >> ( 7 * i ) ) & 0x7F ) | 0x80 );
+    out[kNestedSize-1] = static_cast<char>( ( size >> ( 7 * ( kNestedSize - 1 ) ) ) & 0x7F );
+}
+
+bool Reader::Next() {
+    if( pos_ == end_ || error_ )
+        return false;
+    uint64_t key;
+    std::size_t n = DecodeVarint( pos_ , end_ , &key );
+    if( n == 0 || ( key >> 3 ) > 0xFFFFFFFF ) {
+        error_ = true;
+        return false;
+    }
+    pos_ += n;
+    field_ = static_cast<uint32_t>( key >> 3 );
+    type_ = static_cast<int>( key & 7 );
+    switch( type_ ) {
+        case WIRE_VARINT:
+            n = DecodeVarint( pos_ , end_ , &value_ );
+            if( n == 0 )
+                break;
+            pos_ += n;
+            return true;
+        case WIRE_FIXED64:
+            if( end_ - pos_ < 8 )
+                break;
+            value_ = 0;
+            for( int i = 0 ; i < 8 ; ++i )
+                value_ |= static_cast<uint64_t>( static_cast<unsigned char>(pos_[i]) ) << ( i * 8 );
+            pos_ += 8;
+            return true;
+        case WIRE_BYTES: {
+            uint64_t size;
+            n = DecodeVarint( pos_ , end_ , &size );
+            if( n == 0 || size > static_cast<uint64_t>( end_ - pos_ - n ) )
+                break;
+            bytes_ = StringPiece( pos_ + n , static_cast<std::size_t>(size) );
+            pos_ += n + size;
+            return true;
+        }
+        default:
+            break;
+    }
+    error_ = true;
+    return false;
+}
+
+void Call::Reset( detail::Connection* connection , uint64_t request_id ,
+                  uint32_t method , const StringPiece& body , uint64_t deadline ) {
+    connection_ = connection;
+    prev_ = NULL;
+    next_ = NULL;
+    request_id_ = request_id;
+    method_ = method;
+    body_ = body;
+    deadline_ = deadline;
+    writer_.set_buffer( &connection->socket_.write_buffer() );
+    deferred_ = false;
+    started_ = false;
+    cancelled_ = false;
+    finished_ = false;
+}
+
+bool Call::is_cancelled() const {
+    return cancelled_ || connection_ == NULL ||
+        ( deadline_ != 0 && connection_->Now() > deadline_ );
+}
+
+Writer* Call::response() {
+    assert( !finished_ );
+    if( !started_ ) {
+        started_ = true;
+        if( connection_ != NULL ) {
+            // The status is filled in by Finish
+            char head[2 + kMaxVarint];
+            head[0] = KIND_RESPONSE;
+            head[1] = STATUS_OK;
+            const std::size_t size = 2 + EncodeVarint( head + 2 , request_id_ );
+            if( deferred_ ) {
+                frame_start_ = BeginFrame( buffer_.get() , head , size );
+            } else {
+                Buffer* out = &connection_->socket_.write_buffer();
+                frame_start_ = BeginFrame( out , head , size );
+                // The tokens stay valid when Defer moves the frame
+                writer_.set_buffer( out , frame_start_ );
+                connection_->building_ = this;
+            }
+        }
+    }
+    return &writer_;
+}
+
+void Call::Defer() {
+    if( deferred_ )
+        return;
+    if( buffer_.IsNull() )
+        buffer_.Reset( new Buffer() );
+    assert( buffer_->readable_size() == 0 );
+    if( started_ ) {
+        Buffer* out = &connection_->socket_.write_buffer();
+        buffer_->Write( FrameAt( out , frame_start_ ) , out->readable_size() - frame_start_ );
+        out->Truncate( frame_start_ );
+        frame_start_ = 0;
+        connection_->building_ = NULL;
+    }
+    writer_.set_buffer( buffer_.get() );
+    deferred_ = true;
+}
+
+void Call::Finish( int status ) {
+    assert( !finished_ );
+    assert( status >= 0 && status <= 255 );
+    if( connection_ == NULL ) {
+        delete this;
+        return;
+    }
+    if( started_ || !is_cancelled() ) {
+        Buffer* out = &connection_->socket_.write_buffer();
+        // A response of a handler still running is in the way, move it aside
+        if( deferred_ && connection_->building_ != NULL )
+            connection_->building_->Defer();
+        response();
+        Buffer* buffer = deferred_ ? buffer_.get() : out;
+        FrameAt( buffer , frame_start_ )[kFrameHeader + 1] = static_cast<char>(status);
+        EndFrame( buffer , frame_start_ );
+        if( deferred_ )
+            buffer->TransferTo( out );
+        else
+            connection_->building_ = NULL;
+    }
+    finished_ = true;
+    connection_->Release( this );
+}
+
+namespace detail {
+
+Connection::Connection( Server* server , IOManager* io_manager ) :
+    prev(NULL),
+    next(NULL),
+    server_(server),
+    socket_(io_manager),
+    waiting_(NULL),
+    building_(NULL),
+    free_calls_(),
+    reading_(false),
+    writing_(false),
+    in_run_(false),
+    dead_(false),
+    closing_(false),
+    peer_eof_(false)
+    {}
+
+Connection::~Connection() {
+    // The calls still waited for keep building in their own buffer, the
+    // response is dropped by Finish
+    while( waiting_ != NULL ) {
+        Call* call = waiting_;
+        waiting_ = call->next_;
+        call->connection_ = NULL;
+        call->prev_ = NULL;
+        call->next_ = NULL;
+    }
+    for( std::size_t i = 0 ; i < free_calls_.size() ; ++i )
+        delete free_calls_[i];
+    if( socket_.fd() >= 0 )
+        socket_.Close();
+}
+
+void Connection::Start() {
+    Run();
+}
+
+uint64_t Connection::Now() const {
+    return server_->io_manager_->Now();
+}
+
+void Connection::OnRead( Socket* socket , std::size_t size , const NetState& ok ) {
+    reading_ = false;
+    if( !ok ) {
+        dead_ = true;
+    } else if( size == 0 ) {
+        // Still answer the requests that are already here
+        peer_eof_ = true;
+    }
+    if( !in_run_ )
+        Run();
+}
+
+void Connection::OnWrite( Socket* socket , std::size_t size , const NetState& ok ) {
+    writing_ = false;
+    if( !ok )
+        dead_ = true;
+    if( !in_run_ )
+        Run();
+}
+
+void Connection::Run() {
+    // The socket operations may complete right away, loop here instead of
+    // recursing from their callbacks. The read stays pending while the
+    // responses are written, so a handler may answer at any time.
+    in_run_ = true;
+    while( !dead_ ) {
+        Process();
+        if( !writing_ && socket_.write_buffer().readable_size() != 0 ) {
+            writing_ = true;
+            socket_.AsyncWrite( this );
+            if( !writing_ )
+                continue;
+        }
+        if( closing_ || peer_eof_ ) {
+            if( !writing_ )
+                break;
+        } else if( !reading_ ) {
+            reading_ = true;
+            socket_.AsyncRead( this , server_->idle_timeout_ );
+            if( !reading_ )
+                continue;
+        }
+        in_run_ = false;
+        return;
+    }
+    in_run_ = false;
+    server_->Destroy( this );
+}
+
+void Connection::Flush() {
+    if( in_run_ || dead_ || writing_ || socket_.write_buffer().readable_size() == 0 )
+        return;
+    // A failed write is noticed by the pending read
+    in_run_ = true;
+    writing_ = true;
+    socket_.AsyncWrite( this );
+    in_run_ = false;
+}
+
+void Connection::Process() {
+    Buffer& in = socket_.read_buffer();
+    while( !closing_ ) {
+        Buffer::Accessor accessor = in.GetReadAccessor();
+        if( accessor.size() < kFrameHeader )
+            break;
+        const char* data = static_cast<const char*>(accessor.address());
+        const std::size_t size = DecodeFixed32( data );
+        if( size == 0 || size > server_->max_frame_size_ ) {
+            closing_ = true;
+            break;
+        }
+        if( accessor.size() - kFrameHeader < size )
+            break;
+        accessor.set_committed_size( kFrameHeader + size );
+        const char* frame = data + kFrameHeader;
+        if( frame[0] == KIND_REQUEST ) {
+            OnRequest( frame + 1 , size - 1 );
+        } else if( frame[0] == KIND_CANCEL ) {
+            uint64_t request_id;
+            if( DecodeVarint( frame + 1 , frame + size , &request_id ) == 0 )
+                closing_ = true;
+            else
+                OnCancel( request_id );
+        } else {
+            closing_ = true;
+        }
+    }
+}
+
+void Connection::OnRequest( const char* data , std::size_t size ) {
+    const char* p = data;
+    const char* end = data + size;
+    uint64_t head[3];
+    for( int i = 0 ; i < 3 ; ++i ) {
+        const std::size_t n = DecodeVarint( p , end , &head[i] );
+        if( n == 0 ) {
+            closing_ = true;
+            return;
+        }
+        p += n;
+    }
+    if( head[1] > 0xFFFFFFFF ) {
+        closing_ = true;
+        return;
+    }
+    const uint64_t deadline = head[2] == 0 ? 0 :
+        Now() + head[2] * 1000;
+
+    Call* call;
+    if( free_calls_.empty() ) {
+        call = new Call();
+    } else {
+        call = free_calls_.back();
+        free_calls_.pop_back();
+    }
+    call->Reset( this , head[0] , static_cast<uint32_t>(head[1]) ,
+                 StringPiece( p , end - p ) , deadline );
+    ++server_->call_count_;
+    if( !server_->dispatcher_->Dispatch( call->method_ , call ) ) {
+        call->Finish( STATUS_UNKNOWN_METHOD );
+    } else if( !call->finished_ ) {
+        // The handler answers later, the body is gone by then and the
+        // response must not be flushed half built
+        call->Defer();
+        call->body_ = StringPiece();
+        call->next_ = waiting_;
+        if( waiting_ != NULL )
+            waiting_->prev_ = call;
+        waiting_ = call;
+    }
+}
+
+void Connection::OnCancel( uint64_t request_id ) {
+    for( Call* call = waiting_ ; call != NULL ; call = call->next_ ) {
+        if( call->request_id_ == request_id ) {
+            call->cancelled_ = true;
+            break;
+        }
+    }
+}
+
+void Connection::Release( Call* call ) {
+    if( call->prev_ != NULL )
+        call->prev_->next_ = call->next_;
+    else if( waiting_ == call )
+        waiting_ = call->next_;
+    if( call->next_ != NULL )
+        call->next_->prev_ = call->prev_;
+    call->prev_ = NULL;
+    call->next_ = NULL;
+    free_calls_.push_back( call );
+    Flush();
+}
+
+}// namespace detail
+
+Server::Server( IOManager* io_manager ) :
+    io_manager_(io_manager),
+    server_socket_(),
+    dispatcher_(),
+    accepting_(NULL),
+    connections_(NULL),
+    connection_size_(0),
+    call_count_(0),
+    max_frame_size_(64*1024*1024),
+    idle_timeout_(0)
+    {}
+
+Server::~Server() {
+    while( connections_ != NULL )
+        Destroy( connections_ );
+    delete accepting_;
+}
+
+bool Server::Bind( const Endpoint& endpoint ) {
+    return server_socket_.Bind( endpoint );
+}
+
+void Server::OnAccept( Socket* socket , const NetState& ok ) {
+    detail::Connection* connection = accepting_;
+    accepting_ = new detail::Connection( this , io_manager_ );
+    server_socket_.AsyncAccept( accepting_->socket() , this );
+    if( !ok ) {
+        delete connection;
+        return;
+    }
+    connection->next = connections_;
+    if( connections_ != NULL )
+        connections_->prev = connection;
+    connections_ = connection;
+    ++connection_size_;
+    connection->Start();
+}
+
+void Server::Destroy( detail::Connection* connection ) {
+    if( connection->prev != NULL )
+        connection->prev->next = connection->next;
+    else
+        connections_ = connection->next;
+    if( connection->next != NULL )
+        connection->next->prev = connection->prev;
+    --connection_size_;
+    delete connection;
+}
+
+Client::Client( IOManager* io_manager ) :
+    io_manager_(io_manager),
+    socket_(io_manager),
+    notifier_(),
+    writer_(&socket_.write_buffer()),
+    pending_(),
+    base_id_(1),
+    next_id_(1),
+    pending_size_(0),
+    frame_start_(0),
+    call_deadline_(0),
+    timer_deadline_(0),
+    connected_(false),
+    reading_(false),
+    writing_(false),
+    in_run_(false),
+    lost_(false)
+    {}
+
+Client::~Client() {
+    if( socket_.fd() >= 0 )
+        socket_.Close();
+}
+
+Writer* Client::BeginCall( uint32_t method , int timeout_ms ) {
+    char head[1 + 3 * kMaxVarint];
+    head[0] = KIND_REQUEST;
+    std::size_t size = 1 + EncodeVarint( head + 1 , next_id_ );
+    size += EncodeVarint( head + size , method );
+    size += EncodeVarint( head + size , timeout_ms > 0 ? timeout_ms : 0 );
+    frame_start_ = BeginFrame( &socket_.write_buffer() , head , size );
+    call_deadline_ = timeout_ms > 0 ?
+        io_manager_->Now() + static_cast<uint64_t>(timeout_ms) * 1000 : 0;
+    return &writer_;
+}
+
+uint64_t Client::EndCall( void* context ) {
+    if( lost_ ) {
+        // Nothing is sent any more
+        Buffer::Accessor accessor = socket_.write_buffer().GetReadAccessor();
+        accessor.set_committed_size( accessor.size() );
+        return 0;
+    }
+    EndFrame( &socket_.write_buffer() , frame_start_ );
+    Pending pending;
+    pending.context = context;
+    pending.deadline = call_deadline_;
+    pending.done = false;
+    pending_.push_back( pending );
+    ++pending_size_;
+    if( call_deadline_ != 0 )
+        ArmTimer( call_deadline_ );
+    Flush();
+    return next_id_++;
+}
+
+bool Client::Cancel( uint64_t request_id ) {
+    if( request_id < base_id_ || request_id >= next_id_ )
+        return false;
+    Pending& pending = pending_[ request_id - base_id_ ];
+    if( pending.done )
+        return false;
+    pending.done = true;
+    --pending_size_;
+    Trim();
+    if( !lost_ ) {
+        char head[1 + kMaxVarint];
+        head[0] = KIND_CANCEL;
+        const std::size_t size = 1 + EncodeVarint( head + 1 , request_id );
+        EndFrame( &socket_.write_buffer() ,
+                  BeginFrame( &socket_.write_buffer() , head , size ) );
+        Flush();
+    }
+    return true;
+}
+
+void Client::OnConnect( Socket* socket , const NetState& ok ) {
+    if( !ok ) {
+        lost_ = true;
+        FailAll();
+    } else {
+        connected_ = true;
+    }
+    // Calls made inside of OnConnect are written out by Run
+    in_run_ = true;
+    notifier_->InvokeConnect( this , ok );
+    in_run_ = false;
+    if( ok )
+        Run();
+}
+
+void Client::OnRead( Socket* socket , std::size_t size , const NetState& ok ) {
+    reading_ = false;
+    if( !ok || size == 0 )
+        lost_ = true;
+    if( !in_run_ )
+        Run();
+}
+
+void Client::OnWrite( Socket* socket , std::size_t size , const NetState& ok ) {
+    writing_ = false;
+    if( !ok )
+        lost_ = true;
+    if( !in_run_ )
+        Run();
+}
+
+void Client::OnTimeout( int msec ) {
+    timer_deadline_ = 0;
+    const bool in_run = in_run_;
+    in_run_ = true;
+    ExpireCalls();
+    in_run_ = in_run;
+    if( connected_ && !in_run_ )
+        Run();
+}
+
+void Client::Run() {
+    in_run_ = true;
+    while( true ) {
+        // The responses that arrived before the connection is lost still count
+        Process();
+        if( lost_ )
+            break;
+        if( !writing_ && socket_.write_buffer().readable_size() != 0 ) {
+            writing_ = true;
+            socket_.AsyncWrite( this );
+            if( !writing_ )
+                continue;
+        }
+        if( !reading_ ) {
+            reading_ = true;
+            socket_.AsyncRead( this );
+            if( !reading_ )
+                continue;
+        }
+        in_run_ = false;
+        return;
+    }
+    if( socket_.fd() >= 0 )
+        socket_.Close();
+    FailAll();
+    in_run_ = false;
+}
+
+void Client::Flush() {
+    if( in_run_ || !connected_ || lost_ || writing_ ||
+        socket_.write_buffer().readable_size() == 0 )
+        return;
+    // A failed write is noticed by the pending read
+    in_run_ = true;
+    writing_ = true;
+    socket_.AsyncWrite( this );
+    in_run_ = false;
+}
+
+void Client::Process() {
+    Buffer& in = socket_.read_buffer();
+    while( true ) {
+        Buffer::Accessor accessor = in.GetReadAccessor();
+        if( accessor.size() < kFrameHeader )
+            break;
+        const char* data = static_cast<const char*>(accessor.address());
+        const std::size_t size = DecodeFixed32( data );
+        if( accessor.size() - kFrameHeader < size )
+            break;
+        accessor.set_committed_size( kFrameHeader + size );
+        const char* frame = data + kFrameHeader;
+        const char* end = frame + size;
+        uint64_t request_id;
+        std::size_t n;
+        if( size < 3 || frame[0] != KIND_RESPONSE ||
+            ( n = DecodeVarint( frame + 2 , end , &request_id ) ) == 0 ) {
+            // The server speaks something else
+            lost_ = true;
+            break;
+        }
+        const char* body = frame + 2 + n;
+        Complete( request_id , static_cast<unsigned char>(frame[1]) ,
+                  StringPiece( body , end - body ) );
+    }
+}
+
+void Client::Complete( uint64_t request_id , int status , const StringPiece& body ) {
+    // A late answer of a call that is given up is ignored
+    if( request_id < base_id_ || request_id >= next_id_ )
+        return;
+    Pending& pending = pending_[ request_id - base_id_ ];
+    if( pending.done )
+        return;
+    void* context = pending.context;
+    pending.done = true;
+    --pending_size_;
+    Trim();
+    notifier_->InvokeResponse( this , request_id , status , context , body );
+}
+
+void Client::Trim() {
+    while( !pending_.empty() && pending_.front().done ) {
+        pending_.pop_front();
+        ++base_id_;
+    }
+}
+
+void Client::ExpireCalls() {
+    const uint64_t now = io_manager_->Now();
+    uint64_t next = 0;
+    // Completing a call may trim the head and make new calls, so walk by id
+    for( uint64_t id = base_id_ ; id < next_id_ ; ++id ) {
+        if( id < base_id_ )
+            continue;
+        const Pending& pending = pending_[ id - base_id_ ];
+        if( pending.done || pending.deadline == 0 )
+            continue;
+        if( pending.deadline <= now )
+            Complete( id , STATUS_DEADLINE_EXCEEDED , StringPiece() );
+        else if( next == 0 || pending.deadline < next )
+            next = pending.deadline;
+    }
+    if( next != 0 )
+        ArmTimer( next );
+}
+
+void Client::ArmTimer( uint64_t deadline ) {
+    if( timer_deadline_ != 0 && timer_deadline_ <= deadline )
+        return;
+    timer_deadline_ = deadline;
+    const uint64_t now = io_manager_->Now();
+    // Round up, a timer never fires before the deadline
+    const uint64_t msec = deadline > now ? ( deadline - now + 999 ) / 1000 : 0;
+    socket_.Schedule( static_cast<int>(msec) , this );
+}
+
+void Client::FailAll() {
+    for( uint64_t id = base_id_ ; id < next_id_ ; ++id ) {
+        if( id >= base_id_ && !pending_[ id - base_id_ ].done )
+            Complete( id , STATUS_CONNECTION_LOST , StringPiece() );
+    }
+}
+
+}// namespace rpc
+}// namespace mnet
@@ -0,0 +1,610 @@
+#ifndef MNET_RPC_H_
+#define MNET_RPC_H_
+#include "mnet.h"
+#include <deque>
+
+// A small binary RPC. Every message is a frame of
+//   a 32 bits little endian size of the rest of the frame
+//   a kind byte
+//   a request:  varint request id, varint method id, varint timeout in msec
+//   a response: status byte, varint request id
+//   a cancel:   varint request id
+// followed, for requests and responses, by the fields of the body. A field is a
+// varint key, the field number shifted left by 3 or'ed with the wire type, and
+// its value: a varint, 8 little endian bytes, or a varint size and the bytes.
+// There is no schema, the Writer formats the fields straight into the write
+// buffer of the socket and the Reader walks them as views over the read buffer.
+//
+// The server dispatches on the method id through a table of Method templates,
+// so the method lookup is resolved at compile time. A handler may answer later,
+// which lets the client cancel it. The client pipelines its calls on one
+// connection and fails them on their deadline.
+
+namespace mnet {
+namespace rpc {
+class Call;
+class Client;
+class Server;
+
+namespace detail {
+class Connection;
+}// namespace detail
+
+// The status of a response. The ones the client makes up itself are never sent.
+enum {
+    STATUS_OK = 0,
+    STATUS_UNKNOWN_METHOD = 1,
+    STATUS_DEADLINE_EXCEEDED = 2,
+    STATUS_CANCELLED = 3,
+    STATUS_CONNECTION_LOST = 4,
+    // The first status free for the application, up to 255
+    STATUS_USER = 16
+};
+
+// The wire types of the fields
+enum {
+    WIRE_VARINT = 0,
+    WIRE_FIXED64 = 1,
+    WIRE_BYTES = 2
+};
+
+// Serialize fields into a Buffer. Each field is formatted in place in the
+// memory of the buffer, nothing is copied twice.
+class Writer {
+public:
+    explicit Writer( Buffer* buffer ) :
+        buffer_(buffer),
+        origin_(0)
+        {}
+
+    // The tokens of BeginMessage are offsets from origin in the buffer, so
+    // the bytes from origin on can be moved to another buffer in between
+    void set_buffer( Buffer* buffer , std::size_t origin = 0 ) {
+        buffer_ = buffer;
+        origin_ = origin;
+    }
+
+    void WriteVarint( uint32_t field , uint64_t value );
+
+    // Zigzag encoded, so a small negative value stays short
+    void WriteSigned( uint32_t field , int64_t value ) {
+        WriteVarint( field , ( static_cast<uint64_t>(value) << 1 ) ^
+                             static_cast<uint64_t>( value >> 63 ) );
+    }
+
+    void WriteBool( uint32_t field , bool value ) {
+        WriteVarint( field , value ? 1 : 0 );
+    }
+
+    void WriteFixed64( uint32_t field , uint64_t value );
+
+    void WriteDouble( uint32_t field , double value ) {
+        uint64_t v;
+        memcpy( &v , &value , sizeof(v) );
+        WriteFixed64( field , v );
+    }
+
+    void WriteBytes( uint32_t field , const StringPiece& value ) {
+        memcpy( ReserveBytes( field , value.size() ) , value.data() , value.size() );
+    }
+
+    // Return the memory of a bytes field of size bytes, to be filled by the
+    // caller before anything else is written
+    char* ReserveBytes( uint32_t field , std::size_t size );
+
+    // Start a bytes field that holds a nested message, its fields are written
+    // with this Writer until EndMessage is called with the returned token
+    std::size_t BeginMessage( uint32_t field );
+
+    void EndMessage( std::size_t token );
+
+private:
+    // Return size bytes of writable memory of the buffer
+    char* Extend( std::size_t size ) {
+        buffer_->Reserve( size );
+        Buffer::Accessor accessor = buffer_->GetWriteAccessor();
+        accessor.set_committed_size( size );
+        return static_cast<char*>(accessor.address());
+    }
+
+    Buffer* buffer_;
+    // Offset in the buffer the tokens are relative to
+    std::size_t origin_;
+
+    DISALLOW_COPY_AND_ASSIGN(Writer);
+};
+
+// Walk the fields of a body. The bytes fields point into the body.
+class Reader {
+public:
+    explicit Reader( const StringPiece& data ) :
+        pos_( data.data() ),
+        end_( data.data() + data.size() ),
+        field_(0),
+        type_(0),
+        value_(0),
+        bytes_(),
+        error_(false)
+        {}
+
+    // Move to the next field. It returns false at the end of the body or on
+    // malformed data, which error() tells apart.
+    bool Next();
+
+    uint32_t field() const {
+        return field_;
+    }
+
+    int type() const {
+        return type_;
+    }
+
+    // The value of a varint or of a fixed64 field
+    uint64_t varint() const {
+        return value_;
+    }
+
+    int64_t signed_varint() const {
+        return static_cast<int64_t>( value_ >> 1 ) ^ -static_cast<int64_t>( value_ & 1 );
+    }
+
+    double double_value() const {
+        double v;
+        memcpy( &v , &value_ , sizeof(v) );
+        return v;
+    }
+
+    // The value of a bytes field, a nested message is read with a Reader on it
+    const StringPiece& bytes() const {
+        return bytes_;
+    }
+
+    bool error() const {
+        return error_;
+    }
+
+private:
+    const char* pos_;
+    const char* end_;
+    uint32_t field_;
+    int type_;
+    uint64_t value_;
+    StringPiece bytes_;
+    bool error_;
+};
+
+// A request on the server. It is handed to the handler of its method, which
+// answers it by writing the fields into response() and calling Finish, either
+// before it returns or later on the thread of the server. A response finished
+// before the handler returns is built in place in the write buffer. Otherwise
+// it is built in a buffer of the call and appended to the write buffer by
+// Finish, so only finished responses are ever written out.
+class Call {
+public:
+    uint64_t request_id() const {
+        return request_id_;
+    }
+
+    uint32_t method() const {
+        return method_;
+    }
+
+    // The fields of the request. They point into the read buffer and are only
+    // valid until the handler returns, an answer that comes later has to copy
+    // what it needs.
+    const StringPiece& body() const {
+        return body_;
+    }
+
+    // Microseconds on the clock of IOManager::Now after which the client no
+    // longer waits for the answer, 0 if there is none
+    uint64_t deadline() const {
+        return deadline_;
+    }
+
+    // The client cancelled the call, its deadline passed or the connection is
+    // gone. Nobody waits for the answer, a handler that answers later can skip
+    // its work then.
+    bool is_cancelled() const;
+
+    // The writer of the response body
+    Writer* response();
+
+    // Send the response with the status, the Call must not be used afterwards.
+    // Nothing is sent for a cancelled call whose response is not started.
+    void Finish( int status = STATUS_OK );
+
+private:
+    Call() :
+        connection_(NULL),
+        prev_(NULL),
+        next_(NULL),
+        request_id_(0),
+        method_(0),
+        body_(),
+        deadline_(0),
+        frame_start_(0),
+        writer_(NULL),
+        buffer_(NULL),
+        deferred_(false),
+        started_(false),
+        cancelled_(false),
+        finished_(false)
+        {}
+
+    void Reset( detail::Connection* connection , uint64_t request_id ,
+                uint32_t method , const StringPiece& body , uint64_t deadline );
+
+    // Move the response started in place to the buffer of this call, so it
+    // can be finished at any later time
+    void Defer();
+
+    detail::Connection* connection_;
+    // The list of the calls the connection waits for
+    Call* prev_;
+    Call* next_;
+    uint64_t request_id_;
+    uint32_t method_;
+    StringPiece body_;
+    uint64_t deadline_;
+    // Offset of the response frame in the buffer it is built in
+    std::size_t frame_start_;
+    Writer writer_;
+    // The response of a deferred call is built here, it is kept when the call
+    // is reused. The response of a call whose connection is gone is dropped
+    ::mnet::detail::ScopePtr<Buffer> buffer_;
+    // The response is built in buffer_ instead of the write buffer
+    bool deferred_;
+    bool started_;
+    bool cancelled_;
+    bool finished_;
+
+    friend class detail::Connection;
+
+    DISALLOW_COPY_AND_ASSIGN(Call);
+};
+
+using ::mnet::detail::static_assert_result;
+
+// The end of a method table
+struct MethodEnd {
+    template< uint32_t ID > struct Contains {
+        static const bool value = false;
+    };
+
+    template< typename S >
+    static bool Dispatch( S* service , uint32_t method , Call* call ) {
+        return false;
+    }
+};
+
+// A method table is a chain of Method, each binds a method id to a member
+// function of the service, for example
+//   typedef Method< 1 , Service , &Service::Echo ,
+//           Method< 2 , Service , &Service::Sum > > Methods;
+// The chain is unrolled into a sequence of compares at compile time, a
+// duplicated id is a compile error.
+template< uint32_t ID , typename S , void (S::*Handler)( Call* ) , typename Next = MethodEnd >
+struct Method {
+    template< uint32_t I > struct Contains {
+        static const bool value = I == ID || Next::template Contains<I>::value;
+    };
+
+    static bool Dispatch( S* service , uint32_t method , Call* call ) {
+        STATIC_ASSERT( !Next::template Contains<ID>::value , Duplicated_Method_Id );
+        if( method == ID ) {
+            (service->*Handler)( call );
+            return true;
+        }
+        return Next::Dispatch( service , method , call );
+    }
+};
+
+namespace detail {
+
+// The type erased method table
+class Dispatcher {
+public:
+    // Return false if there is no such method
+    virtual bool Dispatch( uint32_t method , Call* call ) = 0;
+
+#ifdef FORCE_VIRTUAL_DESTRUCTOR
+    virtual ~Dispatcher() {}
+#endif // FORCE_VIRTUAL_DESTRUCTOR
+};
+
+template< typename Table , typename S > struct TableDispatcher : public Dispatcher {
+    virtual bool Dispatch( uint32_t method , Call* call ) {
+        return Table::Dispatch( service , method , call );
+    }
+    S* service;
+    TableDispatcher( S* s ) : service(s) {}
+};
+
+// A client connection of the server. Calls are dispatched as they arrive and
+// their responses are flushed together once the read buffer is drained.
+class Connection {
+public:
+    Connection( Server* server , IOManager* io_manager );
+
+    // Calls that are not finished yet are left cancelled
+    ~Connection();
+
+    Socket* socket() {
+        return &socket_;
+    }
+
+    void Start();
+
+    // Socket callbacks
+    void OnRead( Socket* socket , std::size_t size , const NetState& ok );
+    void OnWrite( Socket* socket , std::size_t size , const NetState& ok );
+
+    // The list of connections of the server
+    Connection* prev;
+    Connection* next;
+
+private:
+    // Read, process and write until an operation has to wait
+    void Run();
+    // Handle the complete frames in the read buffer
+    void Process();
+    // Handle a request frame
+    void OnRequest( const char* data , std::size_t size );
+    // Mark the call the client gave up
+    void OnCancel( uint64_t request_id );
+    // A call is finished, recycle it
+    void Release( Call* call );
+    // Write out the responses finished outside of Run
+    void Flush();
+    // The cached time of the IOManager in microseconds
+    uint64_t Now() const;
+
+    Server* server_;
+    Socket socket_;
+    // The calls whose handlers returned without an answer
+    Call* waiting_;
+    // The call whose response is being built in place in the write buffer
+    Call* building_;
+    // Finished calls, for reuse
+    std::vector<Call*> free_calls_;
+    bool reading_;
+    bool writing_;
+    // Inside of Run or of a Flush, callbacks which are invoked synchronously
+    // only record their result then
+    bool in_run_;
+    // The connection is broken or timed out
+    bool dead_;
+    // The connection is closed once the write buffer is flushed
+    bool closing_;
+    // The peer has shutdown its side
+    bool peer_eof_;
+
+    friend class ::mnet::rpc::Call;
+
+    DISALLOW_COPY_AND_ASSIGN(Connection);
+};
+
+// The type erased client notifier
+class ClientCallback {
+public:
+    virtual void InvokeConnect( Client* client , const NetState& ok ) = 0;
+    virtual void InvokeResponse( Client* client , uint64_t request_id , int status ,
+                                 void* context , const StringPiece& body ) = 0;
+
+#ifdef FORCE_VIRTUAL_DESTRUCTOR
+    virtual ~ClientCallback() {}
+#endif // FORCE_VIRTUAL_DESTRUCTOR
+};
+
+template< typename N > struct ClientNotifier : public ClientCallback {
+    virtual void InvokeConnect( Client* client , const NetState& ok ) {
+        notifier->OnConnect( client , ok );
+    }
+    virtual void InvokeResponse( Client* client , uint64_t request_id , int status ,
+                                 void* context , const StringPiece& body ) {
+        notifier->OnResponse( client , request_id , status , context , body );
+    }
+    N* notifier;
+    ClientNotifier( N* n ) : notifier(n) {}
+};
+
+DECLARE_CONCEPT_CHECK(OnConnect,OnConnect,void (T::*)(Client*,const NetState&));
+DECLARE_CONCEPT_CHECK(OnResponse,OnResponse,
+        void (T::*)(Client*,uint64_t,int,void*,const StringPiece&));
+
+template< typename T >
+ClientCallback* MakeClientCallback( T* n ) {
+    STATIC_ASSERT( HasConcept_OnConnect<T>::result , No_On_Connect_Is_Found );
+    STATIC_ASSERT( HasConcept_OnResponse<T>::result , No_On_Response_Is_Found );
+    return new ClientNotifier<T>(n);
+}
+
+}// namespace detail
+
+// The RPC server. It runs on the thread of its IOManager, a method table and the
+// service object its handlers are called on are given to Start:
+//   server.Start<Methods>( &service );
+// A request for a method the table does not have is answered with
+// STATUS_UNKNOWN_METHOD. Calls that are still waited for when their connection
+// is closed are left cancelled, their Finish only frees them.
+class Server {
+public:
+    explicit Server( IOManager* io_manager );
+
+    // Close all connections
+    ~Server();
+
+    bool Bind( const Endpoint& endpoint );
+
+    template< typename Table , typename S >
+    void Start( S* service );
+
+    // Frames that are larger are a protocol error
+    void set_max_frame_size( std::size_t size ) {
+        max_frame_size_ = size;
+    }
+
+    // Close a connection that is idle for so many milliseconds, 0 means never
+    void set_idle_timeout( int msec ) {
+        idle_timeout_ = msec;
+    }
+
+    // The listener, for the admission control of the ServerSocket
+    ServerSocket* server_socket() {
+        return &server_socket_;
+    }
+
+    std::size_t connection_size() const {
+        return connection_size_;
+    }
+
+    uint64_t call_count() const {
+        return call_count_;
+    }
+
+    // Accept callback, used internally
+    void OnAccept( Socket* socket , const NetState& ok );
+
+private:
+    void Destroy( detail::Connection* connection );
+
+    IOManager* io_manager_;
+    ServerSocket server_socket_;
+    ::mnet::detail::ScopePtr<detail::Dispatcher> dispatcher_;
+    // The connection accepting
+    detail::Connection* accepting_;
+    // The head of the list of connections
+    detail::Connection* connections_;
+    std::size_t connection_size_;
+    uint64_t call_count_;
+    std::size_t max_frame_size_;
+    int idle_timeout_;
+
+    friend class detail::Connection;
+
+    DISALLOW_COPY_AND_ASSIGN(Server);
+};
+
+template< typename Table , typename S >
+void Server::Start( S* service ) {
+    assert( dispatcher_.IsNull() );
+    dispatcher_.Reset( new detail::TableDispatcher<Table,S>(service) );
+    server_socket_.SetIOManager( io_manager_ );
+    accepting_ = new detail::Connection( this , io_manager_ );
+    server_socket_.AsyncAccept( accepting_->socket() , this );
+}
+
+// A pipelined RPC client on one connection. The notifier's
+//   void OnConnect( Client* client , const NetState& ok );
+// is invoked once the connection is made, and
+//   void OnResponse( Client* client , uint64_t request_id , int status ,
+//                    void* context , const StringPiece& body );
+// once for every call, with the response of the server, or with
+// STATUS_DEADLINE_EXCEEDED or STATUS_CONNECTION_LOST and an empty body. The
+// body points into the read buffer and is only valid inside of OnResponse.
+// Calls made inside of the callbacks are written out together when they return.
+class Client {
+public:
+    explicit Client( IOManager* io_manager );
+
+    ~Client();
+
+    template< typename T >
+    void Connect( const Endpoint& endpoint , T* notifier );
+
+    // Start a call, its fields are written into the returned Writer until
+    // EndCall. A timeout of 0 means the call has no deadline. Calls may be made
+    // before the connection is made, they are sent once it is.
+    Writer* BeginCall( uint32_t method , int timeout_ms = 0 );
+
+    // Send the call and return its request id, context is handed back to
+    // OnResponse. It returns 0 if the connection is lost, the call is not sent
+    // and OnResponse is not invoked for it then.
+    uint64_t EndCall( void* context = NULL );
+
+    // Stop waiting for a call and tell the server to give it up, OnResponse is
+    // not invoked for it. Return false if the call is not pending.
+    bool Cancel( uint64_t request_id );
+
+    // The calls waiting for their response
+    std::size_t pending_size() const {
+        return pending_size_;
+    }
+
+    bool is_connected() const {
+        return connected_ && !lost_;
+    }
+
+    ClientSocket* socket() {
+        return &socket_;
+    }
+
+    // Socket callbacks
+    void OnConnect( Socket* socket , const NetState& ok );
+    void OnRead( Socket* socket , std::size_t size , const NetState& ok );
+    void OnWrite( Socket* socket , std::size_t size , const NetState& ok );
+    void OnTimeout( int msec );
+
+private:
+    struct Pending {
+        void* context;
+        // Microseconds on the clock of IOManager::Now, 0 if there is none
+        uint64_t deadline;
+        bool done;
+    };
+
+    // Read, process and write until an operation has to wait
+    void Run();
+    // Handle the complete responses in the read buffer
+    void Process();
+    // Complete a pending call
+    void Complete( uint64_t request_id , int status , const StringPiece& body );
+    // Drop the finished calls at the head of pending_
+    void Trim();
+    // Fail the calls whose deadline passed and arm the timer for the next one
+    void ExpireCalls();
+    // Arm the timer for a deadline that is earlier than the armed one
+    void ArmTimer( uint64_t deadline );
+    // Fail every pending call, the connection is lost
+    void FailAll();
+    // Write out the calls made outside of Run
+    void Flush();
+
+    IOManager* io_manager_;
+    ClientSocket socket_;
+    ::mnet::detail::ScopePtr<detail::ClientCallback> notifier_;
+    Writer writer_;
+    // The pending calls in the order of their ids, the first has base_id_
+    std::deque<Pending> pending_;
+    uint64_t base_id_;
+    uint64_t next_id_;
+    std::size_t pending_size_;
+    // Offset of the frame of the call being written in the write buffer
+    std::size_t frame_start_;
+    uint64_t call_deadline_;
+    // The deadline the earliest armed timer fires at, 0 if none is armed
+    uint64_t timer_deadline_;
+    bool connected_;
+    bool reading_;
+    bool writing_;
+    // Inside of Run, of a callback or of a Flush, socket callbacks which are
+    // invoked synchronously only record their result then
+    bool in_run_;
+    // The connection is broken or closed by the server
+    bool lost_;
+
+    DISALLOW_COPY_AND_ASSIGN(Client);
+};
+
+template< typename T >
+void Client::Connect( const Endpoint& endpoint , T* notifier ) {
+    assert( notifier_.IsNull() );
+    notifier_.Reset( detail::MakeClientCallback(notifier) );
+    socket_.AsyncConnect( endpoint , this );
+}
+
+}// namespace rpc
+}// namespace mnet
+
+#endif // MNET_RPC_H_
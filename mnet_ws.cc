@@ -0,0 +1,602 @@
+#include "mnet_ws.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MNET_WS_X86
+#endif // __x86_64__ || __i386__
+
+namespace mnet {
+namespace ws {
+namespace {
+
+// The GUID a key is concatenated with to form the accept value
+const char kGuid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+// The longest frame header, 2 bytes, a 64 bits length and the mask key
+const std::size_t kMaxHeader = 14;
+
+// The largest payload of a control frame
+const std::size_t kMaxControlPayload = 125;
+
+bool IsSpace( char c ) {
+    return c == ' ' || c == '\t';
+}
+
+// Whether the comma separated list value has the token
+bool HasToken( const StringPiece& value , const StringPiece& token ) {
+    const char* p = value.data();
+    const char* end = p + value.size();
+    while( p < end ) {
+        const char* comma = static_cast<const char*>( memchr( p , ',' , end - p ) );
+        const char* e = comma == NULL ? end : comma;
+        const char* b = p;
+        while( b < e && IsSpace(*b) )
+            ++b;
+        const char* t = e;
+        while( t > b && IsSpace(t[-1]) )
+            --t;
+        if( StringPiece(b,t-b).EqualsIgnoreCase(token) )
+            return true;
+        p = e + 1;
+    }
+    return false;
+}
+
+uint32_t RotateLeft( uint32_t v , int bits ) {
+    return ( v << bits ) | ( v >> ( 32 - bits ) );
+}
+
+// SHA-1 of data into digest. It is only run once per handshake on about 60
+// bytes, so it is the plain textbook version.
+void Sha1( const char* data , std::size_t size , unsigned char digest[20] ) {
+    uint32_t h[5] = { 0x67452301 , 0xEFCDAB89 , 0x98BADCFE , 0x10325476 , 0xC3D2E1F0 };
+    // The message with the padding and the bit length
+    const std::size_t padded = ( size + 8 ) / 64 * 64 + 64;
+    std::string message( data , size );
+    message.resize( padded , '\0' );
+    message[size] = static_cast<char>(0x80);
+    const uint64_t bits = static_cast<uint64_t>(size) * 8;
+    for( int i = 0 ; i < 8 ; ++i )
+        message[padded-1-i] = static_cast<char>( bits >> ( i * 8 ) );
+
+    for( std::size_t block = 0 ; block < padded ; block += 64 ) {
+        const unsigned char* p = reinterpret_cast<const unsigned char*>(message.data()) + block;
+        uint32_t w[80];
+        for( int i = 0 ; i < 16 ; ++i ) {
+            w[i] = static_cast<uint32_t>(p[i*4]) << 24 | static_cast<uint32_t>(p[i*4+1]) << 16 |
+                   static_cast<uint32_t>(p[i*4+2]) << 8 | static_cast<uint32_t>(p[i*4+3]);
+        }
+        for( int i = 16 ; i < 80 ; ++i )
+            w[i] = RotateLeft( w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16] , 1 );
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for( int i = 0 ; i < 80 ; ++i ) {
+            uint32_t f, k;
+            if( i < 20 ) {
+                f = ( b & c ) | ( ~b & d );
+                k = 0x5A827999;
+            } else if( i < 40 ) {
+                f = b ^ c ^ d;
+                k = 0x6ED9EBA1;
+            } else if( i < 60 ) {
+                f = ( b & c ) | ( b & d ) | ( c & d );
+                k = 0x8F1BBCDC;
+            } else {
+                f = b ^ c ^ d;
+                k = 0xCA62C1D6;
+            }
+            const uint32_t t = RotateLeft( a , 5 ) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = RotateLeft( b , 30 );
+            b = a;
+            a = t;
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+    }
+    for( int i = 0 ; i < 5 ; ++i ) {
+        digest[i*4] = static_cast<unsigned char>( h[i] >> 24 );
+        digest[i*4+1] = static_cast<unsigned char>( h[i] >> 16 );
+        digest[i*4+2] = static_cast<unsigned char>( h[i] >> 8 );
+        digest[i*4+3] = static_cast<unsigned char>( h[i] );
+    }
+}
+
+// Base64 of the 20 bytes of a digest, 28 characters with the padding
+void Base64Digest( const unsigned char digest[20] , char out[28] ) {
+    static const char kAlphabet[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::size_t o = 0;
+    for( std::size_t i = 0 ; i < 18 ; i += 3 ) {
+        const uint32_t v = static_cast<uint32_t>(digest[i]) << 16 |
+                           static_cast<uint32_t>(digest[i+1]) << 8 | digest[i+2];
+        out[o++] = kAlphabet[ ( v >> 18 ) & 63 ];
+        out[o++] = kAlphabet[ ( v >> 12 ) & 63 ];
+        out[o++] = kAlphabet[ ( v >> 6 ) & 63 ];
+        out[o++] = kAlphabet[ v & 63 ];
+    }
+    const uint32_t v = static_cast<uint32_t>(digest[18]) << 16 |
+                       static_cast<uint32_t>(digest[19]) << 8;
+    out[o++] = kAlphabet[ ( v >> 18 ) & 63 ];
+    out[o++] = kAlphabet[ ( v >> 12 ) & 63 ];
+    out[o++] = kAlphabet[ ( v >> 6 ) & 63 ];
+    out[o++] = '=';
+}
+
+// Write the header of an unmasked final frame and return its size
+std::size_t EncodeHeader( char* out , int opcode , std::size_t size ) {
+    out[0] = static_cast<char>( 0x80 | opcode );
+    if( size < 126 ) {
+        out[1] = static_cast<char>(size);
+        return 2;
+    } else if( size <= 0xFFFF ) {
+        out[1] = 126;
+        out[2] = static_cast<char>( size >> 8 );
+        out[3] = static_cast<char>( size );
+        return 4;
+    } else {
+        out[1] = 127;
+        const uint64_t v = size;
+        for( int i = 0 ; i < 8 ; ++i )
+            out[2+i] = static_cast<char>( v >> ( ( 7 - i ) * 8 ) );
+        return 10;
+    }
+}
+
+// The tail of every kernel, key is in memory order and data starts at a
+// multiple of 4 of the payload
+void UnmaskScalar( char* data , std::size_t size , uint32_t key ) {
+    const uint64_t key64 = static_cast<uint64_t>(key) << 32 | key;
+    std::size_t i = 0;
+    for( ; i + 8 <= size ; i += 8 ) {
+        uint64_t v;
+        memcpy( &v , data + i , 8 );
+        v ^= key64;
+        memcpy( data + i , &v , 8 );
+    }
+    const char* k = reinterpret_cast<const char*>(&key);
+    for( ; i < size ; ++i )
+        data[i] ^= k[i&3];
+}
+
+#ifdef MNET_WS_X86
+
+#ifdef __SSE2__
+void UnmaskSse2( char* data , std::size_t size , uint32_t key ) {
+    const __m128i k = _mm_set1_epi32( static_cast<int>(key) );
+    std::size_t i = 0;
+    for( ; i + 64 <= size ; i += 64 ) {
+        __m128i* p = reinterpret_cast<__m128i*>(data + i);
+        const __m128i a = _mm_loadu_si128( p );
+        const __m128i b = _mm_loadu_si128( p + 1 );
+        const __m128i c = _mm_loadu_si128( p + 2 );
+        const __m128i d = _mm_loadu_si128( p + 3 );
+        _mm_storeu_si128( p , _mm_xor_si128( a , k ) );
+        _mm_storeu_si128( p + 1 , _mm_xor_si128( b , k ) );
+        _mm_storeu_si128( p + 2 , _mm_xor_si128( c , k ) );
+        _mm_storeu_si128( p + 3 , _mm_xor_si128( d , k ) );
+    }
+    for( ; i + 16 <= size ; i += 16 ) {
+        __m128i* p = reinterpret_cast<__m128i*>(data + i);
+        _mm_storeu_si128( p , _mm_xor_si128( _mm_loadu_si128(p) , k ) );
+    }
+    UnmaskScalar( data + i , size - i , key );
+}
+#endif // __SSE2__
+
+__attribute__((target("avx2")))
+void UnmaskAvx2( char* data , std::size_t size , uint32_t key ) {
+    const __m256i k = _mm256_set1_epi32( static_cast<int>(key) );
+    std::size_t i = 0;
+    for( ; i + 128 <= size ; i += 128 ) {
+        __m256i* p = reinterpret_cast<__m256i*>(data + i);
+        const __m256i a = _mm256_loadu_si256( p );
+        const __m256i b = _mm256_loadu_si256( p + 1 );
+        const __m256i c = _mm256_loadu_si256( p + 2 );
+        const __m256i d = _mm256_loadu_si256( p + 3 );
+        _mm256_storeu_si256( p , _mm256_xor_si256( a , k ) );
+        _mm256_storeu_si256( p + 1 , _mm256_xor_si256( b , k ) );
+        _mm256_storeu_si256( p + 2 , _mm256_xor_si256( c , k ) );
+        _mm256_storeu_si256( p + 3 , _mm256_xor_si256( d , k ) );
+    }
+    for( ; i + 32 <= size ; i += 32 ) {
+        __m256i* p = reinterpret_cast<__m256i*>(data + i);
+        _mm256_storeu_si256( p , _mm256_xor_si256( _mm256_loadu_si256(p) , k ) );
+    }
+    UnmaskScalar( data + i , size - i , key );
+}
+
+#endif // MNET_WS_X86
+
+typedef void (*UnmaskFunction)( char* data , std::size_t size , uint32_t key );
+
+UnmaskFunction ChooseUnmask() {
+#ifdef MNET_WS_X86
+    __builtin_cpu_init();
+    if( __builtin_cpu_supports("avx2") )
+        return UnmaskAvx2;
+#ifdef __SSE2__
+    return UnmaskSse2;
+#endif // __SSE2__
+#endif // MNET_WS_X86
+    return UnmaskScalar;
+}
+
+// Picked once at load time, the CPU does not change afterwards
+const UnmaskFunction kUnmask = ChooseUnmask();
+
+// Whether the close code may be sent by a peer
+bool IsValidCloseCode( int code ) {
+    if( code >= 3000 && code <= 4999 )
+        return true;
+    switch( code ) {
+        case 1000: case 1001: case 1002: case 1003: case 1007:
+        case 1008: case 1009: case 1010: case 1011:
+            return true;
+        default:
+            return false;
+    }
+}
+
+}// namespace
+
+bool Handshake( const http::Request& request , http::Response* response ) {
+    const StringPiece* upgrade = request.FindHeader( "Upgrade" );
+    const StringPiece* connection = request.FindHeader( "Connection" );
+    const StringPiece* key = request.FindHeader( "Sec-WebSocket-Key" );
+    const StringPiece* version = request.FindHeader( "Sec-WebSocket-Version" );
+    // The key is 16 bytes in base64
+    if( request.method() != "GET" || request.minor_version() < 1 ||
+        upgrade == NULL || !HasToken( *upgrade , "websocket" ) ||
+        connection == NULL || !HasToken( *connection , "upgrade" ) ||
+        key == NULL || key->size() != 24 ) {
+        response->set_status(400);
+        return false;
+    }
+    if( version == NULL || *version != "13" ) {
+        response->set_status(426);
+        response->AddHeader( "Sec-WebSocket-Version" , "13" );
+        return false;
+    }
+
+    char input[24 + sizeof(kGuid) - 1];
+    memcpy( input , key->data() , 24 );
+    memcpy( input + 24 , kGuid , sizeof(kGuid) - 1 );
+    unsigned char digest[20];
+    Sha1( input , sizeof(input) , digest );
+    char accept[28];
+    Base64Digest( digest , accept );
+
+    response->set_status(101);
+    response->AddHeader( "Upgrade" , "websocket" );
+    response->AddHeader( "Connection" , "Upgrade" );
+    response->AddHeader( "Sec-WebSocket-Accept" , StringPiece(accept,sizeof(accept)) );
+    return true;
+}
+
+void Unmask( char* data , std::size_t size , const char key[4] ) {
+    uint32_t k;
+    memcpy( &k , key , 4 );
+    kUnmask( data , size , k );
+}
+
+bool IsValidUtf8( const char* data , std::size_t size ) {
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+    const unsigned char* end = p + size;
+    while( p < end ) {
+#ifdef __SSE2__
+        // Skip the ASCII 16 bytes at a time, text is mostly ASCII
+        while( end - p >= 16 &&
+               _mm_movemask_epi8( _mm_loadu_si128( reinterpret_cast<const __m128i*>(p) ) ) == 0 )
+            p += 16;
+        if( p == end )
+            break;
+#endif // __SSE2__
+        const unsigned char c = *p;
+        if( c < 0x80 ) {
+            ++p;
+            continue;
+        }
+        std::size_t n;
+        // The range of the second byte, which rules out the overlong forms,
+        // the surrogates and the code points above U+10FFFF
+        unsigned char low = 0x80, high = 0xBF;
+        if( c >= 0xC2 && c <= 0xDF ) {
+            n = 2;
+        } else if( c >= 0xE0 && c <= 0xEF ) {
+            n = 3;
+            if( c == 0xE0 )
+                low = 0xA0;
+            else if( c == 0xED )
+                high = 0x9F;
+        } else if( c >= 0xF0 && c <= 0xF4 ) {
+            n = 4;
+            if( c == 0xF0 )
+                low = 0x90;
+            else if( c == 0xF4 )
+                high = 0x8F;
+        } else {
+            return false;
+        }
+        if( static_cast<std::size_t>(end - p) < n )
+            return false;
+        if( p[1] < low || p[1] > high )
+            return false;
+        for( std::size_t i = 2 ; i < n ; ++i ) {
+            if( ( p[i] & 0xC0 ) != 0x80 )
+                return false;
+        }
+        p += n;
+    }
+    return true;
+}
+
+Frame::Frame( int opcode , const StringPiece& payload ) {
+    char header[kMaxHeader];
+    const std::size_t header_size = EncodeHeader( header , opcode , payload.size() );
+    data_.reserve( header_size + payload.size() );
+    data_.append( header , header_size );
+    data_.append( payload.data() , payload.size() );
+}
+
+Connection::Connection( Socket* socket ) :
+    socket_(socket),
+    message_callback_(NULL),
+    close_callback_(NULL),
+    max_message_size_(16*1024*1024),
+    message_size_(0),
+    message_opcode_(OPCODE_CONTINUATION),
+    parse_pos_(0),
+    writing_(false),
+    reading_(false),
+    close_sent_(false),
+    close_received_(false),
+    drop_(false),
+    lost_(false),
+    close_code_(CLOSE_ABNORMAL),
+    in_run_(false)
+    {}
+
+Connection::~Connection() {
+    if( socket_->fd() >= 0 )
+        socket_->Close();
+    delete socket_;
+}
+
+void Connection::Send( int opcode , const StringPiece& payload ) {
+    if( close_sent_ || lost_ )
+        return;
+    WriteFrame( opcode , payload.data() , payload.size() );
+    Flush();
+}
+
+void Connection::Send( const Frame& frame ) {
+    if( close_sent_ || lost_ )
+        return;
+    socket_->write_buffer().Write( frame.data() , frame.size() );
+    Flush();
+}
+
+void Connection::Close( int code , const StringPiece& reason ) {
+    if( close_sent_ || lost_ )
+        return;
+    char payload[kMaxControlPayload];
+    payload[0] = static_cast<char>( code >> 8 );
+    payload[1] = static_cast<char>( code );
+    const std::size_t reason_size = std::min( reason.size() , kMaxControlPayload - 2 );
+    memcpy( payload + 2 , reason.data() , reason_size );
+    WriteFrame( OPCODE_CLOSE , payload , 2 + reason_size );
+    close_sent_ = true;
+    close_code_ = code;
+    Flush();
+}
+
+void Connection::WriteFrame( int opcode , const char* payload , std::size_t size ) {
+    Buffer& buffer = socket_->write_buffer();
+    buffer.Reserve( kMaxHeader + size );
+    Buffer::Accessor accessor = buffer.GetWriteAccessor();
+    char* out = static_cast<char*>(accessor.address());
+    const std::size_t header_size = EncodeHeader( out , opcode , size );
+    memcpy( out + header_size , payload , size );
+    accessor.set_committed_size( header_size + size );
+}
+
+void Connection::Flush() {
+    if( writing_ || lost_ || socket_->write_buffer().readable_size() == 0 )
+        return;
+    writing_ = true;
+    // A write that finishes at once must not run the connection from inside
+    // of a send of the user
+    const bool in_run = in_run_;
+    in_run_ = true;
+    socket_->AsyncWrite( this );
+    in_run_ = in_run;
+}
+
+void Connection::Fail( int code ) {
+    if( !close_sent_ ) {
+        char payload[2];
+        payload[0] = static_cast<char>( code >> 8 );
+        payload[1] = static_cast<char>( code );
+        WriteFrame( OPCODE_CLOSE , payload , 2 );
+        close_sent_ = true;
+        Flush();
+    }
+    close_code_ = code;
+    drop_ = true;
+}
+
+void Connection::OnCloseFrame( const char* payload , std::size_t size ) {
+    int code = CLOSE_NO_STATUS;
+    if( size == 1 ) {
+        Fail( CLOSE_PROTOCOL_ERROR );
+        return;
+    } else if( size >= 2 ) {
+        code = static_cast<unsigned char>(payload[0]) << 8 |
+               static_cast<unsigned char>(payload[1]);
+        if( !IsValidCloseCode(code) ) {
+            Fail( CLOSE_PROTOCOL_ERROR );
+            return;
+        }
+        if( !IsValidUtf8( payload + 2 , size - 2 ) ) {
+            Fail( CLOSE_INVALID_DATA );
+            return;
+        }
+    }
+    close_received_ = true;
+    if( !close_sent_ ) {
+        // Echo the code of the peer
+        WriteFrame( OPCODE_CLOSE , payload , size < 2 ? 0 : 2 );
+        close_sent_ = true;
+        close_code_ = code;
+        Flush();
+    }
+}
+
+void Connection::Deliver( int opcode , const char* payload , std::size_t size ) {
+    if( opcode == OPCODE_TEXT && !IsValidUtf8( payload , size ) ) {
+        Fail( CLOSE_INVALID_DATA );
+        return;
+    }
+    message_callback_->Invoke( this , opcode , StringPiece(payload,size) );
+}
+
+void Connection::Process() {
+    Buffer& buffer = socket_->read_buffer();
+    while( !close_received_ && !drop_ ) {
+        Buffer::Accessor accessor = buffer.GetReadAccessor();
+        char* data = static_cast<char*>(accessor.address());
+        const std::size_t available = accessor.size() - parse_pos_;
+        if( available < 2 )
+            break;
+        char* frame = data + parse_pos_;
+        const unsigned char b0 = static_cast<unsigned char>(frame[0]);
+        const unsigned char b1 = static_cast<unsigned char>(frame[1]);
+        const bool fin = ( b0 & 0x80 ) != 0;
+        const int opcode = b0 & 0x0F;
+        const bool control = ( opcode & 0x08 ) != 0;
+        // No extension is negotiated, so the RSV bits are 0, and every client
+        // frame is masked
+        if( ( b0 & 0x70 ) != 0 || ( b1 & 0x80 ) == 0 ) {
+            Fail( CLOSE_PROTOCOL_ERROR );
+            break;
+        }
+        const std::size_t length_size = ( b1 & 0x7F ) == 126 ? 2 : ( b1 & 0x7F ) == 127 ? 8 : 0;
+        const std::size_t header_size = 2 + length_size + 4;
+        if( available < header_size )
+            break;
+        uint64_t length = b1 & 0x7F;
+        if( length_size != 0 ) {
+            length = 0;
+            for( std::size_t i = 0 ; i < length_size ; ++i )
+                length = length << 8 | static_cast<unsigned char>(frame[2+i]);
+            if( length >> 63 ) {
+                Fail( CLOSE_PROTOCOL_ERROR );
+                break;
+            }
+        }
+
+        if( control ) {
+            if( !fin || length > kMaxControlPayload ||
+                ( opcode != OPCODE_CLOSE && opcode != OPCODE_PING && opcode != OPCODE_PONG ) ) {
+                Fail( CLOSE_PROTOCOL_ERROR );
+                break;
+            }
+        } else {
+            // A continuation only follows a fragment, and a new message never
+            // starts inside of a fragmented one
+            if( opcode > OPCODE_BINARY ||
+                ( opcode == OPCODE_CONTINUATION ) != ( message_opcode_ != OPCODE_CONTINUATION ) ) {
+                Fail( CLOSE_PROTOCOL_ERROR );
+                break;
+            }
+            if( length > max_message_size_ - message_size_ ) {
+                Fail( CLOSE_TOO_BIG );
+                break;
+            }
+        }
+        if( available - header_size < length )
+            break;
+
+        char* payload = frame + header_size;
+        const std::size_t size = static_cast<std::size_t>(length);
+        Unmask( payload , size , payload - 4 );
+        parse_pos_ += header_size + size;
+
+        if( control ) {
+            if( opcode == OPCODE_PING )
+                Send( OPCODE_PONG , StringPiece(payload,size) );
+            else if( opcode == OPCODE_CLOSE )
+                OnCloseFrame( payload , size );
+        } else if( fin && opcode != OPCODE_CONTINUATION ) {
+            Deliver( opcode , payload , size );
+        } else {
+            // Join the fragment behind the payload collected so far
+            if( opcode != OPCODE_CONTINUATION )
+                message_opcode_ = opcode;
+            memmove( data + message_size_ , payload , size );
+            message_size_ += size;
+            if( fin ) {
+                const int message_opcode = message_opcode_;
+                message_opcode_ = OPCODE_CONTINUATION;
+                Deliver( message_opcode , data , message_size_ );
+                message_size_ = 0;
+            }
+        }
+
+        // Everything parsed is consumed unless a fragmented message is pending
+        if( message_size_ == 0 ) {
+            accessor.set_committed_size( parse_pos_ );
+            parse_pos_ = 0;
+        }
+    }
+}
+
+void Connection::Run() {
+    in_run_ = true;
+    while( true ) {
+        if( !lost_ )
+            Process();
+        // The close handshake is over once our close frame is flushed, unless
+        // the peer broke the protocol, its close frame is not waited for then
+        const bool flushed = !writing_ && socket_->write_buffer().readable_size() == 0;
+        if( lost_ || ( close_sent_ && ( close_received_ || drop_ ) && flushed ) ) {
+            const int code = lost_ && !close_received_ && !drop_ ? CLOSE_ABNORMAL : close_code_;
+            in_run_ = false;
+            socket_->Close();
+            close_callback_->Invoke( this , code );
+            return;
+        }
+        if( reading_ || close_received_ || drop_ )
+            break;
+        reading_ = true;
+        socket_->AsyncRead( this );
+        if( reading_ )
+            break;
+    }
+    in_run_ = false;
+}
+
+void Connection::OnRead( Socket* socket , std::size_t size , const NetState& ok ) {
+    reading_ = false;
+    if( !ok || size == 0 )
+        lost_ = true;
+    if( !in_run_ )
+        Run();
+}
+
+void Connection::OnWrite( Socket* socket , std::size_t size , const NetState& ok ) {
+    writing_ = false;
+    if( !ok )
+        lost_ = true;
+    else
+        Flush();
+    if( !in_run_ )
+        Run();
+}
+
+}// namespace ws
+}// namespace mnet
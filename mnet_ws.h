@@ -0,0 +1,241 @@
+#ifndef MNET_WS_H_
+#define MNET_WS_H_
+#include "mnet.h"
+#include "mnet_http.h"
+
+// WebSocket (RFC 6455) on top of Socket. The handshake runs on the HTTP server,
+// the handler accepts it with Handshake and hands the socket over through
+// Response::Upgrade. Frames are parsed in place in the read buffer and client
+// payloads are unmasked there by SSE2 or AVX2 XOR kernels. A fragmented message
+// is joined in place as well, so a message is delivered as one StringPiece into
+// the read buffer. Server frames are never masked, their payload is copied into
+// the write buffer once behind the header.
+
+namespace mnet {
+namespace ws {
+class Connection;
+
+enum {
+    // Opcodes
+    OPCODE_CONTINUATION = 0x0,
+    OPCODE_TEXT = 0x1,
+    OPCODE_BINARY = 0x2,
+    OPCODE_CLOSE = 0x8,
+    OPCODE_PING = 0x9,
+    OPCODE_PONG = 0xA
+};
+
+enum {
+    // Close codes
+    CLOSE_NORMAL = 1000,
+    CLOSE_GOING_AWAY = 1001,
+    CLOSE_PROTOCOL_ERROR = 1002,
+    CLOSE_UNSUPPORTED = 1003,
+    // Never sent, it tells the close frame of the peer has no code
+    CLOSE_NO_STATUS = 1005,
+    // Never sent, it tells the connection is lost without a close frame
+    CLOSE_ABNORMAL = 1006,
+    CLOSE_INVALID_DATA = 1007,
+    CLOSE_POLICY = 1008,
+    CLOSE_TOO_BIG = 1009,
+    CLOSE_INTERNAL_ERROR = 1011
+};
+
+// Check the upgrade request and fill response with the 101 that accepts it.
+// On failure, response is set to the 400 or 426 and false is returned. The
+// caller then calls response->Upgrade to receive the socket.
+bool Handshake( const http::Request& request , http::Response* response );
+
+// XOR size bytes of data in place with the 4 byte key, the first byte with
+// key[0]. It uses AVX2 when the CPU has it and SSE2 otherwise.
+void Unmask( char* data , std::size_t size , const char key[4] );
+
+// Whether data is valid UTF-8
+bool IsValidUtf8( const char* data , std::size_t size );
+
+// A server frame serialized once, to be sent to many connections. Each send
+// copies the finished bytes into the write buffer with one memcpy, no header is
+// built and nothing is masked per connection.
+class Frame {
+public:
+    Frame( int opcode , const StringPiece& payload );
+
+    const char* data() const {
+        return data_.data();
+    }
+
+    std::size_t size() const {
+        return data_.size();
+    }
+
+private:
+    std::string data_;
+};
+
+namespace detail {
+
+class MessageCallback {
+public:
+    virtual void Invoke( Connection* connection , int opcode , const StringPiece& payload ) = 0;
+
+#ifdef FORCE_VIRTUAL_DESTRUCTOR
+    virtual ~MessageCallback() {}
+#endif // FORCE_VIRTUAL_DESTRUCTOR
+};
+
+class CloseCallback {
+public:
+    virtual void Invoke( Connection* connection , int code ) = 0;
+
+#ifdef FORCE_VIRTUAL_DESTRUCTOR
+    virtual ~CloseCallback() {}
+#endif // FORCE_VIRTUAL_DESTRUCTOR
+};
+
+template< typename N > struct MessageNotifier : public MessageCallback {
+    virtual void Invoke( Connection* connection , int opcode , const StringPiece& payload ) {
+        notifier->OnMessage( connection , opcode , payload );
+    }
+    N* notifier;
+    MessageNotifier( N* n ) : notifier(n) {}
+};
+
+template< typename N > struct CloseNotifier : public CloseCallback {
+    virtual void Invoke( Connection* connection , int code ) {
+        notifier->OnClose( connection , code );
+    }
+    N* notifier;
+    CloseNotifier( N* n ) : notifier(n) {}
+};
+
+using ::mnet::detail::static_assert_result;
+
+DECLARE_CONCEPT_CHECK(OnMessage,OnMessage,void (T::*)(Connection*,int,const StringPiece&));
+DECLARE_CONCEPT_CHECK(OnClose,OnClose,void (T::*)(Connection*,int));
+
+template< typename T >
+MessageCallback* MakeMessageCallback( T* n ) {
+    STATIC_ASSERT( HasConcept_OnMessage<T>::result , No_On_Message_Is_Found );
+    return new MessageNotifier<T>(n);
+}
+
+template< typename T >
+CloseCallback* MakeCloseCallback( T* n ) {
+    STATIC_ASSERT( HasConcept_OnClose<T>::result , No_On_Close_Is_Found );
+    return new CloseNotifier<T>(n);
+}
+
+}// namespace detail
+
+// A server side WebSocket connection. It owns the socket it is given. Once it
+// is started, the notifier's
+//   void OnMessage( Connection* connection , int opcode , const StringPiece& payload );
+// is invoked for every text or binary message, the payload points into the read
+// buffer and is only valid inside of OnMessage. Pings are answered by itself.
+//   void OnClose( Connection* connection , int code );
+// is invoked once when the socket is closed, with the close code of the peer,
+// 1005 if its close frame has none, 1006 if the connection is lost without a
+// close frame, or the code of the protocol error. The connection may only be
+// deleted there, and OnClose is never invoked from inside of a Send or Close.
+class Connection {
+public:
+    explicit Connection( Socket* socket );
+
+    ~Connection();
+
+    template< typename T >
+    void Start( T* notifier );
+
+    // Messages that are larger are closed with 1009
+    void set_max_message_size( std::size_t size ) {
+        max_message_size_ = size;
+    }
+
+    void SendText( const StringPiece& payload ) {
+        Send( OPCODE_TEXT , payload );
+    }
+
+    void SendBinary( const StringPiece& payload ) {
+        Send( OPCODE_BINARY , payload );
+    }
+
+    void Send( int opcode , const StringPiece& payload );
+
+    // Send a pre-built frame
+    void Send( const Frame& frame );
+
+    void Ping( const StringPiece& payload ) {
+        Send( OPCODE_PING , payload );
+    }
+
+    // Start the close handshake, the socket is closed once the peer answers
+    // with its close frame or it is lost
+    void Close( int code , const StringPiece& reason );
+
+    bool is_closing() const {
+        return close_sent_ || close_received_;
+    }
+
+    Socket* socket() {
+        return socket_;
+    }
+
+    // Socket callbacks
+    void OnRead( Socket* socket , std::size_t size , const NetState& ok );
+    void OnWrite( Socket* socket , std::size_t size , const NetState& ok );
+
+private:
+    // Process, read and close until an operation has to wait
+    void Run();
+    // Handle the complete frames in the read buffer
+    void Process();
+    // Deliver a complete message
+    void Deliver( int opcode , const char* payload , std::size_t size );
+    // Handle a close frame of the peer
+    void OnCloseFrame( const char* payload , std::size_t size );
+    // Send a close frame and close without waiting for the peer's
+    void Fail( int code );
+    // Append a frame to the write buffer
+    void WriteFrame( int opcode , const char* payload , std::size_t size );
+    // Write out the write buffer
+    void Flush();
+
+    Socket* socket_;
+    ::mnet::detail::ScopePtr<detail::MessageCallback> message_callback_;
+    ::mnet::detail::ScopePtr<detail::CloseCallback> close_callback_;
+    std::size_t max_message_size_;
+    // The payload of a fragmented message is joined at the head of the read
+    // buffer, the frames behind it are not consumed until the message is done
+    std::size_t message_size_;
+    int message_opcode_;
+    // Offset of the next frame in the read buffer
+    std::size_t parse_pos_;
+    bool writing_;
+    bool reading_;
+    bool close_sent_;
+    bool close_received_;
+    // The peer is not waited for after the close frame, it broke the protocol
+    bool drop_;
+    // The socket is broken or shutdown by the peer
+    bool lost_;
+    // The close code to report
+    int close_code_;
+    // Inside of Run or of a send, socket callbacks that are invoked synchronously
+    // only record their result then
+    bool in_run_;
+
+    DISALLOW_COPY_AND_ASSIGN(Connection);
+};
+
+template< typename T >
+void Connection::Start( T* notifier ) {
+    message_callback_.Reset( detail::MakeMessageCallback(notifier) );
+    close_callback_.Reset( detail::MakeCloseCallback(notifier) );
+    // The client may have sent frames right behind the handshake
+    Run();
+}
+
+}// namespace ws
+}// namespace mnet
+
+#endif // MNET_WS_H_